@@ -28,4 +28,15 @@
  */
 #define RR_RESERVED_ROOT_DIR_FD 1000
 
+/**
+ * A write of a short name to this fd during recording saves a bookmark
+ * for the current point in the trace, e.g.
+ *
+ *   write(RR_MAGIC_BOOKMARK_FD, "request 1234 start", 18);
+ *
+ * `rr replay --goto-bookmark=<NAME>` starts debugging there. Like
+ * RR_MAGIC_SAVE_DATA_FD, this is opened to /dev/null during recording.
+ */
+#define RR_MAGIC_BOOKMARK_FD 1001
+
 #endif /* RR_H_ */
@@ -4,7 +4,9 @@
 
 #include "AddressSpace.h"
 
+#include <fcntl.h>
 #include <linux/kdev_t.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,6 +17,8 @@
 #include "preload/preload_interface.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "Flags.h"
+#include "kernel_supplement.h"
 #include "log.h"
 #include "RecordSession.h"
 #include "Session.h"
@@ -24,6 +28,7 @@ using namespace rr;
 using namespace std;
 
 /*static*/ ino_t MappableResource::nr_anonymous_maps;
+/*static*/ uint64_t AddressSpace::read_cache_generation_now;
 
 /*static*/ const uint8_t AddressSpace::breakpoint_insn;
 
@@ -143,7 +148,8 @@ ostream& operator<<(ostream& o, const mapped_segment_info& m) {
  *
  * For each map, a |struct map_iterator_data| object is provided which
  * contains segment info, the size of the mapping, and the raw
- * /proc/maps line the data was parsed from.
+ * /proc/maps line the data was parsed from (or, if it came from
+ * PROCMAP_QUERY, an equivalent line formatted from the query result).
  *
  * Any pointers passed transitively to the iterator function are
  * *owned by |iterate_memory_map()||*.  Iterator functions must copy
@@ -158,30 +164,138 @@ struct map_iterator_data {
 typedef void (*memory_map_iterator_t)(void* it_data, Task* t,
                                       const struct map_iterator_data* data);
 
-static void iterate_memory_map(Task* t, memory_map_iterator_t it,
-                               void* it_data) {
-  FILE* maps_file;
+static void set_segment_addresses(Task* t, uint64_t start, uint64_t end,
+                                  struct mapped_segment_info* info) {
+#if defined(__i386__)
+  if (start > numeric_limits<uint32_t>::max() ||
+      end > numeric_limits<uint32_t>::max() || info->name == "[vsyscall]") {
+    // We manually read the exe link here because
+    // this helper is used to set
+    // |t->vm()->exe_image()|, so we can't rely on
+    // that being correct yet.
+    char proc_exe[PATH_MAX];
+    char exe[PATH_MAX];
+    snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", t->tid);
+    readlink(proc_exe, exe, sizeof(exe));
+    FATAL() << "Sorry, tracee " << t->tid << " has x86-64 image " << exe
+            << " and that's not supported with a 32-bit rr.";
+  }
+#endif
+  info->start_addr = start;
+  info->end_addr = end;
+}
+
+/**
+ * Walk the mappings intersecting [start, end) with the PROCMAP_QUERY ioctl
+ * on |maps_fd|, asking each time for the first mapping at or after the end
+ * of the last one. That saves the kernel formatting, and us parsing, a line
+ * of text per mapping, and lets us skip straight to |start|.
+ * Returns false without calling |it| if the kernel doesn't support the
+ * ioctl.
+ * Unlike the text file, this doesn't report the x86-64 [vsyscall] page,
+ * which isn't a real mapping of the process.
+ */
+static bool query_memory_map(Task* t, int maps_fd, memory_map_iterator_t it,
+                             void* it_data, uint64_t start, uint64_t end) {
+  char name[PATH_MAX];
   char line[PATH_MAX * 2];
+  uint64_t addr = start;
+  while (addr < end) {
+    struct procmap_query q;
+    memset(&q, 0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+    q.query_addr = addr;
+    q.vma_name_addr = reinterpret_cast<uintptr_t>(name);
+    q.vma_name_size = sizeof(name);
+    if (ioctl(maps_fd, PROCMAP_QUERY, &q) < 0) {
+      if (errno == ENOENT) {
+        // No more mappings.
+        return true;
+      }
+      if (addr == start && (errno == ENOTTY || errno == EINVAL)) {
+        return false;
+      }
+      FATAL() << "PROCMAP_QUERY at " << HEX(addr) << " for tracee " << t->tid
+              << " failed";
+    }
+
+    if (q.vma_start >= end) {
+      return true;
+    }
+
+    struct map_iterator_data data;
+    data.info.name = q.vma_name_size ? name : "";
+    data.info.file_offset = q.vma_offset;
+    data.info.dev_major = q.dev_major;
+    data.info.dev_minor = q.dev_minor;
+    data.info.inode = q.inode;
+    set_segment_addresses(t, q.vma_start, q.vma_end, &data.info);
+
+    data.info.prot |=
+        (q.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0;
+    data.info.prot |=
+        (q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0;
+    data.info.prot |=
+        (q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0;
+    bool shared = q.vma_flags & PROCMAP_QUERY_VMA_SHARED;
+    data.info.flags |= shared ? MAP_SHARED : MAP_PRIVATE;
+
+    snprintf(line, sizeof(line), "%08" PRIx64 "-%08" PRIx64
+                                 " %c%c%c%c %08" PRIx64 " %02x:%02x %" PRIu64
+                                 " %s",
+             q.vma_start, q.vma_end, (data.info.prot & PROT_READ) ? 'r' : '-',
+             (data.info.prot & PROT_WRITE) ? 'w' : '-',
+             (data.info.prot & PROT_EXEC) ? 'x' : '-', shared ? 's' : 'p',
+             q.vma_offset, q.dev_major, q.dev_minor, q.inode,
+             data.info.name.c_str());
+    data.raw_map_line = line;
+
+    it(it_data, t, &data);
+    addr = q.vma_end;
+  }
+  return true;
+}
+
+/**
+ * Call |it| for each of |t|'s mappings that intersects [start, end).
+ */
+static void iterate_memory_map(
+    Task* t, memory_map_iterator_t it, void* it_data, uint64_t start = 0,
+    uint64_t end = numeric_limits<uint64_t>::max()) {
+  int maps_fd;
   {
     char maps_path[PATH_MAX];
     snprintf(maps_path, sizeof(maps_path) - 1, "/proc/%d/maps", t->tid);
-    ASSERT(t, (maps_file = fopen(maps_path, "r"))) << "Failed to open "
-                                                   << maps_path;
+    ASSERT(t, (maps_fd = open(maps_path, O_RDONLY | O_CLOEXEC)) >= 0)
+        << "Failed to open " << maps_path;
+  }
+  if (query_memory_map(t, maps_fd, it, it_data, start, end)) {
+    close(maps_fd);
+    return;
   }
+
+  // Older kernel: parse the text.
+  FILE* maps_file = fdopen(maps_fd, "r");
+  char line[PATH_MAX * 2];
   while (fgets(line, sizeof(line), maps_file)) {
     struct map_iterator_data data;
     data.raw_map_line = line;
-    uint64_t start, end;
+    uint64_t seg_start, seg_end;
     char flags[32];
     int chars_scanned;
     int nparsed = sscanf(
         line, "%" SCNx64 "-%" SCNx64 " %31s %" SCNx64 " %x:%x %" SCNu64 " %n",
-        &start, &end, flags, &data.info.file_offset, &data.info.dev_major,
-        &data.info.dev_minor, &data.info.inode, &chars_scanned);
+        &seg_start, &seg_end, flags, &data.info.file_offset,
+        &data.info.dev_major, &data.info.dev_minor, &data.info.inode,
+        &chars_scanned);
     ASSERT(t, (8 /*number of info fields*/ == nparsed ||
                7 /*num fields if name is blank*/ == nparsed))
         << "Only parsed " << nparsed << " fields of segment info from\n"
         << data.raw_map_line;
+    if (seg_end <= start || seg_start >= end) {
+      continue;
+    }
 
     // trim trailing newline, if any
     int last_char = strlen(line) - 1;
@@ -189,24 +303,7 @@ static void iterate_memory_map(Task* t, memory_map_iterator_t it,
       line[last_char] = 0;
     }
     data.info.name = trim_leading_blanks(line + chars_scanned);
-#if defined(__i386__)
-    if (start > numeric_limits<uint32_t>::max() ||
-        end > numeric_limits<uint32_t>::max() ||
-        data.info.name == "[vsyscall]") {
-      // We manually read the exe link here because
-      // this helper is used to set
-      // |t->vm()->exe_image()|, so we can't rely on
-      // that being correct yet.
-      char proc_exe[PATH_MAX];
-      char exe[PATH_MAX];
-      snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", t->tid);
-      readlink(proc_exe, exe, sizeof(exe));
-      FATAL() << "Sorry, tracee " << t->tid << " has x86-64 image " << exe
-              << " and that's not supported with a 32-bit rr.";
-    }
-#endif
-    data.info.start_addr = start;
-    data.info.end_addr = end;
+    set_segment_addresses(t, seg_start, seg_end, &data.info);
 
     data.info.prot |= strchr(flags, 'r') ? PROT_READ : 0;
     data.info.prot |= strchr(flags, 'w') ? PROT_WRITE : 0;
@@ -232,7 +329,12 @@ static void print_process_mmap(Task* t) {
   iterate_memory_map(t, print_process_mmap_iterator, nullptr);
 }
 
-AddressSpace::~AddressSpace() { session_->on_destroy(this); }
+AddressSpace::~AddressSpace() {
+  for (auto& kv : mem()) {
+    session_->on_unmap_resource(kv.second.id);
+  }
+  session_->on_destroy(this);
+}
 
 void AddressSpace::after_clone() { allocate_watchpoints(); }
 
@@ -415,7 +517,7 @@ void AddressSpace::brk(remote_ptr<void> addr) {
 void AddressSpace::dump() const {
   fprintf(stderr, "  (heap: %p-%p)\n", (void*)heap.start.as_int(),
           (void*)heap.end.as_int());
-  for (auto it = mem.begin(); it != mem.end(); ++it) {
+  for (auto it = mem().begin(); it != mem().end(); ++it) {
     const Mapping& m = it->first;
     const MappableResource& r = it->second;
     fprintf(stderr, "%s %s\n", m.str().c_str(), r.str().c_str());
@@ -435,15 +537,17 @@ TrapType AddressSpace::get_breakpoint_type_at_addr(remote_code_ptr addr) {
 
 void AddressSpace::replace_breakpoints_with_original_values(
     uint8_t* dest, size_t length, remote_ptr<uint8_t> addr) {
-  for (auto& it : breakpoints) {
-    remote_ptr<uint8_t> bkpt_location = it.first.to_data_ptr<uint8_t>();
-    remote_ptr<uint8_t> start = max(addr, bkpt_location);
+  // Breakpoints are a single byte, so only those inside the range can
+  // overlap it. Don't scan all of them; gdb sessions can set thousands.
+  for (auto it = breakpoints.lower_bound(addr.as_int());
+       it != breakpoints.end() &&
+           it->first.to_data_ptr<uint8_t>() < addr + length;
+       ++it) {
+    remote_ptr<uint8_t> bkpt_location = it->first.to_data_ptr<uint8_t>();
     remote_ptr<uint8_t> end =
-        min(addr + length, bkpt_location + it.second.data_length());
-    if (start < end) {
-      memcpy(dest + (start - addr),
-             it.second.original_data() + (start - bkpt_location), end - start);
-    }
+        min(addr + length, bkpt_location + it->second.data_length());
+    memcpy(dest + (bkpt_location - addr), it->second.original_data(),
+           end - bkpt_location);
   }
 }
 
@@ -498,7 +602,7 @@ void AddressSpace::map(remote_ptr<void> addr, size_t num_bytes, int prot,
     insert_guard_page = true;
   }
 
-  if (mem.end() != mem.find(m)) {
+  if (mem().end() != mem().find(m)) {
     // The mmap() man page doesn't specifically describe
     // what should happen if an existing map is
     // "overwritten" by a new map (of the same resource).
@@ -550,10 +654,59 @@ void AddressSpace::at_preload_init(Task* t) {
 }
 
 typedef AddressSpace::MemoryMap::value_type MappingResourcePair;
+/**
+ * Stop caching pages when we have this many.
+ */
+static const size_t MAX_READ_CACHE_PAGES = 64;
+
+bool AddressSpace::read_cached(remote_ptr<void> addr, size_t size,
+                               void* buf) {
+  // Outside replay, tasks blocked in syscalls can have their memory written
+  // by the kernel at any time.
+  if (size > page_size() || !session()->as_replay() ||
+      !child_mem_fd.is_open()) {
+    return false;
+  }
+  if (read_cache_generation != read_cache_generation_now) {
+    read_cache.clear();
+    read_cache_generation = read_cache_generation_now;
+  }
+
+  remote_ptr<void> end = addr + size;
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  for (remote_ptr<void> page = floor_page_size(addr); page < end;
+       page += page_size()) {
+    auto it = read_cache.find(page);
+    if (it == read_cache.end()) {
+      if (!has_mapping(page)) {
+        return false;
+      }
+      const Mapping& m = mapping_of(page).first;
+      if (!(m.flags & MAP_ANONYMOUS) || (m.flags & MAP_SHARED)) {
+        return false;
+      }
+      if (read_cache.size() >= MAX_READ_CACHE_PAGES) {
+        read_cache.clear();
+      }
+      vector<uint8_t> data(page_size());
+      if (pread64(child_mem_fd, data.data(), data.size(), page.as_int()) !=
+          (ssize_t)data.size()) {
+        return false;
+      }
+      it = read_cache.insert(make_pair(page, move(data))).first;
+    }
+    remote_ptr<void> from = max(page, addr);
+    remote_ptr<void> to = min(page + page_size(), end);
+    memcpy(out, it->second.data() + (from - page), to - from);
+    out += to - from;
+  }
+  return true;
+}
+
 MappingResourcePair AddressSpace::mapping_of(remote_ptr<void> addr) const {
   Mapping m(floor_page_size(addr), page_size());
-  auto it = mem.find(m);
-  assert(it != mem.end());
+  auto it = mem().find(m);
+  assert(it != mem().end());
   assert(it->first.has_subset(m));
   return *it;
 }
@@ -564,8 +717,8 @@ bool AddressSpace::has_mapping(remote_ptr<void> addr) const {
     return false;
   }
   Mapping m(floor_page_size(addr), page_size());
-  auto it = mem.find(m);
-  return it != mem.end() && it->first.has_subset(m);
+  auto it = mem().find(m);
+  return it != mem().end() && it->first.has_subset(m);
 }
 
 /**
@@ -601,7 +754,7 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
       new_start = rem.start;
     }
 
-    mem.erase(m);
+    remove_mapping(mutable_mem().find(m));
     LOG(debug) << "  erased (" << m << ")";
 
     // If the first segment we protect underflows the
@@ -609,14 +762,14 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     // prot.
     if (m.start < new_start) {
       Mapping underflow(m.start, rem.start, m.prot, m.flags, m.offset);
-      mem[underflow] = r;
+      add_mapping(underflow, r);
     }
     // Remap the overlapping region with the new prot.
     remote_ptr<void> new_end = min(rem.end, m.end);
     Mapping overlap(new_start, new_end,
                     prot & (PROT_READ | PROT_WRITE | PROT_EXEC), m.flags,
                     adjust_offset(r, m, new_start - m.start));
-    mem[overlap] = r;
+    add_mapping(overlap, r);
     last_overlap = overlap;
 
     // If the last segment we protect overflows the
@@ -625,13 +778,13 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     if (rem.end < m.end) {
       Mapping overflow(rem.end, m.end, m.prot, m.flags,
                        adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+      add_mapping(overflow, r);
     }
   };
   for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
   // All mappings that we altered which might need coalescing
   // are adjacent to |last_overlap|.
-  coalesce_around(mem.find(last_overlap));
+  coalesce_around(mutable_mem().find(last_overlap));
 }
 
 void AddressSpace::remap(remote_ptr<void> old_addr, size_t old_num_bytes,
@@ -747,7 +900,7 @@ void AddressSpace::save_watchpoints() {
 
 bool AddressSpace::restore_watchpoints() {
   assert(!saved_watchpoints.empty());
-  watchpoints = saved_watchpoints[saved_watchpoints.size() - 1];
+  watchpoints = std::move(saved_watchpoints.back());
   saved_watchpoints.pop_back();
   return allocate_watchpoints();
 }
@@ -824,6 +977,10 @@ bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status) {
 }
 
 void AddressSpace::notify_written(remote_ptr<void> addr, size_t num_bytes) {
+  if (!read_cache.empty()) {
+    read_cache.erase(read_cache.lower_bound(floor_page_size(addr)),
+                     read_cache.lower_bound(ceil_page_size(addr + num_bytes)));
+  }
   update_watchpoint_values(addr, addr + num_bytes);
   session()->accumulate_bytes_written(num_bytes);
 }
@@ -852,7 +1009,7 @@ void AddressSpace::unmap_internal(remote_ptr<void> addr, ssize_t num_bytes) {
       [this](const Mapping& m, const MappableResource& r, const Mapping& rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
 
-    mem.erase(m);
+    remove_mapping(mutable_mem().find(m));
     LOG(debug) << "  erased (" << m << ") ...";
 
     // If the first segment we unmap underflows the unmap
@@ -863,14 +1020,14 @@ void AddressSpace::unmap_internal(remote_ptr<void> addr, ssize_t num_bytes) {
       // When splitting a stack mapping, the bottom part of the split is no
       // longer treated as stack by the kernel.
       new_r.remove_stackness();
-      mem[underflow] = new_r;
+      add_mapping(underflow, new_r);
     }
     // If the last segment we unmap overflows the unmap
     // region, remap the overflow region.
     if (rem.end < m.end) {
       Mapping overflow(rem.end, m.end, m.prot, m.flags,
                        adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+      add_mapping(overflow, r);
     }
   };
   for_each_in_range(addr, num_bytes, unmapper);
@@ -998,7 +1155,13 @@ struct VerifyAddressSpace {
   typedef AddressSpace::MemoryMap::const_iterator const_iterator;
 
   VerifyAddressSpace(const AddressSpace* as)
-      : as(as), it(as->mem.begin()), phase(NO_PHASE) {}
+      : as(as),
+        it(as->mem().begin()),
+        end(as->mem().end()),
+        phase(NO_PHASE) {}
+  VerifyAddressSpace(const AddressSpace* as, const_iterator begin,
+                     const_iterator end)
+      : as(as), it(begin), end(end), phase(NO_PHASE) {}
 
   /**
    * |km| and |m| are the same mapping of the same resource, or
@@ -1015,8 +1178,9 @@ struct VerifyAddressSpace {
   /* The resource that |km| and |m| map. */
   MappableResource r;
   const AddressSpace* as;
-  /* Iterator over mappings in |as|. */
+  /* Iterator over mappings in |as|, up to |end|. */
   const_iterator it;
+  const_iterator end;
   /* Which mapping-checking phase we're in.  See below. */
   enum { NO_PHASE, MERGING_CACHED, INITING_KERNEL, MERGING_KERNEL } phase;
 };
@@ -1054,7 +1218,7 @@ void VerifyAddressSpace::assert_segments_match(Task* t) {
 
 void AddressSpace::fix_stack_segment_start(const Mapping& mapping,
                                            remote_ptr<void> new_start) {
-  auto it = mem.find(mapping);
+  auto it = mutable_mem().find(mapping);
   it->first.update_start(new_start);
 }
 
@@ -1094,14 +1258,13 @@ void AddressSpace::fix_stack_segment_start(const Mapping& mapping,
 /*static*/ void AddressSpace::check_segment_iterator(
     void* pvas, Task* t, const struct map_iterator_data* data) {
   VerifyAddressSpace* vas = static_cast<VerifyAddressSpace*>(pvas);
-  const AddressSpace* as = vas->as;
   const struct mapped_segment_info& info = data->info;
 
   LOG(debug) << "examining /proc/maps segment " << info;
 
   // Merge adjacent cached mappings.
   if (vas->NO_PHASE == vas->phase) {
-    assert(vas->it != as->mem.end());
+    assert(vas->it != vas->end);
 
     vas->phase = vas->MERGING_CACHED;
     // Start of next segment range to match.
@@ -1109,7 +1272,7 @@ void AddressSpace::fix_stack_segment_start(const Mapping& mapping,
     vas->r = vas->it->second.to_kernel();
     do {
       ++vas->it;
-    } while (vas->it != as->mem.end() &&
+    } while (vas->it != vas->end &&
              try_merge_adjacent(&vas->m, vas->r, vas->it->first.to_kernel(),
                                 vas->it->second.to_kernel()));
     vas->phase = vas->INITING_KERNEL;
@@ -1173,20 +1336,103 @@ void AddressSpace::verify(Task* t) const {
   vas.assert_segments_match(t);
 }
 
+void AddressSpace::verify_range(Task* t, const MemoryRange& range) const {
+  assert(task_set().end() != task_set().find(t));
+
+  // Neither we nor the kernel merge mappings across a gap, so widen
+  // |range| to whole runs of contiguous cached mappings, which can be
+  // compared on their own.
+  auto first = mem().lower_bound(Mapping(range.addr, range.end()));
+  remote_ptr<void> start = range.addr;
+  if (first != mem().end() && first->first.start < start) {
+    start = first->first.start;
+  }
+  while (first != mem().begin()) {
+    auto prev = first;
+    --prev;
+    if (prev->first.end < start) {
+      break;
+    }
+    first = prev;
+    start = prev->first.start;
+  }
+  auto last = first;
+  remote_ptr<void> end = range.end();
+  while (last != mem().end() && last->first.start <= end) {
+    end = max(end, last->first.end);
+    ++last;
+  }
+
+  VerifyAddressSpace vas(this, first, last);
+  iterate_memory_map(t, check_segment_iterator, &vas, start.as_int(),
+                     end.as_int());
+
+  if (vas.NO_PHASE == vas.phase) {
+    // Nothing is mapped here, by us or the kernel.
+    assert(first == last);
+    return;
+  }
+  assert(vas.MERGING_KERNEL == vas.phase);
+  vas.assert_segments_match(t);
+}
+
+void AddressSpace::check_cached_mmaps(Task* t) {
+  if (++checks_skipped < Flags::get().check_cached_mmaps_interval) {
+    return;
+  }
+  checks_skipped = 0;
+  if (Flags::get().check_cached_mmaps_changed) {
+    for (auto& range : changed_since_check) {
+      verify_range(t, range);
+    }
+  } else {
+    verify(t);
+  }
+  changed_since_check.clear();
+}
+
+void AddressSpace::note_mappings_changed(const MemoryRange& range) {
+  if (!Flags::get().check_cached_mmaps_changed) {
+    return;
+  }
+  // Merge with any ranges this overlaps or touches.
+  remote_ptr<void> start = range.addr;
+  remote_ptr<void> end = range.end();
+  auto it = changed_since_check.lower_bound(MemoryRange(start, size_t(0)));
+  if (it != changed_since_check.begin()) {
+    auto prev = it;
+    --prev;
+    if (prev->end() >= start) {
+      it = prev;
+    }
+  }
+  while (it != changed_since_check.end() && it->addr <= end) {
+    start = min(start, it->addr);
+    end = max(end, it->end());
+    it = changed_since_check.erase(it);
+  }
+  changed_since_check.insert(MemoryRange(start, end));
+}
+
 AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
     : exe(exe),
       leader_tid_(t->rec_tid),
       leader_serial(t->tuid().serial()),
       exec_count(exec_count),
       is_clone(false),
+      mem_(make_shared<MemoryMap>()),
+      checks_skipped(0),
       session_(&t->session()),
       child_mem_fd(-1),
+      read_cache_generation(0),
       first_run_event_(0) {
   // TODO: this is a workaround of
   // https://github.com/mozilla/rr/issues/1113 .
   if (session_->can_validate()) {
     iterate_memory_map(t, populate_address_space, this);
     assert(!vdso_start_addr.is_null());
+    // These came from the kernel, so there's nothing to check yet.
+    changed_since_check.clear();
   } else {
     // Find the location of the VDSO in the just-spawned process. This will
     // match the VDSO in rr itself since we haven't execed yet. So, speed
@@ -1214,7 +1460,9 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       exec_count(exec_count),
       heap(o.heap),
       is_clone(true),
-      mem(o.mem),
+      mem_(o.mem_),
+      changed_since_check(o.changed_since_check),
+      checks_skipped(0),
       session_(session),
       vdso_start_addr(o.vdso_start_addr),
       monkeypatch_state(o.monkeypatch_state),
@@ -1224,7 +1472,11 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       privileged_untraced_syscall_ip_(o.privileged_untraced_syscall_ip_),
       syscallbuf_lib_start_(o.syscallbuf_lib_start_),
       syscallbuf_lib_end_(o.syscallbuf_lib_end_),
+      read_cache_generation(0),
       first_run_event_(0) {
+  for (auto& kv : mem()) {
+    session->on_map_resource(kv.second.id);
+  }
   for (auto& it : o.breakpoints) {
     breakpoints.insert(make_pair(it.first, it.second));
   }
@@ -1382,6 +1634,7 @@ bool AddressSpace::allocate_watchpoints() {
 }
 
 void AddressSpace::coalesce_around(MemoryMap::iterator it) {
+  MemoryMap& mem = mutable_mem();
   Mapping m = it->first;
   MappableResource r = it->second;
 
@@ -1411,10 +1664,35 @@ void AddressSpace::coalesce_around(MemoryMap::iterator it) {
             first_kv->first.offset);
   LOG(debug) << "  coalescing " << c;
 
-  mem.erase(first_kv, ++last_kv);
+  ++last_kv;
+  while (first_kv != last_kv) {
+    first_kv = remove_mapping(first_kv);
+  }
+
+  add_mapping(c, r);
+}
 
-  auto ins = mem.insert(MemoryMap::value_type(c, r));
+AddressSpace::MemoryMap& AddressSpace::mutable_mem() {
+  if (mem_.use_count() > 1) {
+    mem_ = make_shared<MemoryMap>(*mem_);
+  }
+  return *mem_;
+}
+
+AddressSpace::MemoryMap::iterator AddressSpace::add_mapping(
+    const Mapping& m, const MappableResource& r) {
+  auto ins = mutable_mem().insert(MemoryMap::value_type(m, r));
   assert(ins.second); // key didn't already exist
+  note_mappings_changed(MemoryRange(m.start, m.end));
+  session_->on_map_resource(r.id);
+  return ins.first;
+}
+
+AddressSpace::MemoryMap::iterator AddressSpace::remove_mapping(
+    MemoryMap::iterator it) {
+  session_->on_unmap_resource(it->second.id);
+  note_mappings_changed(MemoryRange(it->first.start, it->first.end));
+  return mutable_mem().erase(it);
 }
 
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
@@ -1439,8 +1717,8 @@ void AddressSpace::for_each_in_range(
 
     // The next page to iterate may not be contiguous with
     // the last one seen.
-    auto it = mem.lower_bound(rem);
-    if (mem.end() == it) {
+    auto it = mem().lower_bound(rem);
+    if (mem().end() == it) {
       LOG(debug) << "  not found, done.";
       return;
     }
@@ -1466,7 +1744,7 @@ void AddressSpace::for_each_in_range(
 
 void AddressSpace::for_all_mappings(
     std::function<void(const Mapping& m, const MappableResource& r)> f) {
-  for (auto& m : mem) {
+  for (auto& m : mem()) {
     f(m.first, m.second);
   }
 }
@@ -1475,7 +1753,7 @@ void AddressSpace::for_all_mappings_in_range(
     std::function<void(const Mapping& m, const MappableResource& r)> f,
     const MemoryRange& range) {
   Mapping m(range.addr, range.end());
-  for (auto it = mem.lower_bound(m); it != mem.end(); ++it) {
+  for (auto it = mem().lower_bound(m); it != mem().end(); ++it) {
     if (it->first.start >= range.end()) {
       break;
     }
@@ -1487,9 +1765,7 @@ void AddressSpace::map_and_coalesce(const Mapping& m,
                                     const MappableResource& r) {
   LOG(debug) << "  mapping " << m;
 
-  auto ins = mem.insert(MemoryMap::value_type(m, r));
-  assert(ins.second); // key didn't already exist
-  coalesce_around(ins.first);
+  coalesce_around(add_mapping(m, r));
 
   update_watchpoint_values(m.start, m.end);
 }
@@ -547,7 +547,7 @@ public:
   /**
    * Return the memory map.
    */
-  const MemoryMap& memmap() const { return mem; }
+  const MemoryMap& memmap() const { return *mem_; }
 
   /**
    * Change the protection bits of [addr, addr + num_bytes) to
@@ -644,6 +644,13 @@ public:
    * kernel thinks it should be.
    */
   void verify(Task* t) const;
+  /**
+   * Called at each point where Flags::check_cached_mmaps asks for
+   * verification. Depending on the flags this verifies only every Nth call,
+   * and/or only the ranges whose mappings we've changed since the last
+   * check.
+   */
+  void check_cached_mmaps(Task* t);
 
   void for_all_mappings(
       std::function<void(const Mapping& m, const MappableResource& r)> f);
@@ -660,6 +667,20 @@ public:
   ScopedFd& mem_fd() { return child_mem_fd; }
   void set_mem_fd(ScopedFd&& fd) { child_mem_fd = std::move(fd); }
 
+  /**
+   * Copy |size| bytes at |addr| into |buf| from the cache of recently read
+   * pages, reading whole pages through mem_fd() on a miss. Returns false if
+   * the range isn't cacheable; the caller must read it itself.
+   * Only private anonymous memory during replay is cached. Nothing else can
+   * change it while every tracee is stopped.
+   */
+  bool read_cached(remote_ptr<void> addr, size_t size, void* buf);
+  /**
+   * Call before any tracee runs. This invalidates the read cache of every
+   * address space, since tasks can write each other's memory.
+   */
+  static void invalidate_read_caches() { ++read_cache_generation_now; }
+
   Monkeypatcher& monkeypatcher() { return monkeypatch_state; }
 
   void at_preload_init(Task* t);
@@ -816,6 +837,30 @@ private:
    */
   void coalesce_around(MemoryMap::iterator it);
 
+  const MemoryMap& mem() const { return *mem_; }
+  /**
+   * Return the memory map for modification, first making our own copy of
+   * it if it's shared with another address space. Iterators into mem()
+   * obtained before this call may refer to the old copy.
+   */
+  MemoryMap& mutable_mem();
+  /**
+   * Add or remove one entry of the memory map. All changes to the set of
+   * entries go through these, so that the session can keep track of which
+   * emulated files are mapped.
+   */
+  MemoryMap::iterator add_mapping(const Mapping& m, const MappableResource& r);
+  MemoryMap::iterator remove_mapping(MemoryMap::iterator it);
+  /**
+   * Remember that the mappings in |range| changed, for
+   * --check-cached-mmaps-changed.
+   */
+  void note_mappings_changed(const MemoryRange& range);
+  /**
+   * Like verify(), but only for the mappings around |range|.
+   */
+  void verify_range(Task* t, const MemoryRange& range) const;
+
   /**
    * Erase |it| from |breakpoints| and restore any memory in
    * this it may have overwritten.
@@ -995,8 +1040,15 @@ private:
   Mapping heap;
   /* Were we cloned from another address space? */
   bool is_clone;
-  /* All segments mapped into this address space. */
-  MemoryMap mem;
+  /* All segments mapped into this address space. Clones share this with
+   * the address space they were cloned from until either of them changes
+   * its mappings, so forking a process that's about to exec doesn't copy
+   * them. Read through mem() and modify only through mutable_mem(). */
+  std::shared_ptr<MemoryMap> mem_;
+  /* Coalesced ranges whose mappings changed since check_cached_mmaps()
+   * last verified, and how many calls to it we've skipped since. */
+  std::set<MemoryRange> changed_since_check;
+  uint32_t checks_skipped;
   /* madvise DONTFORK regions */
   std::set<MemoryRange> dont_fork;
   // The session that created this.  We save a ref to it so that
@@ -1028,6 +1080,14 @@ private:
   remote_ptr<void> syscallbuf_lib_start_;
   remote_ptr<void> syscallbuf_lib_end_;
 
+  /**
+   * Pages read by read_cached() since read_cache_generation. If that isn't
+   * read_cache_generation_now, some tracee has run since and they're stale.
+   */
+  std::map<remote_ptr<void>, std::vector<uint8_t> > read_cache;
+  uint64_t read_cache_generation;
+  static uint64_t read_cache_generation_now;
+
   /**
    * The time of the first event that ran code for a task in this address space.
    * 0 if no such event has occurred.
@@ -4,9 +4,14 @@
 
 #include "AutoRemoteSyscalls.h"
 
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "rr/rr.h"
 
 #include "kernel_metadata.h"
+#include "kernel_supplement.h"
 #include "log.h"
 #include "ReplaySession.h"
 #include "Session.h"
@@ -429,7 +434,35 @@ template <typename Arch> ScopedFd AutoRemoteSyscalls::retrieve_fd_arch(int fd) {
   return ScopedFd(our_fd);
 }
 
+/**
+ * Copy |fd| out of |t| with pidfd_getfd, without running anything in the
+ * tracee. Returns a closed ScopedFd if that isn't possible.
+ */
+static ScopedFd retrieve_fd_with_pidfd(Task* t, int fd) {
+  static bool unsupported = false;
+  // pidfd_open only accepts thread group leaders, and other threads might
+  // not share the leader's fd table.
+  if (unsupported || t->tid != t->real_tgid()) {
+    return ScopedFd();
+  }
+  int pidfd = ::syscall(SYS_pidfd_open, t->tid, 0);
+  if (pidfd < 0) {
+    unsupported = errno == ENOSYS;
+    return ScopedFd();
+  }
+  int our_fd = ::syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+  if (our_fd < 0 && errno == ENOSYS) {
+    unsupported = true;
+  }
+  close(pidfd);
+  return ScopedFd(our_fd);
+}
+
 ScopedFd AutoRemoteSyscalls::retrieve_fd(int fd) {
+  ScopedFd result = retrieve_fd_with_pidfd(t, fd);
+  if (result.is_open()) {
+    return result;
+  }
   RR_ARCH_FUNCTION(retrieve_fd_arch, arch(), fd);
 }
 
@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Command.h"
+#include "main.h"
+#include "PerfCounters.h"
+#include "ReplaySession.h"
+
+using namespace std;
+
+class CalibrateCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  CalibrateCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static CalibrateCommand singleton;
+};
+
+CalibrateCommand CalibrateCommand::singleton(
+    "calibrate",
+    " rr calibrate [OPTION]...\n"
+    "  Measure how late ticks interrupts fire on this CPU, and compare that\n"
+    "  with the margin replay allows for.\n"
+    "  -n, --samples=<NUM>        take NUM measurements (default 1000)\n");
+
+/**
+ * Run conditional branches, which the ticks counter counts, forever.
+ */
+static void spin() {
+  volatile int v = 0;
+  while (true) {
+    if (v == 1) {
+      v = 0;
+    }
+  }
+}
+
+static int calibrate(int samples) {
+  pid_t child = fork();
+  if (child == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    raise(SIGSTOP);
+    spin();
+  }
+  int status;
+  if (child < 0 || waitpid(child, &status, 0) != child ||
+      !WIFSTOPPED(status)) {
+    fprintf(stderr, "Can't start calibration process\n");
+    return 1;
+  }
+
+  // Vary the period, since skid may depend on how long the counter ran.
+  static const Ticks periods[] = { 1000, 10000, 100000, 1000000 };
+  PerfCounters hpc(child);
+  Ticks max_skid = 0;
+  double total_skid = 0;
+  int ret = 0;
+  for (int i = 0; i < samples; ++i) {
+    Ticks period = periods[i % array_length(periods)];
+    hpc.reset(period);
+    ptrace(PTRACE_CONT, child, nullptr, nullptr);
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status) ||
+        WSTOPSIG(status) != PerfCounters::TIME_SLICE_SIGNAL) {
+      fprintf(stderr, "Calibration process stopped unexpectedly (status "
+                      "0x%x)\n",
+              status);
+      ret = 1;
+      break;
+    }
+    Ticks ticks = hpc.read_ticks();
+    Ticks skid = ticks > period ? ticks - period : 0;
+    max_skid = max(max_skid, skid);
+    total_skid += skid;
+  }
+  hpc.stop();
+  kill(child, SIGKILL);
+  waitpid(child, &status, 0);
+  if (ret) {
+    return ret;
+  }
+
+  int margin = ReplaySession::skid_size();
+  printf("Ticks interrupt skid over %d samples: max %llu, mean %.1f\n",
+         samples, (unsigned long long)max_skid, total_skid / samples);
+  printf("Replay allows for %d ticks of skid", margin);
+  if (max_skid >= Ticks(margin)) {
+    printf("; replay may overshoot ticks targets on this CPU\n");
+    return 1;
+  }
+  printf("\n");
+  return 0;
+}
+
+static bool parse_calibrate_arg(vector<string>& args, int& samples) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'n', "samples", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'n':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      samples = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+int CalibrateCommand::run(vector<string>& args) {
+  int samples = 1000;
+  while (parse_calibrate_arg(args, samples)) {
+  }
+
+  if (!args.empty()) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return calibrate(samples);
+}
@@ -9,30 +9,52 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <zlib.h>
 
-#include "CompressedWriter.h"
+#include <algorithm>
+#include <list>
+#include <map>
+
+using namespace std;
 
 CompressedReader::CompressedReader(const std::string& filename)
     : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
   fd_offset = 0;
   error = !fd->is_open();
+  struct stat st;
+  if (!error && fstat(*fd, &st) == 0) {
+    file_dev = st.st_dev;
+    file_ino = st.st_ino;
+  } else {
+    file_dev = 0;
+    file_ino = 0;
+  }
   eof = false;
+  block = nullptr;
+  block_len = 0;
   buffer_read_pos = 0;
   have_saved_state = false;
 }
 
 CompressedReader::CompressedReader(const CompressedReader& other) {
   fd = other.fd;
+  file_dev = other.file_dev;
+  file_ino = other.file_ino;
+  read_ahead = other.read_ahead;
+  block_index = other.block_index;
   fd_offset = other.fd_offset;
   error = other.error;
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
   buffer = other.buffer;
+  mapping = other.mapping;
+  block = other.block;
+  block_len = other.block_len;
   have_saved_state = false;
   assert(!other.have_saved_state);
 }
@@ -53,32 +75,503 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return true;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
+static bool do_decompress(const CompressedWriter::BlockHeader& header,
+                          std::vector<uint8_t>& compressed,
                           std::vector<uint8_t>& uncompressed) {
-  z_stream stream;
-  memset(&stream, 0, sizeof(stream));
-  int result = inflateInit(&stream);
-  if (result != Z_OK) {
-    assert(0 && "inflateInit failed!");
+  const CompressionCodec* codec =
+      CompressionCodec::get((CompressionCodec::Id)header.codec);
+  if (!codec) {
+    fprintf(stderr, "Trace block uses compression codec %d, which this "
+                    "build of rr doesn't support (supported: %s)\n",
+            header.codec, CompressionCodec::supported_names().c_str());
+    return false;
+  }
+  return codec->decompress(compressed.data(), compressed.size(),
+                           uncompressed.data(), uncompressed.size());
+}
+
+/**
+ * Decompressed blocks of all readers in the process, least recently used
+ * first out once they take more than |limit| bytes. Entries are shared with
+ * the readers using them and never modified, like CompressedReader::buffer.
+ */
+class CompressedReader::BlockCache {
+public:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    uint64_t offset;
+    bool operator<(const Key& other) const {
+      if (dev != other.dev) {
+        return dev < other.dev;
+      }
+      if (ino != other.ino) {
+        return ino < other.ino;
+      }
+      return offset < other.offset;
+    }
+  };
+
+  static BlockCache& get() {
+    static BlockCache singleton;
+    return singleton;
+  }
+
+  /**
+   * Return the cached block at |key| and set |next_offset| and |at_eof| as
+   * for ReadAhead::take, or return null.
+   */
+  shared_ptr<vector<uint8_t> > find(const Key& key, uint64_t* next_offset,
+                                     bool* at_eof);
+  void insert(const Key& key, const shared_ptr<vector<uint8_t> >& data,
+              uint64_t next_offset, bool at_eof);
+  void set_limit(size_t bytes);
+
+private:
+  BlockCache() : limit(0), bytes(0) { pthread_mutex_init(&mutex, nullptr); }
+  void evict();
+
+  struct Entry {
+    shared_ptr<vector<uint8_t> > data;
+    uint64_t next_offset;
+    bool at_eof;
+    list<Key>::iterator lru_pos;
+  };
+
+  // rr dump --jobs reads from several threads.
+  pthread_mutex_t mutex;
+  size_t limit;
+  size_t bytes;
+  map<Key, Entry> entries;
+  // Most recently used last.
+  list<Key> lru;
+};
+
+shared_ptr<vector<uint8_t> > CompressedReader::BlockCache::find(
+    const Key& key, uint64_t* next_offset, bool* at_eof) {
+  shared_ptr<vector<uint8_t> > result;
+  pthread_mutex_lock(&mutex);
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    lru.splice(lru.end(), lru, it->second.lru_pos);
+    result = it->second.data;
+    *next_offset = it->second.next_offset;
+    *at_eof = it->second.at_eof;
+  }
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+void CompressedReader::BlockCache::insert(
+    const Key& key, const shared_ptr<vector<uint8_t> >& data,
+    uint64_t next_offset, bool at_eof) {
+  pthread_mutex_lock(&mutex);
+  if (data->size() <= limit && !entries.count(key)) {
+    Entry& e = entries[key];
+    e.data = data;
+    e.next_offset = next_offset;
+    e.at_eof = at_eof;
+    e.lru_pos = lru.insert(lru.end(), key);
+    bytes += data->size();
+    evict();
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedReader::BlockCache::set_limit(size_t bytes) {
+  pthread_mutex_lock(&mutex);
+  limit = bytes;
+  evict();
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedReader::BlockCache::evict() {
+  while (bytes > limit) {
+    auto it = entries.find(lru.front());
+    bytes -= it->second.data->size();
+    entries.erase(it);
+    lru.pop_front();
+  }
+}
+
+/*static*/ void CompressedReader::set_block_cache_size(size_t bytes) {
+  BlockCache::get().set_limit(bytes);
+}
+
+/**
+ * The pool of threads behind enable_read_ahead(). Blocks are identified by
+ * their file offset. The consumer tells us where it will read next
+ * (|window_start|); workers follow the chain of block headers from there
+ * and decompress up to |max_blocks| blocks, much like
+ * CompressedWriter::compression_thread does in the other direction.
+ */
+class CompressedReader::ReadAhead {
+public:
+  ReadAhead(shared_ptr<ScopedFd> fd, uint32_t max_blocks, uint32_t threads);
+  ~ReadAhead();
+
+  /**
+   * If the block at |offset| is being or has been read ahead, wait for it,
+   * move its data into |out| and return true, setting |next_offset| to the
+   * offset of the following block and |at_eof| if there is none.
+   * Returns false if the caller must read the block itself.
+   */
+  bool take(uint64_t offset, vector<uint8_t>& out, uint64_t* next_offset,
+            bool* at_eof);
+  /**
+   * Tell the pool that the next block to be read is at |offset|.
+   */
+  void hint(uint64_t offset);
+
+private:
+  struct Block {
+    Block()
+        : header_read(false),
+          ready(false),
+          failed(false),
+          at_eof(false),
+          next_offset(0) {}
+    // Set once |next_offset| and |at_eof| are known.
+    bool header_read;
+    // Set once |data| is decompressed (or |failed|).
+    bool ready;
+    bool failed;
+    // No block follows this one.
+    bool at_eof;
+    uint64_t next_offset;
+    vector<uint8_t> data;
+  };
+
+  static void* read_ahead_thread_callback(void* p);
+  void read_ahead_thread();
+  bool find_work(uint64_t* offset);
+  void set_window_start(uint64_t offset);
+
+  // Immutable while threads are running
+  shared_ptr<ScopedFd> fd;
+  uint32_t max_blocks;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  vector<pthread_t> threads;
+
+  // BEGIN protected by 'mutex'
+  uint64_t window_start;
+  map<uint64_t, shared_ptr<Block> > blocks;
+  bool closing;
+  // END protected by 'mutex'
+};
+
+void* CompressedReader::ReadAhead::read_ahead_thread_callback(void* p) {
+  static_cast<ReadAhead*>(p)->read_ahead_thread();
+  return nullptr;
+}
+
+CompressedReader::ReadAhead::ReadAhead(shared_ptr<ScopedFd> fd,
+                                       uint32_t max_blocks, uint32_t threads)
+    : fd(fd), max_blocks(max_blocks), window_start(0), closing(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  this->threads.resize(threads);
+  for (auto& t : this->threads) {
+    pthread_create(&t, nullptr, read_ahead_thread_callback, this);
+    pthread_setname_np(t, "read-ahead");
+  }
+}
+
+CompressedReader::ReadAhead::~ReadAhead() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  for (auto& t : threads) {
+    pthread_join(t, nullptr);
+  }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+/**
+ * Find the first block within the window that nobody has started on.
+ * Call with 'mutex' held.
+ */
+bool CompressedReader::ReadAhead::find_work(uint64_t* offset) {
+  uint64_t o = window_start;
+  for (uint32_t i = 0; i < max_blocks; ++i) {
+    auto it = blocks.find(o);
+    if (it == blocks.end()) {
+      *offset = o;
+      return true;
+    }
+    const Block& b = *it->second;
+    if (!b.header_read || b.at_eof || b.failed) {
+      return false;
+    }
+    o = b.next_offset;
+  }
+  return false;
+}
+
+/**
+ * Move the window and drop blocks that are no longer in it.
+ * Call with 'mutex' held.
+ */
+void CompressedReader::ReadAhead::set_window_start(uint64_t offset) {
+  if (offset == window_start) {
+    return;
+  }
+  window_start = offset;
+
+  map<uint64_t, shared_ptr<Block> > in_window;
+  uint64_t o = window_start;
+  for (uint32_t i = 0; i < max_blocks; ++i) {
+    auto it = blocks.find(o);
+    if (it == blocks.end()) {
+      break;
+    }
+    in_window.insert(*it);
+    if (!it->second->header_read || it->second->at_eof) {
+      break;
+    }
+    o = it->second->next_offset;
+  }
+  // Blocks being worked on stay alive through the worker's reference.
+  blocks.swap(in_window);
+  pthread_cond_broadcast(&cond);
+}
+
+void CompressedReader::ReadAhead::read_ahead_thread() {
+  pthread_mutex_lock(&mutex);
+  while (!closing) {
+    uint64_t offset;
+    if (!find_work(&offset)) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    shared_ptr<Block> block(new Block());
+    blocks[offset] = block;
+    pthread_mutex_unlock(&mutex);
+
+    CompressedWriter::BlockHeader header;
+    uint64_t next_offset = offset;
+    bool ok = read_all(*fd, sizeof(header), &header, &next_offset);
+    next_offset += ok ? header.compressed_length : 0;
+    char ch;
+    bool at_eof = !ok || pread(*fd, &ch, 1, next_offset) <= 0;
+
+    pthread_mutex_lock(&mutex);
+    block->header_read = true;
+    block->next_offset = next_offset;
+    block->at_eof = at_eof;
+    // Let other workers start on the following block.
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    vector<uint8_t> compressed;
+    vector<uint8_t> data;
+    // Uncompressed blocks are cheaper to map than to copy, so leave them
+    // for the consumer.
+    ok = ok && header.codec != CompressionCodec::NONE;
+    if (ok) {
+      uint64_t data_offset = offset + sizeof(header);
+      compressed.resize(header.compressed_length);
+      data.resize(header.uncompressed_length);
+      ok = read_all(*fd, compressed.size(), compressed.data(), &data_offset) &&
+           do_decompress(header, compressed, data);
+    }
+
+    pthread_mutex_lock(&mutex);
+    block->ready = true;
+    block->failed = !ok;
+    block->data.swap(data);
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool CompressedReader::ReadAhead::take(uint64_t offset, vector<uint8_t>& out,
+                                       uint64_t* next_offset, bool* at_eof) {
+  pthread_mutex_lock(&mutex);
+  auto it = blocks.find(offset);
+  if (it == blocks.end()) {
+    // The caller will read this block itself and hint() us about the
+    // block after it.
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  shared_ptr<Block> block = it->second;
+  while (!block->ready) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  blocks.erase(offset);
+  bool ok = !block->failed;
+  if (ok) {
+    out.swap(block->data);
+    *next_offset = block->next_offset;
+    *at_eof = block->at_eof;
+    set_window_start(block->next_offset);
+  }
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+void CompressedReader::ReadAhead::hint(uint64_t offset) {
+  pthread_mutex_lock(&mutex);
+  set_window_start(offset);
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedReader::enable_read_ahead(uint32_t blocks, uint32_t threads) {
+  assert(fd_offset == 0 && block_len == 0);
+  if (error || blocks == 0 || threads == 0) {
+    return;
+  }
+  read_ahead = make_shared<ReadAhead>(fd, blocks, threads);
+}
+
+/**
+ * A read-only mapping of the whole file, for reading uncompressed blocks.
+ */
+struct CompressedReader::MappedFile {
+  MappedFile(int fd) : data(nullptr), size(0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(p);
+        size = st.st_size;
+      }
+    }
+  }
+  ~MappedFile() {
+    if (data) {
+      munmap(const_cast<uint8_t*>(data), size);
+    }
+  }
+  const uint8_t* data;
+  uint64_t size;
+};
+
+/**
+ * Point |block| at the uncompressed data following |header|, which has
+ * just been read from before fd_offset. Returns false if the file couldn't
+ * be mapped.
+ */
+bool CompressedReader::map_block(const CompressedWriter::BlockHeader& header) {
+  if (!mapping) {
+    mapping = make_shared<MappedFile>(*fd);
+  }
+  if (!mapping->data ||
+      fd_offset + header.uncompressed_length > mapping->size) {
+    return false;
+  }
+  block = mapping->data + fd_offset;
+  block_len = header.uncompressed_length;
+  fd_offset += header.compressed_length;
+  eof = fd_offset >= mapping->size;
+  return true;
+}
+
+/**
+ * Make the block at fd_offset the current block and advance fd_offset past
+ * it.
+ */
+bool CompressedReader::load_next_block() {
+  if (have_saved_state && !have_saved_buffer) {
+    std::swap(buffer, saved_buffer);
+    have_saved_buffer = true;
+  }
+
+  buffer_read_pos = 0;
+  BlockCache::Key key = { file_dev, file_ino, fd_offset };
+  auto cached = BlockCache::get().find(key, &fd_offset, &eof);
+  if (cached) {
+    buffer = cached;
+    block = buffer->data();
+    block_len = buffer->size();
+    if (read_ahead) {
+      read_ahead->hint(fd_offset);
+    }
+    return true;
+  }
+
+  if (!buffer || buffer.use_count() > 1) {
+    buffer = std::make_shared<std::vector<uint8_t> >();
+  }
+
+  if (read_ahead && read_ahead->take(fd_offset, *buffer, &fd_offset, &eof)) {
+    block = buffer->data();
+    block_len = buffer->size();
+    BlockCache::get().insert(key, buffer, fd_offset, eof);
+    return true;
+  }
+
+  CompressedWriter::BlockHeader header;
+  if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
     return false;
   }
 
-  stream.next_in = &compressed[0];
-  stream.avail_in = compressed.size();
-  stream.next_out = &uncompressed[0];
-  stream.avail_out = uncompressed.size();
-  result = inflate(&stream, Z_FINISH);
-  if (result != Z_STREAM_END) {
-    assert(0 && "inflate failed!");
+  if (header.codec == CompressionCodec::NONE &&
+      header.compressed_length == header.uncompressed_length &&
+      map_block(header)) {
+    if (read_ahead) {
+      read_ahead->hint(fd_offset);
+    }
+    return true;
+  }
+
+  std::vector<uint8_t> compressed_buf;
+  compressed_buf.resize(header.compressed_length);
+  if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
     return false;
   }
 
-  result = inflateEnd(&stream);
-  if (result != Z_OK) {
-    assert(0 && "inflateEnd failed!");
+  char ch;
+  if (pread(*fd, &ch, 1, fd_offset) == 0) {
+    eof = true;
+  }
+
+  if (read_ahead) {
+    read_ahead->hint(fd_offset);
+  }
+
+  buffer->resize(header.uncompressed_length);
+  block = buffer->data();
+  block_len = buffer->size();
+  if (!do_decompress(header, compressed_buf, *buffer)) {
+    return false;
+  }
+  BlockCache::get().insert(key, buffer, fd_offset, eof);
+  return true;
+}
+
+/**
+ * True if the whole block at |offset| is in the file. The CompressedWriter
+ * of a trace that's still being recorded may be partway through writing
+ * the last one.
+ */
+bool CompressedReader::have_whole_block_at(uint64_t offset) {
+  CompressedWriter::BlockHeader header;
+  if (!read_all(*fd, sizeof(header), &header, &offset)) {
     return false;
   }
+  struct stat st;
+  return fstat(*fd, &st) == 0 &&
+         uint64_t(st.st_size) >= offset + header.compressed_length;
+}
 
+bool CompressedReader::refresh() {
+  if (error) {
+    return false;
+  }
+  if (!at_end()) {
+    return true;
+  }
+  // Leave a partly written block until it's complete.
+  if (!have_whole_block_at(fd_offset)) {
+    return false;
+  }
+  eof = false;
   return true;
 }
 
@@ -88,63 +581,201 @@ bool CompressedReader::read(void* data, size_t size) {
       return false;
     }
 
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(size, buffer.size() - buffer_read_pos);
-      memcpy(data, &buffer[buffer_read_pos], amount);
+    if (buffer_read_pos < block_len) {
+      size_t amount = std::min(size, block_len - buffer_read_pos);
+      memcpy(data, block + buffer_read_pos, amount);
       size -= amount;
       data = static_cast<char*>(data) + amount;
       buffer_read_pos += amount;
       continue;
     }
 
-    if (have_saved_state && !have_saved_buffer) {
-      std::swap(buffer, saved_buffer);
-      have_saved_buffer = true;
-    }
-
-    CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
+    if (!load_next_block()) {
       error = true;
       return false;
     }
+  }
+  return true;
+}
 
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
+const uint8_t* CompressedReader::read_view(size_t size) {
+  if (error) {
+    return nullptr;
+  }
+  if (buffer_read_pos == block_len && size > 0 && !eof) {
+    if (!load_next_block()) {
       error = true;
-      return false;
+      return nullptr;
     }
+  }
+  if (block_len - buffer_read_pos < size) {
+    return nullptr;
+  }
+  const uint8_t* data = block + buffer_read_pos;
+  buffer_read_pos += size;
+  return data;
+}
 
-    char ch;
-    if (pread(*fd, &ch, 1, fd_offset) == 0) {
-      eof = true;
+void CompressedReader::rewind() {
+  assert(!have_saved_state);
+  fd_offset = 0;
+  buffer_read_pos = 0;
+  buffer = nullptr;
+  block = nullptr;
+  block_len = 0;
+  eof = false;
+}
+
+bool CompressedReader::seek(uint64_t block_offset, uint64_t offset_in_block) {
+  rewind();
+  fd_offset = block_offset;
+  char ch;
+  if (pread(*fd, &ch, 1, fd_offset) <= 0) {
+    // Seeking to the end of the file.
+    eof = true;
+    return offset_in_block == 0;
+  }
+  if (offset_in_block == 0) {
+    return true;
+  }
+  // Reading a single byte loads the block.
+  if (!read(&ch, 1) || offset_in_block > block_len) {
+    error = true;
+    return false;
+  }
+  buffer_read_pos = offset_in_block;
+  return true;
+}
+
+/**
+ * Maps uncompressed positions to blocks, for read_at(). Only the part of the
+ * file that read_at() has needed so far is indexed.
+ */
+struct CompressedReader::BlockIndex {
+  BlockIndex() : end_pos(0), end_offset(0), cached_block(UINT64_MAX) {}
+  // Uncompressed start position and file offset of each block indexed so
+  // far.
+  vector<uint64_t> block_pos;
+  vector<uint64_t> block_offset;
+  // Uncompressed position and file offset just after the last indexed
+  // block.
+  uint64_t end_pos;
+  uint64_t end_offset;
+  // The most recently decompressed block, since the same block is often
+  // referenced repeatedly.
+  uint64_t cached_block;
+  vector<uint8_t> cached_data;
+};
+
+/**
+ * Add the block after the last indexed one to block_index.
+ */
+bool CompressedReader::index_next_block() {
+  BlockIndex& bi = *block_index;
+  CompressedWriter::BlockHeader header;
+  uint64_t offset = bi.end_offset;
+  if (!read_all(*fd, sizeof(header), &header, &offset)) {
+    return false;
+  }
+  bi.block_pos.push_back(bi.end_pos);
+  bi.block_offset.push_back(bi.end_offset);
+  bi.end_pos += header.uncompressed_length;
+  bi.end_offset = offset + header.compressed_length;
+  return true;
+}
+
+/**
+ * Make block_index->cached_data the block containing |pos|.
+ */
+bool CompressedReader::load_block_at(uint64_t pos) {
+  BlockIndex& bi = *block_index;
+  while (bi.end_pos <= pos) {
+    if (!index_next_block()) {
+      return false;
     }
+  }
 
-    buffer.resize(header.uncompressed_length);
-    buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
-      error = true;
+  size_t block = upper_bound(bi.block_pos.begin(), bi.block_pos.end(), pos) -
+                 bi.block_pos.begin() - 1;
+  if (block == bi.cached_block) {
+    return true;
+  }
+  CompressedWriter::BlockHeader header;
+  uint64_t offset = bi.block_offset[block];
+  vector<uint8_t> compressed;
+  if (!read_all(*fd, sizeof(header), &header, &offset)) {
+    return false;
+  }
+  compressed.resize(header.compressed_length);
+  bi.cached_data.resize(header.uncompressed_length);
+  bi.cached_block = UINT64_MAX;
+  if (!read_all(*fd, compressed.size(), compressed.data(), &offset) ||
+      !do_decompress(header, compressed, bi.cached_data)) {
+    return false;
+  }
+  bi.cached_block = block;
+  return true;
+}
+
+bool CompressedReader::read_at(uint64_t pos, void* data, size_t size) {
+  if (!block_index) {
+    block_index = make_shared<BlockIndex>();
+  }
+  while (size > 0) {
+    if (!load_block_at(pos)) {
       return false;
     }
+    BlockIndex& bi = *block_index;
+    uint64_t block_start = bi.block_pos[bi.cached_block];
+    size_t offset = pos - block_start;
+    size_t amount = min(size, bi.cached_data.size() - offset);
+    memcpy(data, bi.cached_data.data() + offset, amount);
+    data = static_cast<uint8_t*>(data) + amount;
+    size -= amount;
+    pos += amount;
   }
   return true;
 }
 
-void CompressedReader::rewind() {
-  assert(!have_saved_state);
-  fd_offset = 0;
-  buffer_read_pos = 0;
-  buffer.clear();
-  eof = false;
+bool CompressedReader::uncompressed_position(uint64_t block_offset,
+                                             uint64_t offset_in_block,
+                                             uint64_t* pos) {
+  if (!block_index) {
+    block_index = make_shared<BlockIndex>();
+  }
+  BlockIndex& bi = *block_index;
+  while (bi.end_offset < block_offset) {
+    if (!index_next_block()) {
+      return false;
+    }
+  }
+  if (bi.end_offset == block_offset) {
+    *pos = bi.end_pos + offset_in_block;
+    return true;
+  }
+  auto it = lower_bound(bi.block_offset.begin(), bi.block_offset.end(),
+                        block_offset);
+  if (it == bi.block_offset.end() || *it != block_offset) {
+    return false;
+  }
+  *pos = bi.block_pos[it - bi.block_offset.begin()] + offset_in_block;
+  return true;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+void CompressedReader::close() {
+  read_ahead = nullptr;
+  fd = nullptr;
+}
 
 void CompressedReader::save_state() {
   assert(!have_saved_state);
   have_saved_state = true;
   have_saved_buffer = false;
   saved_fd_offset = fd_offset;
+  // If |block| points into |buffer|, it stays valid when |buffer| is swapped
+  // into |saved_buffer|.
+  saved_block = block;
+  saved_block_len = block_len;
   saved_buffer_read_pos = buffer_read_pos;
 }
 
@@ -157,8 +788,10 @@ void CompressedReader::restore_state() {
   fd_offset = saved_fd_offset;
   if (have_saved_buffer) {
     std::swap(buffer, saved_buffer);
-    saved_buffer.clear();
+    saved_buffer = nullptr;
   }
+  block = saved_block;
+  block_len = saved_block_len;
   buffer_read_pos = saved_buffer_read_pos;
 }
 
@@ -5,17 +5,30 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "CompressedWriter.h"
 #include "ScopedFd.h"
 
 /**
  * CompressedReader opens an input file written by CompressedWriter
- * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * and reads data from it. By default data is decompressed by the thread that
+ * calls read(). enable_read_ahead() starts background threads that read and
+ * decompress the blocks following the read position so they're ready by the
+ * time read() needs them. Copies of a CompressedReader share its read-ahead
+ * threads.
+ *
+ * Blocks stored with CompressionCodec::NONE are read straight out of a
+ * read-only mapping of the file instead.
+ *
+ * Decompressed blocks are also kept in a process-wide LRU cache, keyed by
+ * file and block offset, so that readers of the same trace file (e.g. the
+ * sessions of a ReplayTimeline replaying the same stretch again) don't
+ * decompress the same block twice. See set_block_cache_size().
  */
 class CompressedReader {
 public:
@@ -23,12 +36,57 @@ public:
   CompressedReader(const CompressedReader& aOther);
   ~CompressedReader();
   bool good() const { return !error; }
-  bool at_end() const { return eof && buffer_read_pos == buffer.size(); }
+  bool at_end() const { return eof && buffer_read_pos == block_len; }
   // Returns true if successful. Otherwise there's an error and good()
   // will be false.
   bool read(void* data, size_t size);
+  /**
+   * If the next |size| bytes are all in one block, consume them and return
+   * a pointer to them in the reader's block buffer, otherwise return null
+   * and leave the read position unchanged. The data is only valid until
+   * the next call that reads, seeks or restores state on this reader.
+   */
+  const uint8_t* read_view(size_t size);
   void rewind();
   void close();
+  /**
+   * When at_end(), check whether the file has grown since, because its
+   * CompressedWriter is still writing it, and if so carry on reading.
+   * Returns true if there's more to read. A block the writer is still
+   * partway through doesn't count until it's complete.
+   */
+  bool refresh();
+  /**
+   * Move the read position to |offset_in_block| bytes into the block at
+   * file offset |block_offset|, as reported by
+   * CompressedWriter::block_position. Returns false if the block can't be
+   * read.
+   */
+  bool seek(uint64_t block_offset, uint64_t offset_in_block);
+  /**
+   * Read |size| bytes starting at uncompressed position |pos| without
+   * affecting the read position. Returns false if the data isn't there.
+   */
+  bool read_at(uint64_t pos, void* data, size_t size);
+  /**
+   * The inverse of CompressedWriter::block_position: set |pos| to the
+   * uncompressed position |offset_in_block| bytes into the block at file
+   * offset |block_offset|. Returns false if there's no block there.
+   */
+  bool uncompressed_position(uint64_t block_offset, uint64_t offset_in_block,
+                             uint64_t* pos);
+
+  /**
+   * Keep up to |blocks| blocks beyond the read position decompressed, using
+   * |threads| background threads. Must be called before the first read().
+   */
+  void enable_read_ahead(uint32_t blocks, uint32_t threads);
+
+  /**
+   * Let the process-wide cache of decompressed blocks use up to |bytes|
+   * bytes. 0, the initial value, disables it.
+   */
+  static void set_block_cache_size(size_t bytes);
 
   /**
    * Save the current position. Nested saves are not allowed.
@@ -77,21 +135,50 @@ public:
   }
 
 protected:
+  class ReadAhead;
+  class BlockCache;
+  struct BlockIndex;
+  struct MappedFile;
+  bool index_next_block();
+  bool load_block_at(uint64_t pos);
+  bool load_next_block();
+  bool have_whole_block_at(uint64_t offset);
+  bool map_block(const CompressedWriter::BlockHeader& header);
+
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
      Instead track the current position in fd_offset and use pread. */
   uint64_t fd_offset;
   std::shared_ptr<ScopedFd> fd;
+  // Identifies the file in the block cache.
+  dev_t file_dev;
+  ino_t file_ino;
   bool error;
   bool eof;
-  std::vector<uint8_t> buffer;
+  // Storage for the current block when it had to be decompressed. Copies
+  // share it until one of them loads another block, so cloning a session
+  // doesn't copy the decompressed data. Never modified while shared.
+  std::shared_ptr<std::vector<uint8_t> > buffer;
+  // The current block: either buffer.data() or a pointer into |mapping|.
+  const uint8_t* block;
+  size_t block_len;
   size_t buffer_read_pos;
 
   bool have_saved_state;
   bool have_saved_buffer;
   uint64_t saved_fd_offset;
-  std::vector<uint8_t> saved_buffer;
+  std::shared_ptr<std::vector<uint8_t> > saved_buffer;
+  const uint8_t* saved_block;
+  size_t saved_block_len;
   size_t saved_buffer_read_pos;
+
+  // Created when the first uncompressed block is read. Shared between
+  // copies.
+  std::shared_ptr<MappedFile> mapping;
+
+  std::shared_ptr<ReadAhead> read_ahead;
+  // For read_at(). Built lazily and shared between copies.
+  std::shared_ptr<BlockIndex> block_index;
 };
 
 #endif /* RR_COMPRESSED_READER_H_ */
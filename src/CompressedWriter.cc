@@ -7,68 +7,181 @@
 #include "CompressedWriter.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
-#include <zlib.h>
+
+#include <algorithm>
+
+#include "probes.h"
+#include "SelfProfiler.h"
+#include "TraceSink.h"
+#include "util.h"
 
 using namespace std;
 
+WriteMemoryBudget::WriteMemoryBudget(size_t limit) : used(0), generation(0) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  memset(&budget_stats, 0, sizeof(budget_stats));
+  budget_stats.limit = limit;
+}
+
+WriteMemoryBudget::~WriteMemoryBudget() {
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+WriteMemoryBudget::Stats WriteMemoryBudget::stats() const {
+  pthread_mutex_lock(&mutex);
+  Stats result = budget_stats;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+bool WriteMemoryBudget::try_acquire(size_t size, uint64_t* generation) {
+  pthread_mutex_lock(&mutex);
+  bool ok = used + size <= budget_stats.limit;
+  if (ok) {
+    used += size;
+    budget_stats.peak = max<uint64_t>(budget_stats.peak, used);
+  } else {
+    *generation = this->generation;
+  }
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+void WriteMemoryBudget::acquire(size_t size) {
+  pthread_mutex_lock(&mutex);
+  used += size;
+  budget_stats.peak = max<uint64_t>(budget_stats.peak, used);
+  pthread_mutex_unlock(&mutex);
+}
+
+void WriteMemoryBudget::release(size_t size) {
+  pthread_mutex_lock(&mutex);
+  assert(used >= size);
+  used -= size;
+  ++generation;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void WriteMemoryBudget::wait(uint64_t generation) {
+  uint64_t start = monotonic_now_ns();
+  pthread_mutex_lock(&mutex);
+  while (this->generation == generation) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  ++budget_stats.waits;
+  budget_stats.wait_ns += monotonic_now_ns() - start;
+  pthread_mutex_unlock(&mutex);
+}
+
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
   return nullptr;
 }
 
+void* CompressedWriter::write_thread_callback(void* p) {
+  static_cast<CompressedWriter*>(p)->write_thread();
+  return nullptr;
+}
+
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
+                                   uint32_t num_threads,
+                                   CompressionCodec::Id codec_id, int level)
     : fd(filename.c_str(),
          O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
   this->block_size = block_size;
+  codec = CompressionCodec::get(codec_id);
+  this->level = level;
+  assert(codec && "Unsupported compression codec");
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
-  buffer.resize(block_size * (num_threads + 2));
+  // Map the buffer rather than allocating it so its pages aren't touched
+  // before set_huge_pages() can apply.
+  buffer_size = block_size * (num_threads + 2);
+  buffer = static_cast<uint8_t*>(mmap(nullptr, buffer_size,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (buffer == MAP_FAILED) {
+    buffer = nullptr;
+    buffer_size = 0;
+  }
+  // Compressed data is usually much smaller than the uncompressed buffer,
+  // so this lets the writer fall well behind before compression stalls.
+  max_write_queue_bytes = buffer_size;
   pthread_mutex_init(&mutex, nullptr);
-  pthread_cond_init(&cond, nullptr);
+  pthread_cond_init(&work_cond, nullptr);
+  pthread_cond_init(&order_cond, nullptr);
+  pthread_cond_init(&producer_cond, nullptr);
+  pthread_cond_init(&writer_cond, nullptr);
 
   for (uint32_t i = 0; i < num_threads; ++i) {
     thread_pos[i] = UINT64_MAX;
   }
   next_thread_pos = 0;
   next_thread_end_pos = 0;
+  flush_pos = 0;
   closing = false;
   write_error = false;
+  write_offset = 0;
+  write_queue_bytes = 0;
+  compression_done = false;
+  adaptive = false;
+  behind = false;
+  memset(&write_stats, 0, sizeof(write_stats));
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
   producer_reserved_upto_pos = 0;
   error = false;
-  if (fd < 0) {
+  if (fd < 0 || !buffer) {
     error = true;
+    // Don't let close() wait for threads we never started.
+    fd.close();
     return;
   }
 
+  size_t last_slash = filename.rfind('/');
+  string base_name = last_slash == string::npos
+                         ? filename
+                         : filename.substr(last_slash + 1);
+
   // Hold the lock so threads don't inspect the 'threads' array
   // until we've finished initializing it.
   pthread_mutex_lock(&mutex);
   for (uint32_t i = 0; i < num_threads; ++i) {
     pthread_create(&threads[i], nullptr, compression_thread_callback, this);
-    size_t last_slash = filename.rfind('/');
-    string thread_name =
-        string("compress ") + (last_slash == string::npos
-                                   ? filename
-                                   : filename.substr(last_slash + 1));
+    string thread_name = string("compress ") + base_name;
     pthread_setname_np(threads[i], thread_name.substr(0, 15).c_str());
   }
+  pthread_create(&writer, nullptr, write_thread_callback, this);
+  string thread_name = string("write ") + base_name;
+  pthread_setname_np(writer, thread_name.substr(0, 15).c_str());
   pthread_mutex_unlock(&mutex);
 }
 
 CompressedWriter::~CompressedWriter() {
   close();
+  if (buffer) {
+    munmap(buffer, buffer_size);
+  }
   pthread_mutex_destroy(&mutex);
-  pthread_cond_destroy(&cond);
+  pthread_cond_destroy(&work_cond);
+  pthread_cond_destroy(&order_cond);
+  pthread_cond_destroy(&producer_cond);
+  pthread_cond_destroy(&writer_cond);
 }
 
 void CompressedWriter::write(const void* data, size_t size) {
@@ -79,10 +192,10 @@ void CompressedWriter::write(const void* data, size_t size) {
       update_reservation(WAIT);
       continue;
     }
-    size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
-    size_t amount = min(buffer.size() - buf_offset,
+    size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer_size);
+    size_t amount = min(buffer_size - buf_offset,
                         (size_t)min<uint64_t>(reservation_size, size));
-    memcpy(&buffer[buf_offset], data, amount);
+    memcpy(buffer + buf_offset, data, amount);
     producer_reserved_write_pos += amount;
     data = static_cast<const char*>(data) + amount;
     size -= amount;
@@ -90,7 +203,7 @@ void CompressedWriter::write(const void* data, size_t size) {
 
   if (!error &&
       producer_reserved_write_pos - producer_reserved_pos >=
-          buffer.size() / 2) {
+          buffer_size / 2) {
     update_reservation(NOWAIT);
   }
 }
@@ -102,8 +215,10 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   producer_reserved_pos = producer_reserved_write_pos;
 
   // Wake up threads that might be waiting to consume data.
-  pthread_cond_broadcast(&cond);
+  pthread_cond_broadcast(&work_cond);
 
+  bool stalled = false;
+  uint64_t stall_start = 0;
   while (!error) {
     if (write_error) {
       error = true;
@@ -114,13 +229,27 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
     for (uint32_t i = 0; i < thread_pos.size(); ++i) {
       completed_pos = min(completed_pos, thread_pos[i]);
     }
-    producer_reserved_upto_pos = completed_pos + buffer.size();
+    producer_reserved_upto_pos = completed_pos + buffer_size;
     if (producer_reserved_pos < producer_reserved_upto_pos ||
         wait_flag == NOWAIT) {
       break;
     }
 
-    pthread_cond_wait(&cond, &mutex);
+    if (!stalled) {
+      stalled = true;
+      stall_start = monotonic_now_ns();
+      // Compression threads see this when they pick up their next block.
+      behind = adaptive;
+    }
+    pthread_cond_wait(&producer_cond, &mutex);
+  }
+
+  if (stalled) {
+    ++write_stats.stalls;
+    write_stats.stall_ns += monotonic_now_ns() - stall_start;
+  } else if (behind && producer_reserved_upto_pos - producer_reserved_pos >=
+                           buffer_size / 2) {
+    behind = false;
   }
 
   pthread_mutex_unlock(&mutex);
@@ -134,33 +263,68 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
+  const CompressionCodec* store_codec =
+      CompressionCodec::get(CompressionCodec::NONE);
+  size_t outputbuf_size = max(codec->max_compressed_size(block_size),
+                              store_codec->max_compressed_size(block_size)) +
+                          sizeof(BlockHeader);
   vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+  // Used only when a block wraps around the end of 'buffer'
+  vector<uint8_t> scratch;
 
   while (true) {
     if (!write_error && next_thread_pos < next_thread_end_pos &&
-        (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
+        (closing || next_thread_pos + block_size <= next_thread_end_pos ||
+         next_thread_pos < flush_pos)) {
       thread_pos[thread_index] = next_thread_pos;
       next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
-      // header->uncompressed_length must be <= block_size,
+      if (outputbuf.empty() && !spare_buffers.empty()) {
+        outputbuf.swap(spare_buffers.back());
+        spare_buffers.pop_back();
+      }
+      const CompressionCodec* block_codec = behind ? store_codec : codec;
+      BlockHeader header;
+      header.codec = block_codec->id();
+      // header.uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
-      header->uncompressed_length =
+      header.uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
 
       pthread_mutex_unlock(&mutex);
-      header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+      outputbuf.resize(outputbuf_size);
+      uint64_t compress_start = monotonic_now_ns();
+      RR_PROBE2(compress_start, header.uncompressed_length, block_codec->id());
+      size_t compressed_length;
+      {
+        SelfProfiler::Span span("compress", syscall(SYS_gettid),
+                                block_codec->name());
+        compressed_length = do_compress(
+            block_codec, thread_pos[thread_index], header.uncompressed_length,
+            &outputbuf[sizeof(BlockHeader)],
+            outputbuf.size() - sizeof(BlockHeader), scratch);
+      }
+      RR_PROBE2(compress_done, header.uncompressed_length, compressed_length);
+      header.compressed_length = compressed_length;
+      uint64_t compress_ns = monotonic_now_ns() - compress_start;
+      memcpy(outputbuf.data(), &header, sizeof(header));
+      size_t output_size = sizeof(BlockHeader) + header.compressed_length;
       pthread_mutex_lock(&mutex);
 
-      if (header->compressed_length == 0) {
+      ++write_stats.blocks;
+      if (block_codec == codec) {
+        write_stats.compress_ns += compress_ns;
+        write_stats.compress_bytes += header.uncompressed_length;
+      } else {
+        ++write_stats.stored_blocks;
+      }
+
+      if (header.compressed_length == 0) {
         write_error = true;
       }
 
-      // wait until we're the next thread that needs to write
+      // wait until we're the next thread that needs to write, and there's
+      // room in the write queue and the memory budget
+      bool charged = false;
       while (!write_error) {
         bool other_thread_write_first = false;
         for (uint32_t i = 0; i < thread_pos.size(); ++i) {
@@ -168,24 +332,50 @@ void CompressedWriter::compression_thread() {
             other_thread_write_first = true;
           }
         }
-        if (!other_thread_write_first) {
-          break;
+        if (!other_thread_write_first &&
+            write_queue_bytes < max_write_queue_bytes) {
+          if (!budget) {
+            break;
+          }
+          uint64_t generation;
+          if (write_queue_bytes == 0) {
+            budget->acquire(output_size);
+            charged = true;
+            break;
+          }
+          if (budget->try_acquire(output_size, &generation)) {
+            charged = true;
+            break;
+          }
+          // Our own writer thread releases memory too, so we're woken
+          // when our queue drains.
+          pthread_mutex_unlock(&mutex);
+          budget->wait(generation);
+          pthread_mutex_lock(&mutex);
+          continue;
         }
-        pthread_cond_wait(&cond, &mutex);
+        pthread_cond_wait(&order_cond, &mutex);
       }
 
       if (!write_error) {
-        pthread_mutex_unlock(&mutex);
-        ::write(fd, &outputbuf[0],
-                sizeof(BlockHeader) + header->compressed_length);
-        pthread_mutex_lock(&mutex);
+        block_offsets.push_back(write_offset);
+        block_starts.push_back(thread_pos[thread_index]);
+        write_offset += output_size;
+        write_queue_bytes += output_size;
+        write_queue.push_back(QueuedBlock());
+        write_queue.back().data.swap(outputbuf);
+        write_queue.back().size = output_size;
+        write_queue.back().charged = charged;
+      } else if (charged) {
+        budget->release(output_size);
       }
 
       thread_pos[thread_index] = UINT64_MAX;
-      // do a broadcast because we might need to unblock
-      // the producer thread or a compressor thread waiting
-      // for us to write.
-      pthread_cond_broadcast(&cond);
+      // The producer may be waiting for this block's space, the writer for
+      // the block and other compression threads for their turn to write.
+      pthread_cond_signal(&producer_cond);
+      pthread_cond_signal(&writer_cond);
+      pthread_cond_broadcast(&order_cond);
       continue;
     }
 
@@ -193,7 +383,73 @@ void CompressedWriter::compression_thread() {
       break;
     }
 
-    pthread_cond_wait(&cond, &mutex);
+    pthread_cond_wait(&work_cond, &mutex);
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t result = ::write(fd, data, size);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    size -= result;
+    data += result;
+  }
+  return true;
+}
+
+void CompressedWriter::write_thread() {
+  pthread_mutex_lock(&mutex);
+
+  while (true) {
+    if (!write_queue.empty()) {
+      QueuedBlock block;
+      block.data.swap(write_queue.front().data);
+      block.size = write_queue.front().size;
+      block.charged = write_queue.front().charged;
+      write_queue.pop_front();
+      // After an error, just drain the queue.
+      bool skip = write_error;
+
+      pthread_mutex_unlock(&mutex);
+      bool ok = skip || write_all(fd, block.data.data(), block.size);
+      if (!skip && ok && sink) {
+        sink->append(sink_name, block.data.data(), block.size);
+      }
+      pthread_mutex_lock(&mutex);
+
+      if (!ok) {
+        write_error = true;
+        pthread_cond_signal(&producer_cond);
+      }
+      write_queue_bytes -= block.size;
+      if (block.charged) {
+        budget->release(block.size);
+      }
+      if (write_queue_bytes == 0) {
+        // flush() may be waiting for everything to be written.
+        pthread_cond_signal(&producer_cond);
+      }
+      if (spare_buffers.size() < threads.size()) {
+        spare_buffers.push_back(vector<uint8_t>());
+        spare_buffers.back().swap(block.data);
+      }
+      // Compression threads may be waiting for room in the queue.
+      pthread_cond_broadcast(&order_cond);
+      continue;
+    }
+
+    if (compression_done) {
+      break;
+    }
+
+    pthread_cond_wait(&writer_cond, &mutex);
   }
 
   pthread_mutex_unlock(&mutex);
@@ -208,54 +464,152 @@ void CompressedWriter::close() {
 
   pthread_mutex_lock(&mutex);
   closing = true;
-  pthread_cond_broadcast(&cond);
+  pthread_cond_broadcast(&work_cond);
   pthread_mutex_unlock(&mutex);
 
   for (auto i = threads.begin(); i != threads.end(); ++i) {
     pthread_join(*i, nullptr);
   }
 
+  pthread_mutex_lock(&mutex);
+  compression_done = true;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(writer, nullptr);
+
+  if (budget) {
+    budget->release(buffer_size);
+  }
   fd.close();
 }
 
-size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
-  z_stream stream;
-  memset(&stream, 0, sizeof(stream));
-  int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
-  if (result != Z_OK) {
-    assert(0 && "deflateInit failed!");
-    return 0;
+void CompressedWriter::flush() {
+  if (!fd.is_open() || error) {
+    return;
   }
 
-  stream.next_out = outputbuf;
-  stream.avail_out = outputbuf_len;
-
-  while (length > 0 || stream.avail_in > 0) {
-    if (stream.avail_in == 0) {
-      size_t buf_offset = (size_t)(offset % buffer.size());
-      size_t amount = min(length, buffer.size() - buf_offset);
-      stream.next_in = &buffer[buf_offset];
-      stream.avail_in = amount;
-      length -= amount;
-      offset += amount;
-    }
-    if (stream.avail_out == 0) {
-      assert(0 && "outputbuf exhausted!");
-      return 0;
+  update_reservation(NOWAIT);
+
+  pthread_mutex_lock(&mutex);
+  flush_pos = next_thread_end_pos;
+  pthread_cond_broadcast(&work_cond);
+  while (!write_error) {
+    uint64_t completed_pos = next_thread_pos;
+    for (uint32_t i = 0; i < thread_pos.size(); ++i) {
+      completed_pos = min(completed_pos, thread_pos[i]);
     }
-    result = deflate(&stream, length == 0 ? Z_FINISH : Z_NO_FLUSH);
-    if (result != (length == 0 ? Z_STREAM_END : Z_OK)) {
-      assert(0 && "deflate failed!");
-      return 0;
+    if (completed_pos >= flush_pos && write_queue_bytes == 0) {
+      break;
     }
+    pthread_cond_wait(&producer_cond, &mutex);
+  }
+  if (write_error) {
+    error = true;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+uint64_t CompressedWriter::stall_ns() {
+  pthread_mutex_lock(&mutex);
+  uint64_t ns = write_stats.stall_ns;
+  pthread_mutex_unlock(&mutex);
+  return ns;
+}
+
+uint64_t CompressedWriter::backlog() {
+  pthread_mutex_lock(&mutex);
+  uint64_t completed_pos = next_thread_pos;
+  for (uint32_t i = 0; i < thread_pos.size(); ++i) {
+    completed_pos = min(completed_pos, thread_pos[i]);
+  }
+  pthread_mutex_unlock(&mutex);
+  return producer_reserved_write_pos - completed_pos;
+}
+
+void CompressedWriter::block_position(uint64_t pos, uint64_t* block_offset,
+                                      uint64_t* offset_in_block) const {
+  assert(!fd.is_open());
+  // Blocks hold block_size bytes unless flush() cut them short.
+  auto it = upper_bound(block_starts.begin(), block_starts.end(), pos);
+  size_t block = it - block_starts.begin();
+  if (block > 0 && (block < block_starts.size() ||
+                    pos < producer_reserved_write_pos)) {
+    --block;
+    *block_offset = block_offsets[block];
+    *offset_in_block = pos - block_starts[block];
+  } else {
+    *block_offset = write_offset;
+    *offset_in_block = 0;
   }
+}
 
-  result = deflateEnd(&stream);
-  if (result != Z_OK) {
-    assert(0 && "deflateEnd failed!");
-    return 0;
+void CompressedWriter::set_adaptive(bool adaptive) {
+  pthread_mutex_lock(&mutex);
+  this->adaptive = adaptive;
+  if (!adaptive) {
+    behind = false;
   }
+  pthread_mutex_unlock(&mutex);
+}
 
-  return stream.total_out;
+void CompressedWriter::set_huge_pages() {
+  // Without THP support this fails, and normal pages are fine.
+  if (buffer) {
+    madvise(buffer, buffer_size, MADV_HUGEPAGE);
+  }
+}
+
+void CompressedWriter::bind_threads(const vector<int>& cpus) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &mask);
+  }
+  for (auto& t : threads) {
+    pthread_setaffinity_np(t, sizeof(mask), &mask);
+  }
+  pthread_setaffinity_np(writer, sizeof(mask), &mask);
+}
+
+void CompressedWriter::set_sink(const shared_ptr<TraceSink>& sink,
+                                const string& name) {
+  assert(producer_reserved_write_pos == 0);
+  pthread_mutex_lock(&mutex);
+  this->sink = sink;
+  sink_name = name;
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedWriter::set_memory_budget(
+    const shared_ptr<WriteMemoryBudget>& budget) {
+  budget->acquire(buffer_size);
+  pthread_mutex_lock(&mutex);
+  this->budget = budget;
+  pthread_mutex_unlock(&mutex);
+}
+
+size_t CompressedWriter::do_compress(const CompressionCodec* block_codec,
+                                     uint64_t offset, size_t length,
+                                     uint8_t* outputbuf, size_t outputbuf_len,
+                                     vector<uint8_t>& scratch) {
+  size_t buf_offset = (size_t)(offset % buffer_size);
+  const uint8_t* data = buffer + buf_offset;
+  if (buf_offset + length > buffer_size) {
+    // Codecs want contiguous input, so linearize a block that wraps.
+    size_t first = buffer_size - buf_offset;
+    scratch.resize(length);
+    memcpy(scratch.data(), data, first);
+    memcpy(scratch.data() + first, buffer, length - first);
+    data = scratch.data();
+  }
+
+  size_t compressed =
+      block_codec->compress(data, length, outputbuf, outputbuf_len, level);
+  // The codec ID shares a word with the compressed length.
+  if (compressed >= (1 << 28)) {
+    assert(0 && "compressed block too large!");
+    return 0;
+  }
+  return compressed;
 }
@@ -3,15 +3,66 @@
 #ifndef RR_COMPRESSED_WRITER_H_
 #define RR_COMPRESSED_WRITER_H_
 
+#include <assert.h>
 #include <pthread.h>
 #include <stdint.h>
 
+#include <deque>
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "CompressionCodec.h"
 #include "ScopedFd.h"
 
+class TraceSink;
+
+/**
+ * A memory limit shared by a group of CompressedWriters. Each writer's
+ * buffer counts against it, and compressed blocks are only queued for
+ * writing while there's room, so when output can't keep up compression
+ * threads (and, once the buffer fills, the producer) wait instead of
+ * memory growing. A writer can always queue one block, so no writer
+ * starves.
+ */
+class WriteMemoryBudget {
+public:
+  explicit WriteMemoryBudget(size_t limit);
+  ~WriteMemoryBudget();
+
+  struct Stats {
+    uint64_t limit;
+    /* the most memory in use at once */
+    uint64_t peak;
+    /* number of times, and total time, blocks waited for room */
+    uint64_t waits;
+    uint64_t wait_ns;
+  };
+  Stats stats() const;
+
+private:
+  friend class CompressedWriter;
+
+  /**
+   * Charge |size| bytes if they fit. Otherwise return false and set
+   * |generation| to pass to wait().
+   */
+  bool try_acquire(size_t size, uint64_t* generation);
+  /* Charge |size| bytes even if that goes over the limit. */
+  void acquire(size_t size);
+  void release(size_t size);
+  /* Wait until memory is released after try_acquire() returned |generation| */
+  void wait(uint64_t generation);
+
+  mutable pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  size_t used;
+  uint64_t generation;
+  Stats budget_stats;
+  // END protected by 'mutex'
+};
+
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
  * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
@@ -19,18 +70,24 @@
  * 32-bit words: the size of the compressed data (excluding block header)
  * and the size of the uncompressed data, in that order. See BlockHeader below.
  *
- * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
- * CompressedWriter is the "producer" thread and must also be the caller of
- * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
- * being compressed.
+ * We use multiple threads to perform compression. Compressed blocks are
+ * queued, in order, for a single writer thread that performs the actual data
+ * writes, so slow storage doesn't hold up compression until the queue fills.
+ * The thread that creates the CompressedWriter is the "producer" thread and
+ * must also be the caller of 'write'. The producer thread may block in
+ * 'write' if 'buffer_size' bytes are being compressed.
  *
- * Each data block is compressed independently using zlib.
+ * Each data block is compressed independently using the CompressionCodec
+ * chosen at construction time, or stored uncompressed when adaptive mode is
+ * on and compression is holding up the producer. The codec ID is recorded in
+ * each block header.
  */
 class CompressedWriter {
 public:
   CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+                   uint32_t num_threads,
+                   CompressionCodec::Id codec = CompressionCodec::ZLIB,
+                   int level = CompressionCodec::DEFAULT_LEVEL);
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
@@ -38,9 +95,96 @@ public:
   void write(const void* data, size_t size);
   // Call only on producer thread
   void close();
+  /**
+   * Compress and write out everything written so far, including a partial
+   * block, and wait until it's in the file. Readers following the file
+   * while it's written see it all then.
+   * Call only on producer thread.
+   */
+  void flush();
+
+  /**
+   * Number of uncompressed bytes written so far.
+   * Call only on producer thread.
+   */
+  uint64_t uncompressed_pos() const { return producer_reserved_write_pos; }
+  /**
+   * Total time the producer has waited for compression so far.
+   * Call only on producer thread.
+   */
+  uint64_t stall_ns();
+  /**
+   * Number of bytes written that haven't been compressed yet.
+   * Call only on producer thread.
+   */
+  uint64_t backlog();
+  /**
+   * Locate uncompressed position |pos| in the output file: the file offset
+   * of the block containing it and its offset within that block. A position
+   * at the end of the data maps to the end of the file.
+   * Call only after close().
+   */
+  void block_position(uint64_t pos, uint64_t* block_offset,
+                      uint64_t* offset_in_block) const;
+
+  /**
+   * When |adaptive| is true, blocks are stored with CompressionCodec::NONE
+   * from the time the producer has to wait for compression until at least
+   * half the buffer is free again.
+   */
+  void set_adaptive(bool adaptive);
+
+  /**
+   * Ask for the buffer to be backed by transparent huge pages. Call before
+   * the first write().
+   */
+  void set_huge_pages();
+
+  /**
+   * Restrict the compression and write threads to |cpus|.
+   */
+  void bind_threads(const std::vector<int>& cpus);
+
+  /**
+   * Also send every block written to |sink|, as file |name|. Call before
+   * the first write().
+   */
+  void set_sink(const std::shared_ptr<TraceSink>& sink,
+                const std::string& name);
 
+  /**
+   * Count this writer's memory against |budget|: its buffer, and any
+   * compressed blocks queued after this call.
+   */
+  void set_memory_budget(const std::shared_ptr<WriteMemoryBudget>& budget);
+
+  struct Stats {
+    /* number of times, and total time, the producer waited for compression */
+    uint64_t stalls;
+    uint64_t stall_ns;
+    /* blocks written, and how many were stored uncompressed by adaptive mode */
+    uint64_t blocks;
+    uint64_t stored_blocks;
+    /* time compression threads spent compressing, and the bytes compressed */
+    uint64_t compress_ns;
+    uint64_t compress_bytes;
+  };
+  /**
+   * Call only after close().
+   */
+  const Stats& stats() const {
+    assert(!fd.is_open());
+    return write_stats;
+  }
+
+  /**
+   * The codec ID lives in the top bits of the first word. Traces written
+   * before codecs were selectable always have zero there, which is
+   * CompressionCodec::ZLIB.
+   */
   struct BlockHeader {
-    uint32_t compressed_length;
+    uint32_t compressed_length : 28;
+    uint32_t codec : 4;
     uint32_t uncompressed_length;
   };
 
@@ -65,22 +209,51 @@ public:
 
 protected:
   enum WaitFlag { WAIT, NOWAIT };
+  struct QueuedBlock {
+    /* header followed by compressed data; may have unused space at the end */
+    std::vector<uint8_t> data;
+    size_t size;
+    /* whether |size| is charged to the memory budget */
+    bool charged;
+  };
   void update_reservation(WaitFlag wait_flag);
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
-  size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+  static void* write_thread_callback(void* p);
+  void write_thread();
+  size_t do_compress(const CompressionCodec* block_codec, uint64_t offset,
+                     size_t length, uint8_t* outputbuf, size_t outputbuf_len,
+                     std::vector<uint8_t>& scratch);
 
   // Immutable while threads are running
   ScopedFd fd;
   int block_size;
+  const CompressionCodec* codec;
+  int level;
   pthread_mutex_t mutex;
-  pthread_cond_t cond;
+  /* Each kind of waiter has its own condition, so finishing a block doesn't
+   * wake every thread. Compression threads wait on |work_cond| for data to
+   * compress and on |order_cond| for their turn to queue a block; the
+   * producer waits on |producer_cond| for buffer space and the writer thread
+   * on |writer_cond| for queued blocks. */
+  pthread_cond_t work_cond;
+  pthread_cond_t order_cond;
+  pthread_cond_t producer_cond;
+  pthread_cond_t writer_cond;
   std::vector<pthread_t> threads;
+  pthread_t writer;
+  /* compression threads wait while at least this much data is queued */
+  size_t max_write_queue_bytes;
+  /* immutable after set_sink() */
+  std::shared_ptr<TraceSink> sink;
+  std::string sink_name;
+  /* immutable after set_memory_budget() */
+  std::shared_ptr<WriteMemoryBudget> budget;
 
   // Carefully shared...
-  std::vector<uint8_t> buffer;
+  uint8_t* buffer;
+  size_t buffer_size;
 
   // BEGIN protected by 'mutex'
   /* position in output stream that this thread is currently working on,
@@ -92,6 +265,27 @@ protected:
   uint64_t next_thread_end_pos;
   bool closing;
   bool write_error;
+  /* file offset of each block written, in order */
+  std::vector<uint64_t> block_offsets;
+  /* uncompressed position of the start of each block; blocks are smaller
+   * than block_size when flush() wrote them early */
+  std::vector<uint64_t> block_starts;
+  /* compression threads write partial blocks to get data up to here out */
+  uint64_t flush_pos;
+  /* file offset of the next block to be written */
+  uint64_t write_offset;
+  /* compressed blocks, with headers, waiting for the writer thread */
+  std::deque<QueuedBlock> write_queue;
+  /* bytes in write_queue plus the block being written */
+  size_t write_queue_bytes;
+  /* written buffers kept for reuse by compression threads */
+  std::vector<std::vector<uint8_t> > spare_buffers;
+  /* set once all compression threads have exited */
+  bool compression_done;
+  bool adaptive;
+  /* set by the producer while adaptive mode should skip compression */
+  bool behind;
+  Stats write_stats;
   // END protected by 'mutex'
 
   /* producer thread only */
@@ -0,0 +1,280 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "CompressionCodec"
+
+#include "CompressionCodec.h"
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RR_HAVE_BROTLI
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
+
+using namespace std;
+
+static int clamp_level(int level, int min_level, int max_level) {
+  return min(max(level, min_level), max_level);
+}
+
+class ZlibCodec : public CompressionCodec {
+public:
+  virtual Id id() const { return ZLIB; }
+  virtual const char* name() const { return "zlib"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return compressBound(length);
+  }
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int level) const;
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const;
+};
+
+size_t ZlibCodec::compress(const uint8_t* data, size_t length, uint8_t* out,
+                           size_t out_len, int level) const {
+  if (level == DEFAULT_LEVEL) {
+    level = Z_DEFAULT_COMPRESSION;
+  } else {
+    level = clamp_level(level, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+  }
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  int result = deflateInit(&stream, level);
+  if (result != Z_OK) {
+    assert(0 && "deflateInit failed!");
+    return 0;
+  }
+
+  stream.next_in = const_cast<uint8_t*>(data);
+  stream.avail_in = length;
+  stream.next_out = out;
+  stream.avail_out = out_len;
+  result = deflate(&stream, Z_FINISH);
+  if (result != Z_STREAM_END) {
+    assert(0 && "deflate failed!");
+    deflateEnd(&stream);
+    return 0;
+  }
+
+  result = deflateEnd(&stream);
+  if (result != Z_OK) {
+    assert(0 && "deflateEnd failed!");
+    return 0;
+  }
+
+  return stream.total_out;
+}
+
+bool ZlibCodec::decompress(const uint8_t* data, size_t length, uint8_t* out,
+                           size_t out_len) const {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  int result = inflateInit(&stream);
+  if (result != Z_OK) {
+    assert(0 && "inflateInit failed!");
+    return false;
+  }
+
+  stream.next_in = const_cast<uint8_t*>(data);
+  stream.avail_in = length;
+  stream.next_out = out;
+  stream.avail_out = out_len;
+  result = inflate(&stream, Z_FINISH);
+  if (result != Z_STREAM_END) {
+    assert(0 && "inflate failed!");
+    inflateEnd(&stream);
+    return false;
+  }
+
+  result = inflateEnd(&stream);
+  if (result != Z_OK) {
+    assert(0 && "inflateEnd failed!");
+    return false;
+  }
+
+  return true;
+}
+
+#ifdef RR_HAVE_LZ4
+class Lz4Codec : public CompressionCodec {
+public:
+  virtual Id id() const { return LZ4; }
+  virtual const char* name() const { return "lz4"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return LZ4_compressBound(length);
+  }
+  /**
+   * For lz4 the level is the "acceleration" factor: higher is faster and
+   * compresses less.
+   */
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int level) const {
+    int acceleration = level == DEFAULT_LEVEL ? 1 : max(level, 1);
+    int result = LZ4_compress_fast((const char*)data, (char*)out, length,
+                                   out_len, acceleration);
+    return result > 0 ? result : 0;
+  }
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const {
+    int result =
+        LZ4_decompress_safe((const char*)data, (char*)out, length, out_len);
+    return result >= 0 && (size_t)result == out_len;
+  }
+};
+#endif
+
+#ifdef RR_HAVE_ZSTD
+class ZstdCodec : public CompressionCodec {
+public:
+  virtual Id id() const { return ZSTD; }
+  virtual const char* name() const { return "zstd"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return ZSTD_compressBound(length);
+  }
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int level) const {
+    if (level == DEFAULT_LEVEL) {
+      level = ZSTD_CLEVEL_DEFAULT;
+    } else {
+      level = clamp_level(level, 1, ZSTD_maxCLevel());
+    }
+    size_t result = ZSTD_compress(out, out_len, data, length, level);
+    return ZSTD_isError(result) ? 0 : result;
+  }
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const {
+    size_t result = ZSTD_decompress(out, out_len, data, length);
+    return !ZSTD_isError(result) && result == out_len;
+  }
+};
+#endif
+
+#ifdef RR_HAVE_BROTLI
+class BrotliCodec : public CompressionCodec {
+public:
+  virtual Id id() const { return BROTLI; }
+  virtual const char* name() const { return "brotli"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return BrotliEncoderMaxCompressedSize(length);
+  }
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int level) const {
+    if (level == DEFAULT_LEVEL) {
+      level = BROTLI_DEFAULT_QUALITY;
+    } else {
+      level = clamp_level(level, BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY);
+    }
+    size_t encoded_size = out_len;
+    if (!BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_GENERIC, length, data,
+                               &encoded_size, out)) {
+      return 0;
+    }
+    return encoded_size;
+  }
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const {
+    size_t decoded_size = out_len;
+    return BrotliDecoderDecompress(length, data, &decoded_size, out) ==
+               BROTLI_DECODER_RESULT_SUCCESS &&
+           decoded_size == out_len;
+  }
+};
+#endif
+
+class NoCompressionCodec : public CompressionCodec {
+public:
+  virtual Id id() const { return NONE; }
+  virtual const char* name() const { return "none"; }
+  virtual size_t max_compressed_size(size_t length) const { return length; }
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int) const {
+    if (out_len < length) {
+      return 0;
+    }
+    memcpy(out, data, length);
+    return length;
+  }
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const {
+    if (length != out_len) {
+      return false;
+    }
+    memcpy(out, data, length);
+    return true;
+  }
+};
+
+static const CompressionCodec* const* all_codecs() {
+  static const ZlibCodec zlib_codec;
+  static const NoCompressionCodec no_compression_codec;
+#ifdef RR_HAVE_LZ4
+  static const Lz4Codec lz4_codec;
+#endif
+#ifdef RR_HAVE_ZSTD
+  static const ZstdCodec zstd_codec;
+#endif
+#ifdef RR_HAVE_BROTLI
+  static const BrotliCodec brotli_codec;
+#endif
+  static const CompressionCodec* const codecs[CompressionCodec::CODEC_COUNT] =
+      { &zlib_codec,
+#ifdef RR_HAVE_LZ4
+        &lz4_codec,
+#else
+        nullptr,
+#endif
+#ifdef RR_HAVE_ZSTD
+        &zstd_codec,
+#else
+        nullptr,
+#endif
+#ifdef RR_HAVE_BROTLI
+        &brotli_codec,
+#else
+        nullptr,
+#endif
+        &no_compression_codec };
+  return codecs;
+}
+
+/*static*/ const CompressionCodec* CompressionCodec::get(Id id) {
+  if (id < 0 || id >= CODEC_COUNT) {
+    return nullptr;
+  }
+  return all_codecs()[id];
+}
+
+/*static*/ const CompressionCodec* CompressionCodec::get(const string& name) {
+  for (int i = 0; i < CODEC_COUNT; ++i) {
+    const CompressionCodec* codec = all_codecs()[i];
+    if (codec && name == codec->name()) {
+      return codec;
+    }
+  }
+  return nullptr;
+}
+
+/*static*/ string CompressionCodec::supported_names() {
+  string names;
+  for (int i = 0; i < CODEC_COUNT; ++i) {
+    const CompressionCodec* codec = all_codecs()[i];
+    if (codec) {
+      if (!names.empty()) {
+        names += " ";
+      }
+      names += codec->name();
+    }
+  }
+  return names;
+}
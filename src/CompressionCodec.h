@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_COMPRESSION_CODEC_H_
+#define RR_COMPRESSION_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/**
+ * A CompressionCodec compresses and decompresses independent blocks of
+ * trace data. Each block written by CompressedWriter records the ID of the
+ * codec that produced it, so a reader can decode any mix of codecs and
+ * traces written before codec IDs existed (which are all zlib) still read
+ * correctly.
+ *
+ * Codecs other than zlib are optional and only available when rr was built
+ * with the corresponding library.
+ */
+class CompressionCodec {
+public:
+  /**
+   * Codec IDs are stored in the trace. Never renumber these; only append.
+   * IDs must fit in BlockHeader::codec.
+   */
+  enum Id {
+    ZLIB = 0,
+    LZ4 = 1,
+    ZSTD = 2,
+    BROTLI = 3,
+    // Blocks stored as-is. CompressedReader maps these directly.
+    NONE = 4,
+    // Not a real codec.
+    CODEC_COUNT
+  };
+
+  /**
+   * Passing this as a compression level selects the codec's own default.
+   * Otherwise levels are codec-specific and out-of-range levels are clamped.
+   */
+  enum { DEFAULT_LEVEL = INT32_MIN };
+
+  virtual ~CompressionCodec() {}
+
+  virtual Id id() const = 0;
+  virtual const char* name() const = 0;
+
+  /**
+   * Upper bound on the compressed size of 'length' bytes of input.
+   */
+  virtual size_t max_compressed_size(size_t length) const = 0;
+  /**
+   * Compress 'length' bytes at 'data' into 'out', which has room for
+   * 'out_len' bytes, at compression level 'level'. Returns the compressed
+   * size, or 0 on failure.
+   */
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len, int level) const = 0;
+  /**
+   * Decompress 'length' bytes at 'data' into 'out', which must be exactly
+   * the uncompressed size of the block. Returns false on failure.
+   */
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_len) const = 0;
+
+  /**
+   * Return the codec for 'id', or null if it's unknown or rr was built
+   * without support for it.
+   */
+  static const CompressionCodec* get(Id id);
+  /**
+   * Return the codec named 'name' (e.g. "zstd"), or null if it's unknown or
+   * not supported by this build.
+   */
+  static const CompressionCodec* get(const std::string& name);
+  /**
+   * Space-separated list of the codecs supported by this build, for help
+   * and error messages.
+   */
+  static std::string supported_names();
+};
+
+#endif /* RR_COMPRESSION_CODEC_H_ */
@@ -0,0 +1,363 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "CoreDumper"
+
+#include "CoreDumper.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "AddressSpace.h"
+#include "kernel_abi.h"
+#include "log.h"
+#include "ScopedFd.h"
+#include "task.h"
+#include "util.h"
+
+using namespace rr;
+using namespace std;
+
+template <typename Arch> struct CoreElfTypes;
+template <> struct CoreElfTypes<X86Arch> {
+  typedef Elf32_Ehdr Ehdr;
+  typedef Elf32_Phdr Phdr;
+  static const int elf_class = ELFCLASS32;
+  static const int machine = EM_386;
+};
+template <> struct CoreElfTypes<X64Arch> {
+  typedef Elf64_Ehdr Ehdr;
+  typedef Elf64_Phdr Phdr;
+  static const int elf_class = ELFCLASS64;
+  static const int machine = EM_X86_64;
+};
+
+/* The kernel's struct elf_prstatus. */
+template <typename Arch> struct CorePrstatus {
+  int32_t si_signo;
+  int32_t si_code;
+  int32_t si_errno;
+  int16_t pr_cursig;
+  typename Arch::unsigned_long pr_sigpend;
+  typename Arch::unsigned_long pr_sighold;
+  typename Arch::pid_t pr_pid;
+  typename Arch::pid_t pr_ppid;
+  typename Arch::pid_t pr_pgrp;
+  typename Arch::pid_t pr_sid;
+  typename Arch::timeval pr_utime;
+  typename Arch::timeval pr_stime;
+  typename Arch::timeval pr_cutime;
+  typename Arch::timeval pr_cstime;
+  typename Arch::user_regs_struct pr_reg;
+  int32_t pr_fpvalid;
+};
+static_assert(sizeof(CorePrstatus<X86Arch>) == 144, "Bad elf_prstatus size");
+static_assert(sizeof(CorePrstatus<X64Arch>) == 336, "Bad elf_prstatus size");
+
+/* The kernel's struct elf_prpsinfo. */
+template <typename Arch> struct CorePrpsinfo {
+  char pr_state;
+  char pr_sname;
+  char pr_zomb;
+  char pr_nice;
+  typename Arch::unsigned_long pr_flag;
+  typename Arch::legacy_uid_t pr_uid;
+  typename Arch::legacy_uid_t pr_gid;
+  typename Arch::pid_t pr_pid;
+  typename Arch::pid_t pr_ppid;
+  typename Arch::pid_t pr_pgrp;
+  typename Arch::pid_t pr_sid;
+  char pr_fname[16];
+  char pr_psargs[80];
+};
+static_assert(sizeof(CorePrpsinfo<X86Arch>) == 124, "Bad elf_prpsinfo size");
+static_assert(sizeof(CorePrpsinfo<X64Arch>) == 136, "Bad elf_prpsinfo size");
+
+static void append_bytes(vector<uint8_t>& buf, const void* data, size_t size) {
+  auto p = static_cast<const uint8_t*>(data);
+  buf.insert(buf.end(), p, p + size);
+}
+
+/**
+ * Append an ELF note. Core file notes are padded to 4 bytes on both
+ * architectures.
+ */
+static void append_note(vector<uint8_t>& notes, uint32_t type,
+                        const void* desc, size_t desc_size) {
+  static const char name[] = "CORE";
+  Elf32_Nhdr nhdr;
+  nhdr.n_namesz = sizeof(name);
+  nhdr.n_descsz = desc_size;
+  nhdr.n_type = type;
+  append_bytes(notes, &nhdr, sizeof(nhdr));
+  append_bytes(notes, name, sizeof(name));
+  notes.resize((notes.size() + 3) & ~size_t(3));
+  append_bytes(notes, desc, desc_size);
+  notes.resize((notes.size() + 3) & ~size_t(3));
+}
+
+template <typename Arch> static void append_word(vector<uint8_t>& buf,
+                                                 uint64_t value) {
+  typename Arch::unsigned_long word = value;
+  append_bytes(buf, &word, sizeof(word));
+}
+
+template <typename Arch>
+static void append_prstatus(vector<uint8_t>& notes, Task* t) {
+  CorePrstatus<Arch> status;
+  memset(&status, 0, sizeof(status));
+  status.pr_pid = t->rec_tid;
+  status.pr_pgrp = t->tgid();
+  auto regs = t->regs().get_ptrace_for_arch(Arch::arch());
+  memcpy(&status.pr_reg, regs.data(),
+         min(regs.size(), sizeof(status.pr_reg)));
+  append_note(notes, NT_PRSTATUS, &status, sizeof(status));
+}
+
+template <typename Arch>
+static void append_prpsinfo(vector<uint8_t>& notes, Task* t) {
+  CorePrpsinfo<Arch> info;
+  memset(&info, 0, sizeof(info));
+  info.pr_sname = 'R';
+  info.pr_pid = t->tgid();
+  strncpy(info.pr_fname, t->name().c_str(), sizeof(info.pr_fname));
+  strncpy(info.pr_psargs, t->name().c_str(), sizeof(info.pr_psargs) - 1);
+  append_note(notes, NT_PRPSINFO, &info, sizeof(info));
+}
+
+static void append_auxv(vector<uint8_t>& notes, Task* t) {
+  char filename[] = "/proc/01234567890/auxv";
+  snprintf(filename, sizeof(filename) - 1, "/proc/%d/auxv", t->real_tgid());
+  ScopedFd fd(filename, O_RDONLY);
+  uint8_t auxv[8192];
+  ssize_t len = fd.is_open() ? read(fd, auxv, sizeof(auxv)) : -1;
+  if (len > 0) {
+    append_note(notes, NT_AUXV, auxv, len);
+  }
+}
+
+/**
+ * The NT_FILE note tells debuggers which files are mapped where, so they
+ * can find shared libraries without walking the link_map.
+ */
+template <typename Arch>
+static void append_file_note(vector<uint8_t>& notes, Task* t) {
+  vector<uint8_t> desc;
+  vector<uint8_t> names;
+  size_t count = 0;
+  for (auto& kv : t->vm()->memmap()) {
+    const Mapping& m = kv.first;
+    const string& fsname = kv.second.fsname;
+    if (fsname.empty() || fsname[0] != '/') {
+      continue;
+    }
+    ++count;
+    append_word<Arch>(desc, m.start.as_int());
+    append_word<Arch>(desc, m.end.as_int());
+    append_word<Arch>(desc, m.offset / page_size());
+    append_bytes(names, fsname.c_str(), fsname.size() + 1);
+  }
+  if (!count) {
+    return;
+  }
+  vector<uint8_t> note;
+  append_word<Arch>(note, count);
+  append_word<Arch>(note, page_size());
+  append_bytes(note, desc.data(), desc.size());
+  append_bytes(note, names.data(), names.size());
+  append_note(notes, NT_FILE, note.data(), note.size());
+}
+
+typedef vector<pair<remote_ptr<void>, remote_ptr<void> > > AddressRanges;
+
+/**
+ * Read the address ranges of |t|'s mappings that have private copies of
+ * pages (the kernel counts them as "Anonymous"), so no longer match their
+ * file. RELRO segments are like this: ld.so relocates them, then makes them
+ * read-only. Returns false if smaps can't be read.
+ */
+static bool read_modified_ranges(Task* t, AddressRanges* ranges) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/smaps", t->tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return false;
+  }
+  uintptr_t start = 0;
+  uintptr_t end = 0;
+  char line[PATH_MAX + 128];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long kb;
+    uintptr_t s, e;
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &s, &e) == 2) {
+      start = s;
+      end = e;
+    } else if (sscanf(line, "Anonymous: %llu kB", &kb) == 1 && kb > 0) {
+      ranges->push_back(make_pair(start, end));
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+/**
+ * Return how many bytes of |m| to save. A read-only file mapping that must
+ * still be identical to the file, because it's shared or none of its pages
+ * were ever written, only has its first page saved. |modified| is from
+ * read_modified_ranges, or null if that failed.
+ */
+static size_t dumped_size(Task* t, const Mapping& m, const MappableResource& r,
+                          const AddressRanges* modified) {
+  if (!(m.prot & PROT_READ) || m.start == t->scratch_ptr) {
+    return 0;
+  }
+  if (!r.fsname.empty() && r.fsname[0] == '/' && !(m.prot & PROT_WRITE)) {
+    bool matches_file = (m.flags & MAP_SHARED) != 0;
+    if (!matches_file && modified) {
+      matches_file = true;
+      for (auto& range : *modified) {
+        if (range.first < m.end && m.start < range.second) {
+          matches_file = false;
+          break;
+        }
+      }
+    }
+    if (matches_file) {
+      return m.offset == 0 ? page_size() : 0;
+    }
+  }
+  return m.num_bytes();
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+/**
+ * Copy |size| bytes of tracee memory at |addr| to |fd|, in big chunks.
+ * Anything we can't read (e.g. parts of a file mapping beyond the end of
+ * the file) is saved as zeroes, so later segments stay where the program
+ * headers say they are.
+ */
+static bool write_memory(int fd, Task* t, remote_ptr<void> addr,
+                         size_t size) {
+  vector<uint8_t> buf(min(size, size_t(4 * 1024 * 1024)));
+  while (size > 0) {
+    size_t chunk = min(size, buf.size());
+    ssize_t nread = t->read_bytes_fallible(addr, chunk, buf.data());
+    nread = max(ssize_t(0), nread);
+    memset(buf.data() + nread, 0, chunk - nread);
+    if (!write_all(fd, buf.data(), chunk)) {
+      return false;
+    }
+    addr += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+template <typename Arch>
+static bool write_core_file_arch(Task* t, const string& path) {
+  typedef typename CoreElfTypes<Arch>::Ehdr Ehdr;
+  typedef typename CoreElfTypes<Arch>::Phdr Phdr;
+
+  vector<uint8_t> notes;
+  append_prpsinfo<Arch>(notes, t);
+  append_prstatus<Arch>(notes, t);
+  for (Task* thread : t->vm()->task_set()) {
+    if (thread != t && thread->tgid() == t->tgid()) {
+      append_prstatus<Arch>(notes, thread);
+    }
+  }
+  append_auxv(notes, t);
+  append_file_note<Arch>(notes, t);
+
+  AddressRanges modified;
+  bool have_modified = read_modified_ranges(t, &modified);
+  const AddressSpace::MemoryMap& maps = t->vm()->memmap();
+  vector<Phdr> phdrs(1 + maps.size());
+  size_t offset = sizeof(Ehdr) + phdrs.size() * sizeof(Phdr);
+  memset(phdrs.data(), 0, phdrs.size() * sizeof(Phdr));
+  phdrs[0].p_type = PT_NOTE;
+  phdrs[0].p_offset = offset;
+  phdrs[0].p_filesz = notes.size();
+  phdrs[0].p_align = 4;
+  offset = ceil_page_size(offset + notes.size());
+  size_t i = 1;
+  for (auto& kv : maps) {
+    const Mapping& m = kv.first;
+    Phdr& phdr = phdrs[i++];
+    phdr.p_type = PT_LOAD;
+    phdr.p_offset = offset;
+    phdr.p_vaddr = m.start.as_int();
+    phdr.p_filesz =
+        dumped_size(t, m, kv.second, have_modified ? &modified : nullptr);
+    phdr.p_memsz = m.num_bytes();
+    phdr.p_flags = ((m.prot & PROT_READ) ? PF_R : 0) |
+                   ((m.prot & PROT_WRITE) ? PF_W : 0) |
+                   ((m.prot & PROT_EXEC) ? PF_X : 0);
+    phdr.p_align = page_size();
+    offset += phdr.p_filesz;
+  }
+
+  Ehdr ehdr;
+  memset(&ehdr, 0, sizeof(ehdr));
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = CoreElfTypes<Arch>::elf_class;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_CORE;
+  ehdr.e_machine = CoreElfTypes<Arch>::machine;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_phoff = sizeof(Ehdr);
+  ehdr.e_ehsize = sizeof(Ehdr);
+  ehdr.e_phentsize = sizeof(Phdr);
+  ehdr.e_phnum = phdrs.size();
+
+  ScopedFd fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (!fd.is_open()) {
+    LOG(error) << "Can't create core file " << path;
+    return false;
+  }
+  vector<uint8_t> headers;
+  append_bytes(headers, &ehdr, sizeof(ehdr));
+  append_bytes(headers, phdrs.data(), phdrs.size() * sizeof(Phdr));
+  append_bytes(headers, notes.data(), notes.size());
+  headers.resize(phdrs.size() > 1 ? phdrs[1].p_offset : headers.size());
+  if (!write_all(fd, headers.data(), headers.size())) {
+    return false;
+  }
+  i = 1;
+  for (auto& kv : maps) {
+    if (!write_memory(fd, t, kv.first.start, phdrs[i++].p_filesz)) {
+      LOG(error) << "Failed writing core file " << path;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool write_core_file(Task* t, const string& path) {
+  RR_ARCH_FUNCTION(write_core_file_arch, t->arch(), t, path);
+}
@@ -0,0 +1,22 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_CORE_DUMPER_H_
+#define RR_CORE_DUMPER_H_
+
+#include <string>
+
+class Task;
+
+/**
+ * Write an ELF core file for |t|'s process to |path|, reading memory
+ * straight from the tracee rather than through a debugger. Every thread of
+ * the process gets its registers saved, with |t| first so debuggers select
+ * it. Thread and process IDs are the recorded ones.
+ *
+ * Read-only file mappings are left out (apart from their first page, so
+ * debuggers can find ELF headers and build IDs), since their contents are
+ * the file's. Returns false if the file couldn't be written.
+ */
+bool write_core_file(Task* t, const std::string& path);
+
+#endif /* RR_CORE_DUMPER_H_ */
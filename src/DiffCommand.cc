@@ -0,0 +1,558 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "preload/preload_interface.h"
+
+#include "Command.h"
+#include "kernel_abi.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace rr;
+using namespace std;
+
+class DiffCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  DiffCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static DiffCommand singleton;
+};
+
+DiffCommand DiffCommand::singleton(
+    "diff",
+    " rr diff [OPTIONS] <trace_dir1> <trace_dir2>\n"
+    "  Find where two recordings of the same program first behave\n"
+    "  differently, e.g. a passing and a failing run of a test. Each task's\n"
+    "  syscalls, buffered or not, and deterministic signals are compared in\n"
+    "  order with those of the task created by the corresponding clone or\n"
+    "  fork in the other trace. The first divergence found is printed with\n"
+    "  the commands to replay each trace to it. Exits with status 0 if the\n"
+    "  traces don't diverge and 1 if they do.\n"
+    "  -d, --data                 also compare the data recorded for each\n"
+    "                             syscall, by hash\n"
+    "  -j, --jobs=<N>             decompress each trace on N threads; the\n"
+    "                             traces are always decoded in parallel\n");
+
+struct DiffFlags {
+  bool compare_data;
+  // Trace decompression threads per trace; 0 to decompress on the thread
+  // decoding the trace.
+  uint32_t jobs;
+
+  DiffFlags() : compare_data(false), jobs(0) {}
+};
+
+static bool parse_diff_arg(std::vector<std::string>& args, DiffFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'd', "data", NO_PARAMETER },
+                                        { 'j', "jobs", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'd':
+      flags.compare_data = true;
+      break;
+    case 'j':
+      if (!opt.verify_valid_int(1, 256)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * One step of a task's behavior that's compared between the traces.
+ */
+struct DiffEntry {
+  enum Kind { SYSCALL, BUFFERED_SYSCALL, SIGNAL };
+
+  TraceFrame::Time time;
+  pid_t tid;
+  Kind kind;
+  SupportedArch arch;
+  // Syscall or signal number.
+  int number;
+  int64_t result;
+  // Only set for traced syscalls; buffered syscalls don't record them.
+  uint64_t args[6];
+  // Hash of the data recorded for a syscall, when comparing data.
+  uint64_t data_hash;
+};
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Decodes a trace into DiffEntries on a thread of its own, handing them
+ * over in batches so that both traces are decoded while they're compared.
+ */
+class TraceScanner {
+public:
+  TraceScanner(const string& trace_dir, const DiffFlags& flags);
+  ~TraceScanner();
+
+  /**
+   * Move the next batch of entries to |out|, waiting for it if necessary.
+   * Returns false when the whole trace has been handed over.
+   */
+  bool next_batch(vector<DiffEntry>* out);
+
+  const string& dir() const { return trace.dir(); }
+
+private:
+  static void* scan_thread_callback(void* p);
+  void scan_thread();
+  void scan_frame(const TraceFrame& frame, vector<DiffEntry>& batch);
+
+  TraceReader trace;
+  bool compare_data;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  deque<vector<DiffEntry> > batches;
+  bool done;
+  bool closing;
+  // END protected by 'mutex'
+};
+
+static const size_t BATCH_ENTRIES = 1024;
+// Batches decoded ahead of the comparison, per trace.
+static const size_t MAX_BATCHES = 16;
+
+TraceScanner::TraceScanner(const string& trace_dir, const DiffFlags& flags)
+    : trace(trace_dir),
+      compare_data(flags.compare_data),
+      done(false),
+      closing(false) {
+  if (flags.jobs > 0) {
+    trace.enable_read_ahead(2 * flags.jobs, flags.jobs);
+  }
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  pthread_create(&thread, nullptr, scan_thread_callback, this);
+  pthread_setname_np(thread, "diff-scan");
+}
+
+TraceScanner::~TraceScanner() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(thread, nullptr);
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void* TraceScanner::scan_thread_callback(void* p) {
+  static_cast<TraceScanner*>(p)->scan_thread();
+  return nullptr;
+}
+
+void TraceScanner::scan_thread() {
+  vector<DiffEntry> batch;
+  while (!trace.at_end()) {
+    scan_frame(trace.read_frame(), batch);
+    if (batch.size() < BATCH_ENTRIES) {
+      continue;
+    }
+    pthread_mutex_lock(&mutex);
+    while (batches.size() >= MAX_BATCHES && !closing) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+    bool stop = closing;
+    batches.push_back(move(batch));
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    batch.clear();
+    if (stop) {
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&mutex);
+  if (!batch.empty()) {
+    batches.push_back(move(batch));
+  }
+  done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void TraceScanner::scan_frame(const TraceFrame& frame,
+                              vector<DiffEntry>& batch) {
+  const Event& ev = frame.event();
+  DiffEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.time = frame.time();
+  entry.tid = frame.tid();
+  entry.arch = ev.arch();
+  entry.data_hash = FNV_OFFSET_BASIS;
+
+  bool is_entry = false;
+  if (ev.type() == EV_SYSCALL && ev.Syscall().state == EXITING_SYSCALL &&
+      !frame.regs().syscall_may_restart()) {
+    // Interrupted syscalls are left out: where signals interrupt them
+    // depends on scheduling.
+    is_entry = true;
+    entry.kind = DiffEntry::SYSCALL;
+    entry.number = ev.Syscall().number;
+    entry.result = frame.regs().syscall_result_signed();
+    for (int i = 0; i < 6; ++i) {
+      entry.args[i] = frame.regs().arg(i + 1);
+    }
+  } else if (ev.type() == EV_SIGNAL &&
+             ev.Signal().deterministic == DETERMINISTIC_SIG) {
+    // Asynchronous signals arrive at scheduling-dependent points too.
+    is_entry = true;
+    entry.kind = DiffEntry::SIGNAL;
+    entry.number = ev.Signal().siginfo.si_signo;
+  }
+
+  TraceReader::RawDataView data;
+  bool first_record = true;
+  while (trace.read_raw_data_view_for_frame(frame, data)) {
+    // The first record of a flush is the syscallbuf.
+    if (ev.type() == EV_SYSCALLBUF_FLUSH && first_record) {
+      auto hdr = reinterpret_cast<const syscallbuf_hdr*>(data.data);
+      if (hdr->num_rec_bytes > data.size - sizeof(*hdr)) {
+        fprintf(stderr, "Malformed trace file (bad recorded-bytes count)\n");
+        abort();
+      }
+      auto record_ptr = reinterpret_cast<const uint8_t*>(hdr + 1);
+      auto end_ptr = record_ptr + hdr->num_rec_bytes;
+      while (record_ptr < end_ptr) {
+        auto record = reinterpret_cast<const syscallbuf_record*>(record_ptr);
+        if (record->size < sizeof(*record)) {
+          fprintf(stderr, "Malformed trace file (bad record size)\n");
+          abort();
+        }
+        DiffEntry buffered = entry;
+        buffered.kind = DiffEntry::BUFFERED_SYSCALL;
+        buffered.number = record->syscallno;
+        buffered.result = record->ret;
+        if (compare_data) {
+          buffered.data_hash =
+              hash_bytes(buffered.data_hash, record->extra_data,
+                         record->size - sizeof(*record));
+        }
+        batch.push_back(buffered);
+        record_ptr += stored_record_size(record->size);
+      }
+    } else if (compare_data) {
+      entry.data_hash = hash_bytes(entry.data_hash, data.data, data.size);
+    }
+    first_record = false;
+  }
+
+  if (is_entry) {
+    batch.push_back(entry);
+  }
+}
+
+bool TraceScanner::next_batch(vector<DiffEntry>* out) {
+  pthread_mutex_lock(&mutex);
+  while (batches.empty() && !done) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  bool got_batch = !batches.empty();
+  if (got_batch) {
+    *out = move(batches.front());
+    batches.pop_front();
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+  return got_batch;
+}
+
+/**
+ * Compares the entries of tasks in two traces as they're decoded. Tasks
+ * are matched up by the results of corresponding clone, fork and vfork
+ * calls, starting with the first task of each trace, and tids in syscall
+ * arguments and results are compared through that mapping.
+ */
+class TraceDiff {
+public:
+  TraceDiff(const string& dir1, const string& dir2, const DiffFlags& flags)
+      : compare_data(flags.compare_data), diverged(false) {
+    scanners[0] = unique_ptr<TraceScanner>(new TraceScanner(dir1, flags));
+    scanners[1] = unique_ptr<TraceScanner>(new TraceScanner(dir2, flags));
+  }
+
+  /**
+   * Returns true if the traces diverge, after printing where to |out|.
+   */
+  bool run(FILE* out);
+
+private:
+  // Entries of each trace, by tid, that haven't been compared yet.
+  typedef map<pid_t, deque<DiffEntry> > PendingEntries;
+
+  bool same_value(uint64_t v1, uint64_t v2) const;
+  const char* compare(const DiffEntry& e1, const DiffEntry& e2);
+  void compare_pending();
+  void compare_leftovers();
+  void note_divergence(pid_t tid1, pid_t tid2, const DiffEntry* e1,
+                       const DiffEntry* e2, const char* reason);
+  void print_entry(FILE* out, int trace, pid_t tid, const DiffEntry* e);
+
+  unique_ptr<TraceScanner> scanners[2];
+  PendingEntries pending[2];
+  // Tids of the first trace's tasks to their counterparts in the second,
+  // and back.
+  map<pid_t, pid_t> tid_map[2];
+  // Entries compared equal so far, by tid in the first trace.
+  map<pid_t, uint64_t> matched;
+  bool compare_data;
+
+  // The earliest divergence found, by event in the first trace.
+  bool diverged;
+  pid_t diverged_tids[2];
+  bool has_diverged_entry[2];
+  DiffEntry diverged_entries[2];
+  const char* diverged_reason;
+};
+
+bool TraceDiff::same_value(uint64_t v1, uint64_t v2) const {
+  if (v1 == v2) {
+    return true;
+  }
+  if (v1 > INT32_MAX) {
+    return false;
+  }
+  auto it = tid_map[0].find((pid_t)v1);
+  return it != tid_map[0].end() && (uint64_t)it->second == v2;
+}
+
+/**
+ * Returns why |e1| and |e2| differ, or null if they don't. Learns the
+ * mapping of tasks created by clone, fork and vfork on the way.
+ */
+const char* TraceDiff::compare(const DiffEntry& e1, const DiffEntry& e2) {
+  if ((e1.kind == DiffEntry::SIGNAL) != (e2.kind == DiffEntry::SIGNAL)) {
+    return "a signal in one trace and a syscall in the other";
+  }
+  if (e1.arch != e2.arch) {
+    return "different architectures";
+  }
+  if (e1.number != e2.number) {
+    return e1.kind == DiffEntry::SIGNAL ? "different signals"
+                                        : "different syscalls";
+  }
+  if (e1.kind == DiffEntry::SIGNAL) {
+    return nullptr;
+  }
+  if (e1.kind == DiffEntry::SYSCALL && e2.kind == DiffEntry::SYSCALL) {
+    for (int i = 0; i < 6; ++i) {
+      if (!same_value(e1.args[i], e2.args[i])) {
+        return "different syscall arguments";
+      }
+    }
+  }
+  if ((is_clone_syscall(e1.number, e1.arch) ||
+       is_fork_syscall(e1.number, e1.arch) ||
+       is_vfork_syscall(e1.number, e1.arch)) &&
+      e1.result > 0 && e2.result > 0) {
+    tid_map[0][(pid_t)e1.result] = (pid_t)e2.result;
+    tid_map[1][(pid_t)e2.result] = (pid_t)e1.result;
+  }
+  if (!same_value(e1.result, e2.result)) {
+    return "different syscall results";
+  }
+  if (compare_data && e1.data_hash != e2.data_hash) {
+    return "different recorded data";
+  }
+  return nullptr;
+}
+
+void TraceDiff::note_divergence(pid_t tid1, pid_t tid2, const DiffEntry* e1,
+                                const DiffEntry* e2, const char* reason) {
+  // Order by the first trace's event, falling back to the second's when
+  // the first trace has no entry.
+  auto time_of = [](const DiffEntry* e) {
+    return e ? e->time : numeric_limits<TraceFrame::Time>::max();
+  };
+  if (diverged) {
+    TraceFrame::Time t1 =
+        time_of(has_diverged_entry[0] ? &diverged_entries[0] : nullptr);
+    TraceFrame::Time t2 =
+        time_of(has_diverged_entry[1] ? &diverged_entries[1] : nullptr);
+    if (time_of(e1) > t1 || (time_of(e1) == t1 && time_of(e2) >= t2)) {
+      return;
+    }
+  }
+  diverged = true;
+  diverged_tids[0] = tid1;
+  diverged_tids[1] = tid2;
+  const DiffEntry* entries[2] = { e1, e2 };
+  for (int i = 0; i < 2; ++i) {
+    has_diverged_entry[i] = entries[i] != nullptr;
+    if (entries[i]) {
+      diverged_entries[i] = *entries[i];
+    }
+  }
+  diverged_reason = reason;
+}
+
+void TraceDiff::compare_pending() {
+  // Comparing clones maps new tasks, whose entries may then be compared.
+  size_t mapped;
+  do {
+    mapped = tid_map[0].size();
+    for (auto& m : tid_map[0]) {
+      auto& q1 = pending[0][m.first];
+      auto& q2 = pending[1][m.second];
+      while (!q1.empty() && !q2.empty()) {
+        const char* reason = compare(q1.front(), q2.front());
+        if (reason) {
+          note_divergence(m.first, m.second, &q1.front(), &q2.front(),
+                          reason);
+          break;
+        }
+        q1.pop_front();
+        q2.pop_front();
+        ++matched[m.first];
+      }
+    }
+  } while (!diverged && tid_map[0].size() != mapped);
+}
+
+/**
+ * Once both traces have been read, any entries left for a matched pair of
+ * tasks are steps one of them took that the other didn't.
+ */
+void TraceDiff::compare_leftovers() {
+  for (auto& m : tid_map[0]) {
+    auto& q1 = pending[0][m.first];
+    auto& q2 = pending[1][m.second];
+    if (!q1.empty() && q2.empty()) {
+      note_divergence(m.first, m.second, &q1.front(), nullptr,
+                      "the task did more in the first trace");
+    } else if (q1.empty() && !q2.empty()) {
+      note_divergence(m.first, m.second, nullptr, &q2.front(),
+                      "the task did more in the second trace");
+    }
+  }
+}
+
+void TraceDiff::print_entry(FILE* out, int trace, pid_t tid,
+                            const DiffEntry* e) {
+  const char* dir = scanners[trace]->dir().c_str();
+  if (!e) {
+    fprintf(out, "  %s: tid %d: nothing more\n", dir, tid);
+    return;
+  }
+  fprintf(out, "  %s: event %u, tid %d: ", dir, e->time, tid);
+  switch (e->kind) {
+    case DiffEntry::SIGNAL:
+      fprintf(out, "%s\n", signal_name(e->number));
+      break;
+    case DiffEntry::SYSCALL:
+      fprintf(out, "%s(", syscall_name(e->number, e->arch).c_str());
+      for (int i = 0; i < 6; ++i) {
+        fprintf(out, "%s0x%" PRIx64, i ? ", " : "", e->args[i]);
+      }
+      fprintf(out, ") = %" PRId64 "\n", e->result);
+      break;
+    case DiffEntry::BUFFERED_SYSCALL:
+      fprintf(out, "%s(...) = %" PRId64 " (buffered)\n",
+              syscall_name(e->number, e->arch).c_str(), e->result);
+      break;
+  }
+}
+
+bool TraceDiff::run(FILE* out) {
+  bool done[2] = { false, false };
+  pid_t first_tid[2] = { 0, 0 };
+  vector<DiffEntry> batch;
+  while (!diverged && !(done[0] && done[1])) {
+    for (int i = 0; i < 2; ++i) {
+      if (done[i]) {
+        continue;
+      }
+      if (!scanners[i]->next_batch(&batch)) {
+        done[i] = true;
+        continue;
+      }
+      for (auto& e : batch) {
+        pending[i][e.tid].push_back(e);
+      }
+      if (!first_tid[i] && !batch.empty()) {
+        first_tid[i] = batch[0].tid;
+      }
+    }
+    if (tid_map[0].empty() && first_tid[0] && first_tid[1]) {
+      tid_map[0][first_tid[0]] = first_tid[1];
+      tid_map[1][first_tid[1]] = first_tid[0];
+    }
+    compare_pending();
+  }
+  if (!diverged) {
+    compare_leftovers();
+  }
+  if (!diverged) {
+    return false;
+  }
+
+  fprintf(out, "Traces diverge after %" PRIu64 " matching syscalls and "
+               "signals of tid %d: %s\n",
+          matched[diverged_tids[0]], diverged_tids[0], diverged_reason);
+  for (int i = 0; i < 2; ++i) {
+    print_entry(out, i, diverged_tids[i],
+                has_diverged_entry[i] ? &diverged_entries[i] : nullptr);
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (has_diverged_entry[i]) {
+      fprintf(out, "  rr replay -g %u %s\n", diverged_entries[i].time,
+              scanners[i]->dir().c_str());
+    }
+  }
+  return true;
+}
+
+int DiffCommand::run(std::vector<std::string>& args) {
+  DiffFlags flags;
+
+  while (parse_diff_arg(args, flags)) {
+  }
+
+  if (args.size() != 2 || !verify_not_option(args)) {
+    print_help(stderr);
+    return 2;
+  }
+
+  TraceDiff diff(args[0], args[1], flags);
+  return diff.run(stdout) ? 1 : 0;
+}
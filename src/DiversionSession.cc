@@ -20,7 +20,7 @@ DiversionSession::~DiversionSession() {
   // resources.
   kill_all_tasks();
   assert(tasks().size() == 0 && vms().size() == 0);
-  emu_fs->gc(*this);
+  emu_fs->gc();
   assert(emu_fs->size() == 0);
 }
 
@@ -33,6 +33,11 @@ public:
 
   EmuFs& emufs() const { return *emu_fs; }
 
+  virtual void on_map_resource(const FileId& id) { emu_fs->note_mapped(id); }
+  virtual void on_unmap_resource(const FileId& id) {
+    emu_fs->note_unmapped(id);
+  }
+
   enum DiversionStatus {
     // Some execution was done. diversion_step() can be called again.
     DIVERSION_CONTINUE,
@@ -1,9 +1,15 @@
 /* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
 
+#include <algorithm>
 #include <limits>
+#include <map>
+#include <sstream>
 
 #include "preload/preload_interface.h"
 
@@ -30,23 +36,53 @@ DumpCommand DumpCommand::singleton(
     "  Event specs can be either an event number like `127', or a range\n"
     "  like `1000-5000'.  By default, all events are dumped.\n"
     "  -b, --syscallbuf           dump syscallbuf contents\n"
+    "  -c, --syscall=<NAME>       only dump events for syscall NAME (e.g.\n"
+    "                             `open'); buffered syscalls aren't matched\n"
+    "  -e, --event=<TYPE>         only dump events of type TYPE (e.g.\n"
+    "                             `SIGNAL' or `SYSCALLBUF_FLUSH')\n"
+    "  -j, --jobs=<N>             decompress the trace on N threads while\n"
+    "                             events are parsed and dumped in order\n"
     "  -m, --recorded-metadata    dump recorded data metadata\n"
+    "  -q, --quiet                don't print events; with -s, only print\n"
+    "                             the statistics for the matching events\n"
     "  -r, --raw                  dump trace frames in a more easily\n"
     "                             machine-parseable format instead of the\n"
     "                             default human-readable format\n"
-    "  -s, --statistics           dump statistics about the trace\n");
+    "  -s, --statistics           dump statistics about the trace, with\n"
+    "                             event counts and recorded data sizes by\n"
+    "                             event type, syscall and tid for the\n"
+    "                             dumped events\n"
+    "  -t, --tid=<TID>            only dump events of task TID\n"
+    "  -x, --export=<DIR>         instead of printing events, write them\n"
+    "                             to CSV tables in DIR for loading into a\n"
+    "                             database: events.csv, syscalls.csv (with\n"
+    "                             raw arguments and recorded bytes),\n"
+    "                             mmaps.csv and tasks.csv. DIR/schema.sql\n"
+    "                             creates the tables with column types\n");
 
 struct DumpFlags {
   bool dump_syscallbuf;
   bool dump_recorded_data_metadata;
   bool raw_dump;
   bool dump_statistics;
+  bool quiet;
+  // Filters; events must match all of the ones that are set.
+  pid_t only_tid;
+  string only_event_type;
+  string only_syscall;
+  // Trace decompression threads; 0 to decompress on the dumping thread.
+  uint32_t jobs;
+  // Directory to write CSV tables to instead of printing events.
+  string export_dir;
 
   DumpFlags()
       : dump_syscallbuf(false),
         dump_recorded_data_metadata(false),
         raw_dump(false),
-        dump_statistics(false) {}
+        dump_statistics(false),
+        quiet(false),
+        only_tid(0),
+        jobs(0) {}
 };
 
 static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
@@ -55,10 +91,16 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
   }
 
   static const OptionSpec options[] = { { 'b', "syscallbuf", NO_PARAMETER },
+                                        { 'c', "syscall", HAS_PARAMETER },
+                                        { 'e', "event", HAS_PARAMETER },
+                                        { 'j', "jobs", HAS_PARAMETER },
                                         { 'm', "recorded-metadata",
                                           NO_PARAMETER },
+                                        { 'q', "quiet", NO_PARAMETER },
                                         { 'r', "raw", NO_PARAMETER },
-                                        { 's', "statistics", NO_PARAMETER } };
+                                        { 's', "statistics", NO_PARAMETER },
+                                        { 't', "tid", HAS_PARAMETER },
+                                        { 'x', "export", HAS_PARAMETER } };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
     return false;
@@ -68,29 +110,72 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
     case 'b':
       flags.dump_syscallbuf = true;
       break;
+    case 'c':
+      flags.only_syscall = opt.value;
+      break;
+    case 'e':
+      flags.only_event_type = opt.value;
+      break;
+    case 'j':
+      if (!opt.verify_valid_int(1, 256)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
     case 'm':
       flags.dump_recorded_data_metadata = true;
       break;
+    case 'q':
+      flags.quiet = true;
+      break;
     case 'r':
       flags.raw_dump = true;
       break;
     case 's':
       flags.dump_statistics = true;
       break;
+    case 't':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.only_tid = opt.int_value;
+      break;
+    case 'x':
+      flags.export_dir = opt.value;
+      break;
     default:
       assert(0 && "Unknown option");
   }
   return true;
 }
 
-static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
-                                 const TraceFrame& frame) {
-  if (frame.event().type() != EV_SYSCALLBUF_FLUSH) {
-    return;
-  }
-  auto buf = trace.read_raw_data();
-  size_t bytes_remaining = buf.data.size() - sizeof(struct syscallbuf_hdr);
-  auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(buf.data.data());
+/**
+ * Event counts and recorded data sizes for one event type, syscall or tid.
+ */
+struct EventCounts {
+  EventCounts() : events(0), raw_records(0), raw_bytes(0) {}
+  uint64_t events;
+  uint64_t raw_records;
+  uint64_t raw_bytes;
+};
+
+struct TraceStatistics {
+  std::map<string, EventCounts> event_types;
+  // Syscalls are counted once, at exit. Syscalls buffered by the syscallbuf
+  // are counted separately, with the size of their buffered outputs.
+  std::map<string, EventCounts> syscalls;
+  std::map<string, EventCounts> buffered_syscalls;
+  std::map<pid_t, EventCounts> tids;
+};
+
+/**
+ * Call |f| for each syscall record in the flushed syscallbuf |buf|.
+ */
+template <typename F>
+static void for_each_syscallbuf_record(const TraceReader::RawDataView& buf,
+                                       F f) {
+  size_t bytes_remaining = buf.size - sizeof(struct syscallbuf_hdr);
+  auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(buf.data);
   if (flush_hdr->num_rec_bytes > bytes_remaining) {
     fprintf(stderr, "Malformed trace file (bad recorded-bytes count)\n");
     abort();
@@ -101,17 +186,295 @@ static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
   auto end_ptr = record_ptr + bytes_remaining;
   while (record_ptr < end_ptr) {
     auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
-    fprintf(out, "  { syscall:'%s', ret:0x%lx, size:0x%lx }\n",
-            syscall_name(record->syscallno, frame.event().arch()).c_str(),
-            (long)record->ret, (long)record->size);
     if (record->size < sizeof(*record)) {
       fprintf(stderr, "Malformed trace file (bad record size)\n");
       abort();
     }
+    f(*record);
     record_ptr += stored_record_size(record->size);
   }
 }
 
+static void dump_syscallbuf_data(const TraceReader::RawDataView& buf,
+                                 FILE* out, const TraceFrame& frame) {
+  for_each_syscallbuf_record(buf, [&](const syscallbuf_record& record) {
+    fprintf(out, "  { syscall:'%s', ret:0x%lx, size:0x%lx }\n",
+            syscall_name(record.syscallno, frame.event().arch()).c_str(),
+            (long)record.ret, (long)record.size);
+  });
+}
+
+static void count_syscallbuf_data(const TraceReader::RawDataView& buf,
+                                  TraceStatistics& stats,
+                                  const TraceFrame& frame) {
+  for_each_syscallbuf_record(buf, [&](const syscallbuf_record& record) {
+    auto& counts = stats.buffered_syscalls[syscall_name(
+        record.syscallno, frame.event().arch())];
+    ++counts.events;
+    if (record.size > sizeof(record)) {
+      ++counts.raw_records;
+      counts.raw_bytes += record.size - sizeof(record);
+    }
+  });
+}
+
+/**
+ * Add |frame| and its raw data records, described by |raw_sizes|, to
+ * |stats|.
+ */
+static void count_frame(TraceStatistics& stats, const TraceFrame& frame,
+                        const vector<size_t>& raw_sizes) {
+  EventCounts* counts[3] = { &stats.event_types[frame.event().type_name()],
+                             &stats.tids[frame.tid()], nullptr };
+  const Event& ev = frame.event();
+  if (ev.is_syscall_event()) {
+    counts[2] = &stats.syscalls[syscall_name(ev.Syscall().number, ev.arch())];
+  }
+  for (auto c : counts) {
+    if (!c) {
+      continue;
+    }
+    if (c != counts[2] || ev.Syscall().state == EXITING_SYSCALL) {
+      ++c->events;
+    }
+    for (auto size : raw_sizes) {
+      ++c->raw_records;
+      c->raw_bytes += size;
+    }
+  }
+}
+
+/**
+ * The tables written by --export, with their columns as SQL declares them.
+ * Each CSV file's header row names the same columns.
+ */
+static const struct {
+  const char* name;
+  const char* columns;
+} export_tables[] = {
+  { "events", "event BIGINT, tid INTEGER, type VARCHAR, syscall VARCHAR, "
+              "syscall_state VARCHAR, ticks BIGINT, raw_records BIGINT, "
+              "raw_bytes BIGINT" },
+  { "syscalls", "event BIGINT, tid INTEGER, syscall VARCHAR, "
+                "buffered BOOLEAN, arg1 NUMERIC(20), arg2 NUMERIC(20), "
+                "arg3 NUMERIC(20), arg4 NUMERIC(20), arg5 NUMERIC(20), "
+                "arg6 NUMERIC(20), result BIGINT, recorded_bytes BIGINT" },
+  { "mmaps", "mapping BIGINT, type VARCHAR, start_addr NUMERIC(20), "
+             "end_addr NUMERIC(20), offset_pages BIGINT, device BIGINT, "
+             "inode BIGINT, source VARCHAR, file_name VARCHAR" },
+  { "tasks", "task_event BIGINT, type VARCHAR, tid INTEGER, "
+             "parent_tid INTEGER, clone_flags BIGINT, file_name VARCHAR, "
+             "cmd_line VARCHAR" }
+};
+
+/**
+ * Writes the events, syscalls, mapped regions and task events of a trace
+ * as CSV tables, so that many traces can be analyzed together in a
+ * database. Buffered syscalls have no arguments in the trace, so theirs
+ * are NULL.
+ */
+class TableExport {
+public:
+  TableExport() {
+    for (auto& f : files) {
+      f = nullptr;
+    }
+  }
+  ~TableExport() {
+    for (auto f : files) {
+      if (f) {
+        fclose(f);
+      }
+    }
+  }
+
+  /**
+   * Create |dir| if necessary, with the schema and the tables' headers.
+   * Returns false, after printing why, on failure.
+   */
+  bool open(const string& dir);
+
+  void add_frame(const TraceFrame& frame, const vector<size_t>& raw_sizes);
+  void add_buffered_syscall(const TraceFrame& frame,
+                            const syscallbuf_record& record);
+  void add_mapped_regions(const TraceReader& trace);
+  void add_task_events(TraceReader& trace);
+
+private:
+  enum { EVENTS, SYSCALLS, MMAPS, TASKS, TABLE_COUNT };
+
+  FILE* files[TABLE_COUNT];
+};
+
+/**
+ * Write |s| as a quoted CSV field.
+ */
+static void write_csv_string(FILE* out, const string& s) {
+  fputc('"', out);
+  for (char c : s) {
+    if (c == '"') {
+      fputc('"', out);
+    }
+    fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+bool TableExport::open(const string& dir) {
+  if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Can't create export directory %s: %s\n", dir.c_str(),
+            strerror(errno));
+    return false;
+  }
+  string schema_path = dir + "/schema.sql";
+  FILE* schema = fopen(schema_path.c_str(), "w");
+  if (!schema) {
+    fprintf(stderr, "Can't create %s: %s\n", schema_path.c_str(),
+            strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < TABLE_COUNT; ++i) {
+    fprintf(schema, "CREATE TABLE %s (%s);\n", export_tables[i].name,
+            export_tables[i].columns);
+    string path = dir + "/" + export_tables[i].name + ".csv";
+    files[i] = fopen(path.c_str(), "w");
+    if (!files[i]) {
+      fprintf(stderr, "Can't create %s: %s\n", path.c_str(), strerror(errno));
+      fclose(schema);
+      return false;
+    }
+    // The header is the column list without the types.
+    const char* c = export_tables[i].columns;
+    while (*c) {
+      const char* end = strchr(c, ' ');
+      fwrite(c, 1, end - c, files[i]);
+      c = strchr(end, ',');
+      if (!c) {
+        break;
+      }
+      fputc(',', files[i]);
+      c += 2;
+    }
+    fputc('\n', files[i]);
+  }
+  fclose(schema);
+  return true;
+}
+
+void TableExport::add_frame(const TraceFrame& frame,
+                            const vector<size_t>& raw_sizes) {
+  const Event& ev = frame.event();
+  uint64_t raw_bytes = 0;
+  for (auto size : raw_sizes) {
+    raw_bytes += size;
+  }
+
+  FILE* out = files[EVENTS];
+  fprintf(out, "%u,%d,%s,", frame.time(), frame.tid(),
+          ev.type_name().c_str());
+  if (ev.is_syscall_event()) {
+    fprintf(out, "%s,%s", syscall_name(ev.Syscall().number, ev.arch()).c_str(),
+            state_name(ev.Syscall().state));
+  } else {
+    fputc(',', out);
+  }
+  fprintf(out, ",%" PRId64 ",%zu,%" PRIu64 "\n", frame.ticks(),
+          raw_sizes.size(), raw_bytes);
+
+  if (ev.type() != EV_SYSCALL || ev.Syscall().state != EXITING_SYSCALL) {
+    return;
+  }
+  out = files[SYSCALLS];
+  fprintf(out, "%u,%d,%s,false", frame.time(), frame.tid(),
+          syscall_name(ev.Syscall().number, ev.arch()).c_str());
+  for (int i = 1; i <= 6; ++i) {
+    fprintf(out, ",%" PRIu64, (uint64_t)frame.regs().arg(i));
+  }
+  fprintf(out, ",%" PRId64 ",%" PRIu64 "\n",
+          (int64_t)frame.regs().syscall_result_signed(), raw_bytes);
+}
+
+void TableExport::add_buffered_syscall(const TraceFrame& frame,
+                                       const syscallbuf_record& record) {
+  fprintf(files[SYSCALLS], "%u,%d,%s,true,,,,,,,%" PRId64 ",%zu\n",
+          frame.time(), frame.tid(),
+          syscall_name(record.syscallno, frame.event().arch()).c_str(),
+          record.ret, record.size - sizeof(record));
+}
+
+void TableExport::add_mapped_regions(const TraceReader& trace) {
+  static const char* source_names[] = { "trace", "file", "zero" };
+  FILE* out = files[MMAPS];
+  uint64_t mapping = 0;
+  for (auto& r : trace.mapped_regions()) {
+    auto& map = r.first;
+    fprintf(out, "%" PRIu64 ",%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                 ",%" PRIu64 ",%" PRIu64 ",%s,",
+            mapping++,
+            map.type() == TraceMappedRegion::MMAP ? "mmap" : "sysv_shm",
+            (uint64_t)map.start().as_int(), (uint64_t)map.end().as_int(),
+            map.offset_pages(), (uint64_t)map.stat().st_dev,
+            (uint64_t)map.stat().st_ino, source_names[r.second]);
+    write_csv_string(out, map.file_name());
+    fputc('\n', out);
+  }
+}
+
+void TableExport::add_task_events(TraceReader& trace) {
+  static const char* type_names[] = { "none", "clone", "fork", "exec",
+                                      "exit" };
+  FILE* out = files[TASKS];
+  for (uint64_t i = 0;; ++i) {
+    auto e = trace.read_task_event();
+    if (e.type() == TraceTaskEvent::NONE) {
+      break;
+    }
+    fprintf(out, "%" PRIu64 ",%s,%d,", i, type_names[e.type()], e.tid());
+    switch (e.type()) {
+      case TraceTaskEvent::CLONE:
+        fprintf(out, "%d,%" PRIu64 ",,\n", e.parent_tid(),
+                (uint64_t)e.clone_flags());
+        break;
+      case TraceTaskEvent::FORK:
+        fprintf(out, "%d,,,\n", e.parent_tid());
+        break;
+      case TraceTaskEvent::EXEC: {
+        string cmd_line;
+        for (auto& arg : e.cmd_line()) {
+          cmd_line += (cmd_line.empty() ? "" : " ") + arg;
+        }
+        fprintf(out, ",,");
+        write_csv_string(out, e.file_name());
+        fputc(',', out);
+        write_csv_string(out, cmd_line);
+        fputc('\n', out);
+        break;
+      }
+      default:
+        fprintf(out, ",,,\n");
+        break;
+    }
+  }
+}
+
+static bool frame_matches_filters(const TraceFrame& frame,
+                                  const DumpFlags& flags) {
+  if (flags.only_tid && frame.tid() != flags.only_tid) {
+    return false;
+  }
+  const Event& ev = frame.event();
+  if (!flags.only_event_type.empty() &&
+      ev.type_name() != flags.only_event_type) {
+    return false;
+  }
+  if (!flags.only_syscall.empty() &&
+      (!ev.is_syscall_event() ||
+       syscall_name(ev.Syscall().number, ev.arch()) != flags.only_syscall)) {
+    return false;
+  }
+  return true;
+}
+
 /**
  * Dump all events from the current to trace that match |spec| to
  * |out|.  |spec| has the following syntax: /\d+(-\d+)?/, expressing
@@ -123,9 +486,15 @@ static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
  * constructed so as to match properly on a serial linear scan; that
  * is, they should comprise disjoint and monotonically increasing
  * event sets.  No attempt is made to enforce this or normalize specs.
+ *
+ * Events that don't match the tid/event type/syscall filters in |flags|
+ * are skipped. Matching events are added to |stats| and |exports| when
+ * they're non-null; with |exports| they aren't printed.
  */
 static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
-                                 FILE* out, const string* spec) {
+                                 FILE* out, const string* spec,
+                                 TraceStatistics* stats,
+                                 TableExport* exports) {
 
   uint32_t start = 0, end = numeric_limits<uint32_t>::max();
 
@@ -136,70 +505,218 @@ static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
     start = end = atoi(spec->c_str());
   }
 
-  bool process_raw_data =
-      flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
+  // Jump over most of the events before |start| using the trace index.
+  trace.skip_to_before_event(start);
+
+  bool process_raw_data = flags.dump_syscallbuf ||
+                          flags.dump_recorded_data_metadata || stats ||
+                          exports;
+  bool print = !flags.quiet && !exports;
+  vector<size_t> raw_sizes;
   while (!trace.at_end()) {
     auto frame = trace.read_frame();
     if (end < frame.time()) {
       return;
     }
-    if (start <= frame.time() && frame.time() <= end) {
-      if (flags.raw_dump) {
+    if (start <= frame.time() && frame.time() <= end &&
+        frame_matches_filters(frame, flags)) {
+      if (print && flags.raw_dump) {
         frame.dump_raw(out);
-      } else {
+      } else if (print) {
         frame.dump(out);
       }
-      if (flags.dump_syscallbuf) {
-        dump_syscallbuf_data(trace, out, frame);
-      }
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
-        if (flags.dump_recorded_data_metadata) {
+      raw_sizes.clear();
+      TraceReader::RawDataView data;
+      while (process_raw_data &&
+             trace.read_raw_data_view_for_frame(frame, data)) {
+        // The first record of a flush is the syscallbuf.
+        bool is_syscallbuf =
+            frame.event().type() == EV_SYSCALLBUF_FLUSH && raw_sizes.empty();
+        if (is_syscallbuf && flags.dump_syscallbuf && print) {
+          dump_syscallbuf_data(data, out, frame);
+        }
+        if (is_syscallbuf && stats) {
+          count_syscallbuf_data(data, *stats, frame);
+        }
+        if (is_syscallbuf && exports) {
+          for_each_syscallbuf_record(data, [&](const syscallbuf_record& r) {
+            exports->add_buffered_syscall(frame, r);
+          });
+        }
+        if (flags.dump_recorded_data_metadata && print) {
           fprintf(out, "  { addr:%p, length:%p }\n", (void*)data.addr.as_int(),
-                  (void*)data.data.size());
+                  (void*)data.size);
         }
+        raw_sizes.push_back(data.size);
       }
-      if (!flags.raw_dump) {
+      if (stats) {
+        count_frame(*stats, frame, raw_sizes);
+      }
+      if (exports) {
+        exports->add_frame(frame, raw_sizes);
+      }
+      if (!flags.raw_dump && print) {
         fprintf(out, "}\n");
       }
     } else {
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
+      TraceReader::RawDataView data;
+      while (process_raw_data &&
+             trace.read_raw_data_view_for_frame(frame, data)) {
       }
     }
   }
 }
 
-static void dump_statistics(const TraceReader& trace, FILE* out) {
+/* How many of the largest event types, syscalls and tids to list */
+static const size_t TOP_COUNT = 10;
+
+template <typename K>
+static void dump_top_counts(const char* title,
+                            const std::map<K, EventCounts>& all, FILE* out) {
+  if (all.empty()) {
+    return;
+  }
+  vector<pair<string, EventCounts> > sorted;
+  for (auto& c : all) {
+    stringstream key;
+    key << c.first;
+    sorted.push_back(make_pair(key.str(), c.second));
+  }
+  // Largest recorded data first, then most events.
+  sort(sorted.begin(), sorted.end(),
+       [](const pair<string, EventCounts>& a,
+          const pair<string, EventCounts>& b) {
+    if (a.second.raw_bytes != b.second.raw_bytes) {
+      return a.second.raw_bytes > b.second.raw_bytes;
+    }
+    return a.second.events > b.second.events;
+  });
+  fprintf(out, "// Top %s of %zu by recorded data:\n", title, sorted.size());
+  for (size_t i = 0; i < sorted.size() && i < TOP_COUNT; ++i) {
+    auto& c = sorted[i].second;
+    fprintf(out, "//   %-32s %10" PRIu64 " events %10" PRIu64
+                 " records %14" PRIu64 " bytes\n",
+            sorted[i].first.c_str(), c.events, c.raw_records, c.raw_bytes);
+  }
+}
+
+static void dump_statistics(const TraceReader& trace,
+                            const TraceStatistics& event_stats, FILE* out) {
   uint64_t uncompressed = trace.uncompressed_bytes();
   uint64_t compressed = trace.compressed_bytes();
-  fprintf(stdout, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
+  fprintf(out, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
                   ", ratio %.2fx\n",
           uncompressed, compressed, double(uncompressed) / compressed);
+  for (int s = TraceStream::SUBSTREAM_FIRST; s < TraceStream::SUBSTREAM_COUNT;
+       ++s) {
+    auto substream = (TraceStream::Substream)s;
+    auto& policy = trace.compression_policy(substream);
+    const CompressionCodec* codec = CompressionCodec::get(policy.codec);
+    fprintf(out, "// Substream %s: codec %s",
+            TraceStream::substream_name(substream),
+            codec ? codec->name() : "unknown");
+    if (policy.level != CompressionCodec::DEFAULT_LEVEL) {
+      fprintf(out, " level %d", policy.level);
+    }
+    fprintf(out, ", block size %zu, %u threads\n", policy.block_size,
+            policy.threads);
+    uint64_t s_uncompressed = trace.uncompressed_bytes(substream);
+    uint64_t s_compressed = trace.compressed_bytes(substream);
+    fprintf(out, "//   uncompressed bytes %" PRIu64
+                 ", compressed bytes %" PRIu64 ", ratio %.2fx\n",
+            s_uncompressed, s_compressed,
+            s_compressed ? double(s_uncompressed) / s_compressed : 0.0);
+  }
+
+  dump_top_counts("event types", event_stats.event_types, out);
+  dump_top_counts("syscalls", event_stats.syscalls, out);
+  dump_top_counts("buffered syscalls", event_stats.buffered_syscalls, out);
+  dump_top_counts("tids", event_stats.tids, out);
+
+  CompressedWriter::Stats stats[TraceStream::SUBSTREAM_COUNT];
+  WriteMemoryBudget::Stats budget_stats;
+  if (!trace.read_writer_stats(stats, &budget_stats)) {
+    return;
+  }
+  for (int s = TraceStream::SUBSTREAM_FIRST; s < TraceStream::SUBSTREAM_COUNT;
+       ++s) {
+    auto& st = stats[s];
+    fprintf(out, "// Substream %s: recording stalled %" PRIu64
+                 " times for %.3fs, %" PRIu64 " of %" PRIu64
+                 " blocks stored uncompressed",
+            TraceStream::substream_name((TraceStream::Substream)s), st.stalls,
+            st.stall_ns / 1e9, st.stored_blocks, st.blocks);
+    if (st.compress_ns > 0) {
+      fprintf(out, ", compressed at %.1f MB/s",
+              st.compress_bytes / (st.compress_ns / 1e9) / 1e6);
+    }
+    fprintf(out, "\n");
+  }
+  if (budget_stats.limit > 0) {
+    fprintf(out, "// Memory budget: %.1f MB, peak %.1f MB, compressed blocks "
+                 "waited %" PRIu64 " times for %.3fs\n",
+            budget_stats.limit / 1048576.0, budget_stats.peak / 1048576.0,
+            budget_stats.waits, budget_stats.wait_ns / 1e9);
+  }
+
+  map<string, uint64_t> fallbacks;
+  if (trace.read_syscallbuf_fallbacks(&fallbacks) && !fallbacks.empty()) {
+    vector<pair<string, uint64_t> > sorted(fallbacks.begin(),
+                                           fallbacks.end());
+    sort(sorted.begin(), sorted.end(),
+         [](const pair<string, uint64_t>& a, const pair<string, uint64_t>& b) {
+      return a.second > b.second;
+    });
+    fprintf(out, "// Top syscallbuf fallbacks of %zu:\n", sorted.size());
+    for (size_t i = 0; i < sorted.size() && i < TOP_COUNT; ++i) {
+      fprintf(out, "//   %-32s %10" PRIu64 " traced\n", sorted[i].first.c_str(),
+              sorted[i].second);
+    }
+  }
 }
 
-static void dump(const string& trace_dir, const DumpFlags& flags,
-                 const vector<string>& specs, FILE* out) {
+static int dump(const string& trace_dir, const DumpFlags& flags,
+                const vector<string>& specs, FILE* out) {
   TraceReader trace(trace_dir);
+  if (flags.jobs > 0) {
+    // Enough blocks in flight to keep every thread busy.
+    trace.enable_read_ahead(2 * flags.jobs, flags.jobs);
+  }
+
+  TableExport table_export;
+  TableExport* exports = nullptr;
+  if (!flags.export_dir.empty()) {
+    if (!table_export.open(flags.export_dir)) {
+      return 1;
+    }
+    exports = &table_export;
+    exports->add_mapped_regions(trace);
+    exports->add_task_events(trace);
+  }
 
-  if (flags.raw_dump) {
+  if (flags.raw_dump && !flags.quiet && !exports) {
     fprintf(out, "global_time tid reason ticks "
                  "hw_interrupts page_faults instructions "
                  "eax ebx ecx edx esi edi ebp orig_eax esp eip eflags\n");
   }
 
+  TraceStatistics stats;
+  TraceStatistics* event_stats = flags.dump_statistics ? &stats : nullptr;
   if (specs.size() > 0) {
     for (size_t i = 0; i < specs.size(); ++i) {
-      dump_events_matching(trace, flags, stdout, &specs[i]);
+      dump_events_matching(trace, flags, stdout, &specs[i], event_stats,
+                           exports);
     }
   } else {
     // No specs => dump all events.
-    dump_events_matching(trace, flags, stdout, nullptr /*all events*/);
+    dump_events_matching(trace, flags, stdout, nullptr /*all events*/,
+                         event_stats, exports);
   }
 
   if (flags.dump_statistics) {
-    dump_statistics(trace, stdout);
+    dump_statistics(trace, stats, stdout);
   }
+  return 0;
 }
 
 int DumpCommand::run(std::vector<std::string>& args) {
@@ -214,6 +731,5 @@ int DumpCommand::run(std::vector<std::string>& args) {
     return 1;
   }
 
-  dump(trace_dir, flags, args, stdout);
-  return 0;
+  return dump(trace_dir, flags, args, stdout);
 }
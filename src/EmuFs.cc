@@ -4,9 +4,10 @@
 
 #include "EmuFs.h"
 
+#include <errno.h>
 #include <syscall.h>
+#include <unistd.h>
 
-#include <fstream>
 #include <sstream>
 #include <string>
 
@@ -29,13 +30,63 @@ EmuFile::~EmuFile() {
   LOG(debug) << "    EmuFs::~File(einode:" << est.st_ino << ")";
 }
 
+/**
+ * Copy [offset, end) of |from| to the same offsets in |to|, letting the
+ * kernel move the data when it can.
+ */
+static void copy_range(int from, int to, off_t offset, off_t end) {
+  vector<uint8_t> buf;
+  while (offset < end) {
+    ssize_t ret = -1;
+#ifdef SYS_copy_file_range
+    if (buf.empty()) {
+      loff_t in_off = offset;
+      loff_t out_off = offset;
+      ret = syscall(SYS_copy_file_range, from, &in_off, to, &out_off,
+                    (size_t)(end - offset), 0);
+    }
+#endif
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // Not supported between these files (or at all); fall back to
+      // reading and writing.
+      buf.resize(1024 * 1024);
+      size_t len = min<off_t>(buf.size(), end - offset);
+      ret = pread(from, buf.data(), len, offset);
+      if (ret <= 0 || pwrite(to, buf.data(), ret, offset) != ret) {
+        FATAL() << "Can't copy emulated file data";
+      }
+    }
+    offset += ret;
+  }
+}
+
 EmuFile::shr_ptr EmuFile::clone() {
   auto f = EmuFile::create(orig_path.c_str(), est);
-  // NB: this isn't the most efficient possible file copy, but
-  // it's simple and not too slow.
-  ifstream src(proc_path(), ifstream::binary);
-  ofstream dst(f->proc_path(), ofstream::binary);
-  dst << src.rdbuf();
+  // The new segment starts out as one big hole, so only copy the parts of
+  // this one that were ever written. Large shared mappings are often
+  // mostly untouched, and this keeps checkpointing them cheap.
+  off_t end = est.st_size;
+  off_t offset = 0;
+  while (offset < end) {
+    off_t data = lseek(file, offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // No data after |offset|.
+        break;
+      }
+      // SEEK_DATA isn't supported; copy everything.
+      data = offset;
+    }
+    off_t hole = data < end ? lseek(file, data, SEEK_HOLE) : end;
+    if (hole < 0 || hole > end) {
+      hole = end;
+    }
+    copy_range(file, f->file, data, hole);
+    offset = hole;
+  }
   return f;
 }
 
@@ -71,7 +122,7 @@ void EmuFile::update(const struct stat& st) {
 }
 
 EmuFile::EmuFile(ScopedFd&& fd, const struct stat& est, const string& orig_path)
-    : est(est), orig_path(orig_path), file(std::move(fd)), is_marked(false) {}
+    : est(est), orig_path(orig_path), file(std::move(fd)) {}
 
 EmuFile::shr_ptr EmuFs::at(const FileId& id) const { return files.at(id); }
 
@@ -79,66 +130,52 @@ EmuFs::shr_ptr EmuFs::clone() {
   shr_ptr fs(new EmuFs());
   for (auto& kv : files) {
     const FileId& id = kv.first;
-    fs->files[id] = kv.second->clone();
+    fs->add_file(id, kv.second->clone());
   }
   return fs;
 }
 
-void EmuFs::gc(const Session& session) {
-  // XXX this implementation is unnecessarily slow.  But before
-  // throwing it away for something different, give it another
-  // shot once rr is caching local mmaps for all address spaces,
-  // which obviates the need for the yuck slow maps parsing
-  // here.
-  LOG(debug) << "Beginning emufs gc of " << files.size() << " files";
-
-  // Mark in-use files by iterating through the mmaps of all
-  // tracee address spaces.
-  //
-  // We inject these maps into the tracee and are careful to
-  // close the injected fd after we finish the mmap.  That means
-  // that the only way tracees can hold a reference to the
-  // underlying inode is through a memory mapping.  So to
-  // determine if a file is in use, we only have to find a
-  // recognizable filename in some tracee's memory map.
-  //
-  // We check *all* tracee file tables because tracees can share
-  // fds with each other in many ways, and we don't attempt to
-  // track any of that.
-  //
-  // TODO: assuming AddressSpace == FileTable, but technically
-  // they're different things: two tracees could share an
-  // address space but have different file tables.
-  size_t nr_marked_files = 0;
-  for (auto& as : session.vms()) {
-    Task* t = *as->task_set().begin();
-    LOG(debug) << "  iterating /proc/" << t->tid << "/maps ...";
-
-    mark_used_vfiles(t, *as, &nr_marked_files);
-    if (files.size() == nr_marked_files) {
-      break;
+void EmuFs::add_file(const FileId& id, const EmuFile::shr_ptr& file) {
+  files[id] = file;
+  mapping_counts[id] = 0;
+  unmapped.insert(id);
+}
+
+void EmuFs::note_mapped(const FileId& id) {
+  auto it = mapping_counts.find(id);
+  if (it != mapping_counts.end() && it->second++ == 0) {
+    unmapped.erase(id);
+  }
+}
+
+void EmuFs::note_unmapped(const FileId& id) {
+  auto it = mapping_counts.find(id);
+  if (it != mapping_counts.end()) {
+    assert(it->second > 0);
+    if (--it->second == 0) {
+      unmapped.insert(id);
     }
   }
+}
+
+void EmuFs::gc() {
+  LOG(debug) << "Beginning emufs gc of " << files.size() << " files, "
+             << unmapped.size() << " unmapped";
 
-  // Sweep all the virtual files that weren't marked.  It might
+  // Sweep all the virtual files that aren't mapped.  It might
   // be possible that a later task will mmap the same underlying
   // file that we're about to destroy.  That's perfectly fine;
   // we'll just create it anew, and restore its addressible
   // contents from the snapshot saved to the trace.  Since there
   // are no live references to the file in the interim, tracees
   // can't observe the destroy/recreate operation.
-  vector<FileId> garbage;
-  for (auto it = files.begin(); it != files.end(); ++it) {
-    if (!it->second->marked()) {
-      garbage.push_back(it->first);
-    }
-    it->second->unmark();
-  }
-  for (auto it = garbage.begin(); it != garbage.end(); ++it) {
-    LOG(debug) << "  emufs gc reclaiming einode:" << it->disp_inode()
-               << "; fs name `" << files[*it]->emu_path() << "'";
-    files.erase(*it);
+  for (auto& id : unmapped) {
+    LOG(debug) << "  emufs gc reclaiming einode:" << id.disp_inode()
+               << "; fs name `" << files[id]->emu_path() << "'";
+    files.erase(id);
+    mapping_counts.erase(id);
   }
+  unmapped.clear();
 }
 
 EmuFile::shr_ptr EmuFs::get_or_create(const TraceMappedRegion& mf) {
@@ -151,7 +188,7 @@ EmuFile::shr_ptr EmuFs::get_or_create(const TraceMappedRegion& mf) {
     return it->second;
   }
   auto vf = EmuFile::create(mf.file_name(), mf.stat());
-  files[id] = vf;
+  add_file(id, vf);
   return vf;
 }
 
@@ -164,7 +201,7 @@ EmuFile::shr_ptr EmuFs::create_anonymous(const FileId& id, size_t size) {
   stringstream name;
   name << "anonymous-" << id.internal_inode();
   auto vf = EmuFile::create(name.str(), fake_stat);
-  files[id] = vf;
+  add_file(id, vf);
   return vf;
 }
 
@@ -180,30 +217,6 @@ void EmuFs::log() const {
 
 EmuFs::EmuFs() {}
 
-void EmuFs::mark_used_vfiles(Task* t, const AddressSpace& as,
-                             size_t* nr_marked_files) {
-  for (auto& kv : as.memmap()) {
-    const MappableResource& r = kv.second;
-    LOG(debug) << "  examining " << r.fsname.c_str() << " ...";
-
-    auto id_ef = files.find(r.id);
-    if (id_ef == files.end()) {
-      ASSERT(t, !r.is_shared_mmap_file());
-      continue;
-    }
-    auto ef = id_ef->second;
-    if (!ef->marked()) {
-      ef->mark();
-      LOG(debug) << "    marked einode:" << r.id.disp_inode();
-      ++*nr_marked_files;
-      if (files.size() == *nr_marked_files) {
-        LOG(debug) << "  (marked all files, bailing)";
-        return;
-      }
-    }
-  }
-}
-
 EmuFs::AutoGc::AutoGc(ReplaySession& session, SupportedArch arch, int syscallno,
                       SyscallState state)
     : session(session),
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -12,7 +13,6 @@
 #include "task.h"
 
 class ReplaySession;
-class Session;
 class Task;
 
 /**
@@ -37,7 +37,7 @@ class Task;
  * ID was recycled in [t_0, t_1), then all references to F_0 must have
  * been dropped in that inverval.  A corollary of that is that all
  * memory mappings of F_0 must have been fully unmapped in the
- * interval.  As per the first long comment in |gc()| below, an
+ * interval.  As per the comment on |note_mapped()| below, an
  * emulated file can only be "live" during replay if some tracee still
  * has a mapping of it.  Tracees' mappings of emulated files is a
  * subset of the ways they can create references to real files during
@@ -83,13 +83,6 @@ public:
    */
   std::string proc_path() const;
 
-  /**
-   * Mark/unmark/check to see if this file is marked.
-   */
-  void mark() { is_marked = true; }
-  bool marked() const { return is_marked; }
-  void unmark() { is_marked = false; }
-
   /**
    * Ensure that the emulated file is sized to match a later
    * stat() of it, |st|.
@@ -112,7 +105,6 @@ private:
   struct stat est;
   std::string orig_path;
   ScopedFd file;
-  bool is_marked;
 
   EmuFile(const EmuFile&) = delete;
   EmuFile operator=(const EmuFile&) = delete;
@@ -173,26 +165,46 @@ public:
     const bool is_gc_point;
   };
 
+  /**
+   * Record that a mapping of |id| was added to, or removed from, one of
+   * our session's address spaces. Ids that aren't emulated files are
+   * ignored.
+   *
+   * We inject emulated files into tracees and are careful to close the
+   * injected fd after we finish the mmap.  That means that the only way
+   * tracees can hold a reference to the underlying inode is through a
+   * memory mapping, so a file that isn't mapped by any address space is
+   * garbage.  (This assumes AddressSpace == FileTable; technically two
+   * tracees could share an address space but have different file
+   * tables.)
+   */
+  void note_mapped(const FileId& id);
+  void note_unmapped(const FileId& id);
+
   /**
    * Collect emulated files that aren't referenced by tracees.
    * Call this only when a tracee's (possibly shared) file table
    * has been destroyed.  All other gc triggers are handled
    * internally.
    */
-  void gc(const Session& session);
+  void gc();
 
 private:
   EmuFs();
 
   /**
-   * Mark all the files being used by the tasks in |as|, and
-   * increment |nt_marked_files| by the number of files that
-   * were marked.
+   * Start tracking the mappings of a new file |id|.
    */
-  void mark_used_vfiles(Task* t, const AddressSpace& as,
-                        size_t* nr_marked_files);
+  void add_file(const FileId& id, const EmuFile::shr_ptr& file);
 
   FileMap files;
+  /* Number of Mappings of each file in |files|, across all address
+   * spaces. Mappings are counted separately even when they're split
+   * pieces of one mmap. */
+  std::map<FileId, size_t> mapping_counts;
+  /* Files in |files| that no address space maps; these are all
+   * collected by the next |gc()|. */
+  std::set<FileId> unmapped;
 
   EmuFs(const EmuFs&) = delete;
   EmuFs& operator=(const EmuFs&) = delete;
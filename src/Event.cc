@@ -39,7 +39,6 @@ Event::Event(EncodedEvent e) {
     case EV_SEGV_RDTSC:
     case EV_EXIT:
     case EV_SCHED:
-    case EV_SYSCALLBUF_FLUSH:
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
     case EV_PATCH_SYSCALL:
@@ -52,6 +51,12 @@ Event::Event(EncodedEvent e) {
       assert(0 == e.data);
       return;
 
+    case EV_SYSCALLBUF_FLUSH:
+      // Traces before version 32 always store 0 here and record a
+      // separate EV_SYSCALLBUF_RESET.
+      new (&SyscallbufFlush()) SyscallbufFlushEvent(e.data != 0, e.arch());
+      return;
+
     case EV_DESCHED:
       new (&Desched()) DeschedEvent(nullptr, e.arch());
       Desched().state = DeschedState(e.data);
@@ -81,6 +86,9 @@ Event::Event(const Event& o) : event_type(o.event_type) {
     case EV_DESCHED:
       new (&Desched()) DeschedEvent(o.Desched());
       return;
+    case EV_SYSCALLBUF_FLUSH:
+      new (&SyscallbufFlush()) SyscallbufFlushEvent(o.SyscallbufFlush());
+      return;
     case EV_SIGNAL:
     case EV_SIGNAL_DELIVERY:
     case EV_SIGNAL_HANDLER:
@@ -101,6 +109,9 @@ Event::~Event() {
     case EV_DESCHED:
       Desched().~DeschedEvent();
       return;
+    case EV_SYSCALLBUF_FLUSH:
+      SyscallbufFlush().~SyscallbufFlushEvent();
+      return;
     case EV_SIGNAL:
     case EV_SIGNAL_DELIVERY:
     case EV_SIGNAL_HANDLER:
@@ -122,6 +133,9 @@ Event& Event::operator=(const Event& o) {
     case EV_DESCHED:
       Desched().operator=(o.Desched());
       break;
+    case EV_SYSCALLBUF_FLUSH:
+      SyscallbufFlush().operator=(o.SyscallbufFlush());
+      break;
     case EV_SIGNAL:
     case EV_SIGNAL_DELIVERY:
     case EV_SIGNAL_HANDLER:
@@ -158,7 +172,6 @@ EncodedEvent Event::encode() const {
     case EV_SEGV_RDTSC:
     case EV_EXIT:
     case EV_SCHED:
-    case EV_SYSCALLBUF_FLUSH:
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
     case EV_PATCH_SYSCALL:
@@ -170,6 +183,10 @@ EncodedEvent Event::encode() const {
       set_encoded_event_data(&e, 0);
       return e;
 
+    case EV_SYSCALLBUF_FLUSH:
+      set_encoded_event_data(&e, SyscallbufFlush().reset ? 1 : 0);
+      return e;
+
     case EV_DESCHED:
       // Disarming the desched notification is a transient
       // state that we shouldn't try to record.
@@ -271,6 +288,11 @@ string Event::str() const {
         ss << "; " << Desched().rec->syscallno;
       }
       break;
+    case EV_SYSCALLBUF_FLUSH:
+      if (SyscallbufFlush().reset) {
+        ss << ": reset";
+      }
+      break;
     case EV_SIGNAL:
     case EV_SIGNAL_DELIVERY:
     case EV_SIGNAL_HANDLER:
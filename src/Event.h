@@ -139,6 +139,19 @@ struct DeschedEvent : public BaseEvent {
   DeschedState state;
 };
 
+/**
+ * Syscallbuf flush events save the contents of the tracee's syscall
+ * buffer. Normally rr resets the buffer's record counter as part of the
+ * flush, but not while a descheduled buffered syscall still owns a record
+ * in the buffer; then a separate EV_SYSCALLBUF_RESET follows later.
+ */
+struct SyscallbufFlushEvent : public BaseEvent {
+  SyscallbufFlushEvent(bool reset, SupportedArch arch)
+      : BaseEvent(NO_EXEC_INFO, arch), reset(reset) {}
+  // True if the flush also reset the buffer's record counter.
+  bool reset;
+};
+
 /**
  * Signal events track signals through the delivery phase, and if the
  * signal finds a sighandler, on to the end of the handling face.
@@ -256,6 +269,8 @@ struct Event {
   Event(EventType type, HasExecInfo info, SupportedArch arch)
       : event_type(type), base(info, arch) {}
   Event(const DeschedEvent& ev) : event_type(EV_DESCHED), desched(ev) {}
+  Event(const SyscallbufFlushEvent& ev)
+      : event_type(EV_SYSCALLBUF_FLUSH), syscallbuf_flush(ev) {}
   Event(const SignalEvent& ev) : event_type(EV_SIGNAL), signal(ev) {}
   Event(const SyscallEvent& ev) : event_type(EV_SYSCALL), syscall(ev) {}
   Event(const syscall_interruption_t&, const SyscallEvent& ev)
@@ -285,6 +300,15 @@ struct Event {
     return desched;
   }
 
+  SyscallbufFlushEvent& SyscallbufFlush() {
+    assert(EV_SYSCALLBUF_FLUSH == event_type);
+    return syscallbuf_flush;
+  }
+  const SyscallbufFlushEvent& SyscallbufFlush() const {
+    assert(EV_SYSCALLBUF_FLUSH == event_type);
+    return syscallbuf_flush;
+  }
+
   SignalEvent& Signal() {
     assert(is_signal_event());
     return signal;
@@ -370,6 +394,7 @@ private:
   union {
     BaseEvent base;
     DeschedEvent desched;
+    SyscallbufFlushEvent syscallbuf_flush;
     SignalEvent signal;
     SyscallEvent syscall;
   };
@@ -184,6 +184,59 @@ vector<uint8_t> ExtraRegisters::get_user_fpregs_struct(
   }
 }
 
+// Byte offset of the XSAVE header, whose first field is XSTATE_BV.
+static const size_t xsave_header_offset = 512;
+// Components 0 (x87) and 1 (SSE) live in the legacy region and are never
+// cleared.
+static const int first_extended_component = 2;
+static const int max_xsave_components = 63;
+
+struct XsaveComponent {
+  uint32_t offset;
+  uint32_t size;
+};
+
+/**
+ * Offsets and sizes of the XSAVE components in the standard (non-compacted)
+ * format PTRACE_GETREGSET uses, from CPUID leaf 0xD. Size 0 means the
+ * component isn't supported.
+ */
+static const XsaveComponent* xsave_components() {
+  static XsaveComponent components[max_xsave_components];
+  static bool initialized = false;
+  if (!initialized) {
+    initialized = true;
+    unsigned int eax, ebx, ecx, edx;
+    cpuid(CPUID_GETXSAVE, 0, &eax, &ebx, &ecx, &edx);
+    uint64_t supported = eax | (uint64_t(edx) << 32);
+    for (int i = first_extended_component; i < max_xsave_components; ++i) {
+      if (supported & (uint64_t(1) << i)) {
+        cpuid(CPUID_GETXSAVE, i, &eax, &ebx, &ecx, &edx);
+        components[i].offset = ebx;
+        components[i].size = eax;
+      }
+    }
+  }
+  return components;
+}
+
+void ExtraRegisters::clear_unused_xsave_components() {
+  if (format_ != XSAVE ||
+      data.size() < xsave_header_offset + sizeof(uint64_t)) {
+    return;
+  }
+  uint64_t xstate_bv;
+  memcpy(&xstate_bv, data.data() + xsave_header_offset, sizeof(xstate_bv));
+  const XsaveComponent* components = xsave_components();
+  for (int i = first_extended_component; i < max_xsave_components; ++i) {
+    const XsaveComponent& c = components[i];
+    if (c.size && !(xstate_bv & (uint64_t(1) << i)) &&
+        c.offset + c.size <= data.size()) {
+      memset(data.data() + c.offset, 0, c.size);
+    }
+  }
+}
+
 X86Arch::user_fpxregs_struct ExtraRegisters::get_user_fpxregs_struct() const {
   assert(format_ == XSAVE);
   assert(data.size() >= sizeof(X86Arch::user_fpxregs_struct));
@@ -77,6 +77,16 @@ public:
    */
   rr::X86Arch::user_fpxregs_struct get_user_fpxregs_struct() const;
 
+  /**
+   * Zero the XSAVE components (beyond x87 and SSE) whose bits are clear in
+   * the XSTATE_BV header field. Those components are in their initial state,
+   * which is all zeroes, and XRSTOR ignores their contents, but the kernel
+   * may hand us whatever stale bytes were in the task's save area. Clearing
+   * them means equal register states have equal bytes, so they compare equal
+   * in the trace writer and compress to almost nothing.
+   */
+  void clear_unused_xsave_components();
+
 private:
   friend class Task;
 
@@ -2,6 +2,7 @@
 
 #include "FdTable.h"
 
+#include <map>
 #include <unordered_set>
 
 #include "rr/rr.h"
@@ -11,43 +12,87 @@
 
 using namespace std;
 
+void FdTable::set_monitored(int fd, bool is_monitored) {
+  assert(fd >= 0);
+  size_t word = size_t(fd) / 64;
+  uint64_t bit = uint64_t(1) << (fd % 64);
+  if (is_monitored) {
+    if (word >= monitored.size()) {
+      monitored.resize(word + 1);
+    }
+    monitored[word] |= bit;
+  } else if (word < monitored.size()) {
+    monitored[word] &= ~bit;
+  }
+}
+
+void FdTable::add_monitor(int fd, const FileMonitor::shr_ptr& monitor) {
+  fds[fd] = monitor;
+  set_monitored(fd, true);
+  update_syscallbuf_fds_disabled(fd);
+}
+
 Switchable FdTable::will_write(Task* t, int fd) {
-  auto it = fds.find(fd);
-  if (it != fds.end()) {
-    return it->second->will_write(t);
+  if (!is_monitoring(fd)) {
+    return ALLOW_SWITCH;
   }
-  return ALLOW_SWITCH;
+  return fds.find(fd)->second->will_write(t);
 }
 
 void FdTable::did_write(Task* t, int fd,
                         const std::vector<FileMonitor::Range>& ranges) {
-  auto it = fds.find(fd);
-  if (it != fds.end()) {
-    it->second->did_write(t, ranges);
+  if (is_monitoring(fd)) {
+    fds.find(fd)->second->did_write(t, ranges);
+  }
+}
+
+bool FdTable::did_read(Task* t, int fd, const uint8_t* data, size_t length) {
+  if (!is_monitoring(fd)) {
+    return false;
+  }
+  return fds.find(fd)->second->did_read(t, data, length);
+}
+
+void FdTable::did_replay_read(Task* t, int fd, bool recorded,
+                              remote_ptr<void> buf, size_t length) {
+  if (is_monitoring(fd)) {
+    fds.find(fd)->second->did_replay_read(t, recorded, buf, length);
+  }
+}
+
+void FdTable::did_receive(Task* t, int fd, size_t length) {
+  if (is_monitoring(fd)) {
+    fds.find(fd)->second->did_receive(t, length);
   }
 }
 
 void FdTable::did_dup(int from, int to) {
-  if (fds.count(from)) {
+  if (is_monitoring(from)) {
     fds[to] = fds[from];
+    set_monitored(to, true);
   } else {
     fds.erase(to);
+    set_monitored(to, false);
   }
   update_syscallbuf_fds_disabled(to);
 }
 
 void FdTable::did_close(int fd) {
   fds.erase(fd);
+  set_monitored(fd, false);
   update_syscallbuf_fds_disabled(fd);
 }
 
-static bool is_fd_monitored_in_any_task(AddressSpace* vm, int fd) {
+/**
+ * Tasks sharing |vm| share the syscallbuf's fd table, so it must trace
+ * whatever any of their fd tables need traced for |fd|.
+ */
+static int syscallbuf_policy_in_any_task(AddressSpace* vm, int fd) {
+  int policy = RR_RESERVED_ROOT_DIR_FD == fd ? SYSCALLBUF_FD_TRACE_ALL : 0;
   for (Task* t : vm->task_set()) {
-    if (t->fd_table()->is_monitoring(fd)) {
-      return true;
-    }
+    policy |= t->fd_table()->syscallbuf_policy(fd);
   }
-  return false;
+  return policy;
 }
 
 void FdTable::update_syscallbuf_fds_disabled(int fd) {
@@ -65,9 +110,8 @@ void FdTable::update_syscallbuf_fds_disabled(int fd) {
 
     if (!t->syscallbuf_fds_disabled_child.is_null() &&
         fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-      bool disable =
-          is_fd_monitored_in_any_task(vm, fd) || RR_RESERVED_ROOT_DIR_FD == fd;
-      t->write_mem(t->syscallbuf_fds_disabled_child + fd, (char)disable);
+      t->write_mem(t->syscallbuf_fds_disabled_child + fd,
+                   (char)syscallbuf_policy_in_any_task(vm, fd));
     }
   }
 }
@@ -77,26 +121,28 @@ void FdTable::init_syscallbuf_fds_disabled(Task* t) {
     return;
   }
 
-  char disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
-  memset(disabled, 0, sizeof(disabled));
-  assert(RR_RESERVED_ROOT_DIR_FD < SYSCALLBUF_FDS_DISABLED_SIZE);
-  disabled[RR_RESERVED_ROOT_DIR_FD] = 1;
-
-  // It's possible that some tasks in this address space have a different
-  // FdTable. We need to disable syscallbuf for an fd if any tasks for this
+  // The table starts out zeroed in the preload library's bss, and it's far
+  // too big to write in full, so only write the entries for fds that need
+  // tracing. It's possible that some tasks in this address space have a
+  // different FdTable. We need to trace an fd if any tasks for this
   // address space are monitoring the fd.
+  map<int, int> policies;
+  assert(RR_RESERVED_ROOT_DIR_FD < SYSCALLBUF_FDS_DISABLED_SIZE);
+  policies[RR_RESERVED_ROOT_DIR_FD] = SYSCALLBUF_FD_TRACE_ALL;
   for (Task* vm_t : t->vm()->task_set()) {
     for (auto& it : vm_t->fd_table()->fds) {
       int fd = it.first;
       assert(fd >= 0);
       if (fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-        disabled[fd] = 1;
+        policies[fd] |= it.second->syscallbuf_policy();
       }
     }
   }
 
-  t->write_mem(t->syscallbuf_fds_disabled_child, disabled,
-               SYSCALLBUF_FDS_DISABLED_SIZE);
+  for (auto& it : policies) {
+    t->write_mem(t->syscallbuf_fds_disabled_child + it.first,
+                 (char)it.second);
+  }
 }
 
 static bool is_fd_open(Task* t, int fd) {
@@ -3,8 +3,11 @@
 #ifndef RR_FD_TABLE_H_
 #define RR_FD_TABLE_H_
 
-#include <unordered_map>
+#include <stdint.h>
+
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "AddressSpace.h"
 #include "FileMonitor.h"
@@ -20,10 +23,24 @@ public:
     // need to yet.
     assert(!is_monitoring(fd));
     fds[fd] = FileMonitor::shr_ptr(monitor);
+    set_monitored(fd, true);
   }
+  /**
+   * Monitor |fd|, which a tracee just opened, with |monitor| (which may
+   * also monitor other fds), replacing any monitor left over from an
+   * earlier use of the fd number. Updates the syscallbuf's fd policies.
+   */
+  void add_monitor(int fd, const FileMonitor::shr_ptr& monitor);
   Switchable will_write(Task* t, int fd);
   void did_write(Task* t, int fd,
                  const std::vector<FileMonitor::Range>& ranges);
+  /**
+   * See FileMonitor::did_read. Returns false if |fd| isn't monitored.
+   */
+  bool did_read(Task* t, int fd, const uint8_t* data, size_t length);
+  void did_replay_read(Task* t, int fd, bool recorded, remote_ptr<void> buf,
+                       size_t length);
+  void did_receive(Task* t, int fd, size_t length);
 
   void did_dup(int from, int to);
   void did_close(int fd);
@@ -39,7 +56,24 @@ public:
     return fds;
   }
 
-  bool is_monitoring(int fd) { return fds.count(fd) > 0; }
+  /**
+   * This is called for every read and write, so it only tests a bit.
+   */
+  bool is_monitoring(int fd) const {
+    size_t word = size_t(fd) / 64;
+    return fd >= 0 && word < monitored.size() &&
+           (monitored[word] & (uint64_t(1) << (fd % 64)));
+  }
+  /**
+   * Return the SYSCALLBUF_FD_TRACE_* flags the monitor for |fd| needs, or 0
+   * if it's not monitored.
+   */
+  int syscallbuf_policy(int fd) {
+    if (!is_monitoring(fd)) {
+      return 0;
+    }
+    return fds.find(fd)->second->syscallbuf_policy();
+  }
 
   /**
    * Regenerate syscallbuf_fds_disabled in task |t|.
@@ -58,11 +92,16 @@ public:
 
 private:
   FdTable() {}
-  FdTable(const FdTable& other) : fds(other.fds) {}
+  FdTable(const FdTable& other)
+      : fds(other.fds), monitored(other.monitored) {}
 
   void update_syscallbuf_fds_disabled(int fd);
+  void set_monitored(int fd, bool is_monitored);
 
   std::unordered_map<int, FileMonitor::shr_ptr> fds;
+  // Bit |fd| is set when |fds| has a monitor for |fd|. Only as long as the
+  // highest monitored fd needs.
+  std::vector<uint64_t> monitored;
 };
 
 #endif /* RR_FD_TABLE_H_ */
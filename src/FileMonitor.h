@@ -11,6 +11,7 @@ class Task;
 #include <memory>
 #include <vector>
 
+#include "preload/preload_interface.h"
 #include "util.h"
 
 class FileMonitor {
@@ -19,6 +20,12 @@ public:
 
   virtual ~FileMonitor() {}
 
+  /**
+   * Return the SYSCALLBUF_FD_TRACE_* flags for operations on the fd that
+   * the syscallbuf must leave to traced syscalls so this monitor sees them.
+   */
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_ALL; }
+
   /**
    * Notification that task |t| is about to write |data| bytes of length
    * |length| to the file.
@@ -42,6 +49,33 @@ public:
     Range(remote_ptr<void> data, size_t length) : data(data), length(length) {}
   };
   virtual void did_write(Task* t, const std::vector<Range>& ranges) {}
+
+  /**
+   * Notification during recording that a read by task |t| from the file
+   * returned the |length| bytes at |data|, or that it returned |length|
+   * bytes rr must record regardless if |data| is null. Return true if the
+   * monitor can supply the same bytes during replay, in which case they're
+   * not recorded.
+   */
+  virtual bool did_read(Task* t, const uint8_t* data, size_t length) {
+    return false;
+  }
+  /**
+   * Replay's counterpart of did_read, made for the same reads. |recorded|
+   * is true if the data was recorded (did_read returned false) and has
+   * already been written to |buf|. Otherwise the monitor must write the
+   * |length| bytes itself.
+   */
+  virtual void did_replay_read(Task* t, bool recorded, remote_ptr<void> buf,
+                               size_t length) {}
+
+  /**
+   * Notification during recording that a read(), readv(), recvfrom() or
+   * recvmsg() by task |t| took |length| bytes from the file. Unlike
+   * did_read this is made for every such read, whether or not its data is
+   * recorded.
+   */
+  virtual void did_receive(Task* t, size_t length) {}
 };
 
 #endif /* RR_FILE_MONITOR_H_ */
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include <limits>
 #include <string>
 
 #include "Ticks.h"
@@ -21,6 +22,12 @@ struct Flags {
    * event time at which to start checksumming.
    */
   int checksum;
+  /* Only generate or check checksums at events in
+   * [checksum_start, checksum_end). rr verify uses this to split the work
+   * between replays.
+   */
+  TraceFrame::Time checksum_start;
+  TraceFrame::Time checksum_end;
 
   enum { DUMP_ON_ALL = 10000, DUMP_ON_NONE = -DUMP_ON_ALL };
   /* event(s) to create memory dumps for */
@@ -45,6 +52,12 @@ struct Flags {
 
   // Check that cached mmaps match /proc/maps after each event.
   bool check_cached_mmaps;
+  // With check_cached_mmaps, only check at every Nth event of each address
+  // space.
+  uint32_t check_cached_mmaps_interval;
+  // With check_cached_mmaps, only check around the ranges whose cached
+  // mappings changed since the last check.
+  bool check_cached_mmaps_changed;
 
   // Suppress warnings related to environmental features outside rr's
   // control.
@@ -57,15 +70,42 @@ struct Flags {
   // under valgrind.
   std::string forced_uarch;
 
+  // Number of trace blocks per substream to decompress ahead of the
+  // reader in background threads. 0 disables read-ahead.
+  uint32_t read_ahead_blocks;
+
+  // Bytes of decompressed trace blocks to keep for reuse across the
+  // readers of one trace, e.g. replay sessions and their checkpoints.
+  size_t block_cache_size;
+
+  // Also store or check a checksum for each page, so a divergence can be
+  // narrowed down to the first differing page.
+  bool checksum_pages;
+
+  // Write a Chrome trace event timeline of rr's own activity here, if
+  // nonempty. See SelfProfiler.
+  std::string self_profile_path;
+
+  // Print how long each phase of startup took.
+  bool timing;
+
   Flags()
       : checksum(CHECKSUM_NONE),
+        checksum_start(0),
+        checksum_end(std::numeric_limits<TraceFrame::Time>::max()),
         dump_on(DUMP_ON_NONE),
         dump_at(DUMP_AT_NONE),
         verbose(false),
         force_things(false),
         mark_stdio(false),
         check_cached_mmaps(false),
-        suppress_environment_warnings(false) {}
+        check_cached_mmaps_interval(1),
+        check_cached_mmaps_changed(false),
+        suppress_environment_warnings(false),
+        read_ahead_blocks(0),
+        block_cache_size(64 * 1024 * 1024),
+        checksum_pages(false),
+        timing(false) {}
 
   static const Flags& get() { return singleton; }
 
@@ -0,0 +1,22 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "FlightRecorder.h"
+
+using namespace std;
+
+atomic<uint32_t> FlightRecorder::next(0);
+FlightRecorder::Entry FlightRecorder::entries[FlightRecorder::SIZE];
+
+/*static*/ void FlightRecorder::dump(ostream& out) {
+  uint32_t end = next.load(memory_order_relaxed);
+  if (end == 0) {
+    return;
+  }
+  uint32_t start = end > SIZE ? end - SIZE : 0;
+  out << "Last " << (end - start) << " rr events (oldest first):\n";
+  for (uint32_t seq = start; seq != end; ++seq) {
+    const Entry& e = entries[seq & (SIZE - 1)];
+    out << "  #" << seq << " " << (e.name ? e.name : "?") << " " << e.args[0]
+        << " " << e.args[1] << " " << e.args[2] << "\n";
+  }
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_FLIGHT_RECORDER_H_
+#define RR_FLIGHT_RECORDER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <ostream>
+
+/**
+ * A FlightRecorder keeps the most recent of rr's probe events (see probes.h)
+ * in a small in-memory ring buffer, so that FATAL() and failed ASSERT()s can
+ * show what rr was doing just before things went wrong, even though debug
+ * logging is compiled out.
+ *
+ * Recording an event stores a static name and up to three integers; nothing
+ * is formatted until the buffer is dumped. Any thread can record. Slots are
+ * claimed with an atomic increment, so there are no locks, but an entry being
+ * overwritten while it's dumped may be torn.
+ */
+class FlightRecorder {
+public:
+  struct Entry {
+    const char* name;
+    uint64_t args[3];
+  };
+  // Must be a power of two.
+  enum { SIZE = 256 };
+
+  static void record(const char* name, uint64_t a = 0, uint64_t b = 0,
+                     uint64_t c = 0) {
+    uint32_t seq = next.fetch_add(1, std::memory_order_relaxed);
+    Entry& e = entries[seq & (SIZE - 1)];
+    e.name = name;
+    e.args[0] = a;
+    e.args[1] = b;
+    e.args[2] = c;
+  }
+
+  /**
+   * Write the recorded events to |out|, oldest first. Writes nothing if
+   * nothing has been recorded.
+   */
+  static void dump(std::ostream& out);
+
+private:
+  static std::atomic<uint32_t> next;
+  static Entry entries[SIZE];
+};
+
+#endif /* RR_FLIGHT_RECORDER_H_ */
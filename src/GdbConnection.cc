@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <sstream>
 #include <vector>
 
@@ -34,6 +35,11 @@
 
 static const char INTERRUPT_CHAR = '\x03';
 
+// The largest packet we tell gdb it can send us. gdb also uses this to size
+// memory reads, so big reads take fewer round trips.
+static const size_t MAX_PACKET_SIZE = 256 * 1024;
+static const size_t INITIAL_BUFFER_SIZE = 32768;
+
 #ifdef DEBUGTAG
 #define UNHANDLED_REQ() FATAL()
 #else
@@ -58,7 +64,11 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
 }
 
 GdbConnection::GdbConnection(pid_t tgid, const Features& features)
-    : tgid(tgid), no_ack(false), inlen(0), outlen(0), features_(features) {
+    : tgid(tgid),
+      no_ack(false),
+      inbuf(INITIAL_BUFFER_SIZE),
+      inlen(0),
+      features_(features) {
 #ifndef REVERSE_EXECUTION
   features_.reverse_execution = false;
 #endif
@@ -257,7 +267,10 @@ void GdbConnection::read_data_once() {
   /* Wait until there's data, instead of busy-looping on
    * EAGAIN. */
   poll_incoming(sock_fd, -1 /* wait forever */);
-  nread = read(sock_fd, inbuf + inlen, sizeof(inbuf) - inlen);
+  if (inlen == ssize_t(inbuf.size())) {
+    inbuf.resize(inbuf.size() * 2);
+  }
+  nread = read(sock_fd, inbuf.data() + inlen, inbuf.size() - inlen);
   if (0 == nread) {
     LOG(info) << "(gdb closed debugging socket, exiting)";
     exit(0);
@@ -266,36 +279,31 @@ void GdbConnection::read_data_once() {
     FATAL() << "Error reading from gdb";
   }
   inlen += nread;
-  assert("Impl dynamic alloc if this fails (or double inbuf size)" &&
-         inlen < int(sizeof(inbuf)));
 }
 
 void GdbConnection::write_flush() {
   ssize_t write_index = 0;
 
 #ifdef DEBUGTAG
-  outbuf[outlen] = '\0';
-  LOG(debug) << "write_flush: '" << outbuf << "'";
+  LOG(debug) << "write_flush: '" << string(outbuf.begin(), outbuf.end())
+             << "'";
 #endif
-  while (write_index < outlen) {
+  while (write_index < ssize_t(outbuf.size())) {
     ssize_t nwritten;
 
     poll_outgoing(sock_fd, -1 /*wait forever*/);
-    nwritten = write(sock_fd, outbuf + write_index, outlen - write_index);
+    nwritten = write(sock_fd, outbuf.data() + write_index,
+                     outbuf.size() - write_index);
     if (nwritten < 0) {
       FATAL() << "Error writing to gdb";
     }
     write_index += nwritten;
   }
-  outlen = 0;
+  outbuf.clear();
 }
 
 void GdbConnection::write_data_raw(const uint8_t* data, ssize_t len) {
-  assert("Impl dynamic alloc if this fails (or double outbuf size)" &&
-         (outlen + len) < int(sizeof(inbuf)));
-
-  memcpy(outbuf + outlen, data, len);
-  outlen += len;
+  outbuf.insert(outbuf.end(), data, data + len);
 }
 
 void GdbConnection::write_hex(unsigned long hex) {
@@ -306,56 +314,53 @@ void GdbConnection::write_hex(unsigned long hex) {
   write_data_raw((uint8_t*)buf, len);
 }
 
-void GdbConnection::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
-  uint8_t checksum;
-  size_t i;
+size_t GdbConnection::begin_packet() {
+  outbuf.push_back('$');
+  return outbuf.size();
+}
 
-  write_data_raw((uint8_t*)"$", 1);
-  for (i = 0, checksum = 0; i < num_bytes; ++i) {
-    checksum += data[i];
+void GdbConnection::end_packet(size_t payload_start) {
+  uint8_t checksum = 0;
+  for (size_t i = payload_start; i < outbuf.size(); ++i) {
+    checksum += outbuf[i];
   }
-  write_data_raw((uint8_t*)data, num_bytes);
-  write_data_raw((uint8_t*)"#", 1);
+  outbuf.push_back('#');
   write_hex(checksum);
 }
 
+void GdbConnection::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
+  size_t start = begin_packet();
+  write_data_raw(data, num_bytes);
+  end_packet(start);
+}
+
 void GdbConnection::write_packet(const char* data) {
   return write_packet_bytes((const uint8_t*)data, strlen(data));
 }
 
 void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
                                         ssize_t num_bytes) {
-  ssize_t pfx_num_chars = strlen(pfx);
-  uint8_t buf[2 * num_bytes + pfx_num_chars];
-  ssize_t buf_num_bytes = 0;
-  int i;
-
-  strncpy((char*)buf, pfx, sizeof(buf) - 1);
-  buf_num_bytes += pfx_num_chars;
-
-  for (i = 0; i < num_bytes; ++i) {
-    uint8_t b = data[i];
-
-    if (buf_num_bytes + 2 > ssize_t(sizeof(buf))) {
-      break;
-    }
-    switch (b) {
-      case '#':
-      case '$':
-      case '}':
-      case '*':
-        buf[buf_num_bytes++] = '}';
-        buf[buf_num_bytes++] = b ^ 0x20;
-        break;
-      default:
-        buf[buf_num_bytes++] = b;
-        break;
+  size_t start = begin_packet();
+  write_data_raw((const uint8_t*)pfx, strlen(pfx));
+
+  // Escape straight into the output buffer, copying the runs between
+  // special characters in bulk; they're rare in most data.
+  const uint8_t* run = data;
+  const uint8_t* end = data + num_bytes;
+  for (const uint8_t* p = data; p < end; ++p) {
+    uint8_t b = *p;
+    if (b == '#' || b == '$' || b == '}' || b == '*') {
+      outbuf.insert(outbuf.end(), run, p);
+      outbuf.push_back('}');
+      outbuf.push_back(b ^ 0x20);
+      run = p + 1;
     }
   }
+  outbuf.insert(outbuf.end(), run, end);
+  end_packet(start);
 
   LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
                 "be truncated";
-  return write_packet_bytes(buf, buf_num_bytes);
 }
 
 void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
@@ -364,12 +369,15 @@ void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
     return;
   }
 
-  char buf[2 * len + 1];
+  static const char hex_digits[] = "0123456789abcdef";
+  size_t start = begin_packet();
+  outbuf.resize(start + 2 * len);
+  uint8_t* out = outbuf.data() + start;
   for (size_t i = 0; i < len; ++i) {
-    unsigned long b = bytes[i];
-    snprintf(&buf[2 * i], 3, "%02lx", b);
+    out[2 * i] = hex_digits[bytes[i] >> 4];
+    out[2 * i + 1] = hex_digits[bytes[i] & 0xf];
   }
-  write_packet(buf);
+  end_packet(start);
 }
 
 static string decode_ascii_encoded_hex_str(const char* encoded) {
@@ -387,26 +395,26 @@ static string decode_ascii_encoded_hex_str(const char* encoded) {
 }
 
 bool GdbConnection::skip_to_packet_start() {
-  uint8_t* p = nullptr;
-  int i;
+  uint8_t* p = inbuf.data();
+  uint8_t* end = inbuf.data() + inlen;
 
-  /* XXX we want memcspn() here ... */
-  for (i = 0; i < inlen; ++i) {
-    if (inbuf[i] == '$' || inbuf[i] == INTERRUPT_CHAR) {
-      p = &inbuf[i];
-      break;
-    }
+  /* The packet usually starts within the first few bytes (after the
+   * previous packet's checksum digits). */
+  while (p < end && *p != '$' && *p != INTERRUPT_CHAR) {
+    ++p;
   }
 
-  if (!p) {
+  if (p == end) {
     /* Discard all read bytes, which we don't care
      * about. */
     inlen = 0;
     return false;
   }
   /* Discard bytes up to start-of-packet. */
-  memmove(inbuf, p, inlen - (p - inbuf));
-  inlen -= (p - inbuf);
+  if (p != inbuf.data()) {
+    memmove(inbuf.data(), p, end - p);
+    inlen = end - p;
+  }
 
   assert(1 <= inlen);
   assert('$' == inbuf[0] || INTERRUPT_CHAR == inbuf[0]);
@@ -447,11 +455,12 @@ void GdbConnection::read_packet() {
   }
 
   /* Read until we see end-of-packet. */
-  for (checkedlen = 0; !(p = (uint8_t*)memchr(inbuf + checkedlen, '#', inlen));
+  for (checkedlen = 0; !(p = (uint8_t*)memchr(inbuf.data() + checkedlen, '#',
+                                       inlen - checkedlen));
        checkedlen = inlen) {
     read_data_once();
   }
-  packetend = (p - inbuf);
+  packetend = (p - inbuf.data());
   /* NB: we're ignoring the gdb packet checksums here too.  If
    * gdb is corrupted enough to garble a checksum over TCP, it's
    * not really clear why asking for the packet again might make
@@ -515,6 +524,17 @@ bool GdbConnection::xfer(const char* name, char* args) {
     req.target = query_thread;
     return true;
   }
+  if (!strcmp(name, "libraries-svr4")) {
+    assert(!strncmp(args, "read::", sizeof("read::") - 1));
+    args += sizeof("read::") - 1;
+
+    req = GdbRequest(DREQ_GET_LIBRARIES_SVR4);
+    req.target = query_thread;
+    req.mem().addr = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.mem().len = strtoul(args, &args, 16);
+    return true;
+  }
   if (name == strstr(name, "siginfo")) {
     if (args == strstr(args, "read")) {
       req = GdbRequest(DREQ_READ_SIGINFO);
@@ -649,13 +669,18 @@ bool GdbConnection::query(char* payload) {
     LOG(debug) << "gdb supports " << args;
 
     stringstream supported;
-    supported << "PacketSize=" << sizeof(outbuf);
+    supported << "PacketSize=" << hex << MAX_PACKET_SIZE << dec;
     supported << ";QStartNoAckMode+"
                  ";qXfer:auxv:read+"
+                 ";qXfer:libraries-svr4:read+"
                  ";qXfer:siginfo:read+"
                  ";qXfer:siginfo:write+"
                  ";multiprocess+"
-                 ";ConditionalBreakpoints+";
+                 ";ConditionalBreakpoints+"
+                 ";QCatchSyscalls+"
+                 ";QPassSignals+"
+                 ";QProgramSignals+"
+                 ";binary-upload+";
     if (features().reverse_execution) {
       supported << ";ReverseContinue+"
                    ";ReverseStep+";
@@ -663,6 +688,43 @@ bool GdbConnection::query(char* payload) {
     write_packet(supported.str().c_str());
     return false;
   }
+  if (!strcmp(name, "CRC")) {
+    req = GdbRequest(DREQ_GET_MEM_CRC);
+    req.target = query_thread;
+    req.mem().addr = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.mem().len = strtoul(args, &args, 16);
+    LOG(debug) << "gdb asks for the CRC of " << HEX(req.mem().addr) << "+"
+               << req.mem().len;
+    return true;
+  }
+  if (!strcmp(name, "Search")) {
+    if (!args || strncmp(args, "memory:", sizeof("memory:") - 1)) {
+      UNHANDLED_REQ() << "Unhandled gdb search: " << args;
+      return false;
+    }
+    args += sizeof("memory:") - 1;
+    req = GdbRequest(DREQ_SEARCH_MEM);
+    req.target = query_thread;
+    req.mem().addr = strtoul(args, &args, 16);
+    assert(';' == *args++);
+    req.mem().len = strtoul(args, &args, 16);
+    assert(';' == *args++);
+    // The pattern is binary data running to the end of the packet (it may
+    // contain NULs).
+    const uint8_t* end = inbuf.data() + packetend;
+    for (const uint8_t* p = (const uint8_t*)args; p < end; ++p) {
+      uint8_t b = *p;
+      if ('}' == b && p + 1 < end) {
+        b = 0x20 ^ *++p;
+      }
+      req.mem().data.push_back(b);
+    }
+    LOG(debug) << "gdb searches " << HEX(req.mem().addr) << "+"
+               << req.mem().len << " for " << req.mem().data.size()
+               << " bytes";
+    return true;
+  }
   if (!strcmp(name, "Symbol")) {
     LOG(debug) << "gdb is ready for symbol lookups";
     write_packet("OK");
@@ -717,6 +779,38 @@ bool GdbConnection::set_var(char* payload) {
     no_ack = true;
     return false;
   }
+  if (!strcmp(name, "PassSignals")) {
+    // ';'-separated hex gdb signal numbers, replacing the previous set.
+    pass_signals.clear();
+    char* p = args;
+    while (p && *p) {
+      pass_signals.insert(strtol(p, &p, 16));
+      if (*p == ';') {
+        ++p;
+      }
+    }
+    write_packet("OK");
+    return false;
+  }
+  if (!strcmp(name, "ProgramSignals")) {
+    // Which signals reach the program is fixed by the trace, so there's
+    // nothing to do.
+    write_packet("OK");
+    return false;
+  }
+  if (!strcmp(name, "CatchSyscalls")) {
+    // "0" to stop catching, "1" to catch everything, or "1;" followed by
+    // ';'-separated hex syscall numbers.
+    req = GdbRequest(DREQ_CATCH_SYSCALLS);
+    req.catch_syscalls().enabled = args && args[0] == '1';
+    if (req.catch_syscalls().enabled && args[1] == ';') {
+      char* p = args + 1;
+      while (*p == ';') {
+        req.catch_syscalls().syscalls.push_back(strtol(p + 1, &p, 16));
+      }
+    }
+    return true;
+  }
 
   UNHANDLED_REQ() << "Unhandled gdb set: Q" << name;
   return false;
@@ -744,6 +838,60 @@ bool GdbConnection::process_bpacket(char* payload) {
   }
 }
 
+bool GdbConnection::process_vfile_packet(char* payload) {
+  char* args = strchr(payload, ':');
+  if (args) {
+    *args++ = '\0';
+  }
+  const char* name = payload;
+
+  if (!strcmp(name, "setfs")) {
+    // gdb only looks at the debuggee's files, which we serve whatever
+    // filesystem it asks for.
+    write_packet("F0");
+    return false;
+  }
+  if (!args) {
+    UNHANDLED_REQ() << "Unhandled vFile request " << name;
+    return false;
+  }
+  if (!strcmp(name, "open")) {
+    // path (hex-encoded), flags, mode
+    char* comma = strchr(args, ',');
+    assert(comma);
+    *comma = '\0';
+    req = GdbRequest(DREQ_FILE_OPEN);
+    req.file().path = decode_ascii_encoded_hex_str(args);
+    req.file().flags = strtol(comma + 1, &args, 16);
+    LOG(debug) << "gdb opens " << req.file().path;
+    return true;
+  }
+  if (!strcmp(name, "pread")) {
+    req = GdbRequest(DREQ_FILE_PREAD);
+    req.file().fd = strtol(args, &args, 16);
+    assert(',' == *args++);
+    req.file().count = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.file().offset = strtoull(args, &args, 16);
+    return true;
+  }
+  if (!strcmp(name, "close")) {
+    req = GdbRequest(DREQ_FILE_CLOSE);
+    req.file().fd = strtol(args, &args, 16);
+    return true;
+  }
+  if (!strcmp(name, "fstat")) {
+    req = GdbRequest(DREQ_FILE_FSTAT);
+    req.file().fd = strtol(args, &args, 16);
+    return true;
+  }
+
+  // Tells gdb we don't support this one.
+  LOG(debug) << "Unsupported vFile request " << name;
+  write_packet("");
+  return false;
+}
+
 bool GdbConnection::process_vpacket(char* payload) {
   const char* name;
   char* args;
@@ -754,6 +902,10 @@ bool GdbConnection::process_vpacket(char* payload) {
   }
   name = payload;
 
+  if (!strncmp("File:", name, sizeof("File:") - 1)) {
+    return process_vfile_packet(payload + sizeof("File:") - 1);
+  }
+
   if (!strcmp("Cont", name)) {
     vector<GdbContAction> actions;
     bool has_default_action = false;
@@ -785,6 +937,8 @@ bool GdbConnection::process_vpacket(char* payload) {
 
       GdbActionType action;
       int signal_to_deliver = 0;
+      uint64_t range_start = 0;
+      uint64_t range_end = 0;
       char* endptr = NULL;
       switch (cmd[0]) {
         case 'C':
@@ -801,6 +955,15 @@ bool GdbConnection::process_vpacket(char* payload) {
         case 's':
           action = ACTION_STEP;
           break;
+        case 'r':
+          action = ACTION_STEP;
+          range_start = strtoull(cmd + 1, &endptr, 16);
+          if (*endptr != ',') {
+            UNHANDLED_REQ() << "Unhandled vCont range " << cmd;
+            return false;
+          }
+          range_end = strtoull(endptr + 1, &endptr, 16);
+          break;
         default:
           UNHANDLED_REQ() << "Unhandled vCont command " << cmd << "(" << args
                           << ")";
@@ -810,6 +973,10 @@ bool GdbConnection::process_vpacket(char* payload) {
         UNHANDLED_REQ() << "Unhandled vCont command parameters " << cmd;
         return false;
       }
+      GdbContAction cont_action(action, is_default ? GdbThreadId::ALL : target,
+                                signal_to_deliver);
+      cont_action.range_start = range_start;
+      cont_action.range_end = range_end;
       if (is_default) {
         if (has_default_action) {
           UNHANDLED_REQ()
@@ -817,10 +984,9 @@ bool GdbConnection::process_vpacket(char* payload) {
           return false;
         }
         has_default_action = true;
-        default_action =
-            GdbContAction(action, GdbThreadId::ALL, signal_to_deliver);
+        default_action = cont_action;
       } else {
-        actions.push_back(GdbContAction(action, target, signal_to_deliver));
+        actions.push_back(cont_action);
       }
     }
 
@@ -835,7 +1001,7 @@ bool GdbConnection::process_vpacket(char* payload) {
 
   if (!strcmp("Cont?", name)) {
     LOG(debug) << "gdb queries which continue commands we support";
-    write_packet("vCont;c;C;s;S;");
+    write_packet("vCont;c;C;s;S;r");
     return false;
   }
 
@@ -912,7 +1078,8 @@ bool GdbConnection::process_packet() {
 
   assert(INTERRUPT_CHAR == inbuf[0] ||
          ('$' == inbuf[0] &&
-          (((uint8_t*)memchr(inbuf, '#', inlen) - inbuf) == packetend)));
+          (((uint8_t*)memchr(inbuf.data(), '#', inlen) - inbuf.data()) ==
+           packetend)));
 
   if (INTERRUPT_CHAR == inbuf[0]) {
     request = INTERRUPT_CHAR;
@@ -970,11 +1137,13 @@ bool GdbConnection::process_packet() {
       write_packet("OK");
       exit(0);
     case 'm':
+    case 'x':
       req = GdbRequest(DREQ_GET_MEM);
       req.target = query_thread;
       req.mem().addr = strtoul(payload, &payload, 16);
       ++payload;
       req.mem().len = strtoul(payload, &payload, 16);
+      req.mem().binary = request == 'x';
       assert('\0' == *payload);
 
       LOG(debug) << "gdb requests memory (addr=" << HEX(req.mem().addr)
@@ -1106,7 +1275,7 @@ bool GdbConnection::process_packet() {
       ret = false;
   }
   /* Erase the newly processed packet from the input buffer. */
-  memmove(inbuf, inbuf + packetend, inlen - packetend);
+  memmove(inbuf.data(), inbuf.data() + packetend, inlen - packetend);
   inlen = (inlen - packetend);
 
   /* If we processed the request internally, consume it. */
@@ -1291,26 +1460,60 @@ static int to_gdb_signum(int sig) {
   }
 }
 
-void GdbConnection::send_stop_reply_packet(GdbThreadId thread, int sig,
-                                           uintptr_t watch_addr) {
+bool GdbConnection::is_pass_signal(int sig) {
+  return pass_signals.count(to_gdb_signum(sig)) > 0;
+}
+
+void GdbConnection::send_stop_reply_packet(
+    GdbThreadId thread, int sig,
+    const vector<GdbRegisterValue>& expedited_regs, const string& reason) {
   if (sig < 0) {
     write_packet("E01");
     return;
   }
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;",
+           to_gdb_signum(sig), thread.pid, thread.tid);
+  string reply = buf;
+  reply += reason;
+  for (auto& reg : expedited_regs) {
+    char num[16];
+    snprintf(num, sizeof(num), "%x:", reg.name);
+    reply += num;
+    for (size_t i = 0; i < reg.size; ++i) {
+      char byte[3];
+      snprintf(byte, sizeof(byte), "%02x", reg.value[i]);
+      reply += byte;
+    }
+    reply += ';';
+  }
+  write_packet(reply.c_str());
+}
+
+void GdbConnection::notify_stop(GdbThreadId thread, int sig,
+                                const vector<GdbRegisterValue>& expedited_regs,
+                                uintptr_t watch_addr) {
   char watch[1024];
   if (watch_addr) {
     snprintf(watch, sizeof(watch) - 1, "watch:%" PRIxPTR ";", watch_addr);
   } else {
     watch[0] = '\0';
   }
-  char buf[PATH_MAX];
-  snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
-           to_gdb_signum(sig), thread.pid, thread.tid, watch);
-  write_packet(buf);
+  notify_stop_with_reason(thread, sig, expedited_regs, watch);
 }
 
-void GdbConnection::notify_stop(GdbThreadId thread, int sig,
-                                uintptr_t watch_addr) {
+void GdbConnection::notify_syscall_stop(
+    GdbThreadId thread, int syscallno, bool entry,
+    const vector<GdbRegisterValue>& expedited_regs) {
+  char reason[64];
+  snprintf(reason, sizeof(reason) - 1, "%s:%x;",
+           entry ? "syscall_entry" : "syscall_return", syscallno);
+  notify_stop_with_reason(thread, SIGTRAP, expedited_regs, reason);
+}
+
+void GdbConnection::notify_stop_with_reason(
+    GdbThreadId thread, int sig, const vector<GdbRegisterValue>& expedited_regs,
+    const string& reason) {
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
   if (tgid != thread.pid) {
@@ -1320,7 +1523,7 @@ void GdbConnection::notify_stop(GdbThreadId thread, int sig,
     // the next stop we're willing to tell gdb about.
     return;
   }
-  send_stop_reply_packet(thread, sig, watch_addr);
+  send_stop_reply_packet(thread, sig, expedited_regs, reason);
 
   // This isn't documented in the gdb remote protocol, but if we
   // don't do this, gdb will sometimes continue to send requests
@@ -1366,6 +1569,175 @@ void GdbConnection::reply_get_auxv(const vector<GdbAuxvPair>& auxv) {
   consume_request();
 }
 
+static string xml_escape(const string& s) {
+  string ret;
+  for (char c : s) {
+    switch (c) {
+      case '&':
+        ret += "&amp;";
+        break;
+      case '<':
+        ret += "&lt;";
+        break;
+      case '>':
+        ret += "&gt;";
+        break;
+      case '"':
+        ret += "&quot;";
+        break;
+      default:
+        ret += c;
+        break;
+    }
+  }
+  return ret;
+}
+
+void GdbConnection::reply_get_libraries_svr4(
+    uintptr_t main_lm, const vector<GdbSvr4Library>& libs) {
+  assert(DREQ_GET_LIBRARIES_SVR4 == req.type);
+
+  stringstream xml;
+  xml << hex << "<library-list-svr4 version=\"1.0\"";
+  if (main_lm) {
+    xml << " main-lm=\"0x" << main_lm << "\"";
+  }
+  xml << ">";
+  for (auto& lib : libs) {
+    xml << "<library name=\"" << xml_escape(lib.name) << "\" lm=\"0x"
+        << lib.lm << "\" l_addr=\"0x" << lib.l_addr << "\" l_ld=\"0x"
+        << lib.l_ld << "\"/>";
+  }
+  xml << "</library-list-svr4>";
+
+  // gdb reads the document in pieces, asking for the next offset until
+  // we say this is the last one.
+  string doc = xml.str();
+  size_t offset = min<size_t>(req.mem().addr, doc.size());
+  size_t len = min<size_t>(req.mem().len, doc.size() - offset);
+  write_binary_packet(offset + len < doc.size() ? "m" : "l",
+                      (const uint8_t*)doc.data() + offset, len);
+
+  consume_request();
+}
+
+void GdbConnection::reply_search_mem(bool found, uintptr_t addr) {
+  assert(DREQ_SEARCH_MEM == req.type);
+
+  if (found) {
+    char buf[32];
+    snprintf(buf, sizeof(buf) - 1, "1,%" PRIxPTR, addr);
+    write_packet(buf);
+  } else {
+    write_packet("0");
+  }
+
+  consume_request();
+}
+
+void GdbConnection::reply_get_mem_crc(bool ok, uint32_t crc) {
+  assert(DREQ_GET_MEM_CRC == req.type);
+
+  if (ok) {
+    char buf[32];
+    snprintf(buf, sizeof(buf) - 1, "C%x", crc);
+    write_packet(buf);
+  } else {
+    write_packet("E01");
+  }
+
+  consume_request();
+}
+
+/**
+ * Translate |err| to gdb's File-I/O errno values, which match Linux's for
+ * the errors it knows about.
+ */
+static int to_gdb_errno(int err) {
+  switch (err) {
+    case EPERM:
+    case ENOENT:
+    case EINTR:
+    case EBADF:
+    case EACCES:
+    case EFAULT:
+    case EBUSY:
+    case EEXIST:
+    case ENODEV:
+    case ENOTDIR:
+    case EISDIR:
+    case EINVAL:
+    case ENFILE:
+    case EMFILE:
+    case EFBIG:
+    case ENOSPC:
+    case ESPIPE:
+    case EROFS:
+      return err;
+    case ENAMETOOLONG:
+      return 91;
+    default:
+      return 9999; // EUNKNOWN
+  }
+}
+
+void GdbConnection::reply_file_result(int64_t result, int err) {
+  assert(DREQ_FILE_FIRST <= req.type && req.type <= DREQ_FILE_LAST);
+
+  char buf[64];
+  if (result < 0) {
+    snprintf(buf, sizeof(buf) - 1, "F-1,%x", to_gdb_errno(err));
+  } else {
+    snprintf(buf, sizeof(buf) - 1, "F%" PRIx64, result);
+  }
+  write_packet(buf);
+
+  consume_request();
+}
+
+void GdbConnection::reply_file_pread(const vector<uint8_t>& data) {
+  assert(DREQ_FILE_PREAD == req.type);
+
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix) - 1, "F%zx;", data.size());
+  write_binary_packet(prefix, data.data(), data.size());
+
+  consume_request();
+}
+
+template <typename T>
+static void append_big_endian(vector<uint8_t>& out, T value) {
+  for (int i = sizeof(T) - 1; i >= 0; --i) {
+    out.push_back(uint8_t(value >> (i * 8)));
+  }
+}
+
+void GdbConnection::reply_file_fstat(const struct stat& st) {
+  assert(DREQ_FILE_FSTAT == req.type);
+
+  // gdb's struct fio_stat, all big-endian.
+  vector<uint8_t> out;
+  append_big_endian<uint32_t>(out, st.st_dev);
+  append_big_endian<uint32_t>(out, st.st_ino);
+  append_big_endian<uint32_t>(out, st.st_mode);
+  append_big_endian<uint32_t>(out, st.st_nlink);
+  append_big_endian<uint32_t>(out, st.st_uid);
+  append_big_endian<uint32_t>(out, st.st_gid);
+  append_big_endian<uint32_t>(out, st.st_rdev);
+  append_big_endian<uint64_t>(out, st.st_size);
+  append_big_endian<uint64_t>(out, st.st_blksize);
+  append_big_endian<uint64_t>(out, st.st_blocks);
+  append_big_endian<uint32_t>(out, st.st_atime);
+  append_big_endian<uint32_t>(out, st.st_mtime);
+  append_big_endian<uint32_t>(out, st.st_ctime);
+
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix) - 1, "F%zx;", out.size());
+  write_binary_packet(prefix, out.data(), out.size());
+
+  consume_request();
+}
+
 void GdbConnection::reply_get_is_thread_alive(bool alive) {
   assert(DREQ_GET_IS_THREAD_ALIVE == req.type);
 
@@ -1405,6 +1777,8 @@ void GdbConnection::reply_get_mem(const vector<uint8_t>& mem) {
 
   if (req.mem().len > 0 && mem.size() == 0) {
     write_packet("E01");
+  } else if (req.mem().binary) {
+    write_binary_packet("b", mem.data(), mem.size());
   } else {
     write_hex_bytes_packet(mem.data(), mem.size());
   }
@@ -1471,10 +1845,12 @@ void GdbConnection::reply_set_reg(bool ok) {
   consume_request();
 }
 
-void GdbConnection::reply_get_stop_reason(GdbThreadId which, int sig) {
+void GdbConnection::reply_get_stop_reason(
+    GdbThreadId which, int sig,
+    const vector<GdbRegisterValue>& expedited_regs) {
   assert(DREQ_GET_STOP_REASON == req.type);
 
-  send_stop_reply_packet(which, sig);
+  send_stop_reply_packet(which, sig, expedited_regs);
 
   consume_request();
 }
@@ -1519,6 +1895,14 @@ void GdbConnection::reply_watchpoint_request(bool ok) {
   consume_request();
 }
 
+void GdbConnection::reply_catch_syscalls() {
+  assert(DREQ_CATCH_SYSCALLS == req.type);
+
+  write_packet("OK");
+
+  consume_request();
+}
+
 void GdbConnection::reply_detach() {
   assert(DREQ_DETACH <= req.type);
 
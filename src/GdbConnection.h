@@ -4,10 +4,12 @@
 #define RR_GDB_CONNECTION_H_
 
 #include <stddef.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <memory>
 #include <ostream>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -104,8 +106,15 @@ enum GdbRequestType {
   //
   // Uses .mem for offset/len.
   DREQ_READ_SIGINFO,
+  // gdb wants the dynamic linker's list of loaded libraries, as
+  // qXfer:libraries-svr4 XML. Uses .mem for offset/len.
+  DREQ_GET_LIBRARIES_SVR4,
+  // Find the bytes in .mem.data in the .mem range.
+  DREQ_SEARCH_MEM,
+  // CRC the .mem range.
+  DREQ_GET_MEM_CRC,
   DREQ_MEM_FIRST = DREQ_GET_MEM,
-  DREQ_MEM_LAST = DREQ_READ_SIGINFO,
+  DREQ_MEM_LAST = DREQ_GET_MEM_CRC,
 
   DREQ_REMOVE_SW_BREAK,
   DREQ_REMOVE_HW_BREAK,
@@ -126,6 +135,17 @@ enum GdbRequestType {
   DREQ_REG_FIRST = DREQ_GET_REG,
   DREQ_REG_LAST = DREQ_SET_REG,
 
+  /* Uses params.catch_syscalls. */
+  DREQ_CATCH_SYSCALLS,
+
+  /* vFile host I/O. These use params.file. */
+  DREQ_FILE_OPEN,
+  DREQ_FILE_PREAD,
+  DREQ_FILE_CLOSE,
+  DREQ_FILE_FSTAT,
+  DREQ_FILE_FIRST = DREQ_FILE_OPEN,
+  DREQ_FILE_LAST = DREQ_FILE_FSTAT,
+
   /* Use params.cont. */
   DREQ_CONT,
 
@@ -144,13 +164,21 @@ enum GdbRestartType {
 enum GdbActionType { ACTION_CONTINUE, ACTION_STEP };
 
 struct GdbContAction {
-  GdbContAction() {}
+  GdbContAction() : range_start(0), range_end(0) {}
   GdbContAction(GdbActionType type, const GdbThreadId& target,
                 int signal_to_deliver = 0)
-      : type(type), target(target), signal_to_deliver(signal_to_deliver) {}
+      : type(type),
+        target(target),
+        signal_to_deliver(signal_to_deliver),
+        range_start(0),
+        range_end(0) {}
   GdbActionType type;
   GdbThreadId target;
   int signal_to_deliver;
+  // For a range step (vCont;r), an ACTION_STEP that keeps stepping while
+  // the pc is in [range_start, range_end). Empty for an ordinary step.
+  uint64_t range_start;
+  uint64_t range_end;
 };
 
 /**
@@ -168,6 +196,8 @@ struct GdbRequest {
         watch_(other.watch_),
         reg_(other.reg_),
         restart_(other.restart_),
+        catch_syscalls_(other.catch_syscalls_),
+        file_(other.file_),
         cont_(other.cont_) {}
   GdbRequest& operator=(const GdbRequest& other) {
     this->~GdbRequest();
@@ -183,7 +213,11 @@ struct GdbRequest {
     uintptr_t addr;
     size_t len;
     // For SET_MEM requests, the |len| raw bytes that are to be written.
+    // For SEARCH_MEM requests, the pattern to find.
     std::vector<uint8_t> data;
+    // For GET_MEM requests, true if gdb wants the reply in binary ('x')
+    // rather than hex ('m').
+    bool binary;
   } mem_;
   struct Watch {
     uintptr_t addr;
@@ -196,6 +230,21 @@ struct GdbRequest {
     std::string param_str;
     GdbRestartType type;
   } restart_;
+  struct CatchSyscalls {
+    bool enabled;
+    // Syscall numbers to catch, or empty to catch them all.
+    std::vector<int> syscalls;
+  } catch_syscalls_;
+  struct File {
+    // For FILE_OPEN. gdb only opens files for reading.
+    std::string path;
+    int flags;
+    // For the others.
+    int fd;
+    // For FILE_PREAD.
+    size_t count;
+    uint64_t offset;
+  } file_;
   struct Cont {
     RunDirection run_direction;
     std::vector<GdbContAction> actions;
@@ -233,6 +282,22 @@ struct GdbRequest {
     assert(type == DREQ_RESTART);
     return restart_;
   }
+  CatchSyscalls& catch_syscalls() {
+    assert(type == DREQ_CATCH_SYSCALLS);
+    return catch_syscalls_;
+  }
+  const CatchSyscalls& catch_syscalls() const {
+    assert(type == DREQ_CATCH_SYSCALLS);
+    return catch_syscalls_;
+  }
+  File& file() {
+    assert(type >= DREQ_FILE_FIRST && type <= DREQ_FILE_LAST);
+    return file_;
+  }
+  const File& file() const {
+    assert(type >= DREQ_FILE_FIRST && type <= DREQ_FILE_LAST);
+    return file_;
+  }
   Cont& cont() {
     assert(type == DREQ_CONT);
     return cont_;
@@ -258,6 +323,17 @@ struct GdbAuxvPair {
   uintptr_t value;
 };
 
+/**
+ * A shared library from the dynamic linker's link_map chain: the address of
+ * its struct link_map, its load bias and the address of its dynamic section.
+ */
+struct GdbSvr4Library {
+  std::string name;
+  uintptr_t lm;
+  uintptr_t l_addr;
+  uintptr_t l_ld;
+};
+
 /**
  * This struct wraps up the state of the gdb protocol, so that we can
  * offer a (mostly) stateless interface to clients.
@@ -342,8 +418,18 @@ public:
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
    * that stopped execution, or 0 if execution stopped otherwise.
+   * |expedited_regs| are sent along with the stop so gdb doesn't have to
+   * ask for them.
+   */
+  void notify_stop(GdbThreadId which, int sig,
+                   const std::vector<GdbRegisterValue>& expedited_regs,
+                   uintptr_t watch_addr = 0);
+  /**
+   * Like notify_stop, for a stop at entry to (if |entry|) or exit from a
+   * syscall caught with QCatchSyscalls.
    */
-  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0);
+  void notify_syscall_stop(GdbThreadId which, int syscallno, bool entry,
+                           const std::vector<GdbRegisterValue>& expedited_regs);
 
   /** Notify the debugger that a restart request failed. */
   void notify_restart_failed();
@@ -359,6 +445,40 @@ public:
    */
   void reply_get_auxv(const std::vector<GdbAuxvPair>& auxv);
 
+  /**
+   * Reply with the shared libraries in the target's link_map chain, whose
+   * first entry (the executable) is at |main_lm|. |main_lm| is 0 if the
+   * dynamic linker hasn't set up the chain (yet).
+   */
+  void reply_get_libraries_svr4(uintptr_t main_lm,
+                                const std::vector<GdbSvr4Library>& libs);
+
+  /**
+   * Reply to DREQ_SEARCH_MEM with the address of the first match, if
+   * |found|.
+   */
+  void reply_search_mem(bool found, uintptr_t addr);
+
+  /**
+   * Reply to DREQ_GET_MEM_CRC with the |crc| of the range, if it could all
+   * be read (|ok|).
+   */
+  void reply_get_mem_crc(bool ok, uint32_t crc);
+
+  /**
+   * Reply to a vFile request with |result|, or with the error |err| when
+   * |result| is negative.
+   */
+  void reply_file_result(int64_t result, int err);
+  /**
+   * Reply to DREQ_FILE_PREAD with the bytes read.
+   */
+  void reply_file_pread(const std::vector<uint8_t>& data);
+  /**
+   * Reply to DREQ_FILE_FSTAT.
+   */
+  void reply_file_fstat(const struct stat& st);
+
   /**
    * |alive| is true if the requested thread is alive, false if dead.
    */
@@ -412,7 +532,9 @@ public:
   /**
    * Reply to the DREQ_GET_STOP_REASON request.
    */
-  void reply_get_stop_reason(GdbThreadId which, int sig);
+  void reply_get_stop_reason(
+      GdbThreadId which, int sig,
+      const std::vector<GdbRegisterValue>& expedited_regs);
 
   /**
    * |threads| contains the list of live threads, of which there are
@@ -426,6 +548,11 @@ public:
    */
   void reply_watchpoint_request(bool ok);
 
+  /**
+   * DREQ_CATCH_SYSCALLS was processed.
+   */
+  void reply_catch_syscalls();
+
   /**
    * DREQ_DETACH was processed.
    *
@@ -473,6 +600,12 @@ public:
 
   const Features& features() { return features_; }
 
+  /**
+   * True if gdb told us (with QPassSignals) to pass linux signal |sig|
+   * straight to the program. gdb doesn't want to hear about those.
+   */
+  bool is_pass_signal(int sig);
+
 private:
   GdbConnection(pid_t tgid, const Features& features);
 
@@ -492,6 +625,12 @@ private:
   void write_flush();
   void write_data_raw(const uint8_t* data, ssize_t len);
   void write_hex(unsigned long hex);
+  /**
+   * Start a packet in the output buffer. Returns where its payload starts,
+   * for end_packet() to checksum once the payload has been appended.
+   */
+  size_t begin_packet();
+  void end_packet(size_t payload_start);
   void write_packet_bytes(const uint8_t* data, size_t num_bytes);
   void write_packet(const char* data);
   void write_binary_packet(const char* pfx, const uint8_t* data,
@@ -537,14 +676,21 @@ private:
    * false if we already handled the packet internally.
    */
   bool process_bpacket(char* payload);
+  bool process_vfile_packet(char* payload);
   /**
    * Return true if we need to do something in a debugger request,
    * false if we already handled the packet internally.
    */
   bool process_packet();
   void consume_request();
-  void send_stop_reply_packet(GdbThreadId thread, int sig,
-                              uintptr_t watch_addr = 0);
+  void send_stop_reply_packet(
+      GdbThreadId thread, int sig,
+      const std::vector<GdbRegisterValue>& expedited_regs,
+      const std::string& reason = std::string());
+  void notify_stop_with_reason(
+      GdbThreadId thread, int sig,
+      const std::vector<GdbRegisterValue>& expedited_regs,
+      const std::string& reason);
 
   // Current request to be processed.
   GdbRequest req;
@@ -559,13 +705,15 @@ private:
   // true when "no-ack mode" enabled, in which we don't have
   // to send ack packets back to gdb.  This is a huge perf win.
   bool no_ack;
+  // gdb signal numbers set by QPassSignals.
+  std::set<int> pass_signals;
   ScopedFd sock_fd;
-  /* XXX probably need to dynamically size these */
-  uint8_t inbuf[32768];  /* buffered input from gdb */
-  ssize_t inlen;         /* length of valid data */
-  ssize_t packetend;     /* index of '#' character */
-  uint8_t outbuf[32768]; /* buffered output for gdb */
-  ssize_t outlen;
+  // Buffered input from gdb. Grows when a packet doesn't fit.
+  std::vector<uint8_t> inbuf;
+  ssize_t inlen;     /* length of valid data */
+  ssize_t packetend; /* index of '#' character */
+  // Buffered output for gdb.
+  std::vector<uint8_t> outbuf;
   Features features_;
 };
 
@@ -257,8 +257,15 @@ struct ExpressionState {
       case OP_const64:
         return push(fetch<uint64_t>());
       case OP_reg: {
-        GdbRegisterValue v = GdbServer::get_reg(t->regs(), t->extra_regs(),
-                                                GdbRegister(fetch<uint16_t>()));
+        // Conditions almost always test general-purpose registers. Only
+        // fetch the extra registers, which costs a ptrace call per stop,
+        // when the register isn't one of those.
+        GdbRegister reg = GdbRegister(fetch<uint16_t>());
+        GdbRegisterValue v;
+        v.size = t->regs().read_register(&v.value[0], reg, &v.defined);
+        if (!v.defined) {
+          v = GdbServer::get_reg(t->regs(), t->extra_regs(), reg);
+        }
         if (!v.defined) {
           set_error();
           return;
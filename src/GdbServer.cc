@@ -5,6 +5,7 @@
 #include "GdbServer.h"
 
 #include <assert.h>
+#include <elf.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -16,6 +17,7 @@
 #include <vector>
 
 #include "BreakpointCondition.h"
+#include "Flags.h"
 #include "GdbExpression.h"
 #include "kernel_metadata.h"
 #include "log.h"
@@ -58,6 +60,35 @@ static const uintptr_t DBG_COMMAND_PARAMETER_MASK = 0x00FFFFFF;
  */
 static const uintptr_t DBG_WHEN_MAGIC_ADDRESS = DBG_COMMAND_MAGIC_ADDRESS + 4;
 
+/**
+ * 64-bit reads from DBG_CHECKPOINT_MEMORY_MAGIC_ADDRESS return the memory
+ * (PSS, in KB) currently used by checkpoint processes.
+ */
+static const uintptr_t DBG_CHECKPOINT_MEMORY_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 12;
+
+/**
+ * A 64-bit write of a breakpoint address to DBG_IGNORE_ADDR_MAGIC_ADDRESS
+ * followed by a 64-bit write of a count to DBG_IGNORE_COUNT_MAGIC_ADDRESS
+ * makes rr skip that many hits of breakpoints at the address (whose
+ * conditions are true) without stopping for gdb. A count of 0 clears it.
+ */
+static const uintptr_t DBG_IGNORE_ADDR_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 20;
+static const uintptr_t DBG_IGNORE_COUNT_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 28;
+
+/**
+ * A 64-bit write of a breakpoint address to DBG_THREAD_ADDR_MAGIC_ADDRESS
+ * followed by a 64-bit write of a tid to DBG_THREAD_TID_MAGIC_ADDRESS makes
+ * breakpoints at the address only stop in that thread. The other threads
+ * pass them without involving gdb. A tid of 0 clears it.
+ */
+static const uintptr_t DBG_THREAD_ADDR_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 36;
+static const uintptr_t DBG_THREAD_TID_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 44;
+
 // Special-sauce macros defined by rr when launching the gdb client,
 // which implement functionality outside of the gdb remote protocol.
 // (Don't stare at them too long or you'll go blind ;).)
@@ -81,6 +112,23 @@ static const char gdb_rr_macros[] =
     "define when\n"
     "  p *(long long int*)(29298 + 4)\n"
     "end\n"
+    "define checkpoint-memory\n"
+    "  p *(long long int*)(29298 + 12)\n"
+    "end\n"
+    // Like gdb's "ignore", but rr skips the hits itself, so gdb isn't
+    // involved until the last one. Takes a breakpoint address, e.g.
+    // "rr-ignore &func 50000" or "rr-ignore $pc 10".
+    "define rr-ignore\n"
+    "  set *(unsigned long long*)(29298 + 20) = (unsigned long long)$arg0\n"
+    "  set *(unsigned long long*)(29298 + 28) = $arg1\n"
+    "end\n"
+    // Like "break ... thread N", but rr filters the hits itself. Takes a
+    // breakpoint address and the thread's tid (the LWP in "info threads"),
+    // e.g. "rr-break-thread &func 12345". A tid of 0 clears the filter.
+    "define rr-break-thread\n"
+    "  set *(unsigned long long*)(29298 + 36) = (unsigned long long)$arg0\n"
+    "  set *(unsigned long long*)(29298 + 44) = $arg1\n"
+    "end\n"
     // In gdb version "Fedora 7.8.1-30.fc21", a raw "run" command
     // issued before any user-generated resume-execution command
     // results in gdb hanging just after the inferior hits an internal
@@ -177,6 +225,35 @@ static GdbThreadId get_threadid(Task* t) {
   return thread;
 }
 
+/**
+ * The registers gdb needs at every stop to unwind the stack: the
+ * instruction, stack and frame pointers. Sending these with the stop reply
+ * saves gdb a round-trip to fetch all registers.
+ */
+static vector<GdbRegisterValue> expedited_regs(Task* t) {
+  GdbRegister names[3];
+  if (t->arch() == x86) {
+    names[0] = DREG_EIP;
+    names[1] = DREG_ESP;
+    names[2] = DREG_EBP;
+  } else {
+    names[0] = DREG_RIP;
+    names[1] = DREG_RSP;
+    names[2] = DREG_RBP;
+  }
+  vector<GdbRegisterValue> regs;
+  for (GdbRegister name : names) {
+    GdbRegisterValue reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.name = name;
+    reg.size = t->regs().read_register(&reg.value[0], name, &reg.defined);
+    if (reg.defined) {
+      regs.push_back(reg);
+    }
+  }
+  return regs;
+}
+
 static bool matches_threadid(Task* t, const GdbThreadId& target) {
   return (target.pid <= 0 || target.pid == t->tgid()) &&
          (target.tid <= 0 || target.tid == t->rec_tid);
@@ -219,6 +296,36 @@ static void maybe_singlestep_for_event(Task* t, GdbRequest* req) {
 }
 
 bool GdbServer::maybe_process_magic_command(Task* t, const GdbRequest& req) {
+  if ((req.mem().addr == DBG_IGNORE_ADDR_MAGIC_ADDRESS ||
+       req.mem().addr == DBG_IGNORE_COUNT_MAGIC_ADDRESS) &&
+      req.mem().len == 8) {
+    uint64_t value;
+    memcpy(&value, req.mem().data.data(), sizeof(value));
+    if (req.mem().addr == DBG_IGNORE_ADDR_MAGIC_ADDRESS) {
+      ignore_breakpoint_addr = value;
+    } else if (value == 0) {
+      ignore_counts.erase(ignore_breakpoint_addr);
+    } else {
+      ignore_counts[ignore_breakpoint_addr] = make_shared<uint64_t>(value);
+    }
+    dbg->reply_set_mem(true);
+    return true;
+  }
+  if ((req.mem().addr == DBG_THREAD_ADDR_MAGIC_ADDRESS ||
+       req.mem().addr == DBG_THREAD_TID_MAGIC_ADDRESS) &&
+      req.mem().len == 8) {
+    uint64_t value;
+    memcpy(&value, req.mem().data.data(), sizeof(value));
+    if (req.mem().addr == DBG_THREAD_ADDR_MAGIC_ADDRESS) {
+      thread_breakpoint_addr = value;
+    } else if (value == 0) {
+      breakpoint_threads.erase(thread_breakpoint_addr);
+    } else {
+      breakpoint_threads[thread_breakpoint_addr] = value;
+    }
+    dbg->reply_set_mem(true);
+    return true;
+  }
   if (!(req.mem().addr == DBG_COMMAND_MAGIC_ADDRESS && req.mem().len == 4)) {
     return false;
   }
@@ -258,6 +365,17 @@ bool GdbServer::maybe_process_magic_read(Task* t, const GdbRequest& req) {
     dbg->reply_get_mem(mem);
     return true;
   }
+  if (req.mem().addr == DBG_CHECKPOINT_MEMORY_MAGIC_ADDRESS &&
+      req.mem().len == 8) {
+    vector<uint8_t> mem;
+    mem.resize(req.mem().len);
+    int64_t kb = t->session().as_replay()
+                     ? int64_t(timeline.checkpoint_memory() / 1024)
+                     : int64_t(-1);
+    memcpy(mem.data(), &kb, mem.size());
+    dbg->reply_get_mem(mem);
+    return true;
+  }
   return false;
 }
 
@@ -273,12 +391,32 @@ void GdbServer::dispatch_regs_request(const Registers& regs,
 
 class GdbBreakpointCondition : public BreakpointCondition {
 public:
-  GdbBreakpointCondition(const vector<vector<uint8_t> >& bytecodes) {
+  GdbBreakpointCondition(const vector<vector<uint8_t> >& bytecodes)
+      : evaluations(0), breaks(0), evaluation_time(0) {
     for (auto& b : bytecodes) {
       expressions.push_back(GdbExpression(b.data(), b.size()));
     }
   }
+  virtual ~GdbBreakpointCondition() {
+    if (Flags::get().verbose && evaluations > 0) {
+      fprintf(stderr, "rr: breakpoint condition evaluated %zu times, "
+                      "broke %zu times, %.3fms total\n",
+              evaluations, breaks, evaluation_time * 1000);
+    }
+  }
   virtual bool evaluate(Task* t) const {
+    double start = now_sec();
+    bool result = evaluate_expressions(t);
+    evaluation_time += now_sec() - start;
+    ++evaluations;
+    if (result) {
+      ++breaks;
+    }
+    return result;
+  }
+
+private:
+  bool evaluate_expressions(Task* t) const {
     for (auto& e : expressions) {
       GdbExpression::Value v;
       // Break if evaluation fails or the result is nonzero
@@ -289,8 +427,53 @@ public:
     return false;
   }
 
-private:
   vector<GdbExpression> expressions;
+  // Statistics reported under -V when the breakpoint is removed, to help
+  // find expensive conditions in gdb scripts.
+  mutable size_t evaluations;
+  mutable size_t breaks;
+  mutable double evaluation_time;
+};
+
+/**
+ * Doesn't break until |inner| (if any) has been true |*remaining| times.
+ */
+class IgnoreCountCondition : public BreakpointCondition {
+public:
+  IgnoreCountCondition(const shared_ptr<uint64_t>& remaining,
+                       unique_ptr<BreakpointCondition> inner)
+      : remaining(remaining), inner(move(inner)) {}
+  virtual bool evaluate(Task* t) const {
+    if (inner && !inner->evaluate(t)) {
+      return false;
+    }
+    if (*remaining > 0) {
+      --*remaining;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  shared_ptr<uint64_t> remaining;
+  unique_ptr<BreakpointCondition> inner;
+};
+
+/**
+ * Breaks only in the task whose recorded tid is |tid|, and then only if
+ * |inner| (if any) is true.
+ */
+class ThreadCondition : public BreakpointCondition {
+public:
+  ThreadCondition(pid_t tid, unique_ptr<BreakpointCondition> inner)
+      : tid(tid), inner(move(inner)) {}
+  virtual bool evaluate(Task* t) const {
+    return t->rec_tid == tid && (!inner || inner->evaluate(t));
+  }
+
+private:
+  pid_t tid;
+  unique_ptr<BreakpointCondition> inner;
 };
 
 static unique_ptr<BreakpointCondition> breakpoint_condition(
@@ -302,6 +485,274 @@ static unique_ptr<BreakpointCondition> breakpoint_condition(
       new GdbBreakpointCondition(request.watch().conditions));
 }
 
+static unique_ptr<BreakpointCondition> breakpoint_condition(
+    const GdbRequest& request,
+    const map<uintptr_t, shared_ptr<uint64_t> >& ignore_counts,
+    const map<uintptr_t, pid_t>& breakpoint_threads) {
+  unique_ptr<BreakpointCondition> cond = breakpoint_condition(request);
+  auto thread = breakpoint_threads.find(request.watch().addr);
+  if (thread != breakpoint_threads.end()) {
+    cond = unique_ptr<BreakpointCondition>(
+        new ThreadCondition(thread->second, move(cond)));
+  }
+  // Only count hits in the right thread.
+  auto it = ignore_counts.find(request.watch().addr);
+  if (it != ignore_counts.end()) {
+    cond = unique_ptr<BreakpointCondition>(
+        new IgnoreCountCondition(it->second, move(cond)));
+  }
+  return cond;
+}
+
+template <typename Arch> struct ElfTypes;
+template <> struct ElfTypes<X86Arch> {
+  typedef Elf32_Phdr Phdr;
+  typedef Elf32_Dyn Dyn;
+};
+template <> struct ElfTypes<X64Arch> {
+  typedef Elf64_Phdr Phdr;
+  typedef Elf64_Dyn Dyn;
+};
+
+/**
+ * Find the dynamic linker's link_map chain through the executable's
+ * DT_DEBUG entry and read it. Returns the address of the first entry (the
+ * executable itself), or 0 if there's no chain yet.
+ */
+template <typename Arch>
+static uintptr_t read_svr4_libraries_arch(Task* t,
+                                          vector<GdbSvr4Library>* libs) {
+  typedef typename Arch::unsigned_word Word;
+  typedef typename ElfTypes<Arch>::Phdr Phdr;
+  typedef typename ElfTypes<Arch>::Dyn Dyn;
+
+  char filename[] = "/proc/01234567890/auxv";
+  snprintf(filename, sizeof(filename) - 1, "/proc/%d/auxv", t->real_tgid());
+  ScopedFd fd(filename, O_RDONLY);
+  Word auxv[1024];
+  ssize_t len = fd.is_open() ? read(fd, auxv, sizeof(auxv)) : -1;
+  remote_ptr<Phdr> phdrs;
+  size_t phnum = 0;
+  for (ssize_t i = 0; i + 1 < len / ssize_t(sizeof(Word)); i += 2) {
+    if (auxv[i] == AT_PHDR) {
+      phdrs = remote_ptr<Phdr>(auxv[i + 1]);
+    } else if (auxv[i] == AT_PHNUM) {
+      phnum = auxv[i + 1];
+    }
+  }
+  if (phdrs.is_null()) {
+    return 0;
+  }
+
+  bool ok = true;
+  vector<Phdr> phdr_list = t->read_mem(phdrs, phnum, &ok);
+  if (!ok) {
+    return 0;
+  }
+  uintptr_t bias = 0;
+  uintptr_t dynamic = 0;
+  for (auto& phdr : phdr_list) {
+    if (phdr.p_type == PT_PHDR) {
+      bias = phdrs.as_int() - phdr.p_vaddr;
+    }
+  }
+  for (auto& phdr : phdr_list) {
+    if (phdr.p_type == PT_DYNAMIC) {
+      dynamic = bias + phdr.p_vaddr;
+    }
+  }
+  if (!dynamic) {
+    // Statically linked.
+    return 0;
+  }
+
+  remote_ptr<Word> r_debug;
+  for (remote_ptr<Dyn> d = dynamic;; ++d) {
+    Dyn dyn = t->read_mem(d, &ok);
+    if (!ok || dyn.d_tag == DT_NULL) {
+      break;
+    }
+    if (dyn.d_tag == DT_DEBUG) {
+      r_debug = remote_ptr<Word>(dyn.d_un.d_ptr);
+    }
+  }
+  if (r_debug.is_null()) {
+    return 0;
+  }
+
+  // struct r_debug { int r_version; struct link_map* r_map; ... }, with
+  // r_map word-aligned.
+  remote_ptr<Word> main_lm = t->read_mem(r_debug + 1, &ok);
+  // struct link_map { l_addr; l_name; l_ld; l_next; l_prev; ... }, all
+  // words.
+  for (remote_ptr<Word> lm = main_lm; ok && !lm.is_null();) {
+    vector<Word> fields = t->read_mem(lm, 4, &ok);
+    if (!ok) {
+      break;
+    }
+    // The first entry is the executable, which gdb finds without our help.
+    if (lm != main_lm && fields[1]) {
+      GdbSvr4Library lib;
+      lib.name = t->read_c_str(remote_ptr<void>(fields[1]));
+      lib.lm = lm.as_int();
+      lib.l_addr = fields[0];
+      lib.l_ld = fields[2];
+      if (!lib.name.empty()) {
+        libs->push_back(lib);
+      }
+    }
+    lm = remote_ptr<Word>(fields[3]);
+  }
+  return main_lm.as_int();
+}
+
+static uintptr_t read_svr4_libraries(Task* t, vector<GdbSvr4Library>* libs) {
+  RR_ARCH_FUNCTION(read_svr4_libraries_arch, t->arch(), t, libs);
+}
+
+/**
+ * Read tracee memory the way gdb should see it, i.e. without our
+ * breakpoints. Returns the number of bytes read.
+ */
+static size_t read_debugger_mem(Task* t, remote_ptr<void> addr, size_t len,
+                                uint8_t* buf) {
+  ssize_t nread = t->read_bytes_fallible(addr, len, buf);
+  if (nread <= 0) {
+    return 0;
+  }
+  t->vm()->replace_breakpoints_with_original_values(buf, nread,
+                                                    addr.cast<uint8_t>());
+  return nread;
+}
+
+/* Read this much at a time when scanning memory for gdb. */
+static const size_t DEBUGGER_SCAN_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * Find |pattern| in [addr, addr + len), returning true and setting |*found|
+ * if it's there. Stops at the first unreadable byte.
+ */
+static bool search_mem(Task* t, remote_ptr<void> addr, size_t len,
+                       const vector<uint8_t>& pattern,
+                       remote_ptr<void>* found) {
+  if (pattern.empty() || pattern.size() > len) {
+    return false;
+  }
+  vector<uint8_t> buf(max(DEBUGGER_SCAN_CHUNK_SIZE, 2 * pattern.size()));
+  // Bytes of |buf| carried over from the previous chunk, so matches
+  // spanning chunks are found.
+  size_t kept = 0;
+  remote_ptr<void> buf_start = addr;
+  remote_ptr<void> end = addr + len;
+  while (true) {
+    remote_ptr<void> read_start = buf_start + kept;
+    size_t want = min<size_t>(buf.size() - kept, end - read_start);
+    size_t nread = read_debugger_mem(t, read_start, want, buf.data() + kept);
+    size_t have = kept + nread;
+    // memmem is vectorized in glibc.
+    void* match = memmem(buf.data(), have, pattern.data(), pattern.size());
+    if (match) {
+      *found = buf_start + ((uint8_t*)match - buf.data());
+      return true;
+    }
+    if (nread < want || read_start + nread >= end ||
+        have < pattern.size()) {
+      return false;
+    }
+    kept = pattern.size() - 1;
+    memmove(buf.data(), buf.data() + have - kept, kept);
+    buf_start = buf_start + (have - kept);
+  }
+}
+
+/**
+ * The CRC-32 gdb uses for qCRC (libiberty's xcrc32): polynomial 0x04c11db7,
+ * most significant bit first, no final inversion.
+ */
+static uint32_t gdb_crc32(const uint8_t* data, size_t len, uint32_t crc) {
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i << 24;
+      for (int j = 0; j < 8; ++j) {
+        c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : c << 1;
+      }
+      table[i] = c;
+    }
+  }
+  for (size_t i = 0; i < len; ++i) {
+    crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 255];
+  }
+  return crc;
+}
+
+void GdbServer::dispatch_file_request(const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_FILE_OPEN: {
+      if (req.file().flags != 0) {
+        // Only O_RDONLY; don't let gdb modify anything.
+        dbg->reply_file_result(-1, EACCES);
+        return;
+      }
+      if (!mapped_file_copies_loaded && timeline.is_running()) {
+        mapped_file_copies =
+            timeline.current_session().trace_reader().mapped_file_copies();
+        mapped_file_copies_loaded = true;
+      }
+      auto it = mapped_file_copies.find(req.file().path);
+      const string& path =
+          it == mapped_file_copies.end() ? req.file().path : it->second;
+      ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (!fd.is_open()) {
+        dbg->reply_file_result(-1, errno);
+        return;
+      }
+      int n = fd.get();
+      open_files[n] = move(fd);
+      dbg->reply_file_result(n, 0);
+      return;
+    }
+    case DREQ_FILE_PREAD: {
+      auto it = open_files.find(req.file().fd);
+      if (it == open_files.end()) {
+        dbg->reply_file_result(-1, EBADF);
+        return;
+      }
+      vector<uint8_t> data(req.file().count);
+      ssize_t ret =
+          pread(it->second, data.data(), data.size(), req.file().offset);
+      if (ret < 0) {
+        dbg->reply_file_result(-1, errno);
+        return;
+      }
+      data.resize(ret);
+      dbg->reply_file_pread(data);
+      return;
+    }
+    case DREQ_FILE_CLOSE:
+      if (!open_files.erase(req.file().fd)) {
+        dbg->reply_file_result(-1, EBADF);
+        return;
+      }
+      dbg->reply_file_result(0, 0);
+      return;
+    case DREQ_FILE_FSTAT: {
+      auto it = open_files.find(req.file().fd);
+      struct stat st;
+      if (it == open_files.end()) {
+        dbg->reply_file_result(-1, EBADF);
+      } else if (fstat(it->second, &st) < 0) {
+        dbg->reply_file_result(-1, errno);
+      } else {
+        dbg->reply_file_fstat(st);
+      }
+      return;
+    }
+    default:
+      FATAL() << "Unknown file request " << req.type;
+  }
+}
+
 void GdbServer::dispatch_debugger_request(Session& session, Task* t,
                                           const GdbRequest& req,
                                           ReportState state) {
@@ -319,6 +770,20 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       /* TODO */
       dbg->reply_get_offsets();
       return;
+    case DREQ_FILE_OPEN:
+    case DREQ_FILE_PREAD:
+    case DREQ_FILE_CLOSE:
+    case DREQ_FILE_FSTAT:
+      dispatch_file_request(req);
+      return;
+    case DREQ_CATCH_SYSCALLS:
+      if (req.catch_syscalls().enabled) {
+        timeline.catch_syscalls(req.catch_syscalls().syscalls);
+      } else {
+        timeline.stop_catching_syscalls();
+      }
+      dbg->reply_catch_syscalls();
+      return;
     case DREQ_GET_THREAD_LIST: {
       vector<GdbThreadId> tids;
       if (state != REPORT_THREADS_DEAD) {
@@ -332,7 +797,7 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
     case DREQ_INTERRUPT:
       // Tell the debugger we stopped and await further
       // instructions.
-      dbg->notify_stop(get_threadid(t), 0);
+      dbg->notify_stop(get_threadid(t), 0, expedited_regs(t));
       return;
     default:
       /* fall through to next switch stmt */
@@ -393,6 +858,14 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       dbg->reply_get_auxv(auxv);
       return;
     }
+    case DREQ_GET_LIBRARIES_SVR4: {
+      // Walking the chain here saves gdb thousands of memory reads when
+      // there are many libraries.
+      vector<GdbSvr4Library> libs;
+      uintptr_t main_lm = read_svr4_libraries(target, &libs);
+      dbg->reply_get_libraries_svr4(main_lm, libs);
+      return;
+    }
     case DREQ_GET_MEM: {
       if (maybe_process_magic_read(target, req)) {
         return;
@@ -407,6 +880,30 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       dbg->reply_get_mem(mem);
       return;
     }
+    case DREQ_SEARCH_MEM: {
+      remote_ptr<void> found;
+      bool ok = search_mem(target, req.mem().addr, req.mem().len,
+                           req.mem().data, &found);
+      dbg->reply_search_mem(ok, found.as_int());
+      return;
+    }
+    case DREQ_GET_MEM_CRC: {
+      vector<uint8_t> buf(min(DEBUGGER_SCAN_CHUNK_SIZE, req.mem().len));
+      uint32_t crc = 0xffffffff;
+      remote_ptr<void> addr = req.mem().addr;
+      size_t remaining = req.mem().len;
+      bool ok = true;
+      while (ok && remaining > 0) {
+        size_t want = min(buf.size(), remaining);
+        size_t nread = read_debugger_mem(target, addr, want, buf.data());
+        crc = gdb_crc32(buf.data(), nread, crc);
+        ok = nread == want;
+        addr += nread;
+        remaining -= nread;
+      }
+      dbg->reply_get_mem_crc(ok, crc);
+      return;
+    }
     case DREQ_SET_MEM: {
       // gdb has been observed to send requests of length 0 at
       // odd times
@@ -470,7 +967,8 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       return;
     }
     case DREQ_GET_STOP_REASON: {
-      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig);
+      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig,
+                                 expedited_regs(target));
       return;
     }
     case DREQ_SET_SW_BREAK: {
@@ -479,8 +977,9 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       // Mirror all breakpoint/watchpoint sets/unsets to the target process
       // if it's not part of the timeline (i.e. it's a diversion).
       Task* replay_task = timeline.current_session().find_task(t->tuid());
-      bool ok = timeline.add_breakpoint(replay_task, req.watch().addr,
-                                        breakpoint_condition(req));
+      bool ok = timeline.add_breakpoint(
+          replay_task, req.watch().addr,
+          breakpoint_condition(req, ignore_counts, breakpoint_threads));
       if (ok && &session != &timeline.current_session()) {
         bool diversion_ok =
             target->vm()->add_breakpoint(req.watch().addr, TRAP_BKPT_USER);
@@ -623,6 +1122,19 @@ void GdbServer::maybe_notify_stop(const BreakStatus& break_status) {
   }
   if (break_status.signal) {
     sig = break_status.signal;
+    if (!break_status.breakpoint_hit && break_status.watchpoints_hit.empty() &&
+        !break_status.singlestep_complete && dbg->is_pass_signal(sig)) {
+      // gdb would only resume us. Keep going with the pending resume
+      // request instead.
+      return;
+    }
+  }
+  if (break_status.syscall_caught && !break_status.signal &&
+      !break_status.breakpoint_hit && break_status.watchpoints_hit.empty()) {
+    dbg->notify_syscall_stop(get_threadid(break_status.task),
+                             break_status.syscallno, break_status.syscall_entry,
+                             expedited_regs(break_status.task));
+    return;
   }
   if (is_last_thread_exit(break_status) && dbg->features().reverse_execution) {
     // The exit of the last task in a task group generates a fake SIGKILL,
@@ -633,8 +1145,38 @@ void GdbServer::maybe_notify_stop(const BreakStatus& break_status) {
   if (sig >= 0) {
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
-    dbg->notify_stop(get_threadid(break_status.task), sig, watch_addr.as_int());
+    // An exiting task's registers can't be read any more.
+    vector<GdbRegisterValue> regs;
+    if (!break_status.task_exit) {
+      regs = expedited_regs(break_status.task);
+    }
+    dbg->notify_stop(get_threadid(break_status.task), sig, regs,
+                     watch_addr.as_int());
+  }
+}
+
+/**
+ * True when |req| range-steps |t| and the singlestep that produced
+ * |break_status| left it inside the range, with nothing else to report, so
+ * we should step again without telling gdb.
+ */
+static bool keep_range_stepping(Task* t, const GdbRequest& req,
+                                const BreakStatus& break_status) {
+  if (!t || req.cont().run_direction != RUN_FORWARD ||
+      break_status.task != t || !break_status.singlestep_complete ||
+      break_status.breakpoint_hit || !break_status.watchpoints_hit.empty() ||
+      break_status.signal || break_status.task_exit ||
+      break_status.approaching_ticks_target || break_status.syscall_caught) {
+    return false;
+  }
+  for (auto& action : req.cont().actions) {
+    if (matches_threadid(t, action.target)) {
+      uint64_t ip = t->ip().register_value();
+      return action.type == ACTION_STEP && action.range_start <= ip &&
+             ip < action.range_end;
+    }
   }
+  return false;
 }
 
 static RunCommand compute_run_command_from_actions(Task* t,
@@ -678,7 +1220,10 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
     // breakpoint/watchpoint state.
     timeline.apply_breakpoints_and_watchpoints();
   }
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
+  // gdb only ever sees one task group, so the diversion doesn't need the
+  // others.
+  DiversionSession::shr_ptr diversion_session =
+      replay.clone_diversion(replay.find_task(task));
   uint32_t diversion_refcount = 1;
 
   Task* t = diversion_session->find_task(task);
@@ -691,7 +1236,7 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
     if (req.cont().run_direction == RUN_BACKWARD) {
       // We don't support reverse execution in a diversion. Just issue
       // an immediate stop.
-      dbg->notify_stop(get_threadid(t), SIGTRAP, 0);
+      dbg->notify_stop(get_threadid(t), SIGTRAP, expedited_regs(t));
       continue;
     }
 
@@ -899,7 +1444,11 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
         result.break_status.breakpoint_hit = true;
       }
     }
-    if (!req.suppress_debugger_stop) {
+    // While range-stepping, the resume request stays pending, so we come
+    // back here and step again unless gdb has sent something new.
+    if (!req.suppress_debugger_stop &&
+        !(command == RUN_SINGLESTEP &&
+          keep_range_stepping(t, req, result.break_status))) {
       maybe_notify_stop(result.break_status);
     }
     if (req.cont().run_direction == RUN_FORWARD &&
@@ -1057,6 +1606,7 @@ void GdbServer::serve_replay(const ConnectionFlags& flags) {
       return;
     }
   } while (!at_target());
+  note_startup_phase("debugger target reached");
 
   unsigned short port = flags.dbg_port > 0 ? flags.dbg_port : getpid();
   // Don't probe if the user specified a port.  Explicitly
@@ -1081,8 +1631,20 @@ void GdbServer::serve_replay(const ConnectionFlags& flags) {
 
   activate_debugger();
 
-  RunDirection last_direction = RUN_FORWARD;
-  while (debug_one_step(&last_direction) == CONTINUE_DEBUGGING) {
+  while (true) {
+    RunDirection last_direction = RUN_FORWARD;
+    while (debug_one_step(&last_direction) == CONTINUE_DEBUGGING) {
+    }
+    if (!flags.keep_listening) {
+      break;
+    }
+    // The replay state, timeline and checkpoints stay as they are, so
+    // reattaching is instant.
+    LOG(info) << "Debugger detached; waiting for a new connection";
+    t = timeline.current_session().current_task();
+    dbg = GdbConnection::await_client_connection(
+        port, GdbConnection::DONT_PROBE, t->tgid(), t->vm()->exe_image(),
+        GdbConnection::Features());
   }
 
   LOG(debug) << "debugger server exiting ...";
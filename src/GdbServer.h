@@ -34,8 +34,14 @@ public:
     // parameters through this pipe. GdbServer::launch_gdb is passed the
     // other end of this pipe to exec gdb with the parameters.
     ScopedFd* debugger_params_write_pipe;
-
-    ConnectionFlags() : dbg_port(-1), debugger_params_write_pipe(nullptr) {}
+    // If true, when the debugger detaches wait for another connection on
+    // the same port, keeping the current replay state and checkpoints.
+    bool keep_listening;
+
+    ConnectionFlags()
+        : dbg_port(-1),
+          debugger_params_write_pipe(nullptr),
+          keep_listening(false) {}
   };
 
   /**
@@ -45,7 +51,10 @@ public:
             const ReplaySession::Flags& flags, const Target& target)
       : target(target),
         stop_replaying_to_target(false),
-        timeline(std::move(session), flags) {}
+        timeline(std::move(session), flags),
+        ignore_breakpoint_addr(0),
+        thread_breakpoint_addr(0),
+        mapped_file_copies_loaded(false) {}
 
   /**
    * Actually run the server. Returns only when the debugger disconnects.
@@ -81,6 +90,21 @@ public:
    */
   void interrupt_replay_to_target() { stop_replaying_to_target = true; }
 
+  /**
+   * Limit the memory used by reverse-execution checkpoints to |bytes|.
+   * See ReplayTimeline::set_checkpoint_memory_budget.
+   */
+  void set_checkpoint_memory_budget(uint64_t bytes) {
+    timeline.set_checkpoint_memory_budget(bytes);
+  }
+
+  /**
+   * See ReplayTimeline::set_timeline_log.
+   */
+  void set_timeline_log(const std::string& path) {
+    timeline.set_timeline_log(path);
+  }
+
   /**
    * Return the register |which|, which may not have a defined value.
    */
@@ -90,7 +114,11 @@ public:
 
 private:
   GdbServer(std::unique_ptr<GdbConnection>& dbg)
-      : dbg(std::move(dbg)), stop_replaying_to_target(false) {}
+      : dbg(std::move(dbg)),
+        stop_replaying_to_target(false),
+        ignore_breakpoint_addr(0),
+        thread_breakpoint_addr(0),
+        mapped_file_copies_loaded(false) {}
 
   /**
    * If |req| is a magic-write command, interpret it and return true.
@@ -105,6 +133,11 @@ private:
   void dispatch_regs_request(const Registers& regs,
                              const ExtraRegisters& extra_regs);
   enum ReportState { REPORT_NORMAL, REPORT_THREADS_DEAD };
+  /**
+   * Handle a vFile request, serving the files replay uses: the trace's
+   * copies of mapped files where it has them.
+   */
+  void dispatch_file_request(const GdbRequest& req);
   /**
    * Process the single debugger request |req|, made by |dbg| targeting
    * |t|, inside the session |session|.
@@ -197,6 +230,22 @@ private:
 
   // gdb checkpoints, indexed by ID
   std::map<int, ReplayTimeline::Mark> checkpoints;
+
+  // Remaining ignore counts set by "rr-ignore", indexed by breakpoint
+  // address. Shared with the conditions of the breakpoints we set there,
+  // so counts survive gdb removing and reinserting breakpoints.
+  std::map<uintptr_t, std::shared_ptr<uint64_t> > ignore_counts;
+  // Address written by "rr-ignore", waiting for its count.
+  uintptr_t ignore_breakpoint_addr;
+  // Threads set by "rr-break-thread", indexed by breakpoint address.
+  std::map<uintptr_t, pid_t> breakpoint_threads;
+  // Address written by "rr-break-thread", waiting for its tid.
+  uintptr_t thread_breakpoint_addr;
+  // Files opened by gdb with vFile:open, by fd.
+  std::map<int, ScopedFd> open_files;
+  // TraceReader::mapped_file_copies(), loaded on the first vFile:open.
+  std::map<std::string, std::string> mapped_file_copies;
+  bool mapped_file_copies_loaded;
 };
 
 #endif /* RR_GDB_SERVER_H_ */
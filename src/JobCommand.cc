@@ -0,0 +1,177 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Command.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class JobCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  JobCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static JobCommand singleton;
+};
+
+JobCommand JobCommand::singleton(
+    "job",
+    " rr job [OPTIONS] <trace_dir>...\n"
+    "  Print the manifest of a distributed job from the traces its ranks'\n"
+    "  nodes recorded with `rr record --job': a line \"job <ID>\", then a\n"
+    "  line \"rank <RANK> <HOST> <TRACE_DIR>\" for each trace, by rank. Each\n"
+    "  rank can be replayed on its own from its trace.\n"
+    "  -m, --messages             also print a line\n"
+    "                             \"<RANK>:<EVENT> -> <RANK>:<EVENT> <BYTES>\"\n"
+    "                             for each receive on a TCP connection\n"
+    "                             between the traces, with the event that\n"
+    "                             sent its first byte and the event that\n"
+    "                             received it\n");
+
+struct JobFlags {
+  bool messages;
+
+  JobFlags() : messages(false) {}
+};
+
+static bool parse_job_arg(std::vector<std::string>& args, JobFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'm', "messages", NO_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'm':
+      flags.messages = true;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+struct JobTrace {
+  string dir;
+  TraceStream::JobInfo job;
+};
+
+static string rank_name(int rank) {
+  return rank < 0 ? string("?") : to_string(rank);
+}
+
+/**
+ * Print the receive of each message in |traces| whose sender is also in
+ * |traces|, with the send that its first byte came from.
+ */
+static void print_messages(const vector<JobTrace>& traces, FILE* out) {
+  // The trace and connection index of each connection, by its endpoints.
+  map<pair<string, string>, pair<size_t, uint32_t> > connections;
+  // The sends on each connection, by trace and connection index, in stream
+  // order.
+  map<pair<size_t, uint32_t>, vector<const TraceStream::JobMessage*> > sends;
+  for (size_t i = 0; i < traces.size(); ++i) {
+    auto& job = traces[i].job;
+    for (uint32_t c = 0; c < job.connections.size(); ++c) {
+      connections[make_pair(job.connections[c].local,
+                            job.connections[c].peer)] = make_pair(i, c);
+    }
+    for (auto& m : job.messages) {
+      if (m.sent) {
+        sends[make_pair(i, m.connection)].push_back(&m);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < traces.size(); ++i) {
+    auto& job = traces[i].job;
+    for (auto& m : job.messages) {
+      if (m.sent) {
+        continue;
+      }
+      auto& connection = job.connections[m.connection];
+      auto sender =
+          connections.find(make_pair(connection.peer, connection.local));
+      if (sender == connections.end()) {
+        continue;
+      }
+      auto& sent = sends[sender->second];
+      // The last send starting at or before the receive's first byte.
+      auto it = upper_bound(sent.begin(), sent.end(), m.offset,
+                            [](uint64_t offset,
+                               const TraceStream::JobMessage* s) {
+        return offset < s->offset;
+      });
+      if (it == sent.begin() ||
+          m.offset >= (*(it - 1))->offset + (*(it - 1))->length) {
+        continue;
+      }
+      fprintf(out, "%s:%u -> %s:%u %" PRIu64 "\n",
+              rank_name(traces[sender->second.first].job.rank).c_str(),
+              (*(it - 1))->time, rank_name(job.rank).c_str(), m.time,
+              m.length);
+    }
+  }
+}
+
+static int job(const vector<string>& dirs, const JobFlags& flags, FILE* out) {
+  vector<JobTrace> traces;
+  for (auto& dir : dirs) {
+    JobTrace t;
+    TraceReader trace(dir);
+    t.dir = trace.dir();
+    if (!trace.read_job(&t.job)) {
+      fprintf(stderr, "Trace %s wasn't recorded with --job\n", t.dir.c_str());
+      return 1;
+    }
+    if (!traces.empty() && t.job.id != traces[0].job.id) {
+      fprintf(stderr, "Trace %s is of job %s, not %s\n", t.dir.c_str(),
+              t.job.id.c_str(), traces[0].job.id.c_str());
+      return 1;
+    }
+    traces.push_back(t);
+  }
+  stable_sort(traces.begin(), traces.end(),
+              [](const JobTrace& a, const JobTrace& b) {
+    return a.job.rank < b.job.rank;
+  });
+
+  fprintf(out, "job %s\n", traces[0].job.id.c_str());
+  for (auto& t : traces) {
+    fprintf(out, "rank %s %s %s\n", rank_name(t.job.rank).c_str(),
+            t.job.host.c_str(), t.dir.c_str());
+  }
+  if (flags.messages) {
+    print_messages(traces, out);
+  }
+  return 0;
+}
+
+int JobCommand::run(std::vector<std::string>& args) {
+  JobFlags flags;
+
+  while (parse_job_arg(args, flags)) {
+  }
+
+  if (args.empty() || !verify_not_option(args)) {
+    print_help(stderr);
+    return 2;
+  }
+
+  return job(args, flags, stdout);
+}
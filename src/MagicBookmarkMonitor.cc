@@ -0,0 +1,20 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "MagicBookmarkMonitor.h"
+
+#include "RecordSession.h"
+#include "task.h"
+
+using namespace std;
+
+void MagicBookmarkMonitor::did_write(Task* t, const vector<Range>& ranges) {
+  if (!t->session().is_recording()) {
+    return;
+  }
+  string name;
+  for (auto& r : ranges) {
+    auto bytes = t->read_mem(r.data.cast<char>(), r.length);
+    name.append(bytes.begin(), bytes.end());
+  }
+  t->record_session().trace_writer().add_bookmark(name);
+}
@@ -0,0 +1,22 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_MAGIC_BOOKMARK_MONITOR_H_
+#define RR_MAGIC_BOOKMARK_MONITOR_H_
+
+#include "FileMonitor.h"
+
+/**
+ * A FileMonitor to track writes to RR_MAGIC_BOOKMARK_FD. During recording,
+ * each write's data is saved in the trace as a bookmark for the current
+ * event, which `rr replay --goto-bookmark` can seek to.
+ */
+class MagicBookmarkMonitor : public FileMonitor {
+public:
+  MagicBookmarkMonitor() {}
+
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_WRITES; }
+
+  virtual void did_write(Task* t, const std::vector<Range>& ranges);
+};
+
+#endif /* RR_MAGIC_BOOKMARK_MONITOR_H_ */
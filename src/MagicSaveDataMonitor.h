@@ -14,6 +14,8 @@ class MagicSaveDataMonitor : public FileMonitor {
 public:
   MagicSaveDataMonitor() {}
 
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_WRITES; }
+
   /**
    * During recording, record the written data.
    * During replay, check that the written data matches what was recorded.
@@ -82,17 +82,28 @@ template <typename Arch> static void setup_preload_library_path(Task* t) {
 void Monkeypatcher::init_dynamic_syscall_patching(
     Task* t, int syscall_patch_hook_count,
     remote_ptr<struct syscall_patch_hook> syscall_patch_hooks,
-    remote_ptr<void> stub_buffer, remote_ptr<void> stub_buffer_end) {
+    remote_ptr<void> syscall_hook_trampoline, remote_ptr<void> stub_buffer,
+    remote_ptr<void> stub_buffer_end) {
   if (syscall_patch_hook_count) {
     syscall_hooks = t->read_mem(syscall_patch_hooks, syscall_patch_hook_count);
   }
+  this->syscall_hook_trampoline = syscall_hook_trampoline;
   this->stub_buffer = stub_buffer;
   this->stub_buffer_end = stub_buffer_end;
 }
 
 template <typename Arch>
 static bool patch_syscall_with_hook_arch(Monkeypatcher& patcher, Task* t,
-                                         const syscall_patch_hook& hook);
+                                         const syscall_patch_hook& hook,
+                                         const uint8_t* relocated);
+
+/**
+ * Every syscall stub ends with this many NOPs followed by a 5-byte jump
+ * back to the patch site. Instructions relocated from the patch site are
+ * copied over the NOPs.
+ */
+static const size_t STUB_RELOCATION_AREA_SIZE = 16;
+static const size_t STUB_RETURN_JUMP_SIZE = 5;
 
 remote_ptr<uint8_t> Monkeypatcher::allocate_stub(Task* t, size_t bytes) {
   if (!stub_buffer) {
@@ -141,10 +152,15 @@ void substitute<X64SyscallStubMonkeypatch>(uint8_t* buffer,
  * from the callsite to the stub. The stub decrements the stack pointer,
  * calls the appropriate syscall hook function, reincrements the stack pointer,
  * and jumps back to immediately after the patched callsite.
+ *
+ * If |relocated| is non-null, it holds the hook.next_instruction_length
+ * bytes following the syscall, which the stub executes after calling a
+ * hook that doesn't reproduce them itself.
  */
 template <typename JumpPatch, typename StubPatch, uint32_t trampoline_call_end>
 static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
+                                           const syscall_patch_hook& hook,
+                                           const uint8_t* relocated) {
   uint8_t stub_patch[StubPatch::size];
   auto stub_patch_start = patcher.allocate_stub(t, sizeof(stub_patch));
   if (!stub_patch_start) {
@@ -195,6 +211,15 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
   // Now write out the stub
   substitute<StubPatch>(stub_patch, jump_patch_end.as_int(),
                         trampoline_call_offset32, return_jump_offset32);
+  if (relocated) {
+    static_assert(sizeof(stub_patch) >=
+                      STUB_RELOCATION_AREA_SIZE + STUB_RETURN_JUMP_SIZE,
+                  "Stub too small");
+    assert(hook.next_instruction_length <= STUB_RELOCATION_AREA_SIZE);
+    memcpy(stub_patch + sizeof(stub_patch) - STUB_RETURN_JUMP_SIZE -
+               STUB_RELOCATION_AREA_SIZE,
+           relocated, hook.next_instruction_length);
+  }
   t->write_bytes(stub_patch_start, stub_patch);
 
   return true;
@@ -202,24 +227,53 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
 
 template <>
 bool patch_syscall_with_hook_arch<X86Arch>(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish<X86SysenterVsyscallMonkeypatch,
-                                        X86SyscallStubMonkeypatch, 30>(patcher,
-                                                                       t, hook);
+                                           const syscall_patch_hook& hook,
+                                           const uint8_t* relocated) {
+  return patch_syscall_with_hook_x86ish<
+      X86SysenterVsyscallMonkeypatch, X86SyscallStubMonkeypatch, 30>(
+      patcher, t, hook, relocated);
 }
 
 template <>
 bool patch_syscall_with_hook_arch<X64Arch>(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish<
-      X64JumpMonkeypatch, X64SyscallStubMonkeypatch, 43>(patcher, t, hook);
+                                           const syscall_patch_hook& hook,
+                                           const uint8_t* relocated) {
+  return patch_syscall_with_hook_x86ish<X64JumpMonkeypatch,
+                                        X64SyscallStubMonkeypatch, 43>(
+      patcher, t, hook, relocated);
 }
 
 static bool patch_syscall_with_hook(Monkeypatcher& patcher, Task* t,
-                                    const syscall_patch_hook& hook) {
-  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook);
+                                    const syscall_patch_hook& hook,
+                                    const uint8_t* relocated = nullptr) {
+  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook,
+                   relocated);
 }
 
+/**
+ * Instruction sequences that libc wrappers put straight after a syscall,
+ * which we can copy into a stub to run after the generic syscall hook. The
+ * patch overwrites the start of the sequence, which is only safe if
+ * nothing jumps into the overwritten bytes. We can't tell that by
+ * decoding, so we only accept these sequences: they consume the syscall's
+ * result in straight-line wrapper code that is only entered through the
+ * syscall. They're position-independent and contain no control flow.
+ */
+struct RelocatableSequence {
+  SupportedArch arch;
+  uint8_t length;
+  uint8_t bytes[STUB_RELOCATION_AREA_SIZE];
+};
+static const RelocatableSequence relocatable_sequences[] = {
+  // mov %eax,%edx; neg %edx (glibc lowlevellock error paths)
+  { x86, 4, { 0x89, 0xc2, 0xf7, 0xda } },
+  { x86_64, 4, { 0x89, 0xc2, 0xf7, 0xda } },
+  // mov %eax,%ecx; xor %edx,%edx
+  { x86_64, 4, { 0x89, 0xc1, 0x31, 0xd2 } },
+  // mov $1,%edx (glibc futex wake wrappers)
+  { x86_64, 5, { 0xba, 0x01, 0x00, 0x00, 0x00 } },
+};
+
 // TODO de-dup
 static void advance_syscall(Task* t) {
   do {
@@ -238,20 +292,27 @@ static void operator<<(ostream& stream, const vector<uint8_t>& bytes) {
   }
 }
 
-bool Monkeypatcher::try_patch_syscall(Task* t) {
+bool Monkeypatcher::try_patch_syscall(Task* t, const char** failure_reason) {
+  const char* dummy_reason;
+  if (!failure_reason) {
+    failure_reason = &dummy_reason;
+  }
   if (syscall_hooks.empty()) {
     // Syscall hooks not set up yet. Don't spew warnings, and don't
     // fill tried_to_patch_syscall_addresses with addresses that we might be
     // able to patch later.
+    *failure_reason = "syscall buffering not initialized";
     return false;
   }
   if (t->is_in_traced_syscall()) {
     // Never try to patch the traced-syscall in our preload library!
+    *failure_reason = "not buffered by the preload library";
     return false;
   }
 
   Registers r = t->regs();
   if (tried_to_patch_syscall_addresses.count(r.ip())) {
+    *failure_reason = "unpatchable instructions after syscall";
     return false;
   }
   // We could examine the current syscall number and if it's not one that
@@ -296,9 +357,52 @@ bool Monkeypatcher::try_patch_syscall(Task* t) {
       return true;
     }
   }
+
+  // No hook matches, so if the bytes the patch overwrites start a sequence
+  // we know we can relocate, move it into the stub after a call to the
+  // generic hook.
+  uint8_t code[STUB_RELOCATION_AREA_SIZE];
+  ssize_t code_len = t->read_bytes_fallible(r.ip().to_data_ptr<void>(),
+                                            sizeof(code), code);
+  // The patch site's 5-byte jump overwrites the syscall and the start of
+  // whatever follows it.
+  size_t needed = STUB_RETURN_JUMP_SIZE - syscall_instruction_length(t->arch());
+  size_t relocated_len = 0;
+  for (auto& seq : relocatable_sequences) {
+    if (!syscall_hook_trampoline.is_null() && seq.arch == t->arch() &&
+        seq.length >= needed && code_len >= ssize_t(seq.length) &&
+        memcmp(code, seq.bytes, seq.length) == 0) {
+      relocated_len = seq.length;
+      break;
+    }
+  }
+  if (relocated_len >= needed) {
+    syscall_patch_hook hook;
+    memset(&hook, 0, sizeof(hook));
+    hook.next_instruction_length = relocated_len;
+    hook.hook_address = syscall_hook_trampoline.as_int();
+
+    r.set_original_syscallno(syscall_number_for_gettid(t->arch()));
+    t->set_regs(r);
+    advance_syscall(t);
+    r.set_original_syscallno(-1);
+    r.set_syscallno(syscallno);
+    r.set_ip(r.ip() - syscall_instruction_length(t->arch()));
+    t->set_regs(r);
+
+    patch_syscall_with_hook(*this, t, hook, code);
+
+    LOG(debug) << "Patched syscall at " << r.ip() << " syscall "
+               << syscall_name(syscallno, t->arch()) << " tid " << t->tid
+               << " by relocating "
+               << vector<uint8_t>(code, code + relocated_len);
+    return true;
+  }
+
   LOG(debug) << "Failed to patch syscall at " << r.ip() << " syscall "
              << syscall_name(syscallno, t->arch()) << " tid " << t->tid
              << " bytes " << next_instruction;
+  *failure_reason = "unpatchable instructions after syscall";
   return false;
 }
 
@@ -366,6 +470,18 @@ static bool is_kernel_vsyscall(Task* t, remote_ptr<void> addr) {
  * implementation in |t|'s address space.
  */
 static remote_ptr<void> locate_and_verify_kernel_vsyscall(Task* t) {
+  // Every tracee has the same vDSO, so after the first exec we only need
+  // to check that __kernel_vsyscall is still where it was.
+  static size_t cached_vdso_size;
+  static uintptr_t cached_offset;
+  auto vdso = t->vm()->vdso();
+  if (cached_vdso_size == vdso.num_bytes()) {
+    remote_ptr<void> candidate = vdso.start + cached_offset;
+    if (is_kernel_vsyscall(t, candidate)) {
+      return candidate;
+    }
+  }
+
   auto syms = read_vdso_symbols<X86Arch>(t);
 
   remote_ptr<void> kernel_vsyscall = nullptr;
@@ -398,6 +514,8 @@ static remote_ptr<void> locate_and_verify_kernel_vsyscall(Task* t) {
 
       if (is_kernel_vsyscall(t, candidate)) {
         kernel_vsyscall = candidate;
+        cached_vdso_size = vdso.num_bytes();
+        cached_offset = candidate_offset;
       }
     }
   }
@@ -417,6 +535,45 @@ struct named_syscall {
   int syscall_number;
 };
 
+/**
+ * A vDSO function we replace with a real syscall, at |offset| from the
+ * start of the vDSO.
+ */
+struct VdsoSyscallSite {
+  uintptr_t offset;
+  int syscall_number;
+};
+
+/**
+ * The vDSO is the same in every tracee of an architecture, wherever it's
+ * mapped, so its symbols are only parsed on the first exec. |*vdso_size| is
+ * the size of the vDSO the sites were found in, or 0 if that hasn't
+ * happened yet.
+ */
+static bool have_vdso_syscall_sites(Task* t, size_t* vdso_size,
+                                    vector<VdsoSyscallSite>* sites) {
+  size_t size = t->vm()->vdso().num_bytes();
+  if (*vdso_size == size) {
+    return true;
+  }
+  *vdso_size = size;
+  sites->clear();
+  return false;
+}
+
+template <typename Patch>
+static void patch_vdso_syscalls(Task* t,
+                                const vector<VdsoSyscallSite>& sites) {
+  auto vdso_start = t->vm()->vdso().start;
+  for (auto& site : sites) {
+    uint8_t patch[Patch::size];
+    Patch::substitute(patch, site.syscall_number);
+    t->write_bytes(vdso_start.as_int() + site.offset, patch);
+    LOG(debug) << "monkeypatched vdso+" << HEX(site.offset) << " to syscall "
+               << site.syscall_number;
+  }
+}
+
 template <typename Arch> static void patch_after_exec_arch(Task* t);
 
 // Monkeypatch x86-32 vdso syscalls immediately after exec. The vdso syscalls
@@ -427,7 +584,12 @@ template <typename Arch> static void patch_after_exec_arch(Task* t);
 template <> void patch_after_exec_arch<X86Arch>(Task* t) {
   setup_preload_library_path<X86Arch>(t);
 
-  auto vdso_start = t->vm()->vdso().start;
+  static size_t vdso_size;
+  static vector<VdsoSyscallSite> sites;
+  if (have_vdso_syscall_sites(t, &vdso_size, &sites)) {
+    patch_vdso_syscalls<X86VsyscallMonkeypatch>(t, sites);
+    return;
+  }
 
   auto syms = read_vdso_symbols<X86Arch>(t);
 
@@ -445,18 +607,14 @@ template <> void patch_after_exec_arch<X86Arch>(Task* t) {
         static const uintptr_t vdso_max_size = 0xffffLL;
         uintptr_t sym_address = uintptr_t(sym.st_value);
         assert((sym_address & ~vdso_max_size) == 0);
-        uintptr_t absolute_address = vdso_start.as_int() + sym_address;
-
-        uint8_t patch[X86VsyscallMonkeypatch::size];
-        uint32_t syscall_number = syscalls_to_monkeypatch[j].syscall_number;
-        X86VsyscallMonkeypatch::substitute(patch, syscall_number);
-
-        t->write_bytes(absolute_address, patch);
-        LOG(debug) << "monkeypatched " << symname << " to syscall "
-                   << syscalls_to_monkeypatch[j].syscall_number;
+        VdsoSyscallSite site = { sym_address,
+                                 syscalls_to_monkeypatch[j].syscall_number };
+        sites.push_back(site);
+        LOG(debug) << "found " << symname << " at vdso+" << HEX(sym_address);
       }
     }
   }
+  patch_vdso_syscalls<X86VsyscallMonkeypatch>(t, sites);
 }
 
 // Monkeypatch x86 vsyscall hook only after the preload library
@@ -501,7 +659,8 @@ void patch_at_preload_init_arch<X86Arch>(Task* t, Monkeypatcher& patcher) {
 
   patcher.init_dynamic_syscall_patching(
       t, params.syscall_patch_hook_count, params.syscall_patch_hooks,
-      params.syscall_hook_stub_buffer, params.syscall_hook_stub_buffer_end);
+      params.syscall_hook_trampoline, params.syscall_hook_stub_buffer,
+      params.syscall_hook_stub_buffer_end);
 }
 
 // Monkeypatch x86-64 vdso syscalls immediately after exec. The vdso syscalls
@@ -512,7 +671,12 @@ void patch_at_preload_init_arch<X86Arch>(Task* t, Monkeypatcher& patcher) {
 template <> void patch_after_exec_arch<X64Arch>(Task* t) {
   setup_preload_library_path<X64Arch>(t);
 
-  auto vdso_start = t->vm()->vdso().start;
+  static size_t vdso_size;
+  static vector<VdsoSyscallSite> sites;
+  if (have_vdso_syscall_sites(t, &vdso_size, &sites)) {
+    patch_vdso_syscalls<X64VsyscallMonkeypatch>(t, sites);
+    return;
+  }
 
   auto syms = read_vdso_symbols<X64Arch>(t);
 
@@ -541,18 +705,14 @@ template <> void patch_after_exec_arch<X64Arch>(Task* t) {
         assert((sym_address & ~vdso_max_size) == vdso_static_base ||
                (sym_address & ~vdso_max_size) == 0);
         uintptr_t sym_offset = sym_address & vdso_max_size;
-        uintptr_t absolute_address = vdso_start.as_int() + sym_offset;
-
-        uint8_t patch[X64VsyscallMonkeypatch::size];
-        uint32_t syscall_number = syscalls_to_monkeypatch[j].syscall_number;
-        X64VsyscallMonkeypatch::substitute(patch, syscall_number);
-
-        t->write_bytes(absolute_address, patch);
-        LOG(debug) << "monkeypatched " << symname << " to syscall "
-                   << syscalls_to_monkeypatch[j].syscall_number;
+        VdsoSyscallSite site = { sym_offset,
+                                 syscalls_to_monkeypatch[j].syscall_number };
+        sites.push_back(site);
+        LOG(debug) << "found " << symname << " at vdso+" << HEX(sym_offset);
       }
     }
   }
+  patch_vdso_syscalls<X64VsyscallMonkeypatch>(t, sites);
 }
 
 template <>
@@ -565,7 +725,8 @@ void patch_at_preload_init_arch<X64Arch>(Task* t, Monkeypatcher& patcher) {
 
   patcher.init_dynamic_syscall_patching(
       t, params.syscall_patch_hook_count, params.syscall_patch_hooks,
-      params.syscall_hook_stub_buffer, params.syscall_hook_stub_buffer_end);
+      params.syscall_hook_trampoline, params.syscall_hook_stub_buffer,
+      params.syscall_hook_stub_buffer_end);
 }
 
 void Monkeypatcher::patch_after_exec(Task* t) {
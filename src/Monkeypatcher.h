@@ -27,12 +27,17 @@ class Task;
  *
  * 3) Patch syscall instructions whose following instructions match a known
  * pattern to call the syscall hook.
+ *
+ * 4) Patch other syscall instructions whose following instructions are a
+ * known sequence that can be relocated into the patch stub, after the call
+ * to the generic syscall hook.
  */
 class Monkeypatcher {
 public:
   Monkeypatcher() : stub_buffer_allocated(0) {}
   Monkeypatcher(const Monkeypatcher& o)
       : syscall_hooks(o.syscall_hooks),
+        syscall_hook_trampoline(o.syscall_hook_trampoline),
         tried_to_patch_syscall_addresses(o.tried_to_patch_syscall_addresses),
         stub_buffer(o.stub_buffer),
         stub_buffer_end(o.stub_buffer_end),
@@ -57,13 +62,16 @@ public:
    * as normal. If this returns true, patching succeeded and the syscall
    * was aborted; ip() has been reset to the start of the patched syscall,
    * and execution should resume normally to execute the patched code.
+   * When patching fails and |failure_reason| is non-null, it's set to a
+   * short description of why.
    */
-  bool try_patch_syscall(Task* t);
+  bool try_patch_syscall(Task* t, const char** failure_reason = nullptr);
 
   void init_dynamic_syscall_patching(
       Task* t, int syscall_patch_hook_count,
       remote_ptr<syscall_patch_hook> syscall_patch_hooks,
-      remote_ptr<void> stub_buffer, remote_ptr<void> stub_buffer_end);
+      remote_ptr<void> syscall_hook_trampoline, remote_ptr<void> stub_buffer,
+      remote_ptr<void> stub_buffer_end);
 
   /**
    * Try to allocate a stub from the sycall patching stub buffer. Returns null
@@ -78,6 +86,11 @@ private:
    * after a syscall instruction.
    */
   std::vector<syscall_patch_hook> syscall_hooks;
+  /**
+   * The preload library's generic syscall hook, which expects the stub to
+   * execute whatever followed the syscall instruction itself.
+   */
+  remote_ptr<void> syscall_hook_trampoline;
   /**
    * The addresses of the instructions following syscalls that we've tried
    * (or are currently trying) to patch.
@@ -0,0 +1,40 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "Command.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class PackCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  PackCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static PackCommand singleton;
+};
+
+PackCommand PackCommand::singleton(
+    "pack",
+    " rr pack [<trace_dir>]\n"
+    "  Copy every file mapped by the recorded processes into the trace\n"
+    "  directory, so the trace can be replayed after those files change\n"
+    "  or on another machine. Identical files are only stored once, and\n"
+    "  are shared with other packed traces in the same directory.\n");
+
+int PackCommand::run(std::vector<std::string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir) || !args.empty()) {
+    print_help(stderr);
+    return 1;
+  }
+
+  TraceReader trace(trace_dir);
+  trace.pack_mapped_files();
+  return 0;
+}
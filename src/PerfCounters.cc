@@ -6,6 +6,7 @@
 #include <err.h>
 #include <fcntl.h>
 #include <linux/perf_event.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -173,25 +174,72 @@ static void init_attributes() {
   hw_interrupts_attr.exclude_hv = 1;
   init_perf_event_attr(&page_faults_attr, PERF_TYPE_SOFTWARE,
                        PERF_COUNT_SW_PAGE_FAULTS);
+  if (PerfCounters::extra_perf_counters_enabled()) {
+    // Read the whole group through the ticks counter; see read_group().
+    ticks_attr.read_format = PERF_FORMAT_GROUP;
+  }
+  note_startup_phase("pmu detection");
 }
 
 PerfCounters::PerfCounters(pid_t tid) : tid(tid), started(false) {
   init_attributes();
 }
 
+/**
+ * Our attributes don't set |disabled|, so counters count from the moment
+ * they're opened and don't need a PERF_EVENT_IOC_ENABLE.
+ */
 static ScopedFd start_counter(pid_t tid, int group_fd,
                               struct perf_event_attr* attr) {
+  assert(!attr->disabled);
   int fd = syscall(__NR_perf_event_open, attr, tid, -1, group_fd, 0);
   if (0 > fd) {
     FATAL() << "Failed to initialize counter";
   }
-  if (ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
-    FATAL() << "Failed to start counter";
-  }
   return fd;
 }
 
+/**
+ * Some kernels only apply a period set with PERF_EVENT_IOC_PERIOD after the
+ * counter next overflows. Detect that by setting a tiny period on a fresh
+ * counter for ourselves: a working kernel has overflowed it by the time
+ * poll() returns.
+ */
+static bool has_ioc_period_bug() {
+  static bool checked = false;
+  static bool has_bug = true;
+  if (checked) {
+    return has_bug;
+  }
+  checked = true;
+
+  struct perf_event_attr attr = ticks_attr;
+  attr.sample_period = 0xffffffff;
+  ScopedFd fd = start_counter(0, -1, &attr);
+  uint64_t period = 1;
+  if (ioctl(fd, PERF_EVENT_IOC_PERIOD, &period)) {
+    LOG(debug) << "PERF_EVENT_IOC_PERIOD failed; reopening counters instead";
+    return has_bug;
+  }
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  poll(&pfd, 1, 0);
+  has_bug = pfd.revents == 0;
+  LOG(debug) << "PERF_EVENT_IOC_PERIOD " << (has_bug ? "is" : "isn't")
+             << " buggy";
+  return has_bug;
+}
+
 void PerfCounters::reset(Ticks ticks_period) {
+  if (started && !has_ioc_period_bug()) {
+    // Reprogramming the counters we already have open saves several
+    // perf_event_open calls and fcntls every time the task is resumed.
+    uint64_t period = ticks_period;
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) ||
+        ioctl(fd_ticks, PERF_EVENT_IOC_PERIOD, &period)) {
+      FATAL() << "Failed to reprogram ticks counter";
+    }
+    return;
+  }
   stop();
 
   struct perf_event_attr attr = ticks_attr;
@@ -240,8 +288,36 @@ static int64_t read_counter(ScopedFd& fd) {
   return val;
 }
 
+/**
+ * With extra counters enabled, one read() of the ticks counter returns every
+ * counter in its group, in the order they were opened by reset().
+ */
+enum {
+  GROUP_TICKS,
+  GROUP_HW_INTERRUPTS,
+  GROUP_INSTRUCTIONS_RETIRED,
+  GROUP_PAGE_FAULTS,
+  GROUP_SIZE
+};
+static void read_group(ScopedFd& fd, int64_t values[GROUP_SIZE]) {
+  uint64_t buf[1 + GROUP_SIZE];
+  ssize_t nread = read(fd, buf, sizeof(buf));
+  assert(nread == sizeof(buf) && buf[0] == GROUP_SIZE);
+  for (int i = 0; i < GROUP_SIZE; ++i) {
+    values[i] = buf[1 + i];
+  }
+}
+
 Ticks PerfCounters::read_ticks() {
-  return started ? read_counter(fd_ticks) : 0;
+  if (!started) {
+    return 0;
+  }
+  if (extra_perf_counters_enabled()) {
+    int64_t values[GROUP_SIZE];
+    read_group(fd_ticks, values);
+    return values[GROUP_TICKS];
+  }
+  return read_counter(fd_ticks);
 }
 
 PerfCounters::Extra PerfCounters::read_extra() {
@@ -249,9 +325,11 @@ PerfCounters::Extra PerfCounters::read_extra() {
 
   Extra extra;
   if (started) {
-    extra.page_faults = read_counter(fd_page_faults);
-    extra.hw_interrupts = read_counter(fd_hw_interrupts);
-    extra.instructions_retired = read_counter(fd_instructions_retired);
+    int64_t values[GROUP_SIZE];
+    read_group(fd_ticks, values);
+    extra.page_faults = values[GROUP_PAGE_FAULTS];
+    extra.hw_interrupts = values[GROUP_HW_INTERRUPTS];
+    extra.instructions_retired = values[GROUP_INSTRUCTIONS_RETIRED];
   } else {
     memset(&extra, 0, sizeof(extra));
   }
@@ -37,6 +37,10 @@ public:
   // Change this to 'true' to enable perf counters that may be interesting
   // for experimentation, but aren't necessary for core functionality.
   static bool extra_perf_counters_enabled() { return false; }
+  /**
+   * Number of perf event fds rr holds open for each running task.
+   */
+  static int fds_per_task() { return extra_perf_counters_enabled() ? 4 : 1; }
 
   /**
    * Reset all counter values to 0 and program the counters to send
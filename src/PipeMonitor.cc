@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "PipeMonitor.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "RecordSession.h"
+#include "ReplaySession.h"
+#include "Session.h"
+#include "task.h"
+
+using namespace std;
+
+// Unread data kept for all of a session's pipes together. In steady state
+// this is what's sitting in the kernel's pipe buffers (64KB each by
+// default). If it gets bigger, some reader isn't keeping up with what
+// we've seen written, so we start over.
+static const size_t MAX_PIPE_BUFFERS_SIZE = 4 * 1024 * 1024;
+
+void PipeBuffers::append(uint64_t id, const uint8_t* data, size_t length) {
+  if (total_size + length > MAX_PIPE_BUFFERS_SIZE) {
+    buffers.clear();
+    total_size = 0;
+    if (length > MAX_PIPE_BUFFERS_SIZE) {
+      return;
+    }
+  }
+  auto& buf = buffers[id];
+  buf.insert(buf.end(), data, data + length);
+  total_size += length;
+}
+
+bool PipeBuffers::consume(uint64_t id, const uint8_t* data, size_t length) {
+  auto it = buffers.find(id);
+  if (it == buffers.end()) {
+    return false;
+  }
+  auto& buf = it->second;
+  if (buf.size() < length || memcmp(buf.data(), data, length)) {
+    drop(id);
+    return false;
+  }
+  buf.erase(buf.begin(), buf.begin() + length);
+  total_size -= length;
+  if (buf.empty()) {
+    buffers.erase(it);
+  }
+  return true;
+}
+
+bool PipeBuffers::take(uint64_t id, size_t length, vector<uint8_t>* out) {
+  auto it = buffers.find(id);
+  if (it == buffers.end() || it->second.size() < length) {
+    return false;
+  }
+  auto& buf = it->second;
+  out->assign(buf.begin(), buf.begin() + length);
+  buf.erase(buf.begin(), buf.begin() + length);
+  total_size -= length;
+  if (buf.empty()) {
+    buffers.erase(it);
+  }
+  return true;
+}
+
+void PipeBuffers::drop(uint64_t id) {
+  auto it = buffers.find(id);
+  if (it != buffers.end()) {
+    total_size -= it->second.size();
+    buffers.erase(it);
+  }
+}
+
+static bool elides_pipe_data(Session& session) {
+  if (session.is_recording()) {
+    return session.as_record()->elide_pipe_data();
+  }
+  if (session.is_replaying()) {
+    return session.as_replay()->trace_reader().elides_pipe_data();
+  }
+  return false;
+}
+
+// IDs only have to be unique within this rr process; recording and replay
+// don't need to agree on them.
+static uint64_t next_pipe_id = 1;
+
+/* static */ void PipeMonitor::did_create_pipe(Task* t, remote_ptr<int> fds) {
+  if (!elides_pipe_data(t->session())) {
+    return;
+  }
+  auto fd = t->read_mem(fds, 2);
+  auto monitor = make_shared<PipeMonitor>(next_pipe_id, next_pipe_id);
+  ++next_pipe_id;
+  t->fd_table()->add_monitor(fd[0], monitor);
+  t->fd_table()->add_monitor(fd[1], monitor);
+}
+
+/* static */ void PipeMonitor::did_create_socketpair(Task* t, int domain,
+                                                    int type,
+                                                    remote_ptr<int> fds) {
+  if (domain != AF_UNIX ||
+      (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_STREAM ||
+      !elides_pipe_data(t->session())) {
+    return;
+  }
+  auto fd = t->read_mem(fds, 2);
+  // Each direction is a separate stream.
+  uint64_t id = next_pipe_id++;
+  uint64_t other_id = next_pipe_id++;
+  t->fd_table()->add_monitor(fd[0], make_shared<PipeMonitor>(id, other_id));
+  t->fd_table()->add_monitor(fd[1], make_shared<PipeMonitor>(other_id, id));
+}
+
+void PipeMonitor::did_write(Task* t, const std::vector<Range>& ranges) {
+  if (!t->session().is_recording() && !t->session().is_replaying()) {
+    return;
+  }
+  auto& buffers = t->session().pipe_buffers();
+  for (auto& r : ranges) {
+    bool ok = true;
+    auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length, &ok);
+    if (!ok) {
+      buffers.drop(write_id);
+      return;
+    }
+    buffers.append(write_id, bytes.data(), bytes.size());
+  }
+}
+
+bool PipeMonitor::did_read(Task* t, const uint8_t* data, size_t length) {
+  auto& buffers = t->session().pipe_buffers();
+  if (!data) {
+    buffers.drop(read_id);
+    return false;
+  }
+  return buffers.consume(read_id, data, length);
+}
+
+void PipeMonitor::did_replay_read(Task* t, bool recorded, remote_ptr<void> buf,
+                                  size_t length) {
+  auto& buffers = t->session().pipe_buffers();
+  if (recorded) {
+    buffers.drop(read_id);
+    return;
+  }
+  vector<uint8_t> data;
+  bool ok = buffers.take(read_id, length, &data);
+  ASSERT(t, ok) << "Read of " << length << " bytes was elided from the "
+                << "trace, but the pipe's buffer is shorter";
+  t->write_bytes_helper(buf, data.size(), data.data());
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PIPE_MONITOR_H_
+#define RR_PIPE_MONITOR_H_
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "FileMonitor.h"
+
+/**
+ * The bytes written to each monitored pipe that haven't been read yet, by
+ * pipe ID. Each session has its own, so that clones of a replay session
+ * carry on from where their original was.
+ */
+class PipeBuffers {
+public:
+  PipeBuffers() : total_size(0) {}
+
+  /**
+   * Add |length| bytes at |data| to the end of pipe |id|'s buffer.
+   */
+  void append(uint64_t id, const uint8_t* data, size_t length);
+  /**
+   * If pipe |id|'s buffer starts with the |length| bytes at |data|, remove
+   * them and return true. Otherwise empty the buffer and return false.
+   */
+  bool consume(uint64_t id, const uint8_t* data, size_t length);
+  /**
+   * Move the first |length| bytes of pipe |id|'s buffer to |out|. Returns
+   * false, leaving the buffer alone, if it doesn't have that many.
+   */
+  bool take(uint64_t id, size_t length, std::vector<uint8_t>* out);
+  void drop(uint64_t id);
+
+private:
+  // Empty buffers are erased, so this only holds pipes with unread data.
+  std::unordered_map<uint64_t, std::vector<uint8_t> > buffers;
+  size_t total_size;
+};
+
+/**
+ * A FileMonitor for the ends of pipes and stream socketpairs created by
+ * tracees, when recording with --elide-pipe-data.
+ * Replay reproduces every write a tracee makes, so a read that returns
+ * exactly the oldest unread bytes tracees wrote to the pipe needn't record
+ * them: replay copies them from its own PipeBuffers instead. Anything else
+ * a read returns (data from writers rr can't see, or a read that completed
+ * before the write's syscall exit was processed) is recorded as usual and
+ * empties the buffer, which resynchronizes with later writes.
+ */
+class PipeMonitor : public FileMonitor {
+public:
+  /**
+   * Reads consume pipe |read_id| and writes feed pipe |write_id|. Both
+   * ends of a pipe share one monitor with both IDs the same; the ends of a
+   * socketpair have them crossed.
+   */
+  PipeMonitor(uint64_t read_id, uint64_t write_id)
+      : read_id(read_id), write_id(write_id) {}
+
+  /**
+   * Start monitoring the fds a successful pipe() or pipe2() stored at
+   * |fds|, if the session elides pipe data.
+   */
+  static void did_create_pipe(Task* t, remote_ptr<int> fds);
+  /**
+   * Likewise for socketpair(|domain|, |type|, ...), if it made a pair of
+   * connected Unix stream sockets.
+   */
+  static void did_create_socketpair(Task* t, int domain, int type,
+                                    remote_ptr<int> fds);
+
+  /**
+   * Reads and writes must be traced so that we see every one.
+   */
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_ALL; }
+
+  virtual void did_write(Task* t, const std::vector<Range>& ranges);
+  virtual bool did_read(Task* t, const uint8_t* data, size_t length);
+  virtual void did_replay_read(Task* t, bool recorded, remote_ptr<void> buf,
+                               size_t length);
+
+private:
+  uint64_t read_id;
+  uint64_t write_id;
+};
+
+#endif /* RR_PIPE_MONITOR_H_ */
@@ -0,0 +1,145 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "Command.h"
+#include "main.h"
+#include "ScopedFd.h"
+#include "TraceSink.h"
+
+using namespace std;
+
+class ReceiveCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  ReceiveCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ReceiveCommand singleton;
+};
+
+ReceiveCommand ReceiveCommand::singleton(
+    "receive",
+    " rr receive <trace_dir>\n"
+    "  Read a trace streamed by `rr record --stream-to' from standard\n"
+    "  input and save it in the new directory <trace_dir>.\n");
+
+static bool read_all(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = read(fd, data, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    data = static_cast<uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+/**
+ * Names in the stream must refer to files directly in the trace directory.
+ */
+static bool valid_file_name(const string& name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == string::npos;
+}
+
+static bool check_manifest(const string& manifest,
+                           const map<string, uint64_t>& sizes) {
+  istringstream in(manifest);
+  string name;
+  uint64_t size;
+  size_t count = 0;
+  bool ok = true;
+  while (in >> name >> size) {
+    ++count;
+    auto it = sizes.find(name);
+    uint64_t received = it == sizes.end() ? 0 : it->second;
+    if (received != size) {
+      fprintf(stderr, "Received %" PRIu64 " bytes of %s, expected %" PRIu64
+                      "\n",
+              received, name.c_str(), size);
+      ok = false;
+    }
+  }
+  if (count != sizes.size()) {
+    fprintf(stderr, "Received files missing from the manifest\n");
+    ok = false;
+  }
+  return ok;
+}
+
+static int receive(const string& trace_dir) {
+  if (mkdir(trace_dir.c_str(), S_IRWXU | S_IRWXG) < 0) {
+    fprintf(stderr, "Can't create trace directory %s: %s\n",
+            trace_dir.c_str(), strerror(errno));
+    return 1;
+  }
+
+  map<string, shared_ptr<ScopedFd> > files;
+  map<string, uint64_t> sizes;
+  vector<uint8_t> data;
+  while (true) {
+    TraceSink::RecordHeader header;
+    if (!read_all(STDIN_FILENO, &header, sizeof(header))) {
+      fprintf(stderr, "Stream ended before the trace was complete\n");
+      return 1;
+    }
+    string name(header.name_length, '\0');
+    data.resize(header.data_length);
+    if (!read_all(STDIN_FILENO, &name[0], name.size()) ||
+        !read_all(STDIN_FILENO, data.data(), data.size())) {
+      fprintf(stderr, "Stream ended in the middle of a record\n");
+      return 1;
+    }
+
+    if (header.type == TraceSink::MANIFEST) {
+      return check_manifest(string(data.begin(), data.end()), sizes) ? 0 : 1;
+    }
+    if (header.type != TraceSink::APPEND || !valid_file_name(name)) {
+      fprintf(stderr, "Invalid trace stream\n");
+      return 1;
+    }
+
+    auto& file = files[name];
+    if (!file) {
+      string path = trace_dir + "/" + name;
+      file = make_shared<ScopedFd>(
+          path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      if (!file->is_open()) {
+        fprintf(stderr, "Can't create %s: %s\n", path.c_str(),
+                strerror(errno));
+        return 1;
+      }
+    }
+    if (write(*file, data.data(), data.size()) != (ssize_t)data.size()) {
+      fprintf(stderr, "Can't write %s/%s: %s\n", trace_dir.c_str(),
+              name.c_str(), strerror(errno));
+      return 1;
+    }
+    sizes[name] += data.size();
+  }
+}
+
+int ReceiveCommand::run(std::vector<std::string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  if (!verify_not_option(args) || args.size() != 1) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return receive(args[0]);
+}
@@ -3,10 +3,12 @@
 #include "RecordCommand.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <sysexits.h>
 
 #include "preload/preload_interface.h"
 
+#include "CompressionCodec.h"
 #include "Flags.h"
 #include "kernel_metadata.h"
 #include "log.h"
@@ -19,26 +21,137 @@ using namespace std;
 RecordCommand RecordCommand::singleton(
     "record",
     " rr record [OPTION]... <exe> [exe-args]...\n"
+    "  -a, --adaptive-compression\n"
+    "                             store trace blocks uncompressed while\n"
+    "                             compression is slowing down tracees\n"
     "  -b, --force-syscall-buffer force the syscall buffer preload library\n"
     "                             to be used, even if that's probably a bad\n"
     "                             idea\n"
     "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
     "                             retired conditional branches) to allow a \n"
     "                             task to run before interrupting it\n"
+    "                             (compute-bound tasks are allowed up to\n"
+    "                             4x this)\n"
+    "  -d, --dedup-data=<BYTES>   store recorded data blocks of at least\n"
+    "                             BYTES bytes that repeat earlier data as\n"
+    "                             references to the earlier copy\n"
     "  -e, --num-events=<NUM>     maximum number of events (syscall \n"
     "                             enter/exit, signal, CPU interrupt, ...) \n"
     "                             to allow a task before descheduling it\n"
+    "  -f, --copy-mapped-files=<MB>\n"
+    "                             record private mappings of at least MB\n"
+    "                             megabytes whose memory would be copied\n"
+    "                             into the trace by copying their files\n"
+    "                             into the trace directory instead, using\n"
+    "                             reflinks where the filesystem can\n"
+    "  -h, --chaos                randomize scheduling decisions (timeslice\n"
+    "                             lengths, priorities, starving tasks) to\n"
+    "                             make intermittent races easier to\n"
+    "                             reproduce\n"
+    "  -H, --huge-pages           ask for transparent huge pages for trace\n"
+    "                             buffers, and for syscall buffers whose\n"
+    "                             size is a multiple of 2MB (see -k), to\n"
+    "                             reduce TLB misses. Normal pages are used\n"
+    "                             where huge pages aren't available.\n"
     "  -i, --ignore-signal=<SIG>  block <SIG> from being delivered to \n"
     "                             tracees. Probably only useful for unit \n"
     "                             tests.\n"
+    "  -j, --job=<ID>[:<RANK>]    tag the trace as rank RANK of distributed\n"
+    "                             job ID, recorded by one rr per node with\n"
+    "                             the same ID, and note where each TCP\n"
+    "                             connection's data was sent and received\n"
+    "                             so `rr job' can match messages between\n"
+    "                             ranks. RANK defaults to the MPI or Slurm\n"
+    "                             rank in the environment. Sends and\n"
+    "                             receives on TCP sockets bypass the\n"
+    "                             syscall buffer.\n"
+    "  -k, --syscallbuf-size=<KB>\n"
+    "                             give each thread's syscall buffer KB\n"
+    "                             kilobytes (64 to 65536; default 1024).\n"
+    "                             Larger buffers let bigger reads be\n"
+    "                             buffered and reduce buffer flushes.\n"
+    "  -l, --cpu-layout=show|<CPU>[:<CPUS>]\n"
+    "                             `show' prints which CPU tracees are bound\n"
+    "                             to and which CPUs trace compression runs\n"
+    "                             on. Otherwise, bind tracees to CPU and\n"
+    "                             compression to the CPU list CPUS (like\n"
+    "                             4-7,12), or any CPU if CPUS is omitted.\n"
+    "                             By default tracees get a random (isolated\n"
+    "                             if possible) CPU and compression the other\n"
+    "                             cores of its NUMA node.\n"
+    "  -m, --max-trace-memory=<MB>\n"
+    "                             make compression and, if necessary,\n"
+    "                             tracees wait when trace buffers and\n"
+    "                             blocks waiting to be written use more\n"
+    "                             than MB megabytes\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload \n"
     "                             library even if it would otherwise be used\n"
+    "  -o, --elide-pipe-data      don't record data that tracees read from\n"
+    "                             pipes and stream socketpairs they\n"
+    "                             created, when replay can reproduce it from\n"
+    "                             the tracees' writes. Reads and writes on\n"
+    "                             those fds bypass the syscall buffer, so\n"
+    "                             this pays off for large transfers.\n"
+    "  -p, --profile=<FILE>       when recording ends, write a CSV profile\n"
+    "                             of the time rr spent on each task, by\n"
+    "                             reason for the stop, traced syscall and\n"
+    "                             signal, plus scheduler switches and waits\n"
+    "                             for trace compression, to FILE\n"
+    "  -r, --report-traced-syscalls\n"
+    "                             when recording ends, list the syscall\n"
+    "                             instructions that most often had to be\n"
+    "                             traced instead of buffered, and why,\n"
+    "                             the futexes waited on the most, the\n"
+    "                             syscalls copying the most data through\n"
+    "                             scratch memory and the peak memory and\n"
+    "                             fds rr used for tracees' scratch\n"
+    "                             buffers and syscallbufs\n"
+    "  -s, --stream-to=<COMMAND>  also stream the trace, as it's recorded,\n"
+    "                             to the standard input of COMMAND (run\n"
+    "                             with /bin/sh). `rr receive' turns the\n"
+    "                             stream back into a trace directory.\n"
+    "  -t, --stats-interval=<SECS>\n"
+    "                             print rates of events, traced and\n"
+    "                             buffered syscalls and trace data, the\n"
+    "                             compression backlog, the number of\n"
+    "                             tasks and rr's memory per task, and the\n"
+    "                             number of spin-waits detected to stderr\n"
+    "                             about every SECS seconds\n"
     "  -u, --cpu-unbound          allow tracees to run on any virtual CPU.\n"
     "                             Default is to bind to CPU 0.  This option\n"
     "                             can cause replay divergence: use with\n"
     "                             caution.\n"
     "  -v, --env=NAME=VALUE       value to add to the environment of the\n"
-    "                             tracee. There can be any number of these.\n");
+    "                             tracee. There can be any number of these.\n"
+    "  -w, --flush-interval=<MS>  write out the trace about every MS\n"
+    "                             milliseconds, and whenever all tracees\n"
+    "                             block, so that `rr replay' can debug the\n"
+    "                             recording while it's still running\n"
+    "  -x, --scratch-size=<KB>    give each thread a scratch buffer of KB\n"
+    "                             kilobytes (16 to 16384; default 2048 with\n"
+    "                             4KB pages) for syscall outparams. Traced\n"
+    "                             syscalls needing more can't be switched\n"
+    "                             away from while they block.\n"
+    "  -y, --until-failure=<N>    record up to N times, until the tracee\n"
+    "                             exits with a nonzero status or is killed\n"
+    "                             by a signal. Traces of runs that succeed\n"
+    "                             are deleted as soon as they finish. Use\n"
+    "                             with -h to shake out intermittent races.\n"
+    "  -z, --compression=[<SUBSTREAM>:]<CODEC>[:<LEVEL>[:<BLOCK_KB>\n"
+    "                             [:<THREADS>]]]\n"
+    "                             compress the trace (or only SUBSTREAM,\n"
+    "                             one of events, data_header, data, mmaps\n"
+    "                             or tasks) with CODEC, one of zlib (the\n"
+    "                             default), none, or lz4, zstd or brotli\n"
+    "                             when rr was built with support for\n"
+    "                             them. LEVEL, BLOCK_KB and THREADS\n"
+    "                             override the codec level, block size in\n"
+    "                             KB and number of compression threads.\n"
+    "                             Can be repeated.\n"
+    "  -Z, --uncompressed         store the trace uncompressed so replay\n"
+    "                             can map it directly instead of\n"
+    "                             decompressing it. Same as\n"
+    "                             --compression=none.\n");
 
 struct RecordFlags {
   vector<string> extra_env;
@@ -61,14 +174,226 @@ struct RecordFlags {
    * to run on any logical CPU. */
   bool cpu_unbound;
 
+  /* Minimum size of recorded data to deduplicate, or 0 to disable. */
+  size_t dedup_min_size;
+
+  /* Minimum size of mappings to record by copying their file, or 0. */
+  size_t copy_mapped_files_min_size;
+
+  /* How to compress each trace substream. */
+  vector<TraceStream::CompressionPolicy> compression;
+
+  /* Skip compressing blocks while the recorder is falling behind. */
+  bool adaptive_compression;
+
+  /* Command to stream the trace to, if any. */
+  string stream_command;
+
+  /* Memory limit for trace writing, or 0 for none. */
+  size_t max_trace_memory;
+
+  /* Size of each task's syscallbuf. */
+  size_t syscallbuf_size;
+
+  /* Size of each task's scratch buffer, or 0 for the default. */
+  size_t scratch_size;
+
+  /* Print the hottest traced syscall sites at the end of recording. */
+  bool report_traced_syscalls;
+
+  /* Make random scheduling decisions. */
+  bool chaos;
+
+  /* Ask for transparent huge pages for syscallbufs and trace buffers. */
+  bool huge_pages;
+
+  /* Don't record pipe reads that replay can reproduce. */
+  bool elide_pipe_data;
+
+  /* File to write the recording profile to, if any. */
+  string profile_path;
+
+  /* Distributed job the trace is a rank of, if any, and the rank, or -1 if
+   * unknown. */
+  string job_id;
+  int job_rank;
+
+  /* Seconds between live statistics reports, or 0 for none. */
+  uint32_t stats_interval;
+
+  /* Milliseconds between flushes of the trace for live replay, or 0 to
+   * only write out full blocks. */
+  uint32_t flush_interval;
+
+  /* Maximum number of recordings to make until one fails, or 0 to record
+   * just once and keep the trace regardless. */
+  uint32_t until_failure;
+
+  /* Print the CPU layout; use |cpu_layout| instead of choosing one. */
+  bool show_cpu_layout;
+  bool override_cpu_layout;
+  RecordSession::CpuLayout cpu_layout;
+
   RecordFlags()
       : max_ticks(Scheduler::DEFAULT_MAX_TICKS),
         max_events(Scheduler::DEFAULT_MAX_EVENTS),
         ignore_sig(0),
         use_syscall_buffer(true),
-        cpu_unbound(false) {}
+        cpu_unbound(false),
+        dedup_min_size(0),
+        copy_mapped_files_min_size(0),
+        adaptive_compression(false),
+        max_trace_memory(0),
+        syscallbuf_size(SYSCALLBUF_BUFFER_SIZE),
+        scratch_size(0),
+        report_traced_syscalls(false),
+        chaos(false),
+        huge_pages(false),
+        elide_pipe_data(false),
+        job_rank(-1),
+        stats_interval(0),
+        flush_interval(0),
+        until_failure(0),
+        show_cpu_layout(false),
+        override_cpu_layout(false) {
+    for (int s = TraceStream::SUBSTREAM_FIRST;
+         s < TraceStream::SUBSTREAM_COUNT; ++s) {
+      compression.push_back(TraceStream::default_compression_policy(
+          (TraceStream::Substream)s));
+    }
+  }
 };
 
+static bool parse_int_field(const string& field, int64_t min, int64_t max,
+                            int64_t* out) {
+  char* end;
+  int64_t v = strtoll(field.c_str(), &end, 10);
+  if (field.empty() || *end || v < min || v > max) {
+    return false;
+  }
+  *out = v;
+  return true;
+}
+
+/**
+ * Parse a --compression spec and apply it to |policies|.
+ */
+static bool parse_compression_spec(const string& spec,
+                                   vector<TraceStream::CompressionPolicy>&
+                                       policies) {
+  vector<string> fields;
+  size_t start = 0;
+  while (true) {
+    size_t colon = spec.find(':', start);
+    fields.push_back(spec.substr(start, colon - start));
+    if (colon == string::npos) {
+      break;
+    }
+    start = colon + 1;
+  }
+
+  int first = TraceStream::SUBSTREAM_FIRST;
+  int last = TraceStream::SUBSTREAM_COUNT;
+  TraceStream::Substream substream;
+  if (TraceStream::substream_for_name(fields[0], &substream)) {
+    first = substream;
+    last = substream + 1;
+    fields.erase(fields.begin());
+  }
+  if (fields.empty() || fields.size() > 4) {
+    fprintf(stderr, "Invalid compression spec `%s'\n", spec.c_str());
+    return false;
+  }
+
+  const CompressionCodec* codec = CompressionCodec::get(fields[0]);
+  if (!codec) {
+    fprintf(stderr,
+            "Unsupported compression codec `%s'; this rr supports: %s\n",
+            fields[0].c_str(), CompressionCodec::supported_names().c_str());
+    return false;
+  }
+  int64_t level = CompressionCodec::DEFAULT_LEVEL;
+  int64_t block_kb = 0;
+  int64_t threads = 0;
+  // The block size is bounded by the 28-bit compressed-length field of
+  // the block header.
+  if ((fields.size() > 1 &&
+       !parse_int_field(fields[1], INT32_MIN + 1, INT32_MAX, &level)) ||
+      (fields.size() > 2 && !parse_int_field(fields[2], 4, 64 * 1024,
+                                             &block_kb)) ||
+      (fields.size() > 3 && !parse_int_field(fields[3], 1, 64, &threads))) {
+    fprintf(stderr, "Invalid compression spec `%s'\n", spec.c_str());
+    return false;
+  }
+
+  for (int s = first; s < last; ++s) {
+    auto& policy = policies[s];
+    policy.codec = codec->id();
+    policy.level = level;
+    if (block_kb) {
+      policy.block_size = block_kb * 1024;
+    }
+    if (threads) {
+      policy.threads = threads;
+    }
+  }
+  return true;
+}
+
+/**
+ * Parse a --job spec into |flags|. Without a rank, use the one MPI or
+ * Slurm put in our environment, if any.
+ */
+static bool parse_job_spec(const string& spec, RecordFlags& flags) {
+  size_t colon = spec.find(':');
+  string id = spec.substr(0, colon);
+  int64_t rank = -1;
+  if (id.empty() ||
+      id.find_first_of(" \t\n") != string::npos ||
+      (colon != string::npos &&
+       !parse_int_field(spec.substr(colon + 1), 0, INT32_MAX, &rank))) {
+    fprintf(stderr, "Invalid job `%s'\n", spec.c_str());
+    return false;
+  }
+  if (colon == string::npos) {
+    static const char* const rank_vars[] = { "OMPI_COMM_WORLD_RANK",
+                                             "PMI_RANK", "PMIX_RANK",
+                                             "SLURM_PROCID" };
+    for (auto var : rank_vars) {
+      const char* value = getenv(var);
+      if (value && parse_int_field(value, 0, INT32_MAX, &rank)) {
+        break;
+      }
+    }
+  }
+  flags.job_id = id;
+  flags.job_rank = rank;
+  return true;
+}
+
+/**
+ * Parse a --cpu-layout spec into |flags|.
+ */
+static bool parse_cpu_layout_spec(const string& spec, RecordFlags& flags) {
+  if (spec == "show") {
+    flags.show_cpu_layout = true;
+    return true;
+  }
+  size_t colon = spec.find(':');
+  int64_t cpu;
+  RecordSession::CpuLayout layout;
+  if (!parse_int_field(spec.substr(0, colon), 0, CPU_SETSIZE - 1, &cpu) ||
+      (colon != string::npos &&
+       !parse_cpu_list(spec.substr(colon + 1), &layout.compression_cpus))) {
+    fprintf(stderr, "Invalid CPU layout `%s'\n", spec.c_str());
+    return false;
+  }
+  layout.tracee_cpu = cpu;
+  flags.override_cpu_layout = true;
+  flags.cpu_layout = layout;
+  return true;
+}
+
 static bool parse_record_arg(std::vector<std::string>& args,
                              RecordFlags& flags) {
   if (parse_global_option(args)) {
@@ -76,13 +401,32 @@ static bool parse_record_arg(std::vector<std::string>& args,
   }
 
   static const OptionSpec options[] = {
+    { 'a', "adaptive-compression", NO_PARAMETER },
     { 'b', "force-syscall-buffer", NO_PARAMETER },
     { 'i', "ignore-signal", HAS_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
+    { 'd', "dedup-data", HAS_PARAMETER },
     { 'e', "num-events", HAS_PARAMETER },
+    { 'f', "copy-mapped-files", HAS_PARAMETER },
+    { 'h', "chaos", NO_PARAMETER },
+    { 'H', "huge-pages", NO_PARAMETER },
+    { 'j', "job", HAS_PARAMETER },
+    { 'k', "syscallbuf-size", HAS_PARAMETER },
+    { 'l', "cpu-layout", HAS_PARAMETER },
+    { 'm', "max-trace-memory", HAS_PARAMETER },
     { 'n', "no-syscall-buffer", NO_PARAMETER },
+    { 'o', "elide-pipe-data", NO_PARAMETER },
+    { 'p', "profile", HAS_PARAMETER },
+    { 'r', "report-traced-syscalls", NO_PARAMETER },
+    { 's', "stream-to", HAS_PARAMETER },
+    { 't', "stats-interval", HAS_PARAMETER },
     { 'u', "cpu-unbound", NO_PARAMETER },
-    { 'v', "env", HAS_PARAMETER }
+    { 'v', "env", HAS_PARAMETER },
+    { 'w', "flush-interval", HAS_PARAMETER },
+    { 'x', "scratch-size", HAS_PARAMETER },
+    { 'y', "until-failure", HAS_PARAMETER },
+    { 'z', "compression", HAS_PARAMETER },
+    { 'Z', "uncompressed", NO_PARAMETER }
   };
   ParsedOption opt;
   auto args_copy = args;
@@ -91,6 +435,9 @@ static bool parse_record_arg(std::vector<std::string>& args,
   }
 
   switch (opt.short_name) {
+    case 'a':
+      flags.adaptive_compression = true;
+      break;
     case 'b':
       flags.use_syscall_buffer = true;
       break;
@@ -100,6 +447,12 @@ static bool parse_record_arg(std::vector<std::string>& args,
       }
       flags.max_ticks = opt.int_value;
       break;
+    case 'd':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.dedup_min_size = opt.int_value;
+      break;
     case 'e':
       if (!opt.verify_valid_int(1, UINT32_MAX)) {
         return false;
@@ -107,21 +460,103 @@ static bool parse_record_arg(std::vector<std::string>& args,
       flags.max_events = opt.int_value;
       ;
       break;
+    case 'f':
+      if (!opt.verify_valid_int(1, 2048)) {
+        return false;
+      }
+      flags.copy_mapped_files_min_size = (size_t)opt.int_value * 1024 * 1024;
+      break;
+    case 'h':
+      flags.chaos = true;
+      break;
+    case 'H':
+      flags.huge_pages = true;
+      break;
     case 'i':
       if (!opt.verify_valid_int(1, _NSIG - 1)) {
         return false;
       }
       flags.ignore_sig = opt.int_value;
       break;
+    case 'j':
+      if (!parse_job_spec(opt.value, flags)) {
+        return false;
+      }
+      break;
+    case 'k':
+      if (!opt.verify_valid_int(SYSCALLBUF_MIN_BUFFER_SIZE / 1024,
+                                SYSCALLBUF_MAX_BUFFER_SIZE / 1024)) {
+        return false;
+      }
+      flags.syscallbuf_size = opt.int_value * 1024;
+      break;
+    case 'l':
+      if (!parse_cpu_layout_spec(opt.value, flags)) {
+        return false;
+      }
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, 1024 * 1024)) {
+        return false;
+      }
+      flags.max_trace_memory = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'n':
       flags.use_syscall_buffer = false;
       break;
+    case 'o':
+      flags.elide_pipe_data = true;
+      break;
+    case 'p':
+      flags.profile_path = opt.value;
+      break;
+    case 'r':
+      flags.report_traced_syscalls = true;
+      break;
+    case 's':
+      flags.stream_command = opt.value;
+      break;
+    case 't':
+      if (!opt.verify_valid_int(1, 24 * 60 * 60)) {
+        return false;
+      }
+      flags.stats_interval = opt.int_value;
+      break;
     case 'u':
       flags.cpu_unbound = true;
       break;
     case 'v':
       flags.extra_env.push_back(opt.value);
       break;
+    case 'w':
+      if (!opt.verify_valid_int(1, 60 * 60 * 1000)) {
+        return false;
+      }
+      flags.flush_interval = opt.int_value;
+      break;
+    case 'x':
+      if (!opt.verify_valid_int(16, 16384)) {
+        return false;
+      }
+      flags.scratch_size = opt.int_value * 1024;
+      break;
+    case 'y':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.until_failure = opt.int_value;
+      break;
+    case 'z':
+      if (!parse_compression_spec(opt.value, flags.compression)) {
+        return false;
+      }
+      break;
+    case 'Z':
+      for (auto& policy : flags.compression) {
+        policy.codec = CompressionCodec::NONE;
+        policy.level = CompressionCodec::DEFAULT_LEVEL;
+      }
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -163,18 +598,60 @@ static void setup_session_from_flags(RecordSession& session,
                                      const RecordFlags& flags) {
   session.scheduler().set_max_ticks(flags.max_ticks);
   session.scheduler().set_max_events(flags.max_events);
+  session.scheduler().set_enable_chaos(flags.chaos);
   session.set_ignore_sig(flags.ignore_sig);
+  session.set_syscallbuf_size(flags.syscallbuf_size);
+  if (flags.scratch_size) {
+    session.set_scratch_size(flags.scratch_size);
+  }
+  session.set_report_traced_syscalls(flags.report_traced_syscalls);
+  session.set_profile_path(flags.profile_path);
+  session.set_stats_interval(flags.stats_interval);
+  session.set_flush_interval(flags.flush_interval);
+  session.trace_writer().set_raw_data_dedup_min_size(flags.dedup_min_size);
+  session.trace_writer().set_copy_mapped_files_min_size(
+      flags.copy_mapped_files_min_size);
+  session.trace_writer().set_adaptive_compression(flags.adaptive_compression);
+  if (flags.max_trace_memory) {
+    session.trace_writer().set_memory_budget(flags.max_trace_memory);
+  }
+  if (!flags.job_id.empty()) {
+    session.trace_writer().set_job(flags.job_id, flags.job_rank);
+  }
+}
+
+static uint32_t session_flags_for(const RecordFlags& flags) {
+  return (flags.cpu_unbound ? RecordSession::CPU_UNBOUND : 0) |
+         (flags.use_syscall_buffer ? 0 : RecordSession::DISABLE_SYSCALL_BUF) |
+         (flags.huge_pages ? RecordSession::HUGE_PAGES : 0) |
+         (flags.elide_pipe_data ? RecordSession::ELIDE_PIPE_DATA : 0);
 }
 
-static int record(const vector<string>& args, const RecordFlags& flags) {
+/**
+ * Record one run of |args| with CPU layout |layout|. If |trace_dir| is
+ * non-null, the trace's directory is stored there.
+ */
+static int record(const vector<string>& args, const RecordFlags& flags,
+                  const RecordSession::CpuLayout& layout, string* trace_dir) {
   LOG(info) << "Start recording...";
 
-  auto session = RecordSession::create(
-      args,
-      (flags.cpu_unbound ? RecordSession::CPU_UNBOUND : 0) |
-          (flags.use_syscall_buffer ? 0 : RecordSession::DISABLE_SYSCALL_BUF),
-      flags.extra_env);
+  shared_ptr<TraceSink> sink;
+  if (!flags.stream_command.empty()) {
+    sink = TraceSink::create(flags.stream_command);
+    if (!sink) {
+      fprintf(stderr, "Can't run `%s' to stream the trace to\n",
+              flags.stream_command.c_str());
+      return EX_OSERR;
+    }
+  }
+
+  auto session =
+      RecordSession::create(args, session_flags_for(flags), flags.extra_env,
+                            flags.compression, sink, &layout);
   setup_session_from_flags(*session, flags);
+  if (trace_dir) {
+    *trace_dir = session->trace_writer().dir();
+  }
 
   // Install signal handlers after creating the session, to ensure they're not
   // inherited by the tracee.
@@ -222,6 +699,32 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
   }
 }
 
+/**
+ * Record up to |flags.until_failure| times, deleting the trace of each run
+ * that succeeds, until one doesn't. The prerequisite checks and CPU layout
+ * are shared by all the runs.
+ */
+static int record_until_failure(const vector<string>& args,
+                                const RecordFlags& flags,
+                                const RecordSession::CpuLayout& layout) {
+  for (uint32_t run = 1; run <= flags.until_failure; ++run) {
+    string trace_dir;
+    int status = record(args, flags, layout, &trace_dir);
+    if (term_request) {
+      return status;
+    }
+    if (status) {
+      fprintf(stderr, "rr: run %u of %u failed with status %d; its trace is "
+                      "`%s'\n",
+              run, flags.until_failure, status, trace_dir.c_str());
+      return status;
+    }
+    TraceWriter::delete_trace(trace_dir);
+  }
+  fprintf(stderr, "rr: all %u runs succeeded\n", flags.until_failure);
+  return 0;
+}
+
 int RecordCommand::run(std::vector<std::string>& args) {
   RecordFlags flags;
   while (parse_record_arg(args, flags)) {
@@ -232,8 +735,25 @@ int RecordCommand::run(std::vector<std::string>& args) {
     return 1;
   }
 
+  if (flags.until_failure && !flags.stream_command.empty()) {
+    fprintf(stderr, "--until-failure can't be combined with --stream-to\n");
+    return 1;
+  }
+
   assert_prerequisites(flags.use_syscall_buffer);
   check_performance_settings();
 
-  return record(args, flags);
+  RecordSession::CpuLayout layout =
+      flags.override_cpu_layout
+          ? flags.cpu_layout
+          : RecordSession::choose_cpu_layout(session_flags_for(flags));
+  if (flags.show_cpu_layout) {
+    fprintf(stderr, "rr: cpu layout: %s\n",
+            RecordSession::describe_cpu_layout(layout).c_str());
+  }
+
+  if (flags.until_failure) {
+    return record_until_failure(args, flags, layout);
+  }
+  return record(args, flags, layout, nullptr);
 }
@@ -4,15 +4,22 @@
 
 #include "RecordSession.h"
 
+#include <inttypes.h>
+#include <time.h>
+
 #include <algorithm>
+#include <fstream>
 #include <sstream>
 
 #include "kernel_metadata.h"
 #include "log.h"
+#include "probes.h"
 #include "record_signal.h"
 #include "record_syscall.h"
 #include "seccomp-bpf.h"
+#include "SelfProfiler.h"
 #include "task.h"
+#include "util.h"
 
 // Undef si_addr_lsb since it's an alias for a field name that doesn't exist,
 // and we need to use the actual field name.
@@ -65,15 +72,21 @@ static string create_pulseaudio_config() {
 }
 
 /**
- * Pick a CPU at random to bind to, unless --cpu-unbound has been given,
- * in which case we return -1.
+ * Pick a CPU at random to bind tracees to, unless --cpu-unbound has been
+ * given. CPUs the kernel keeps free of other work (isolcpus) are preferred.
+ * Compression threads go on the other cores of the tracee CPU's NUMA node,
+ * so they don't compete with tracees for a core but the trace buffers,
+ * which rr's thread fills first, stay node-local. If that leaves nothing,
+ * they can use any core but the tracees'.
  */
-static int choose_cpu(uint32_t flags) {
-  if (flags & RecordSession::CPU_UNBOUND) {
-    return -1;
+/*static*/ RecordSession::CpuLayout RecordSession::choose_cpu_layout(
+    uint32_t flags) {
+  CpuLayout layout;
+  if (flags & CPU_UNBOUND) {
+    return layout;
   }
 
-  // Pin tracee tasks to logical CPU 0, both in
+  // Pin tracee tasks to one logical CPU, both in
   // recording and replay.  Tracees can see which HW
   // thread they're running on by asking CPUID, and we
   // don't have a way to emulate it yet.  So if a tracee
@@ -87,7 +100,64 @@ static int choose_cpu(uint32_t flags) {
   // performance win in certain circumstances,
   // presumably due to cheaper context switching and/or
   // better interaction with CPU frequency scaling.
-  return random() % get_num_cpus();
+  vector<CpuInfo> cpus = get_cpu_topology();
+  vector<int> isolated;
+  ifstream isolated_file("/sys/devices/system/cpu/isolated");
+  string isolated_list;
+  getline(isolated_file, isolated_list);
+  parse_cpu_list(isolated_list, &isolated);
+  auto is_isolated = [&isolated](int cpu) {
+    return find(isolated.begin(), isolated.end(), cpu) != isolated.end();
+  };
+
+  vector<size_t> candidates;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (is_isolated(cpus[i].cpu)) {
+      candidates.push_back(i);
+    }
+  }
+  if (candidates.empty()) {
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      candidates.push_back(i);
+    }
+  }
+  const CpuInfo& tracee = cpus[candidates[random() % candidates.size()]];
+  layout.tracee_cpu = tracee.cpu;
+
+  auto shares_core = [&tracee](const CpuInfo& info) {
+    return info.cpu == tracee.cpu ||
+           (tracee.core >= 0 && info.core == tracee.core);
+  };
+  vector<int> others;
+  for (auto& info : cpus) {
+    if (shares_core(info) || is_isolated(info.cpu)) {
+      continue;
+    }
+    others.push_back(info.cpu);
+    if (info.node == tracee.node) {
+      layout.compression_cpus.push_back(info.cpu);
+    }
+  }
+  if (layout.compression_cpus.empty()) {
+    layout.compression_cpus = others;
+  }
+  return layout;
+}
+
+/*static*/ string RecordSession::describe_cpu_layout(const CpuLayout& layout) {
+  stringstream out;
+  if (layout.tracee_cpu >= 0) {
+    out << "tracees on CPU " << layout.tracee_cpu;
+  } else {
+    out << "tracees on any CPU";
+  }
+  if (layout.compression_cpus.empty()) {
+    out << ", compression on any CPU";
+  } else {
+    out << ", compression on CPUs "
+        << format_cpu_list(layout.compression_cpus);
+  }
+  return out.str();
 }
 
 /**
@@ -330,7 +400,7 @@ void RecordSession::task_continue(Task* t, const StepState& step_state) {
      * record in the traditional way (with PTRACE_SYSCALL)
      * until it is installed. */
     t->cont_syscall_nonblocking(step_state.continue_sig,
-                                t->record_session().scheduler().max_ticks());
+                                scheduler().current_timeslice());
   } else {
     /* When the seccomp filter is on, instead of capturing
      * syscalls by using PTRACE_SYSCALL, the filter will
@@ -343,7 +413,7 @@ void RecordSession::task_continue(Task* t, const StepState& step_state) {
      * the syscall (using cont_syscall_block()) and then
      * using the same logic as before. */
     t->cont_nonblocking(step_state.continue_sig,
-                        t->record_session().scheduler().max_ticks());
+                        scheduler().current_timeslice());
   }
 }
 
@@ -529,6 +599,14 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
          * (if it's not a SYS_restart_syscall restart)
          * will use the original registers. */
         t->ev().Syscall().regs = t->regs();
+
+        // The syscallbuf hook only makes traced syscalls from
+        // traced_syscall_ip() when it can't buffer them.
+        if (t->ip() == t->vm()->traced_syscall_ip()
+                           .increment_by_syscall_insn_length(t->arch())) {
+          trace_out.count_syscallbuf_fallback(
+              t->syscall_name(t->ev().Syscall().number));
+        }
       }
 
       last_task_switchable = rec_prepare_syscall(t);
@@ -540,7 +618,7 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
       step_state->continue_type = CONTINUE_SYSCALL;
 
       if (t->session().can_validate() && Flags::get().check_cached_mmaps) {
-        t->vm()->verify(t);
+        t->vm()->check_cached_mmaps(t);
       }
 
       if (t->desched_rec() && t->is_in_untraced_syscall() &&
@@ -629,7 +707,7 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
       if (!may_restart) {
         rec_process_syscall(t);
         if (t->session().can_validate() && Flags::get().check_cached_mmaps) {
-          t->vm()->verify(t);
+          t->vm()->check_cached_mmaps(t);
         }
       } else {
         LOG(debug) << "  may restart " << t->syscall_name(syscallno)
@@ -670,21 +748,6 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
   }
 }
 
-/**
- * If the syscallbuf has just been flushed, and resetting hasn't been
- * overridden with a delay request, then record the reset event for
- * replay.
- */
-static void maybe_reset_syscallbuf(Task* t) {
-  if (t->flushed_syscallbuf && !t->delay_syscallbuf_reset) {
-    t->record_event(Event(EV_SYSCALLBUF_RESET, NO_EXEC_INFO, t->arch()));
-  }
-  /* Any code that sets |delay_syscallbuf_reset| is responsible
-   * for recording its own SYSCALLBUF_RESET event at a
-   * convenient time. */
-  t->flushed_syscallbuf = false;
-}
-
 /** If the perf counters seem to be working return, otherwise don't return. */
 void RecordSession::check_perf_counters_working(Task* t,
                                                 RecordResult* step_result) {
@@ -877,6 +940,34 @@ static void inject_signal(Task* t) {
          0 == t->hpc.read_extra().instructions_retired);
 }
 
+/**
+ * Return the number of bytes at |handler_sp| to record as the signal frame
+ * the kernel set up for a handler that interrupted code at |interrupted_sp|.
+ *
+ * When the handler runs on the interrupted stack, the frame is everything
+ * between the two stack pointers (on x86-64 that includes the 128-byte red
+ * zone, which is harmless to record), so we record exactly that. This
+ * matters for runtimes that take a SIGSEGV for every GC barrier or JIT
+ * deoptimization: most frames are smaller than the fixed overestimate,
+ * and frames with large XSAVE areas are bigger than it.
+ *
+ * Otherwise the handler is on an alternate stack and we don't know where the
+ * frame ends, so fall back to an overestimate. That estimate was made by
+ * comparing $sp before and after entering the sighandler, for a sighandler
+ * that used the main task stack. On linux 3.11.2 that size was 1736 bytes;
+ * we round it up to 2048.
+ */
+static size_t sigframe_size_for(remote_ptr<void> interrupted_sp,
+                                remote_ptr<void> handler_sp) {
+  static const size_t FALLBACK_SIGFRAME_SIZE = 2048;
+  static const size_t MAX_SIGFRAME_SIZE = 64 * 1024;
+  if (handler_sp < interrupted_sp &&
+      size_t(interrupted_sp - handler_sp) <= MAX_SIGFRAME_SIZE) {
+    return interrupted_sp - handler_sp;
+  }
+  return FALLBACK_SIGFRAME_SIZE;
+}
+
 /**
  * |t| is being delivered a signal, and its state changed.
  *
@@ -899,27 +990,10 @@ void RecordSession::signal_state_changed(Task* t, StepState* step_state) {
         LOG(debug) << "  " << t->tid << ": " << signal_name(sig)
                    << " has user handler";
 
+        remote_ptr<void> interrupted_sp = t->sp();
         inject_signal(t);
 
-        // It's somewhat difficult engineering-wise to
-        // compute the sigframe size at compile time,
-        // and it can vary across kernel versions.  So
-        // this size is an overestimate of the real
-        // size(s).  The estimate was made by
-        // comparing $sp before and after entering the
-        // sighandler, for a sighandler that used the
-        // main task stack.  On linux 3.11.2, that
-        // computed size was 1736 bytes, which is an
-        // upper bound on the sigframe size.  We don't
-        // want to mess with this code much, so we
-        // overapproximate the overapproximation and
-        // round off to 2048.
-        //
-        // If this size becomes too small in the
-        // future, and unit tests that use sighandlers
-        // are run with checksumming enabled, then
-        // they can catch errors here.
-        sigframe_size = 2048;
+        sigframe_size = sigframe_size_for(interrupted_sp, t->sp());
 
         t->ev().transform(EV_SIGNAL_HANDLER);
         t->signal_delivered(sig);
@@ -1055,6 +1129,7 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
     case EV_SCHED:
       t->record_current_event();
       t->pop_event(t->ev().type());
+      scheduler().on_timeslice_expired(t);
       last_task_switchable = ALLOW_SWITCH;
       step_state->continue_type = DONT_CONTINUE;
       break;
@@ -1067,11 +1142,13 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
       }
       // We just entered a syscall.
       if (!maybe_restart_syscall(t)) {
-        if (t->vm()->monkeypatcher().try_patch_syscall(t)) {
+        const char* reason = nullptr;
+        if (t->vm()->monkeypatcher().try_patch_syscall(t, &reason)) {
           // Syscall was patched. Emit event and continue execution.
           t->record_event(Event(EV_PATCH_SYSCALL, NO_EXEC_INFO, t->arch()));
           break;
         }
+        note_traced_syscall(t, reason);
 
         t->push_event(SyscallEvent(t->regs().original_syscallno(), t->arch()));
       }
@@ -1084,8 +1161,6 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
     default:
       return;
   }
-
-  maybe_reset_syscallbuf(t);
 }
 
 bool RecordSession::prepare_to_inject_signal(Task* t, StepState* step_state) {
@@ -1139,7 +1214,9 @@ static string find_syscall_buffer_library() {
 
 /*static*/ RecordSession::shr_ptr RecordSession::create(
     const vector<string>& argv, uint32_t flags,
-    const vector<string>& extra_env) {
+    const vector<string>& extra_env,
+    const vector<TraceStream::CompressionPolicy>& compression,
+    const shared_ptr<TraceSink>& sink, const CpuLayout* layout) {
   // The syscallbuf library interposes some critical
   // external symbols like XShmQueryExtension(), so we
   // preload it whether or not syscallbuf is enabled. Indicate here whether
@@ -1197,25 +1274,168 @@ static string find_syscall_buffer_library() {
   // it is useless when running under rr.
   env.push_back("MOZ_GDB_SLEEP=0");
 
-  shr_ptr session(new RecordSession(argv, env, cwd, flags));
+  shr_ptr session(new RecordSession(
+      argv, env, cwd, flags, compression, sink,
+      layout ? *layout : choose_cpu_layout(flags)));
+  note_startup_phase("tracee spawned");
   return session;
 }
 
 RecordSession::RecordSession(const std::vector<std::string>& argv,
                              const std::vector<std::string>& envp,
-                             const string& cwd, uint32_t flags)
-    : trace_out(argv, envp, cwd, choose_cpu(flags)),
+                             const string& cwd, uint32_t flags,
+                             const vector<TraceStream::CompressionPolicy>&
+                                 compression,
+                             const shared_ptr<TraceSink>& sink,
+                             const CpuLayout& layout)
+    : trace_out(argv, envp, cwd, layout.tracee_cpu, compression, sink),
       scheduler_(*this),
       last_recorded_task(nullptr),
       ignore_sig(0),
       last_task_switchable(PREVENT_SWITCH),
       use_syscall_buffer_(!(flags & DISABLE_SYSCALL_BUF)),
+      use_huge_pages_(flags & HUGE_PAGES),
+      elide_pipe_data_(flags & ELIDE_PIPE_DATA),
+      syscallbuf_size_(SYSCALLBUF_BUFFER_SIZE),
+      scratch_size_(512 * page_size()),
+      injected_peak_tasks(0),
+      injected_peak_address_spaces(0),
+      report_traced_syscalls(false),
+      stats_interval_ns(0),
+      flush_interval_ns(0),
+      last_flush_ns(0),
+      last_flush_time(0),
+      num_traced_syscalls(0),
+      num_buffered_syscalls(0),
       can_deliver_signals(false) {
+  memset(&last_stats, 0, sizeof(last_stats));
+  if (!layout.compression_cpus.empty()) {
+    trace_out.bind_compression_threads(layout.compression_cpus);
+  }
+  if (use_huge_pages_) {
+    trace_out.set_huge_pages();
+  }
+  if (elide_pipe_data_) {
+    trace_out.set_elides_pipe_data();
+  }
   last_recorded_task = Task::spawn(*this, trace_out);
   initial_task_group = last_recorded_task->task_group();
   on_create(last_recorded_task);
 }
 
+void RecordSession::set_syscallbuf_size(size_t size) {
+  syscallbuf_size_ = ceil_page_size(size);
+  if (syscallbuf_size_ != SYSCALLBUF_BUFFER_SIZE) {
+    trace_out.set_custom_syscallbuf_size();
+  }
+}
+
+/**
+ * Charges the time from its construction to its destruction, and the time
+ * trace writing stalled in between, to what one task stopped for, and adds
+ * the step to the self-profile timeline. Does nothing unless one of those
+ * is enabled, apart from firing the record_step_start/record_step_done
+ * probes.
+ */
+class RecordSession::StepProfiler {
+public:
+  StepProfiler(RecordSession& session, Task* t)
+      : session(session),
+        tid(t->rec_tid),
+        start_ns(0),
+        start_stall_ns(0),
+        stop_reason("OTHER"),
+        syscall_entered(false) {
+    RR_PROBE1(record_step_start, tid);
+    if (enabled()) {
+      start_ns = monotonic_now_ns();
+      start_stall_ns = session.trace_out.stall_ns();
+    }
+  }
+  ~StepProfiler();
+
+  bool enabled() const {
+    return !session.profile_path.empty() || SelfProfiler::get();
+  }
+  void set_stop_reason(const string& reason) {
+    if (enabled()) {
+      stop_reason = reason;
+    }
+  }
+  void set_signal(int sig) {
+    if (enabled()) {
+      signal = signal_name(sig);
+    }
+  }
+  void set_syscall(const string& name, bool entered) {
+    if (enabled()) {
+      syscall = name;
+      syscall_entered = entered;
+    }
+  }
+  void note_switch() {
+    if (enabled()) {
+      ++session.profile[tid][make_pair(string("scheduler"), string("switch"))]
+            .count;
+    }
+  }
+
+private:
+  RecordSession& session;
+  pid_t tid;
+  uint64_t start_ns;
+  uint64_t start_stall_ns;
+  string stop_reason;
+  string signal;
+  string syscall;
+  bool syscall_entered;
+};
+
+RecordSession::StepProfiler::~StepProfiler() {
+  RR_PROBE1(record_step_done, tid);
+  if (!enabled()) {
+    return;
+  }
+  uint64_t end_ns = monotonic_now_ns();
+  uint64_t ns = end_ns - start_ns;
+  if (SelfProfiler* self_profiler = SelfProfiler::get()) {
+    string name = stop_reason;
+    if (!syscall.empty()) {
+      name = syscall + (syscall_entered ? " entry" : " exit");
+    } else if (!signal.empty()) {
+      name = signal;
+    }
+    self_profiler->add_span(name, "record", tid, start_ns / 1000,
+                            end_ns / 1000);
+  }
+  if (session.profile_path.empty()) {
+    return;
+  }
+  uint64_t stall_ns = session.trace_out.stall_ns() - start_stall_ns;
+  TaskProfile& p = session.profile[tid];
+
+  ProfileEntry& stop = p[make_pair(string("stop"), stop_reason)];
+  ++stop.count;
+  stop.ns += ns;
+  if (!signal.empty()) {
+    ProfileEntry& e = p[make_pair(string("signal"), signal)];
+    ++e.count;
+    e.ns += ns;
+  }
+  if (!syscall.empty()) {
+    // Entry and exit are separate steps; count the syscall once but charge
+    // both.
+    ProfileEntry& e = p[make_pair(string("syscall"), syscall)];
+    e.count += syscall_entered;
+    e.ns += ns;
+  }
+  if (stall_ns) {
+    ProfileEntry& e = p[make_pair(string("trace_writer"), string("stall"))];
+    ++e.count;
+    e.ns += stall_ns;
+  }
+}
+
 RecordSession::RecordResult RecordSession::record_step() {
   RecordResult result;
 
@@ -1227,6 +1447,13 @@ RecordSession::RecordResult RecordSession::record_step() {
 
   result.status = STEP_CONTINUE;
 
+  if (stats_enabled()) {
+    maybe_print_stats();
+  }
+  if (flush_interval_ns) {
+    maybe_flush_trace(false);
+  }
+
   bool did_wait;
   Task* t = scheduler().get_next_thread(last_recorded_task,
                                         last_task_switchable, &did_wait);
@@ -1237,6 +1464,10 @@ RecordSession::RecordResult RecordSession::record_step() {
     // (e.g. terminate the recording).
     return result;
   }
+  StepProfiler profiler(*this, t);
+  if (t != last_recorded_task) {
+    profiler.note_switch();
+  }
   last_recorded_task = t;
 
   // Have to disable context-switching until we know it's safe
@@ -1248,6 +1479,7 @@ RecordSession::RecordResult RecordSession::record_step() {
 #ifdef DEBUGTAG
   t->log_pending_events();
 #endif
+  profiler.set_stop_reason("PTRACE_EXIT");
   if (handle_ptrace_exit_event(t)) {
     // t is dead and has been deleted.
     last_recorded_task = nullptr;
@@ -1259,12 +1491,21 @@ RecordSession::RecordResult RecordSession::record_step() {
     // an unstable exit. We can't replay them.
     LOG(debug) << "Task in unstable exit; "
                   "refusing to record non-ptrace events";
+    profiler.set_stop_reason("UNSTABLE_EXIT");
     last_task_switchable = ALLOW_SWITCH;
     return result;
   }
 
   StepState step_state(CONTINUE);
 
+  if (did_wait && profiler.enabled()) {
+    if (t->ptrace_event()) {
+      profiler.set_stop_reason("PTRACE_EVENT");
+    } else if (t->pending_sig()) {
+      profiler.set_stop_reason("SIGNAL");
+      profiler.set_signal(t->pending_sig());
+    }
+  }
   if (!(did_wait && handle_ptrace_event(t, &step_state)) &&
       !(did_wait && handle_signal_event(t, &step_state))) {
     runnable_state_changed(t, &result, did_wait, &step_state);
@@ -1273,11 +1514,23 @@ RecordSession::RecordResult RecordSession::record_step() {
       return result;
     }
 
+    if (profiler.enabled()) {
+      profiler.set_stop_reason(t->ev().type_name());
+    }
     switch (t->ev().type()) {
       case EV_DESCHED:
         desched_state_changed(t);
         break;
       case EV_SYSCALL:
+        if (t->ev().Syscall().state == ENTERING_SYSCALL) {
+          ++num_traced_syscalls;
+          scheduler().on_syscall_entry(t, t->ev().Syscall().number);
+        }
+        if (profiler.enabled()) {
+          auto& syscall = t->ev().Syscall();
+          profiler.set_syscall(syscall_name(syscall.number, syscall.arch()),
+                               syscall.state == ENTERING_SYSCALL);
+        }
         syscall_state_changed(t, &step_state);
         break;
       case EV_SIGNAL:
@@ -1321,6 +1574,257 @@ void RecordSession::terminate_recording() {
                    last_recorded_task ? last_recorded_task->tick_count() : 0);
   trace_out.write_frame(frame);
   trace_out.close();
+
+  if (report_traced_syscalls) {
+    report_traced_syscall_sites();
+  }
+  if (!profile_path.empty()) {
+    write_profile();
+  }
+}
+
+/**
+ * Flush the trace for replays following the recording if the flush
+ * interval has passed, or if |blocking| because all tasks are about to
+ * block, unless nothing has been recorded since the last flush.
+ */
+void RecordSession::maybe_flush_trace(bool blocking) {
+  if (!flush_interval_ns || trace_out.time() == last_flush_time) {
+    return;
+  }
+  uint64_t now = monotonic_now_ns();
+  if (!blocking && now - last_flush_ns < flush_interval_ns) {
+    return;
+  }
+  trace_out.flush();
+  last_flush_ns = now;
+  last_flush_time = trace_out.time();
+}
+
+/**
+ * Print the rates of events, traced and buffered syscalls and trace bytes
+ * per substream since the last report, if at least the stats interval has
+ * passed. The first call only takes the initial snapshot.
+ */
+void RecordSession::maybe_print_stats() {
+  uint64_t now = monotonic_now_ns();
+  if (last_stats.ns && now - last_stats.ns < stats_interval_ns) {
+    return;
+  }
+
+  StatsSnapshot stats;
+  stats.ns = now;
+  stats.events = trace_out.time();
+  stats.traced_syscalls = num_traced_syscalls;
+  stats.buffered_syscalls = num_buffered_syscalls;
+  stats.spins = scheduler().spins_detected();
+  for (int s = TraceStream::SUBSTREAM_FIRST; s < TraceStream::SUBSTREAM_COUNT;
+       ++s) {
+    stats.trace_bytes[s] =
+        trace_out.uncompressed_pos((TraceStream::Substream)s);
+  }
+  if (!last_stats.ns) {
+    last_stats = stats;
+    return;
+  }
+
+  double secs = double(now - last_stats.ns) / 1e9;
+  stringstream bytes;
+  for (int s = TraceStream::SUBSTREAM_FIRST; s < TraceStream::SUBSTREAM_COUNT;
+       ++s) {
+    bytes << " " << TraceStream::substream_name((TraceStream::Substream)s)
+          << " "
+          << uint64_t((stats.trace_bytes[s] - last_stats.trace_bytes[s]) /
+                      1024 / secs);
+  }
+  size_t task_bytes = 0;
+  for (auto& p : tasks()) {
+    task_bytes += p.second->memory_footprint();
+  }
+  fprintf(stderr, "rr: stats: %.0f events/s, %.0f traced + %.0f buffered "
+                  "syscalls/s, trace KB/s%s, %" PRIu64 " KB waiting for "
+                  "compression, %zu tasks (%zu bytes each), %" PRIu64
+                  " spins\n",
+          (stats.events - last_stats.events) / secs,
+          (stats.traced_syscalls - last_stats.traced_syscalls) / secs,
+          (stats.buffered_syscalls - last_stats.buffered_syscalls) / secs,
+          bytes.str().c_str(), trace_out.compression_backlog() / 1024,
+          tasks().size(), tasks().empty() ? 0 : task_bytes / tasks().size(),
+          stats.spins - last_stats.spins);
+  last_stats = stats;
+}
+
+/**
+ * One line per task and thing it spent recording time on:
+ * "tid,category,name,count,ns". Categories are "stop" (each time rr handled
+ * the task, by why it stopped), "signal", "syscall" (traced syscalls; both
+ * the entry and exit stops are charged), "scheduler" (switches to the task)
+ * and "trace_writer" (time the task's steps waited for compression).
+ */
+void RecordSession::write_profile() {
+  ofstream out(profile_path.c_str(), ios::trunc);
+  out << "tid,category,name,count,ns\n";
+  for (auto& task : profile) {
+    for (auto& e : task.second) {
+      out << task.first << "," << e.first.first << "," << e.first.second
+          << "," << e.second.count << "," << e.second.ns << "\n";
+    }
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write recording profile " << profile_path;
+  }
+}
+
+/**
+ * Describe |addr| as a file and offset, for reports.
+ */
+static string describe_address(Task* t, remote_ptr<void> addr) {
+  stringstream location;
+  if (t->vm()->has_mapping(addr)) {
+    auto m = t->vm()->mapping_of(addr);
+    location << (m.second.fsname.empty() ? "<anonymous>"
+                                         : m.second.fsname.c_str())
+             << "+0x" << hex << (addr - m.first.start) + m.first.offset;
+  } else {
+    location << addr;
+  }
+  return location.str();
+}
+
+void RecordSession::note_traced_syscall(Task* t, const char* reason) {
+  Registers r = t->regs();
+  TracedSyscallSite& site =
+      traced_syscall_sites[make_pair(r.ip(), (int)r.original_syscallno())];
+  if (!site.count) {
+    site.arch = t->arch();
+    site.reason = reason;
+    site.location = describe_address(t, r.ip().to_data_ptr<void>());
+  }
+  ++site.count;
+}
+
+void RecordSession::note_scratch_use(int syscallno, SupportedArch arch,
+                                     size_t num_bytes) {
+  ScratchUse& use = scratch_use[make_pair(arch, syscallno)];
+  ++use.count;
+  use.num_bytes += num_bytes;
+  use.max_bytes = max<uint64_t>(use.max_bytes, num_bytes);
+}
+
+void RecordSession::note_injected_state(Task* t) {
+  if (!report_traced_syscalls) {
+    return;
+  }
+  InjectedState& state = injected_state[t];
+  injected_total.scratch_bytes -= state.scratch_bytes;
+  injected_total.syscallbuf_bytes -= state.syscallbuf_bytes;
+  injected_total.fds -= state.fds;
+
+  state.scratch_bytes = t->scratch_size;
+  state.syscallbuf_bytes =
+      t->syscallbuf_child.is_null() ? 0 : t->num_syscallbuf_bytes;
+  state.fds = PerfCounters::fds_per_task() + (t->desched_fd.is_open() ? 1 : 0);
+  injected_total.scratch_bytes += state.scratch_bytes;
+  injected_total.syscallbuf_bytes += state.syscallbuf_bytes;
+  injected_total.fds += state.fds;
+
+  if (injected_total.scratch_bytes + injected_total.syscallbuf_bytes >=
+      injected_peak.scratch_bytes + injected_peak.syscallbuf_bytes) {
+    injected_peak = injected_total;
+    injected_peak_tasks = tasks().size();
+    injected_peak_address_spaces = vm_map.size();
+  }
+}
+
+void RecordSession::note_futex_wait(Task* t, remote_ptr<int> futex) {
+  ContendedFutex& f = contended_futexes[futex];
+  if (!f.count) {
+    f.location = describe_address(t, futex);
+  }
+  ++f.count;
+}
+
+void RecordSession::report_traced_syscall_sites() {
+  static const size_t MAX_SITES_REPORTED = 20;
+
+  typedef decltype(traced_syscall_sites)::value_type Entry;
+  vector<const Entry*> ranked;
+  uint64_t total = 0;
+  for (auto& s : traced_syscall_sites) {
+    ranked.push_back(&s);
+    total += s.second.count;
+  }
+  sort(ranked.begin(), ranked.end(), [](const Entry* a, const Entry* b) {
+    return a->second.count > b->second.count;
+  });
+
+  fprintf(stderr, "rr: %" PRIu64 " traced syscalls at %zu sites\n", total,
+          ranked.size());
+  for (size_t i = 0; i < ranked.size() && i < MAX_SITES_REPORTED; ++i) {
+    const TracedSyscallSite& site = ranked[i]->second;
+    fprintf(stderr, "%10" PRIu64 "  %s  %s (%s)\n", site.count,
+            site.location.c_str(),
+            syscall_name(ranked[i]->first.second, site.arch).c_str(),
+            site.reason);
+  }
+
+  typedef decltype(contended_futexes)::value_type FutexEntry;
+  vector<const FutexEntry*> futexes;
+  uint64_t total_waits = 0;
+  for (auto& f : contended_futexes) {
+    futexes.push_back(&f);
+    total_waits += f.second.count;
+  }
+  sort(futexes.begin(), futexes.end(),
+       [](const FutexEntry* a, const FutexEntry* b) {
+         return a->second.count > b->second.count;
+       });
+
+  fprintf(stderr, "rr: %" PRIu64 " unbuffered futex waits on %zu futexes\n",
+          total_waits, futexes.size());
+  for (size_t i = 0; i < futexes.size() && i < MAX_SITES_REPORTED; ++i) {
+    stringstream addr;
+    addr << futexes[i]->first;
+    fprintf(stderr, "%10" PRIu64 "  %s  %s\n", futexes[i]->second.count,
+            addr.str().c_str(), futexes[i]->second.location.c_str());
+  }
+
+  typedef decltype(scratch_use)::value_type ScratchEntry;
+  vector<const ScratchEntry*> scratch_syscalls;
+  uint64_t total_scratch_bytes = 0;
+  for (auto& s : scratch_use) {
+    scratch_syscalls.push_back(&s);
+    total_scratch_bytes += s.second.num_bytes;
+  }
+  sort(scratch_syscalls.begin(), scratch_syscalls.end(),
+       [](const ScratchEntry* a, const ScratchEntry* b) {
+         return a->second.num_bytes > b->second.num_bytes;
+       });
+
+  fprintf(stderr, "rr: %" PRIu64 " bytes of syscall memory parameters copied "
+                  "through scratch\n",
+          total_scratch_bytes);
+  for (size_t i = 0; i < scratch_syscalls.size() && i < MAX_SITES_REPORTED;
+       ++i) {
+    const ScratchEntry& s = *scratch_syscalls[i];
+    fprintf(stderr, "%10" PRIu64 "  %s (%" PRIu64 " calls, at most %" PRIu64
+                    " bytes)\n",
+            s.second.num_bytes,
+            syscall_name(s.first.second, s.first.first).c_str(),
+            s.second.count, s.second.max_bytes);
+  }
+
+  // The syscallbufs are shared memory, mapped by rr as well as the tracee,
+  // so they're only counted once. Scratch memory is only committed when
+  // a syscall copies through it.
+  fprintf(stderr, "rr: at peak, %zu tasks in %zu address spaces had %" PRIu64
+                  " KB of scratch mapped, %" PRIu64 " KB of syscallbufs, "
+                  "%zu KB of rr pages and %" PRIu64 " fds held by rr\n",
+          injected_peak_tasks, injected_peak_address_spaces,
+          injected_peak.scratch_bytes / 1024,
+          injected_peak.syscallbuf_bytes / 1024,
+          injected_peak_address_spaces * AddressSpace::rr_page_size() / 1024,
+          injected_peak.fds);
 }
 
 void RecordSession::on_create(Task* t) {
@@ -1329,6 +1833,13 @@ void RecordSession::on_create(Task* t) {
 }
 
 void RecordSession::on_destroy(Task* t) {
+  auto it = injected_state.find(t);
+  if (it != injected_state.end()) {
+    injected_total.scratch_bytes -= it->second.scratch_bytes;
+    injected_total.syscallbuf_bytes -= it->second.syscallbuf_bytes;
+    injected_total.fds -= it->second.fds;
+    injected_state.erase(it);
+  }
   scheduler().on_destroy(t);
   Session::on_destroy(t);
 }
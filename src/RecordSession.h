@@ -3,6 +3,7 @@
 #ifndef RR_RECORD_SESSION_H_
 #define RR_RECORD_SESSION_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -16,17 +17,115 @@ class RecordSession : public Session {
 public:
   typedef std::shared_ptr<RecordSession> shr_ptr;
 
+  /**
+   * The CPU that tracees and rr are bound to, or -1 for none, and the CPUs
+   * the trace compression and write threads run on (empty for any).
+   */
+  struct CpuLayout {
+    CpuLayout() : tracee_cpu(-1) {}
+    int tracee_cpu;
+    std::vector<int> compression_cpus;
+  };
+
   /**
    * Create a recording session for the initial command line |argv|.
+   * The trace is compressed according to |compression|, which is either
+   * empty (use the defaults) or has one policy per trace substream, and
+   * streamed to |sink| if that's non-null. Threads are placed according to
+   * |layout|, or choose_cpu_layout(flags) if that's null.
    */
-  enum { DISABLE_SYSCALL_BUF = 0x01, CPU_UNBOUND = 0x02 };
+  enum {
+    DISABLE_SYSCALL_BUF = 0x01,
+    CPU_UNBOUND = 0x02,
+    HUGE_PAGES = 0x04,
+    ELIDE_PIPE_DATA = 0x08
+  };
   static shr_ptr create(
       const std::vector<std::string>& argv, uint32_t flags = 0,
-      const std::vector<std::string>& extra_env = std::vector<std::string>());
+      const std::vector<std::string>& extra_env = std::vector<std::string>(),
+      const std::vector<TraceStream::CompressionPolicy>& compression =
+          std::vector<TraceStream::CompressionPolicy>(),
+      const std::shared_ptr<TraceSink>& sink = nullptr,
+      const CpuLayout* layout = nullptr);
+
+  /**
+   * Pick where to run tracees and compression threads from the machine's
+   * topology. See RecordSession.cc.
+   */
+  static CpuLayout choose_cpu_layout(uint32_t flags);
+  /**
+   * Describe |layout| for the user.
+   */
+  static std::string describe_cpu_layout(const CpuLayout& layout);
 
   bool use_syscall_buffer() const { return use_syscall_buffer_; }
+  /**
+   * True if syscallbufs and trace buffers should ask for transparent huge
+   * pages.
+   */
+  bool use_huge_pages() const { return use_huge_pages_; }
+  /**
+   * True if tracees' pipes get PipeMonitors, so reads that replay can
+   * reproduce aren't recorded.
+   */
+  bool elide_pipe_data() const { return elide_pipe_data_; }
   void set_ignore_sig(int ignore_sig) { this->ignore_sig = ignore_sig; }
   int get_ignore_sig() const { return ignore_sig; }
+  /**
+   * Size of the syscallbufs of tasks that initialize them from now on,
+   * rounded up to a whole number of pages.
+   */
+  void set_syscallbuf_size(size_t size);
+  size_t syscallbuf_size() const { return syscallbuf_size_; }
+  /**
+   * Size of the scratch buffers of tasks created from now on, rounded up
+   * to a whole number of pages.
+   */
+  void set_scratch_size(size_t size) { scratch_size_ = ceil_page_size(size); }
+  size_t scratch_size() const { return scratch_size_; }
+  /**
+   * Make terminate_recording() print the syscall sites that were traced the
+   * most, rather than going through the syscallbuf, and why, the futexes
+   * that were waited on the most, the syscalls that copied the most data
+   * through scratch memory and the peak memory and fds rr used on behalf
+   * of tracees.
+   */
+  void set_report_traced_syscalls(bool report) {
+    report_traced_syscalls = report;
+  }
+  /**
+   * Make terminate_recording() write a CSV profile of where recording time
+   * went, per task, to |path|. See StepProfiler.
+   */
+  void set_profile_path(const std::string& path) { profile_path = path; }
+  /**
+   * Print event, syscall, trace-writing and task counters to stderr about
+   * every |seconds| seconds while recording, or never if it's 0.
+   */
+  void set_stats_interval(uint32_t seconds) {
+    stats_interval_ns = uint64_t(seconds) * 1000000000;
+  }
+  bool stats_enabled() const { return stats_interval_ns != 0; }
+  /**
+   * Flush the trace about every |ms| milliseconds, and before waiting for
+   * blocked tasks, so that a replay can follow the recording. 0 (the
+   * default) leaves the trace to be written out a full block at a time.
+   */
+  void set_flush_interval(uint32_t ms) {
+    flush_interval_ns = uint64_t(ms) * 1000000;
+  }
+  /**
+   * Called by the Scheduler before it waits for a task when they're all
+   * blocked, which could be for a long time if the tracees are hung.
+   */
+  void will_wait_for_blocked_tasks() { maybe_flush_trace(true); }
+  /**
+   * Count syscalls that completed in a task's syscallbuf, for the live
+   * statistics.
+   */
+  void note_buffered_syscalls(uint32_t count) {
+    num_buffered_syscalls += count;
+  }
 
   enum RecordStatus {
     // Some execution was recorded. record_step() can be called again.
@@ -65,6 +164,23 @@ public:
 
   TraceWriter& trace_writer() { return trace_out; }
 
+  /**
+   * Count a FUTEX_WAIT* on |futex| that couldn't be handled entirely by the
+   * syscallbuf: either it was traced, or it blocked and was desched'd.
+   */
+  void note_futex_wait(Task* t, remote_ptr<int> futex);
+  /**
+   * Count a |syscallno| whose memory parameters had to be copied through
+   * |num_bytes| of scratch memory.
+   */
+  void note_scratch_use(int syscallno, SupportedArch arch, size_t num_bytes);
+  /**
+   * Account for |t|'s scratch buffer, syscallbuf and the fds rr holds for
+   * it, after any of them changed. Only collected when reporting traced
+   * syscalls.
+   */
+  void note_injected_state(Task* t);
+
   virtual void on_destroy(Task* t);
 
   Scheduler& scheduler() { return scheduler_; }
@@ -72,7 +188,10 @@ public:
 private:
   RecordSession(const std::vector<std::string>& argv,
                 const std::vector<std::string>& envp, const std::string& cwd,
-                uint32_t flags);
+                uint32_t flags,
+                const std::vector<TraceStream::CompressionPolicy>& compression,
+                const std::shared_ptr<TraceSink>& sink,
+                const CpuLayout& layout);
 
   virtual void on_create(Task* t);
 
@@ -97,6 +216,13 @@ private:
   void desched_state_changed(Task* t);
   bool prepare_to_inject_signal(Task* t, StepState* step_state);
   void task_continue(Task* t, const StepState& step_state);
+  void note_traced_syscall(Task* t, const char* reason);
+  void report_traced_syscall_sites();
+  void write_profile();
+  void maybe_print_stats();
+  void maybe_flush_trace(bool blocking);
+
+  class StepProfiler;
 
   TraceWriter trace_out;
   Scheduler scheduler_;
@@ -106,6 +232,91 @@ private:
   int ignore_sig;
   Switchable last_task_switchable;
   bool use_syscall_buffer_;
+  bool use_huge_pages_;
+  bool elide_pipe_data_;
+  size_t syscallbuf_size_;
+  size_t scratch_size_;
+
+  /**
+   * Traced syscalls by the address of their syscall instruction and their
+   * syscall number. Addresses in different address spaces aren't
+   * distinguished, but the module they're in is recorded the first time
+   * each is seen.
+   */
+  struct TracedSyscallSite {
+    TracedSyscallSite() : count(0), arch(x86), reason(nullptr) {}
+    uint64_t count;
+    SupportedArch arch;
+    const char* reason;
+    std::string location;
+  };
+  std::map<std::pair<remote_code_ptr, int>, TracedSyscallSite>
+      traced_syscall_sites;
+  struct ContendedFutex {
+    ContendedFutex() : count(0) {}
+    uint64_t count;
+    std::string location;
+  };
+  std::map<remote_ptr<int>, ContendedFutex> contended_futexes;
+  struct ScratchUse {
+    ScratchUse() : count(0), num_bytes(0), max_bytes(0) {}
+    uint64_t count;
+    uint64_t num_bytes;
+    uint64_t max_bytes;
+  };
+  std::map<std::pair<SupportedArch, int>, ScratchUse> scratch_use;
+  /**
+   * Memory and fds used for tracees' rr-injected state, per live task,
+   * and when the total memory was highest.
+   */
+  struct InjectedState {
+    InjectedState() : scratch_bytes(0), syscallbuf_bytes(0), fds(0) {}
+    uint64_t scratch_bytes;
+    uint64_t syscallbuf_bytes;
+    uint64_t fds;
+  };
+  std::map<Task*, InjectedState> injected_state;
+  InjectedState injected_total;
+  InjectedState injected_peak;
+  size_t injected_peak_tasks;
+  size_t injected_peak_address_spaces;
+  bool report_traced_syscalls;
+
+  /**
+   * Recording overhead by recorded tid, then by (category, name), e.g.
+   * ("syscall", "read"). Only collected when |profile_path| is set.
+   */
+  struct ProfileEntry {
+    ProfileEntry() : count(0), ns(0) {}
+    uint64_t count;
+    uint64_t ns;
+  };
+  typedef std::map<std::pair<std::string, std::string>, ProfileEntry>
+      TaskProfile;
+  std::map<pid_t, TaskProfile> profile;
+  std::string profile_path;
+
+  /**
+   * Live statistics; see set_stats_interval(). |last_stats| is the
+   * snapshot the current rates are computed from.
+   */
+  struct StatsSnapshot {
+    uint64_t ns;
+    TraceFrame::Time events;
+    uint64_t traced_syscalls;
+    uint64_t buffered_syscalls;
+    uint64_t spins;
+    uint64_t trace_bytes[TraceStream::SUBSTREAM_COUNT];
+  };
+  StatsSnapshot last_stats;
+  uint64_t stats_interval_ns;
+
+  /* See set_flush_interval(). */
+  uint64_t flush_interval_ns;
+  uint64_t last_flush_ns;
+  TraceFrame::Time last_flush_time;
+  uint64_t num_traced_syscalls;
+  uint64_t num_buffered_syscalls;
 
   /* True when it's safe to deliver signals, namely, when the initial
    * tracee has exec()'d the tracee image.  Before then, the address
@@ -306,10 +306,59 @@ static void maybe_print_reg_mismatch(MismatchBehavior mismatch_behavior,
   }
 }
 
+/**
+ * The bits of Arch::user_regs_struct that compare_registers_core compares,
+ * as whole words, so that the common case of matching registers can be
+ * checked with a simple loop the compiler vectorizes.
+ */
+template <typename Arch> struct RegisterCompareMask {
+  enum { WORDS = (sizeof(typename Arch::user_regs_struct) + 7) / 8 };
+  uint64_t words[WORDS];
+
+  RegisterCompareMask() {
+    uint8_t bytes[WORDS * 8];
+    memset(bytes, 0, sizeof(bytes));
+    for (auto& rv : RegisterInfo<Arch>::registers) {
+      for (size_t i = 0; i < rv.nbytes; ++i) {
+        bytes[rv.offset + i] |= uint8_t(rv.comparison_mask >> (i * 8));
+      }
+    }
+    memcpy(words, bytes, sizeof(words));
+  }
+
+  static const RegisterCompareMask& get() {
+    static const RegisterCompareMask mask;
+    return mask;
+  }
+
+  /**
+   * |regs1| and |regs2| must have room for WORDS words; bytes beyond the
+   * user_regs_struct are ignored.
+   */
+  bool equal(const void* regs1, const void* regs2) const {
+    uint64_t w1[WORDS];
+    uint64_t w2[WORDS];
+    memcpy(w1, regs1, sizeof(w1));
+    memcpy(w2, regs2, sizeof(w2));
+    uint64_t diff = 0;
+    for (size_t i = 0; i < WORDS; ++i) {
+      diff |= (w1[i] ^ w2[i]) & words[i];
+    }
+    return diff == 0;
+  }
+};
+
 template <typename Arch>
 bool Registers::compare_registers_core(const char* name1, const Registers& reg1,
                                        const char* name2, const Registers& reg2,
                                        MismatchBehavior mismatch_behavior) {
+  static_assert(RegisterCompareMask<Arch>::WORDS * 8 <= sizeof(AllRegisters),
+                "Compare mask reads beyond the registers");
+  if (RegisterCompareMask<Arch>::get().equal(&reg1.u, &reg2.u)) {
+    return true;
+  }
+
+  // Find and report the mismatching registers.
   bool match = true;
 
   for (auto& rv : RegisterInfo<Arch>::registers) {
@@ -56,6 +56,14 @@ public:
 
   SupportedArch arch() const { return arch_; }
 
+  /**
+   * True when every byte of these registers equals |other|'s, including
+   * bits that compare_register_files() ignores.
+   */
+  bool identical_to(const Registers& other) const {
+    return arch_ == other.arch_ && !memcmp(&u, &other.u, sizeof(u));
+  }
+
   void set_arch(SupportedArch a) { arch_ = a; }
 
   /**
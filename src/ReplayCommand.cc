@@ -3,19 +3,28 @@
 //#define DEBUGTAG "ReplayCommand"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
+#include <map>
 
 #include "Command.h"
+#include "CoreDumper.h"
 #include "Flags.h"
+#include "GdbExpression.h"
 #include "GdbServer.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "main.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "util.h"
 
 using namespace std;
 
@@ -35,6 +44,15 @@ ReplayCommand ReplayCommand::singleton(
     "replay",
     " rr replay [OPTION]... [<trace-dir>]\n"
     "  -a, --autopilot            replay without debugger server\n"
+    "  -b, --goto-bookmark=<NAME> like -g, for the event where a tracee\n"
+    "                             wrote <NAME> to RR_MAGIC_BOOKMARK_FD\n"
+    "  -c, --core-at=<EVENT-NUM>  instead of debugging, write the core file\n"
+    "                             core.<EVENT-NUM>.<PID> for the process\n"
+    "                             that -g <EVENT-NUM> would debug\n"
+    "  -e, --eval-at=<EVENTS>     instead of debugging, print a CSV line of\n"
+    "                             the --expr values at each of <EVENTS>,\n"
+    "                             e.g. 100,200,1000-1010, in the process -g\n"
+    "                             would debug\n"
     "  -f, --onfork=<PID>         start a debug server when <PID> has been\n"
     "                             fork()d, AND the target event has been\n"
     "                             reached.\n"
@@ -42,6 +60,21 @@ ReplayCommand ReplayCommand::singleton(
     "<EVENT-NUM>\n"
     "                             in the trace.  See -M in the general "
     "options.\n"
+    "  -i, --stats                with -a, when replay finishes print how\n"
+    "                             many steps, how much time, tracee resumes,\n"
+    "                             singlesteps and breakpoint hits replaying\n"
+    "                             each event type and syscall took\n"
+    "  -k, --keep-listening       with -s, keep replaying and wait for a new\n"
+    "                             debugger connection when the debugger\n"
+    "                             detaches\n"
+    "  -l, --timeline-log=<FILE>  log checkpoints and seeks to <FILE> for\n"
+    "                             src/script/checkpoint-visualizer.html\n"
+    "  -m, --checkpoint-memory=<MB>\n"
+    "                             discard reverse-execution checkpoints, "
+    "oldest\n"
+    "                             first, while checkpoint processes use more "
+    "than\n"
+    "                             <MB> of memory\n"
     "  -p, --onprocess=<PID>|<COMMAND>\n"
     "                             start a debug server when <PID> or "
     "<COMMAND>\n"
@@ -49,12 +82,26 @@ ReplayCommand ReplayCommand::singleton(
     "been\n"
     "                             reached.\n"
     "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
+    "  -r, --expr=<EXPRS>         comma-separated values for --eval-at:\n"
+    "                             <ADDR>:<SIZE> reads memory (as an integer\n"
+    "                             when <SIZE> is 1, 2, 4 or 8, otherwise as\n"
+    "                             hex bytes); agent:<HEX> evaluates gdb agent\n"
+    "                             expression bytecode\n"
     "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
     "                             don't automatically launch the debugger\n"
     "                             client too.\n"
     "  -t, --trace=<EVENT>        singlestep instructions and dump register\n"
     "                             states when replaying towards <EVENT> or\n"
     "                             later\n"
+    "  -u, --fast                 with -a, -c or -e, don't check registers\n"
+    "                             and tick counts against the trace after\n"
+    "                             each step. Faster, but a divergence is only\n"
+    "                             noticed when replay can't continue\n"
+    "  -w, --goto-time=<TIME>     like -g, for the first event after a\n"
+    "                             tracee read the wall-clock time <TIME>,\n"
+    "                             given as\n"
+    "                             [YYYY-MM-DD ]HH:MM:SS[.FRAC] local time or\n"
+    "                             seconds since the epoch\n"
     "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n");
 
 struct ReplayFlags {
@@ -63,8 +110,21 @@ struct ReplayFlags {
   // been "created".
   TraceFrame::Time goto_event;
 
+  // Resolved to |goto_event| once we know the trace.
+  string goto_bookmark;
+
+  // Resolved to |goto_event| using the trace's wall-clock index.
+  string goto_time;
+
   TraceFrame::Time singlestep_to_event;
 
+  // Write a core file at this event instead of debugging, if nonzero.
+  TraceFrame::Time core_at_event;
+
+  // Print |eval_expr| at these events instead of debugging, if nonempty.
+  string eval_at;
+  string eval_expr;
+
   pid_t target_process;
 
   string target_command;
@@ -84,20 +144,40 @@ struct ReplayFlags {
   // IP port to listen on for debug connections.
   int dbg_port;
 
+  // Accept a new debugger connection when one detaches.
+  bool keep_listening;
+
   // Pass this file name to debugger with -x
   string gdb_command_file_path;
 
   /* When true, echo tracee stdout/stderr writes to console. */
   bool redirect;
 
+  /* Memory budget for reverse-execution checkpoints; 0 means unlimited. */
+  uint64_t checkpoint_memory_budget;
+
+  /* If non-empty, log ReplayTimeline activity here. */
+  string timeline_log;
+
+  /* Print a breakdown of replay costs by event type at the end. */
+  bool stats;
+
+  /* Skip verifying tracee state against the trace. Only without a debugger. */
+  bool fast;
+
   ReplayFlags()
       : goto_event(0),
         singlestep_to_event(0),
+        core_at_event(0),
         target_process(0),
         process_created_how(CREATED_NONE),
         dont_launch_debugger(false),
         dbg_port(-1),
-        redirect(true) {}
+        keep_listening(false),
+        redirect(true),
+        checkpoint_memory_budget(0),
+        stats(false),
+        fast(false) {}
 };
 
 static bool parse_replay_arg(std::vector<std::string>& args,
@@ -107,13 +187,26 @@ static bool parse_replay_arg(std::vector<std::string>& args,
   }
 
   static const OptionSpec options[] = { { 'a', "autopilot", NO_PARAMETER },
+                                        { 'b', "goto-bookmark",
+                                          HAS_PARAMETER },
+                                        { 'c', "core-at", HAS_PARAMETER },
+                                        { 'e', "eval-at", HAS_PARAMETER },
                                         { 's', "dbgport", HAS_PARAMETER },
                                         { 'g', "goto", HAS_PARAMETER },
+                                        { 'i', "stats", NO_PARAMETER },
+                                        { 'k', "keep-listening",
+                                          NO_PARAMETER },
+                                        { 'l', "timeline-log", HAS_PARAMETER },
+                                        { 'm', "checkpoint-memory",
+                                          HAS_PARAMETER },
                                         { 't', "trace", HAS_PARAMETER },
+                                        { 'u', "fast", NO_PARAMETER },
                                         { 'q', "no-redirect-output",
                                           NO_PARAMETER },
+                                        { 'r', "expr", HAS_PARAMETER },
                                         { 'f', "onfork", HAS_PARAMETER },
                                         { 'p', "onprocess", HAS_PARAMETER },
+                                        { 'w', "goto-time", HAS_PARAMETER },
                                         { 'x', "gdb-x", HAS_PARAMETER } };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
@@ -125,6 +218,18 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       flags.goto_event = numeric_limits<decltype(flags.goto_event)>::max();
       flags.dont_launch_debugger = true;
       break;
+    case 'b':
+      flags.goto_bookmark = opt.value;
+      break;
+    case 'c':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.core_at_event = opt.int_value;
+      break;
+    case 'e':
+      flags.eval_at = opt.value;
+      break;
     case 'f':
       if (!opt.verify_valid_int(1, INT32_MAX)) {
         return false;
@@ -138,6 +243,18 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.goto_event = opt.int_value;
       break;
+    case 'i':
+      flags.stats = true;
+      break;
+    case 'l':
+      flags.timeline_log = opt.value;
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, 1024 * 1024)) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = uint64_t(opt.int_value) * 1024 * 1024;
+      break;
     case 'p':
       if (opt.int_value > 0) {
         if (!opt.verify_valid_int(1, INT32_MAX)) {
@@ -149,9 +266,15 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.process_created_how = ReplayFlags::CREATED_EXEC;
       break;
+    case 'k':
+      flags.keep_listening = true;
+      break;
     case 'q':
       flags.redirect = false;
       break;
+    case 'r':
+      flags.eval_expr = opt.value;
+      break;
     case 's':
       if (!opt.verify_valid_int(1, INT32_MAX)) {
         return false;
@@ -165,6 +288,12 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.singlestep_to_event = opt.int_value;
       break;
+    case 'u':
+      flags.fast = true;
+      break;
+    case 'w':
+      flags.goto_time = opt.value;
+      break;
     case 'x':
       flags.gdb_command_file_path = opt.value;
       break;
@@ -229,6 +358,7 @@ static pid_t waiting_for_child;
 static ReplaySession::Flags session_flags(ReplayFlags flags) {
   ReplaySession::Flags result;
   result.redirect_stdio = flags.redirect;
+  result.skip_verification = flags.fast;
   return result;
 }
 
@@ -236,6 +366,48 @@ static uint64_t to_microseconds(const struct timeval& tv) {
   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+/**
+ * Replay costs for one kind of event, for --stats.
+ */
+struct EventReplayStats {
+  EventReplayStats() : steps(0), ns(0), resumes(0), singlesteps(0), hits(0) {}
+  uint64_t steps;
+  uint64_t ns;
+  uint64_t resumes;
+  uint64_t singlesteps;
+  uint64_t hits;
+};
+
+static string event_stats_name(const Event& ev) {
+  if (ev.is_syscall_event()) {
+    return ev.type_name() + " " +
+           syscall_name(ev.Syscall().number, ev.Syscall().arch());
+  }
+  return ev.type_name();
+}
+
+static void print_event_stats(FILE* out,
+                              const map<string, EventReplayStats>& stats,
+                              const Session::Statistics& session_stats) {
+  vector<pair<uint64_t, string> > by_time;
+  for (auto& s : stats) {
+    by_time.push_back(make_pair(s.second.ns, s.first));
+  }
+  sort(by_time.rbegin(), by_time.rend());
+
+  fprintf(out, "%-40s %10s %12s %10s %12s %10s\n", "event", "steps", "ms",
+          "resumes", "singlesteps", "bkpt_hits");
+  for (auto& e : by_time) {
+    const EventReplayStats& s = stats.find(e.second)->second;
+    fprintf(out, "%-40s %10" PRIu64 " %12.3f %10" PRIu64 " %12" PRIu64
+                 " %10" PRIu64 "\n",
+            e.second.c_str(), s.steps, s.ns / 1000000.0, s.resumes,
+            s.singlesteps, s.hits);
+  }
+  fprintf(out, "register writes saved: %" PRIu64 "\n",
+          session_stats.register_writes_saved);
+}
+
 static void serve_replay_no_debugger(const string& trace_dir,
                                      const ReplayFlags& flags) {
   ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
@@ -244,6 +416,7 @@ static void serve_replay_no_debugger(const string& trace_dir,
   struct timeval last_dump_time;
   Session::Statistics last_stats;
   gettimeofday(&last_dump_time, NULL);
+  map<string, EventReplayStats> event_stats;
 
   while (true) {
     RunCommand cmd = RUN_CONTINUE;
@@ -255,18 +428,41 @@ static void serve_replay_no_debugger(const string& trace_dir,
       t->regs().print_register_file_compact(stderr);
       fprintf(stderr, " ticks:%" PRId64 "\n", t->tick_count());
     }
+    string event_name;
+    uint64_t step_start_ns = 0;
+    Session::Statistics step_start_stats;
+    if (flags.stats) {
+      event_name =
+          event_stats_name(replay_session->current_trace_frame().event());
+      step_start_ns = monotonic_now_ns();
+      step_start_stats = replay_session->statistics();
+    }
     auto result = replay_session->replay_step(cmd);
     ++step_count;
+    if (flags.stats) {
+      Session::Statistics stats = replay_session->statistics();
+      EventReplayStats& s = event_stats[event_name];
+      ++s.steps;
+      s.ns += monotonic_now_ns() - step_start_ns;
+      s.resumes += stats.resumes - step_start_stats.resumes;
+      s.singlesteps += stats.singlesteps - step_start_stats.singlesteps;
+      s.hits += stats.breakpoint_hits - step_start_stats.breakpoint_hits;
+    }
     if (DUMP_STATS_PERIOD > 0 && step_count % DUMP_STATS_PERIOD == 0) {
       struct timeval now;
       gettimeofday(&now, NULL);
       Session::Statistics stats = replay_session->statistics();
       printf(
           "[ReplayStatistics] ticks %lld syscalls %lld bytes_written %lld "
+          "async_targets %lld async_target_singlesteps %lld "
           "microseconds %lld\n",
           (long long)(stats.ticks_processed - last_stats.ticks_processed),
           (long long)(stats.syscalls_performed - last_stats.syscalls_performed),
           (long long)(stats.bytes_written - last_stats.bytes_written),
+          (long long)(stats.async_targets_reached -
+                      last_stats.async_targets_reached),
+          (long long)(stats.async_target_singlesteps -
+                      last_stats.async_target_singlesteps),
           (long long)(to_microseconds(now) - to_microseconds(last_dump_time)));
       last_dump_time = now;
       last_stats = stats;
@@ -281,9 +477,225 @@ static void serve_replay_no_debugger(const string& trace_dir,
     assert(cmd == RUN_SINGLESTEP || !result.break_status.singlestep_complete);
   }
 
+  if (flags.stats) {
+    print_event_stats(stdout, event_stats, replay_session->statistics());
+  }
+
   LOG(info) << ("Replayer successfully finished.");
 }
 
+/**
+ * Return the task GdbServer would start debugging if it was targeting
+ * |event| and the process selected by |flags|, or null if |session| hasn't
+ * got there yet.
+ */
+static Task* task_at_event(ReplaySession& session, const ReplayFlags& flags,
+                           TraceFrame::Time event) {
+  Task* t = session.current_task();
+  if (t && session.can_validate() &&
+      session.current_trace_frame().time() > event &&
+      (flags.process_created_how == ReplayFlags::CREATED_NONE ||
+       t->tgid() == flags.target_process) &&
+      (flags.process_created_how != ReplayFlags::CREATED_EXEC ||
+       t->vm()->execed())) {
+    return t;
+  }
+  return nullptr;
+}
+
+/**
+ * Replay to the point where GdbServer would start debugging at
+ * |flags.core_at_event| and write a core file for the current process.
+ */
+static int dump_core(const string& trace_dir, const ReplayFlags& flags) {
+  ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
+  replay_session->set_flags(session_flags(flags));
+  while (true) {
+    Task* t = task_at_event(*replay_session, flags, flags.core_at_event);
+    if (t) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "core.%u.%d", flags.core_at_event,
+               t->tgid());
+      if (!write_core_file(t, path)) {
+        fprintf(stderr, "Failed to write %s.\n", path);
+        return 1;
+      }
+      fprintf(stderr, "Wrote %s for process %d at event %u.\n", path,
+              t->tgid(), replay_session->current_trace_frame().time());
+      return 0;
+    }
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      fprintf(stderr, "Replay ended before the target event was reached.\n");
+      return 2;
+    }
+  }
+}
+
+static vector<string> split_commas(const string& s) {
+  vector<string> items;
+  size_t start = 0;
+  while (true) {
+    size_t comma = s.find(',', start);
+    items.push_back(s.substr(start, comma - start));
+    if (comma == string::npos) {
+      return items;
+    }
+    start = comma + 1;
+  }
+}
+
+/**
+ * Parse a list of events and event ranges like "100,200,1000-1010" into
+ * sorted, distinct event numbers.
+ */
+static bool parse_event_list(const string& s, vector<TraceFrame::Time>* out) {
+  for (auto& item : split_commas(s)) {
+    char* end;
+    unsigned long first = strtoul(item.c_str(), &end, 10);
+    unsigned long last = first;
+    if (*end == '-') {
+      last = strtoul(end + 1, &end, 10);
+    }
+    if (item.empty() || *end || first < 1 || last < first ||
+        last > UINT32_MAX) {
+      return false;
+    }
+    for (unsigned long e = first; e <= last; ++e) {
+      out->push_back(e);
+    }
+  }
+  sort(out->begin(), out->end());
+  out->erase(unique(out->begin(), out->end()), out->end());
+  return true;
+}
+
+struct EvalTerm {
+  remote_ptr<void> addr;
+  size_t size;
+  // Set for agent: terms.
+  shared_ptr<GdbExpression> expr;
+};
+
+static bool parse_eval_terms(const string& s, vector<EvalTerm>* out) {
+  for (auto& item : split_commas(s)) {
+    EvalTerm term;
+    if (item.compare(0, 6, "agent:") == 0) {
+      string hex = item.substr(6);
+      vector<uint8_t> bytecode;
+      for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        char* end;
+        string byte = hex.substr(i, 2);
+        bytecode.push_back(strtoul(byte.c_str(), &end, 16));
+        if (*end) {
+          return false;
+        }
+      }
+      if (bytecode.empty() || hex.size() % 2) {
+        return false;
+      }
+      term.size = 0;
+      term.expr =
+          make_shared<GdbExpression>(bytecode.data(), bytecode.size());
+    } else {
+      char* end;
+      term.addr = strtoull(item.c_str(), &end, 0);
+      if (item.empty() || *end != ':') {
+        return false;
+      }
+      term.size = strtoul(end + 1, &end, 10);
+      if (*end || term.size < 1 || term.size > 4096) {
+        return false;
+      }
+    }
+    out->push_back(term);
+  }
+  return true;
+}
+
+/**
+ * Format |term|'s value in |t| for a CSV field. Values that can't be
+ * evaluated are left empty.
+ */
+static string eval_term(Task* t, const EvalTerm& term) {
+  char buf[32];
+  if (term.expr) {
+    GdbExpression::Value v;
+    if (!term.expr->evaluate(t, &v)) {
+      return string();
+    }
+    snprintf(buf, sizeof(buf), "%" PRId64, v.i);
+    return buf;
+  }
+  vector<uint8_t> data(term.size);
+  if (t->read_bytes_fallible(term.addr, data.size(), data.data()) !=
+      ssize_t(data.size())) {
+    return string();
+  }
+  if (term.size == 1 || term.size == 2 || term.size == 4 || term.size == 8) {
+    uint64_t value = 0;
+    memcpy(&value, data.data(), term.size);
+    snprintf(buf, sizeof(buf), "%" PRIu64, value);
+    return buf;
+  }
+  string hex;
+  for (auto b : data) {
+    snprintf(buf, sizeof(buf), "%02x", b);
+    hex += buf;
+  }
+  return hex;
+}
+
+/**
+ * Replay once through the trace, printing "<event>,<tid>,<values>..." to
+ * stdout at each of the requested events. Everything is read in-process,
+ * with no debugger round trips.
+ */
+static int eval_at_events(const string& trace_dir, const ReplayFlags& flags) {
+  vector<TraceFrame::Time> events;
+  if (!parse_event_list(flags.eval_at, &events)) {
+    fprintf(stderr, "Can't parse event list '%s'.\n", flags.eval_at.c_str());
+    return 1;
+  }
+  vector<EvalTerm> terms;
+  if (!parse_eval_terms(flags.eval_expr, &terms)) {
+    fprintf(stderr, "Can't parse expressions '%s'.\n",
+            flags.eval_expr.c_str());
+    return 1;
+  }
+
+  // Keep tracee output out of the CSV.
+  ReplayFlags quiet_flags = flags;
+  quiet_flags.redirect = false;
+  ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
+  replay_session->set_flags(session_flags(quiet_flags));
+  printf("event,tid,%s\n", flags.eval_expr.c_str());
+  size_t next = 0;
+  while (next < events.size()) {
+    Task* t = task_at_event(*replay_session, flags, events[next]);
+    if (t) {
+      string line;
+      for (auto& term : terms) {
+        line += "," + eval_term(t, term);
+      }
+      // Several events may be reached at the same point.
+      while (next < events.size() &&
+             task_at_event(*replay_session, flags, events[next])) {
+        printf("%u,%d%s\n", events[next], t->rec_tid, line.c_str());
+        ++next;
+      }
+      continue;
+    }
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      fprintf(stderr, "Replay ended before event %u was reached.\n",
+              events[next]);
+      return 2;
+    }
+  }
+  return 0;
+}
+
 /* Handling ctrl-C during replay:
  * We want the entire group of processes to remain a single process group
  * since that allows shell job control to work best.
@@ -327,6 +739,13 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
   }
   target.event = flags.goto_event;
 
+  if (flags.core_at_event) {
+    return dump_core(trace_dir, flags);
+  }
+  if (!flags.eval_at.empty()) {
+    return eval_at_events(trace_dir, flags);
+  }
+
   // If we're not going to autolaunch the debugger, don't go
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
@@ -337,7 +756,13 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       auto session = ReplaySession::create(trace_dir);
       GdbServer::ConnectionFlags conn_flags;
       conn_flags.dbg_port = flags.dbg_port;
-      GdbServer(session, session_flags(flags), target).serve_replay(conn_flags);
+      conn_flags.keep_listening = flags.keep_listening;
+      GdbServer server(session, session_flags(flags), target);
+      server.set_checkpoint_memory_budget(flags.checkpoint_memory_budget);
+      if (!flags.timeline_log.empty()) {
+        server.set_timeline_log(flags.timeline_log);
+      }
+      server.serve_replay(conn_flags);
     }
     return 0;
   }
@@ -357,6 +782,10 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
     conn_flags.dbg_port = flags.dbg_port;
     conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
     GdbServer server(session, session_flags(flags), target);
+    server.set_checkpoint_memory_budget(flags.checkpoint_memory_budget);
+    if (!flags.timeline_log.empty()) {
+      server.set_timeline_log(flags.timeline_log);
+    }
 
     server_ptr = &server;
     struct sigaction sa;
@@ -410,6 +839,55 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
   return 0;
 }
 
+/**
+ * Parse |value| as a wall-clock time in microseconds since the epoch. A
+ * time of day without a date is taken to be on the day the recording's
+ * first timestamp |first_usecs| was taken, or the day after if it would
+ * otherwise be earlier than that.
+ */
+static bool parse_wall_clock_time(const string& value, int64_t first_usecs,
+                                  int64_t* usecs) {
+  const char* s = value.c_str();
+  char* end;
+  int64_t sec;
+  if (value.find(':') == string::npos) {
+    sec = strtoll(s, &end, 10);
+  } else {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    bool has_date = value.find('-') != string::npos;
+    if (has_date) {
+      end = strptime(s, "%Y-%m-%d %H:%M:%S", &tm);
+    } else {
+      time_t first = first_usecs / 1000000;
+      localtime_r(&first, &tm);
+      end = strptime(s, "%H:%M:%S", &tm);
+    }
+    if (!end) {
+      return false;
+    }
+    tm.tm_isdst = -1;
+    sec = mktime(&tm);
+    if (!has_date && sec * 1000000 < first_usecs - 1000000) {
+      sec += 24 * 60 * 60;
+    }
+  }
+  int64_t frac = 0;
+  if (*end == '.') {
+    ++end;
+    int64_t scale = 100000;
+    for (; *end >= '0' && *end <= '9'; ++end) {
+      frac += (*end - '0') * scale;
+      scale /= 10;
+    }
+  }
+  if (end == s || *end) {
+    return false;
+  }
+  *usecs = sec * 1000000 + frac;
+  return true;
+}
+
 int ReplayCommand::run(std::vector<std::string>& args) {
   bool found_dir = false;
   string trace_dir;
@@ -427,6 +905,48 @@ int ReplayCommand::run(std::vector<std::string>& args) {
     return 1;
   }
 
+  if (!flags.goto_bookmark.empty()) {
+    TraceReader trace(trace_dir);
+    bool found = false;
+    for (auto& b : trace.read_bookmarks()) {
+      if (b.name == flags.goto_bookmark) {
+        flags.goto_event = b.time;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "No bookmark '%s' found in trace.\n",
+              flags.goto_bookmark.c_str());
+      return 2;
+    }
+  }
+  if (!flags.goto_time.empty()) {
+    TraceReader trace(trace_dir);
+    auto times = trace.read_wall_clock_times();
+    if (times.empty()) {
+      fprintf(stderr, "No tracee read the wall-clock time in this trace.\n");
+      return 2;
+    }
+    int64_t usecs;
+    if (!parse_wall_clock_time(flags.goto_time, times[0].usecs, &usecs)) {
+      fprintf(stderr, "Can't parse time '%s'.\n", flags.goto_time.c_str());
+      return 1;
+    }
+    bool found = false;
+    for (auto& t : times) {
+      if (t.usecs >= usecs) {
+        flags.goto_event = t.time;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "Time '%s' is after the end of the trace.\n",
+              flags.goto_time.c_str());
+      return 2;
+    }
+  }
   if (!flags.target_command.empty()) {
     flags.target_process =
         find_pid_for_command(trace_dir, flags.target_command);
@@ -450,6 +970,14 @@ int ReplayCommand::run(std::vector<std::string>& args) {
       return 2;
     }
   }
+  if (flags.fast && !flags.core_at_event && flags.eval_at.empty() &&
+      !(flags.dont_launch_debugger &&
+        flags.goto_event ==
+            numeric_limits<decltype(flags.goto_event)>::max())) {
+    // A debugger relies on replay noticing divergence where it happens.
+    fprintf(stderr, "--fast can only be used with -a, -c or -e.\n");
+    return 2;
+  }
 
   assert_prerequisites();
   check_performance_settings();
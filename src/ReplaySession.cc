@@ -15,7 +15,9 @@
 #include "fast_forward.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "probes.h"
 #include "replay_syscall.h"
+#include "SelfProfiler.h"
 #include "task.h"
 #include "util.h"
 
@@ -84,16 +86,18 @@ ReplaySession::~ReplaySession() {
 
 ReplaySession::shr_ptr ReplaySession::clone() {
   LOG(debug) << "Deepforking ReplaySession " << this << " ...";
+  RR_PROBE(clone_start);
+  SelfProfiler::Span span("session", getpid(), "clone");
 
   finish_initializing();
 
   shr_ptr session(new ReplaySession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
-  memcpy(session->syscallbuf_flush_buffer_array, syscallbuf_flush_buffer_array,
-         sizeof(syscallbuf_flush_buffer_array));
+  session->syscallbuf_flush_buffer_array = syscallbuf_flush_buffer_array;
 
   copy_state_to(*session, session->emufs());
 
+  RR_PROBE(clone_done);
   return session;
 }
 
@@ -147,7 +151,7 @@ bool ReplaySession::can_clone() {
   return t && can_validate() && can_checkpoint_at(t, current_trace_frame());
 }
 
-DiversionSession::shr_ptr ReplaySession::clone_diversion() {
+DiversionSession::shr_ptr ReplaySession::clone_diversion(Task* t) {
   finish_initializing();
 
   LOG(debug) << "Deepforking ReplaySession " << this
@@ -156,16 +160,22 @@ DiversionSession::shr_ptr ReplaySession::clone_diversion() {
   DiversionSession::shr_ptr session(new DiversionSession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
 
-  copy_state_to(*session, session->emufs());
+  copy_state_to(*session, session->emufs(), t ? t->vm().get() : nullptr);
   session->finish_initializing();
 
   return session;
 }
 
-void ReplaySession::gc_emufs() { emu_fs->gc(*this); }
+void ReplaySession::gc_emufs() { emu_fs->gc(); }
 
 /*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir) {
   shr_ptr session(new ReplaySession(dir));
+  note_startup_phase("trace opened");
+  if (session->trace_in.following()) {
+    fprintf(stderr, "rr: Trace `%s' is still being recorded; replay will "
+                    "wait for more events at its end.\n",
+            session->trace_in.dir().c_str());
+  }
 
   // Because we execvpe() the tracee, we must ensure that $PATH
   // is the same as in recording so that libc searches paths in
@@ -185,13 +195,16 @@ void ReplaySession::gc_emufs() { emu_fs->gc(*this); }
   Task* t = Task::spawn(*session, session->trace_in,
                         session->trace_reader().peek_frame().tid());
   session->on_create(t);
+  note_startup_phase("tracee spawned");
 
   return session;
 }
 
 void ReplaySession::advance_to_next_trace_frame(TraceFrame::Time stop_at_time) {
-  if (trace_in.at_end()) {
-    return;
+  while (trace_in.at_end()) {
+    if (!trace_in.wait_for_more()) {
+      return;
+    }
   }
 
   trace_frame = trace_in.read_frame();
@@ -211,6 +224,8 @@ void ReplaySession::advance_to_next_trace_frame(TraceFrame::Time stop_at_time) {
   }
 }
 
+/*static*/ int ReplaySession::skid_size() { return SKID_SIZE; }
+
 bool ReplaySession::is_ignored_signal(int sig) {
   switch (sig) {
     // SIGCHLD can arrive after tasks die during replay.  We don't
@@ -464,6 +479,7 @@ TrapType ReplaySession::compute_trap_type(Task* t, int target_sig,
   trap_type = t->vm()->get_breakpoint_type_for_retired_insn(t->ip());
   if (TRAP_BKPT_USER == trap_type || TRAP_BKPT_INTERNAL == trap_type) {
     assert(is_breakpoint_trap(t));
+    accumulate_breakpoint_hit();
     return trap_type;
   }
 
@@ -639,6 +655,7 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
   bool did_set_internal_breakpoint = false;
   bool ignored_early_match = false;
   Ticks ticks_left_at_ignored_early_match = 0;
+  uint64_t singlesteps = 0;
 
   assert(t->hpc.ticks_fd() > 0);
   assert(t->child_sig == 0);
@@ -650,8 +667,12 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
   LOG(debug) << "advancing " << ticks_left << " ticks to reach " << ticks << "/"
              << ip;
 
-  /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
+  /* Keep programming interrupts until we're within the skid region, as
+   * advance_to_ticks_target() does. Interrupts never fire early, so
+   * each one makes progress, and one more interrupt is much cheaper than
+   * trapping on the target $ip at every loop iteration until we get
+   * there. */
+  while (ticks_left > SKID_SIZE) {
     if (SIGTRAP == t->child_sig) {
       /* We proved we're not at the execution
        * target, and we haven't set any internal
@@ -782,6 +803,9 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
       // Adjust dynamic ticks count to match trace, in case
       // there was slack.
       t->set_tick_count(ticks);
+      LOG(debug) << "  reached target after " << singlesteps
+                 << " singlesteps";
+      accumulate_async_target_reached(singlesteps);
       /* Case (2) above: done. */
       return COMPLETE;
     }
@@ -806,6 +830,9 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
       LOG(debug) << "    breaking on target $ip";
       t->vm()->add_breakpoint(ip, TRAP_BKPT_INTERNAL);
       did_set_internal_breakpoint = true;
+      if (constraints.is_singlestep()) {
+        ++singlesteps;
+      }
       continue_or_step(t, constraints);
     } else {
       /* Case (3) above: we can't put a breakpoint
@@ -813,6 +840,7 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
        * would just trap and we'd be back where we
        * started.  Single-step or fast-forward past it. */
       LOG(debug) << "    (fast-forwarding over target $ip)";
+      ++singlesteps;
       if (constraints.command == RUN_SINGLESTEP) {
         continue_or_step(t, constraints);
       } else {
@@ -913,13 +941,14 @@ void ReplaySession::check_ticks_consistency(Task* t, const Event& ev) {
     return;
   }
 
-  Ticks ticks_slack = get_ticks_slack(t);
-  Ticks ticks_now = t->tick_count();
   Ticks trace_ticks = trace_frame.ticks();
-
-  ASSERT(t, llabs(ticks_now - trace_ticks) <= ticks_slack)
-      << "ticks mismatch for '" << ev << "'; expected " << trace_ticks
-      << ", got " << ticks_now << "";
+  if (should_verify()) {
+    Ticks ticks_slack = get_ticks_slack(t);
+    Ticks ticks_now = t->tick_count();
+    ASSERT(t, llabs(ticks_now - trace_ticks) <= ticks_slack)
+        << "ticks mismatch for '" << ev << "'; expected " << trace_ticks
+        << ", got " << ticks_now << "";
+  }
   // Sync task ticks with trace ticks so we don't keep accumulating errors
   t->set_tick_count(trace_ticks);
 }
@@ -1048,14 +1077,19 @@ void ReplaySession::prepare_syscallbuf_records(Task* t) {
 
   // Read the recorded syscall buffer back into the buffer
   // region.
-  auto buf = t->trace_reader().read_raw_data();
-  assert(buf.data.size() >= sizeof(struct syscallbuf_hdr));
+  auto buf = t->trace_reader().read_raw_data_view();
+  assert(buf.size >= sizeof(struct syscallbuf_hdr));
   current_step.flush.num_rec_bytes_remaining =
       sizeof(struct syscallbuf_hdr) +
-      ((struct syscallbuf_hdr*)buf.data.data())->num_rec_bytes;
+      ((const struct syscallbuf_hdr*)buf.data)->num_rec_bytes;
 
-  assert(current_step.flush.num_rec_bytes_remaining <= SYSCALLBUF_BUFFER_SIZE);
-  memcpy(syscallbuf_flush_buffer_array, buf.data.data(),
+  assert(current_step.flush.num_rec_bytes_remaining <= buf.size);
+  size_t words = (current_step.flush.num_rec_bytes_remaining +
+                  sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  if (syscallbuf_flush_buffer_array.size() < words) {
+    syscallbuf_flush_buffer_array.resize(words);
+  }
+  memcpy(syscallbuf_flush_buffer_array.data(), buf.data,
          current_step.flush.num_rec_bytes_remaining);
 
   // The stored num_rec_bytes in the header doesn't include the
@@ -1125,6 +1159,39 @@ static void restore_futex_words(Task* t, const struct syscallbuf_record* rec) {
   }
 }
 
+/**
+ * Emulated buffered syscalls normally finish by single-stepping out of the
+ * syscall-entry stop. When the next record in the flush is another
+ * emulated syscall without desched ioctls and we're about to run straight
+ * to it, that step can be skipped: resuming from the entry stop with
+ * PTRACE_SYSEMU skips the syscall just the same, and the syscallbuf's
+ * instruction after the syscall then runs once rather than twice. That
+ * halves the stops for runs of small buffered syscalls.
+ *
+ * We don't do this when there's a ticks target, since
+ * cont_syscall_boundary() can then return without resuming the task and
+ * leave it in the entry stop for other code to see.
+ */
+static bool can_skip_emulated_syscall_exit(
+    Task* t, const syscallbuf_hdr* flush_hdr,
+    const ReplayFlushBufferedSyscallState& flush,
+    const ReplaySession::StepConstraints& constraints) {
+  if (constraints.command != RUN_CONTINUE || constraints.ticks_target > 0 ||
+      !t->is_in_untraced_syscall()) {
+    return false;
+  }
+  const struct syscallbuf_record* rec =
+      (const struct syscallbuf_record*)((uint8_t*)flush_hdr->recs +
+                                        flush.syscall_record_offset);
+  size_t rec_size = stored_record_size(rec->size);
+  if (rec->desched || flush.num_rec_bytes_remaining <= rec_size) {
+    return false;
+  }
+  const struct syscallbuf_record* next =
+      (const struct syscallbuf_record*)((uint8_t*)rec + rec_size);
+  return !next->desched && !is_madvise_syscall(next->syscallno, t->arch());
+}
+
 /**
  * Try to flush one buffered syscall as described by |flush|.  Return
  * INCOMPLETE if an unhandled interrupt occurred, and COMPLETE if the syscall
@@ -1198,7 +1265,10 @@ Completion ReplaySession::flush_one_syscall(
 
       assert_at_buffered_syscall(t, call);
 
-      // Restore saved trace data.
+      // Restore saved trace data. Buffered syscalls direct all their outputs
+      // (including scratch iovecs and msghdrs) into the record and copy them
+      // out afterwards, so this recreates them; only futex words, which
+      // must be used in place, need restoring separately below.
       memcpy(child_rec->extra_data, rec_rec->extra_data, rec_rec->size);
 
       // Restore return value.
@@ -1209,7 +1279,9 @@ Completion ReplaySession::flush_one_syscall(
         }
         assert_at_buffered_syscall(t, call);
       }
-      if (emu == EMULATE) {
+      if (emu == EMULATE &&
+          !can_skip_emulated_syscall_exit(t, flush_hdr, current_step.flush,
+                                          constraints)) {
         t->finish_emulated_syscall();
       }
       Registers r = t->regs();
@@ -1283,6 +1355,30 @@ Completion ReplaySession::flush_syscallbuf(Task* t,
   return COMPLETE;
 }
 
+/**
+ * Called as each frame of |t| is retired. In traces that list the
+ * flush_resets section, flushes reset the buffer themselves instead of
+ * being followed by an EV_SYSCALLBUF_RESET; replay that reset once the
+ * frame after the flush, which is always |t|'s event that caused the
+ * flush, is done.
+ */
+void ReplaySession::retire_syscallbuf_reset(Task* t, const Event& ev) {
+  if (EV_SYSCALLBUF_FLUSH == ev.type()) {
+    syscallbuf_reset_pending = ev.SyscallbufFlush().reset;
+    ASSERT(t, !syscallbuf_reset_pending || trace_in.flush_resets())
+        << "Syscallbuf flush resets the buffer in a trace without a "
+           "flush_resets section";
+    return;
+  }
+  if (syscallbuf_reset_pending) {
+    // |t| is null if the task just exited.
+    if (t) {
+      t->syscallbuf_hdr->num_rec_bytes = 0;
+    }
+    syscallbuf_reset_pending = false;
+  }
+}
+
 Completion ReplaySession::patch_next_syscall(
     Task* t, const StepConstraints& constraints) {
   if (cont_syscall_boundary(t, EMULATE, constraints) == INCOMPLETE) {
@@ -1347,6 +1443,28 @@ static bool is_in_exec_syscall(Task* t) {
  * |step| was made, or INCOMPLETE if there was a trap or |step| needs
  * more work.
  */
+static const char* replay_step_name(ReplayTraceStepType action) {
+  switch (action) {
+#define CASE(_id)                                                              \
+  case TSTEP_##_id:                                                            \
+    return #_id
+    CASE(NONE);
+    CASE(ENTER_SYSCALL);
+    CASE(EXIT_SYSCALL);
+    CASE(DETERMINISTIC_SIGNAL);
+    CASE(PROGRAM_ASYNC_SIGNAL_INTERRUPT);
+    CASE(DELIVER_SIGNAL);
+    CASE(FLUSH_SYSCALLBUF);
+    CASE(PATCH_SYSCALL);
+    CASE(DESCHED);
+    CASE(EXIT_TASK);
+    CASE(RETIRE);
+#undef CASE
+    default:
+      return "???";
+  }
+}
+
 Completion ReplaySession::try_one_trace_step(
     Task* t, const StepConstraints& constraints) {
   if (constraints.ticks_target > 0 &&
@@ -1554,6 +1672,7 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
     setup_replay_one_trace_frame(t);
     if (current_step.action == TSTEP_NONE) {
       // Already at the destination event.
+      retire_syscallbuf_reset(t, trace_frame.event());
       advance_to_next_trace_frame(constraints.stop_at_time);
     }
     if (current_step.action == TSTEP_EXIT_TASK) {
@@ -1570,7 +1689,17 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
 
   /* Advance towards fulfilling |current_step|. */
   ReplayTraceStepType current_action = current_step.action;
-  if (try_one_trace_step(t, constraints) == INCOMPLETE) {
+  RR_PROBE2(replay_step_start, t->tid, current_action);
+  Completion completion;
+  {
+    SelfProfiler::Span span("replay", t->tid);
+    if (span.enabled()) {
+      span.set_name(replay_step_name(current_action));
+    }
+    completion = try_one_trace_step(t, constraints);
+  }
+  RR_PROBE2(replay_step_done, t->tid, completion);
+  if (completion == INCOMPLETE) {
     if (EV_TRACE_TERMINATION == trace_frame.event().type()) {
       // An irregular trace step had to read the
       // next trace frame, and that frame was an
@@ -1617,7 +1746,7 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
     const Event& ev = trace_frame.event();
     if (can_validate() && ev.is_syscall_event() &&
         ::Flags::get().check_cached_mmaps) {
-      t->vm()->verify(t);
+      t->vm()->check_cached_mmaps(t);
     }
 
     if (has_deterministic_ticks(ev, current_step)) {
@@ -1626,6 +1755,14 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
 
     debug_memory(t);
 
+    if (EV_SYSCALL == ev.type() &&
+        (ENTERING_SYSCALL == ev.Syscall().state ||
+         EXITING_SYSCALL == ev.Syscall().state)) {
+      result.break_status.syscallno = ev.Syscall().number;
+      result.break_status.syscall_entry =
+          ENTERING_SYSCALL == ev.Syscall().state;
+    }
+
     if (constraints.is_singlestep() &&
         (EV_SEGV_RDTSC == ev.type() || EV_SIGNAL_HANDLER == ev.type())) {
       // We completed this RDTSC event, and that counts as a completed
@@ -1637,6 +1774,8 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
     check_approaching_ticks_target(t, constraints, result.break_status);
   }
 
+  retire_syscallbuf_reset(t, trace_frame.event());
+
   // Advance to next trace frame before doing rep_after_enter_syscall,
   // so that FdTable notifications run with the same trace timestamp during
   // replay as during recording
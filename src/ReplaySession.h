@@ -4,6 +4,7 @@
 #define RR_REPLAY_SESSION_H_
 
 #include <memory>
+#include <vector>
 
 #include "CPUIDBugDetector.h"
 #include "DiversionSession.h"
@@ -215,15 +216,21 @@ public:
 
   /**
    * Like |clone()|, but return a session in "diversion" mode,
-   * which allows free execution.
+   * which allows free execution. If |t| is non-null, only |t|'s task group
+   * is copied, which is much cheaper when there are many processes.
    */
-  DiversionSession::shr_ptr clone_diversion();
+  DiversionSession::shr_ptr clone_diversion(Task* t = nullptr);
 
   EmuFs& emufs() const { return *emu_fs; }
 
   /** Collect garbage files from this session's emufs. */
   void gc_emufs();
 
+  virtual void on_map_resource(const FileId& id) { emu_fs->note_mapped(id); }
+  virtual void on_unmap_resource(const FileId& id) {
+    emu_fs->note_unmapped(id);
+  }
+
   TraceReader& trace_reader() { return trace_in; }
   const TraceReader& trace_reader() const { return trace_in; }
 
@@ -303,18 +310,40 @@ public:
    */
   static bool is_ignored_signal(int sig);
 
+  /**
+   * Replay programs ticks interrupts this many ticks short of a target, to
+   * allow for the interrupt firing late. `rr calibrate` compares this
+   * against the skid measured on the host CPU.
+   */
+  static int skid_size();
+
   struct Flags {
-    Flags() : redirect_stdio(false) {}
+    Flags() : redirect_stdio(false), skip_verification(false) {}
     Flags(const Flags& other) = default;
     bool redirect_stdio;
+    // Don't compare registers and tick counts with the trace after each
+    // step. A divergence then goes unnoticed until replay can't continue.
+    bool skip_verification;
   };
   bool redirect_stdio() { return flags.redirect_stdio; }
 
+  /**
+   * Return true if tracee state should be checked against the trace:
+   * tracees are consistent and we weren't asked to skip verification.
+   */
+  bool should_verify() const {
+    return can_validate() && !flags.skip_verification;
+  }
+
   void set_flags(const Flags& flags) { this->flags = flags; }
 
 private:
   ReplaySession(const std::string& dir)
-      : emu_fs(EmuFs::create()), trace_in(dir), trace_frame(), current_step() {
+      : emu_fs(EmuFs::create()),
+        trace_in(dir),
+        trace_frame(),
+        current_step(),
+        syscallbuf_reset_pending(false) {
     advance_to_next_trace_frame(0);
   }
 
@@ -325,10 +354,11 @@ private:
         trace_frame(other.trace_frame),
         current_step(other.current_step),
         cpuid_bug_detector(other.cpuid_bug_detector),
-        flags(other.flags) {}
+        flags(other.flags),
+        syscallbuf_reset_pending(other.syscallbuf_reset_pending) {}
 
   const struct syscallbuf_hdr* syscallbuf_flush_buffer_hdr() {
-    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array;
+    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array.data();
   }
 
   void setup_replay_one_trace_frame(Task* t);
@@ -371,6 +401,7 @@ private:
   Completion flush_one_syscall(Task* t, const StepConstraints& constraints);
   Completion flush_syscallbuf(Task* t, const StepConstraints& constraints);
   Completion patch_next_syscall(Task* t, const StepConstraints& constraints);
+  void retire_syscallbuf_reset(Task* t, const Event& ev);
   void check_approaching_ticks_target(Task* t,
                                       const StepConstraints& constraints,
                                       BreakStatus& break_status);
@@ -383,18 +414,22 @@ private:
   CPUIDBugDetector cpuid_bug_detector;
   Flags flags;
   bool did_fast_forward;
+  /**
+   * True after replaying a flush that reset the syscallbuf during
+   * recording. The tracee only commits its last buffered record while
+   * replaying the frame after the flush, so the reset waits for that.
+   */
+  bool syscallbuf_reset_pending;
   /**
    * Buffer for recorded syscallbuf bytes.  By definition buffer flushes
    * must be replayed sequentially, so we can use one buffer for all
    * tracees.  At the start of the flush, the recorded bytes are read
    * back into this buffer.  Then they're copied back to the tracee
    * record-by-record, as the tracee exits those syscalls.
-   * This needs to be word-aligned.
+   * This needs to be word-aligned, so it's made of uint64_ts, and it
+   * grows to fit the largest syscallbuf flushed so far.
    */
-  union {
-    uint8_t syscallbuf_flush_buffer_array[SYSCALLBUF_BUFFER_SIZE];
-    uint64_t align_padding;
-  };
+  std::vector<uint64_t> syscallbuf_flush_buffer_array;
 };
 
 #endif // RR_REPLAY_SESSION_H_
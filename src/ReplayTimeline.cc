@@ -4,10 +4,24 @@
 
 #include "ReplayTimeline.h"
 
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <set>
+
+#include "AutoRemoteSyscalls.h"
 #include "fast_forward.h"
+#include "Flags.h"
+#include "kernel_supplement.h"
 #include "log.h"
+#include "probes.h"
 
 using namespace rr;
 using namespace std;
@@ -65,13 +79,25 @@ ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session,
                                const ReplaySession::Flags& session_flags)
     : session_flags(session_flags),
       current(std::move(session)),
+      marks_created(0),
+      marks_needing_replay(0),
       breakpoints_applied(false),
-      reverse_execution_barrier_event(0) {
+      catching_syscalls(false),
+      reverse_execution_barrier_event(0),
+      checkpoint_memory_budget(0),
+      checkpoint_uses(0),
+      replay_speed_ratio(1),
+      speed_sample_progress(0),
+      speed_sample_microseconds(0),
+      timeline_log(nullptr) {
   current->set_visible_execution(false);
   current->set_flags(session_flags);
 }
 
 ReplayTimeline::~ReplayTimeline() {
+  if (timeline_log) {
+    fclose(timeline_log);
+  }
   for (auto it : marks) {
     for (shared_ptr<InternalMark>& itv : it.second) {
       itv->owner = nullptr;
@@ -114,14 +140,67 @@ shared_ptr<ReplayTimeline::InternalMark> ReplayTimeline::current_mark() {
   return shared_ptr<InternalMark>();
 }
 
+static bool equal_extra_regs(const ExtraRegisters& r1,
+                             const ExtraRegisters& r2) {
+  return r1.format() == r2.format() && r1.arch() == r2.arch() &&
+         r1.data_size() == r2.data_size() &&
+         !memcmp(r1.data_bytes(), r2.data_bytes(), r1.data_size());
+}
+
+shared_ptr<const ExtraRegisters> ReplayTimeline::share_extra_regs(
+    const ExtraRegisters& regs) {
+  if (!last_extra_regs || !equal_extra_regs(*last_extra_regs, regs)) {
+    last_extra_regs = make_shared<ExtraRegisters>(regs);
+  }
+  return last_extra_regs;
+}
+
+/**
+ * mark() calls collect_unreferenced_marks() every this many new marks.
+ */
+static const uint64_t MARK_COLLECTION_INTERVAL = 4096;
+
+void ReplayTimeline::collect_unreferenced_marks() {
+  for (auto it = marks.begin(); it != marks.end();) {
+    auto& mark_vector = it->second;
+    size_t kept = 0;
+    for (size_t i = 0; i < mark_vector.size(); ++i) {
+      shared_ptr<InternalMark>& m = mark_vector[i];
+      if (m.use_count() == 1 && !m->checkpoint) {
+        // The previous kept mark's successor changes.
+        if (kept > 0) {
+          mark_vector[kept - 1]->singlestep_to_next_mark_no_signal = false;
+        }
+        continue;
+      }
+      if (kept != i) {
+        swap(mark_vector[kept], m);
+      }
+      ++kept;
+    }
+    mark_vector.resize(kept);
+    if (mark_vector.empty()) {
+      it = marks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 ReplayTimeline::Mark ReplayTimeline::mark() {
   Mark result;
   auto cm = current_mark();
   if (cm) {
+    // We're exactly at cm, so until we seek we're at or after it. This lets
+    // a mark() after stepping forward from here take the cheap path below.
+    current_at_or_after_mark = cm;
     swap(cm, result.ptr);
     return result;
   }
 
+  if (++marks_created % MARK_COLLECTION_INTERVAL == 0) {
+    collect_unreferenced_marks();
+  }
   MarkKey key = current_mark_key();
   Task* t = current->current_task();
   shared_ptr<InternalMark> m = make_shared<InternalMark>(this, t, key);
@@ -134,6 +213,9 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
   } else {
     // Now the hard part: figuring out where to put it in the list of existing
     // marks.
+    ++marks_needing_replay;
+    double start = now_sec();
+    size_t steps = 0;
     unapply_breakpoints_and_watchpoints();
     ReplaySession::shr_ptr tmp_session = current->clone();
     vector<shared_ptr<InternalMark> >::iterator mark_index = mark_vector.end();
@@ -157,6 +239,7 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
 
     while (true) {
       auto result = tmp_session->replay_step(constraints);
+      ++steps;
       if (session_mark_key(*tmp_session) != key ||
           result.status != REPLAY_CONTINUE) {
         break;
@@ -193,6 +276,12 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
     }
 
     LOG(debug) << "Mark location found";
+    if (Flags::get().verbose) {
+      fprintf(stderr, "rr: mark() cloned and replayed %zu steps in %.1fms "
+                      "(%" PRIu64 " of %" PRIu64 " new marks needed this)\n",
+              steps, (now_sec() - start) * 1000, marks_needing_replay,
+              marks_created);
+    }
 
     // mark_index is the current index of the next mark after 'current'. So
     // insert our new marks at mark_index.
@@ -260,6 +349,7 @@ ReplayTimeline::Mark ReplayTimeline::add_explicit_checkpoint() {
   Mark m = mark();
   if (!m.ptr->checkpoint) {
     unapply_breakpoints_and_watchpoints();
+    RR_PROBE1(checkpoint_create, m.ptr->key.trace_time);
     m.ptr->checkpoint = current->clone();
     auto key = m.ptr->key;
     if (marks_with_checkpoints.find(key) == marks_with_checkpoints.end()) {
@@ -267,6 +357,8 @@ ReplayTimeline::Mark ReplayTimeline::add_explicit_checkpoint() {
     } else {
       marks_with_checkpoints[key]++;
     }
+    note_checkpoint_use(*m.ptr);
+    page_out_cold_checkpoints();
   }
   ++m.ptr->checkpoint_refcount;
   return m;
@@ -313,11 +405,13 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
       for (auto mark_it : marks[it->first]) {
         shared_ptr<InternalMark> m(mark_it);
         if (m->checkpoint) {
+          RR_PROBE1(checkpoint_restore, m->key.trace_time);
           current = m->checkpoint->clone();
           // At this point, m->checkpoint is fully initialized but current
           // is not. Swap them so that m->checkpoint is not fully
           // initialized, to reduce resource usage.
           swap(current, m->checkpoint);
+          note_checkpoint_use(*m);
           break;
         }
       }
@@ -347,11 +441,13 @@ void ReplayTimeline::seek_up_to_mark(const Mark& mark) {
       at_or_before_mark = true;
     }
     if (at_or_before_mark && m->checkpoint) {
+      RR_PROBE1(checkpoint_restore, m->key.trace_time);
       current = m->checkpoint->clone();
       // At this point, m->checkpoint is fully initialized but current
       // is not. Swap them so that m->checkpoint is not fully
       // initialized, to reduce resource usage.
       swap(current, m->checkpoint);
+      note_checkpoint_use(*m);
       breakpoints_applied = false;
       current_at_or_after_mark = m;
       return;
@@ -506,13 +602,21 @@ void ReplayTimeline::seek_to_proto_mark(const ProtoMark& pmark) {
 }
 
 void ReplayTimeline::seek_to_mark(const Mark& mark) {
+  Progress from = timeline_log ? estimate_progress() : 0;
   seek_up_to_mark(mark);
+  Progress restored = timeline_log ? estimate_progress() : 0;
   while (current_mark() != mark.ptr) {
     unapply_breakpoints_and_watchpoints();
     ReplayStepToMarkStrategy strategy;
     replay_step_to_mark(mark, strategy);
   }
   current_at_or_after_mark = mark.ptr;
+  if (timeline_log) {
+    Progress to = estimate_progress();
+    fprintf(timeline_log, "{\"event\":\"seek\",\"from\":%lld,\"to\":%lld,"
+                          "\"replayed\":%lld}\n",
+            (long long)from, (long long)to, (long long)(to - restored));
+  }
   // XXX handle cases where breakpoints can't yet be applied
 }
 
@@ -788,10 +892,12 @@ ReplayResult ReplayTimeline::reverse_continue(
         break;
       }
       // If there is a breakpoint at the current ip() where we start a
-      // reverse-continue, gdb expects us to skip it.
-      if (result.break_status.breakpoint_hit) {
+      // reverse-continue, gdb expects us to skip it. Likewise a caught
+      // syscall we're stopped at.
+      if (result.break_status.breakpoint_hit ||
+          result.break_status.syscall_caught) {
         dest = mark();
-        LOG(debug) << "Found breakpoint break at " << dest;
+        LOG(debug) << "Found breakpoint or syscall break at " << dest;
         final_result = result;
         final_tuid = result.break_status.task ? result.break_status.task->tuid()
                                               : TaskUid();
@@ -974,6 +1080,11 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
   }
   auto auid = t->vm()->uid();
 
+  int syscallno = result.break_status.syscallno;
+  result.break_status.syscall_caught =
+      catching_syscalls && syscallno >= 0 &&
+      (caught_syscalls.empty() || caught_syscalls.count(syscallno));
+
   if (result.break_status.breakpoint_hit) {
     auto addr = t->ip();
     auto it = breakpoints.lower_bound(make_tuple(auid, addr, nullptr));
@@ -1023,11 +1134,14 @@ ReplayResult ReplayTimeline::replay_step(
   if (direction == RUN_FORWARD) {
     apply_breakpoints_and_watchpoints();
     ProtoMark before = proto_mark();
+    Progress progress_before = estimate_progress();
+    double start_time = now_sec();
     current->set_visible_execution(true);
     ReplaySession::StepConstraints constraints(command);
     constraints.stop_at_time = stop_at_time;
     result = current->replay_step(constraints);
     current->set_visible_execution(false);
+    note_replay_speed(progress_before, now_sec() - start_time);
     if (command == RUN_CONTINUE) {
       // Since it's easy for us to fix the coalescing quirk for forward
       // execution, we may as well do so. It's nice to have forward execution
@@ -1085,6 +1199,42 @@ ReplayTimeline::Progress ReplayTimeline::estimate_progress() {
                   microseconds_constant);
 }
 
+/**
+ * Update replay_speed_ratio after this much estimated replay time, so short
+ * singlesteps don't make it noisy.
+ */
+static const ReplayTimeline::Progress replay_speed_sample_length = 200000;
+
+/**
+ * Limit how far replay_speed_ratio moves from the fixed estimate.
+ */
+static const double max_replay_speed_ratio = 16;
+
+void ReplayTimeline::note_replay_speed(Progress before, double seconds) {
+  Progress advanced = estimate_progress() - before;
+  if (advanced <= 0) {
+    return;
+  }
+  speed_sample_progress += advanced;
+  speed_sample_microseconds += seconds * 1000000;
+  if (speed_sample_progress < replay_speed_sample_length) {
+    return;
+  }
+
+  double ratio = speed_sample_microseconds / speed_sample_progress;
+  ratio = min(max(ratio, 1 / max_replay_speed_ratio), max_replay_speed_ratio);
+  // Smooth across samples; workloads switch between compute-bound and
+  // syscall-bound phases often.
+  replay_speed_ratio = 0.75 * replay_speed_ratio + 0.25 * ratio;
+  LOG(debug) << "Replay speed ratio now " << replay_speed_ratio;
+  speed_sample_progress = 0;
+  speed_sample_microseconds = 0;
+}
+
+ReplayTimeline::Progress ReplayTimeline::calibrated_interval(Progress len) {
+  return Progress(len / replay_speed_ratio);
+}
+
 /*
  * Checkpointing strategy:
  *
@@ -1153,7 +1303,8 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
   Progress now = estimate_progress();
   auto it = reverse_exec_checkpoints.rbegin();
   if (it != reverse_exec_checkpoints.rend() &&
-      it->second >= now - inter_checkpoint_interval(strategy)) {
+      it->second >=
+          now - calibrated_interval(inter_checkpoint_interval(strategy))) {
     // Latest checkpoint is close enough; we don't need to do anything.
     return;
   }
@@ -1168,6 +1319,173 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
   discard_past_reverse_exec_checkpoints(strategy);
 
   reverse_exec_checkpoints[add_explicit_checkpoint()] = now;
+  if (timeline_log) {
+    fprintf(timeline_log,
+            "{\"event\":\"add\",\"progress\":%lld,\"memory\":%llu}\n",
+            (long long)now, (unsigned long long)checkpoint_memory());
+  }
+  enforce_checkpoint_memory_budget();
+}
+
+void ReplayTimeline::set_timeline_log(const string& path) {
+  timeline_log = fopen(path.c_str(), "w");
+  if (!timeline_log) {
+    FATAL() << "Can't open timeline log " << path;
+  }
+}
+
+void ReplayTimeline::discard_reverse_exec_checkpoint(const Mark& m) {
+  auto it = reverse_exec_checkpoints.find(m);
+  assert(it != reverse_exec_checkpoints.end());
+  if (timeline_log) {
+    fprintf(timeline_log, "{\"event\":\"remove\",\"progress\":%lld}\n",
+            (long long)it->second);
+  }
+  remove_explicit_checkpoint(m);
+  reverse_exec_checkpoints.erase(it);
+}
+
+void ReplayTimeline::note_checkpoint_use(InternalMark& m) {
+  m.checkpoint_last_use = ++checkpoint_uses;
+  // A restore swaps in a fresh clone, whose pages are all resident.
+  m.checkpoint_paged_out = false;
+}
+
+/**
+ * A checkpoint is cold when this many other checkpoints have been created
+ * or restored since it was last used.
+ */
+static const uint64_t COLD_CHECKPOINT_AGE = 4;
+
+static bool page_out_unsupported = false;
+
+/**
+ * Page out the private writable memory of |vm|, whose process is |t|.
+ * Uses process_madvise when we're allowed to (it needs CAP_SYS_NICE on
+ * recent kernels), otherwise makes |t| call madvise itself.
+ */
+static void page_out_address_space(Task* t, AddressSpace* vm) {
+  vector<struct iovec> ranges;
+  for (auto& kv : vm->memmap()) {
+    const Mapping& m = kv.first;
+    if ((m.prot & PROT_WRITE) && (m.flags & MAP_PRIVATE)) {
+      struct iovec range = { (void*)m.start.as_int(), m.num_bytes() };
+      ranges.push_back(range);
+    }
+  }
+
+  int pidfd = ::syscall(SYS_pidfd_open, t->real_tgid(), 0);
+  bool done = false;
+  if (pidfd >= 0) {
+    done = true;
+    for (size_t i = 0; i < ranges.size(); i += UIO_MAXIOV) {
+      size_t count = min(ranges.size() - i, size_t(UIO_MAXIOV));
+      if (::syscall(SYS_process_madvise, pidfd, &ranges[i], count,
+                    MADV_PAGEOUT, 0) < 0 &&
+          errno != ENOMEM) {
+        done = false;
+        break;
+      }
+    }
+    close(pidfd);
+  }
+  if (done) {
+    return;
+  }
+
+  AutoRemoteSyscalls remote(t);
+  for (auto& range : ranges) {
+    long ret = remote.syscall(syscall_number_for_madvise(remote.arch()),
+                              range.iov_base, range.iov_len, MADV_PAGEOUT);
+    if (ret == -EINVAL) {
+      LOG(debug) << "MADV_PAGEOUT not supported; not paging out checkpoints";
+      page_out_unsupported = true;
+      return;
+    }
+  }
+}
+
+void ReplayTimeline::page_out_cold_checkpoints() {
+  if (page_out_unsupported) {
+    return;
+  }
+  for (auto& it : marks) {
+    for (shared_ptr<InternalMark>& m : it.second) {
+      if (!m->checkpoint || m->checkpoint_paged_out ||
+          m->checkpoint_last_use + COLD_CHECKPOINT_AGE > checkpoint_uses) {
+        continue;
+      }
+      LOG(debug) << "Paging out cold checkpoint " << *m;
+      for (AddressSpace* vm : m->checkpoint->vms()) {
+        if (!vm->task_set().empty() && !page_out_unsupported) {
+          page_out_address_space(*vm->task_set().begin(), vm);
+        }
+      }
+      m->checkpoint_paged_out = true;
+    }
+  }
+}
+
+/**
+ * Return the PSS of process |tid| in bytes, or 0 if it can't be read.
+ */
+static uint64_t read_pss(pid_t tid) {
+  char path[64];
+  // smaps_rollup is much cheaper, but only exists on Linux >= 4.14.
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    snprintf(path, sizeof(path), "/proc/%d/smaps", tid);
+    f = fopen(path, "r");
+    if (!f) {
+      return 0;
+    }
+  }
+  uint64_t total_kb = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long kb;
+    if (sscanf(line, "Pss: %llu kB", &kb) == 1) {
+      total_kb += kb;
+    }
+  }
+  fclose(f);
+  return total_kb * 1024;
+}
+
+uint64_t ReplayTimeline::checkpoint_memory() {
+  set<ReplaySession*> sessions;
+  for (auto& it : marks) {
+    for (shared_ptr<InternalMark>& m : it.second) {
+      if (m->checkpoint) {
+        sessions.insert(m->checkpoint.get());
+      }
+    }
+  }
+  uint64_t total = 0;
+  for (ReplaySession* s : sessions) {
+    for (AddressSpace* vm : s->vms()) {
+      if (!vm->task_set().empty()) {
+        total += read_pss((*vm->task_set().begin())->tid);
+      }
+    }
+  }
+  return total;
+}
+
+void ReplayTimeline::enforce_checkpoint_memory_budget() {
+  if (!checkpoint_memory_budget) {
+    return;
+  }
+  while (reverse_exec_checkpoints.size() > 1) {
+    uint64_t used = checkpoint_memory();
+    if (used <= checkpoint_memory_budget) {
+      break;
+    }
+    Mark m = reverse_exec_checkpoints.begin()->first;
+    LOG(debug) << "Checkpoints use " << used << " bytes, discarding " << m;
+    discard_reverse_exec_checkpoint(m);
+  }
 }
 
 void ReplayTimeline::discard_future_reverse_exec_checkpoints() {
@@ -1177,8 +1495,7 @@ void ReplayTimeline::discard_future_reverse_exec_checkpoints() {
     if (it == reverse_exec_checkpoints.rend() || it->second < now) {
       break;
     }
-    remove_explicit_checkpoint(it->first);
-    reverse_exec_checkpoints.erase(it->first);
+    discard_reverse_exec_checkpoint(it->first);
   }
 }
 
@@ -1193,7 +1510,7 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
   vector<Mark> checkpoints_to_delete;
   for (Progress len = inter_checkpoint_interval(strategy);;
        len = next_interval_length(len)) {
-    Progress start = now - len;
+    Progress start = now - calibrated_interval(len);
     // Count checkpoints >= start, starting at 'it', and leave the first
     // checkpoint entry < start in 'tmp_it'.
     auto tmp_it = it;
@@ -1216,8 +1533,7 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
   }
 
   for (auto& m : checkpoints_to_delete) {
-    remove_explicit_checkpoint(m);
-    reverse_exec_checkpoints.erase(m);
+    discard_reverse_exec_checkpoint(m);
   }
 }
 
@@ -28,7 +28,7 @@ private:
 public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session,
                  const ReplaySession::Flags& session_flags);
-  ReplayTimeline() : breakpoints_applied(false) {}
+  ReplayTimeline() : breakpoints_applied(false), catching_syscalls(false) {}
   ~ReplayTimeline();
 
   bool is_running() const { return current != nullptr; }
@@ -62,7 +62,7 @@ public:
      * Return the values of the general-purpose registers at this mark.
      */
     const Registers& regs() const { return ptr->regs; }
-    const ExtraRegisters& extra_regs() const { return ptr->extra_regs; }
+    const ExtraRegisters& extra_regs() const { return *ptr->extra_regs; }
 
   private:
     friend class ReplayTimeline;
@@ -143,6 +143,20 @@ public:
   bool has_watchpoint_at_address(Task* t, remote_ptr<void> addr,
                                  size_t num_bytes, WatchType type);
 
+  /**
+   * Stop at entry to and exit from the syscalls in |syscalls|, or all
+   * syscalls if |syscalls| is empty, while executing in either direction.
+   * Unbuffered syscalls only; buffered syscalls don't have their own events.
+   */
+  void catch_syscalls(const std::vector<int>& syscalls) {
+    catching_syscalls = true;
+    caught_syscalls = std::set<int>(syscalls.begin(), syscalls.end());
+  }
+  void stop_catching_syscalls() {
+    catching_syscalls = false;
+    caught_syscalls.clear();
+  }
+
   /**
    * Ensure that reverse execution never proceeds into an event before
    * |event|. Reverse execution will stop with a |task_exit| break status when
@@ -152,6 +166,27 @@ public:
     reverse_execution_barrier_event = event;
   }
 
+  /**
+   * While checkpoint processes use more than |bytes| of memory, discard
+   * reverse-execution checkpoints, farthest in the past first. Explicit
+   * checkpoints are never discarded. 0 means no limit.
+   */
+  void set_checkpoint_memory_budget(uint64_t bytes) {
+    checkpoint_memory_budget = bytes;
+  }
+  /**
+   * Memory used by all checkpoint processes, measured as the sum of their
+   * PSS so pages shared between checkpoints are only counted once.
+   */
+  uint64_t checkpoint_memory();
+
+  /**
+   * Append a JSON object per line to |path| for every reverse-exec
+   * checkpoint added or removed and every seek to a mark, for
+   * src/script/checkpoint-visualizer.html.
+   */
+  void set_timeline_log(const std::string& path);
+
   // State-changing APIs. These may alter state associated with
   // current_session().
 
@@ -293,12 +328,15 @@ private:
         : owner(owner),
           key(key),
           checkpoint_refcount(0),
+          checkpoint_last_use(0),
+          checkpoint_paged_out(false),
           singlestep_to_next_mark_no_signal(false) {
       if (t) {
         regs = t->regs();
         return_addresses = t->return_addresses();
-        extra_regs = t->extra_regs();
       }
+      extra_regs = owner->share_extra_regs(t ? t->extra_regs()
+                                             : ExtraRegisters());
     }
     ~InternalMark();
 
@@ -309,10 +347,16 @@ private:
     ReplayTimeline* owner;
     MarkKey key;
     Registers regs;
-    ExtraRegisters extra_regs;
+    // Usually shared with neighbouring marks; see share_extra_regs().
+    std::shared_ptr<const ExtraRegisters> extra_regs;
     ReturnAddressList return_addresses;
     ReplaySession::shr_ptr checkpoint;
     uint32_t checkpoint_refcount;
+    // Value of ReplayTimeline::checkpoint_uses when |checkpoint| was
+    // created or last restored.
+    uint64_t checkpoint_last_use;
+    // Whether page_out_cold_checkpoints has paged out |checkpoint|.
+    bool checkpoint_paged_out;
     // The next InternalMark in the mark vector is the result of singlestepping
     // from this mark *and* no signal is reported in the break_status.
     bool singlestep_to_next_mark_no_signal;
@@ -329,6 +373,21 @@ private:
    */
   void unapply_breakpoints_and_watchpoints();
 
+  /**
+   * Return a shared copy of |regs|. FP/vector state rarely changes between
+   * consecutive marks, so reusing the last mark's copy when it's equal saves
+   * a full XSAVE area per mark.
+   */
+  std::shared_ptr<const ExtraRegisters> share_extra_regs(
+      const ExtraRegisters& regs);
+
+  /**
+   * Drop marks that nothing but |marks| refers to and that have no
+   * checkpoint. They can always be recreated, at worst by replaying to find
+   * their place again.
+   */
+  void collect_unreferenced_marks();
+
   static MarkKey session_mark_key(ReplaySession& session) {
     Task* t = session.current_task();
     return MarkKey(session.trace_reader().time(), t ? t->tick_count() : 0,
@@ -372,6 +431,15 @@ private:
   static bool less_than(const Mark& m1, const Mark& m2);
 
   Progress estimate_progress();
+  /**
+   * Fold a forward replay that advanced from |before| in |seconds| of wall
+   * clock time into replay_speed_ratio.
+   */
+  void note_replay_speed(Progress before, double seconds);
+  /**
+   * Convert |len| microseconds of real replay time into Progress units.
+   */
+  Progress calibrated_interval(Progress len);
 
   /**
    * Called when the current session has moved forward to a new execution
@@ -391,6 +459,26 @@ private:
    * useless).
    */
   void discard_future_reverse_exec_checkpoints();
+  /**
+   * Discard reverse-exec checkpoints in the past until we're within
+   * checkpoint_memory_budget. The most recent one is always kept.
+   */
+  void enforce_checkpoint_memory_budget();
+  /**
+   * Remove |m| from reverse_exec_checkpoints and drop its checkpoint.
+   */
+  void discard_reverse_exec_checkpoint(const Mark& m);
+  /**
+   * Record that |m|'s checkpoint was just created or restored.
+   */
+  void note_checkpoint_use(InternalMark& m);
+  /**
+   * Ask the kernel to page out the private memory of checkpoints that
+   * haven't been created or restored recently. Checkpoints are rarely
+   * touched after they're made, so this lets many more of them fit in
+   * RAM, at the cost of slower restores of cold ones.
+   */
+  void page_out_cold_checkpoints();
 
   Mark set_short_checkpoint();
 
@@ -429,11 +517,23 @@ private:
    */
   std::map<MarkKey, uint32_t> marks_with_checkpoints;
 
+  /**
+   * Number of new marks created by mark(), and how many of those had to
+   * clone the session and replay to find their place. Reported with -V.
+   */
+  uint64_t marks_created;
+  uint64_t marks_needing_replay;
+
+  std::shared_ptr<const ExtraRegisters> last_extra_regs;
+
   std::set<std::tuple<AddressSpaceUid, remote_code_ptr,
                       std::unique_ptr<BreakpointCondition> > > breakpoints;
   std::set<std::tuple<AddressSpaceUid, remote_ptr<void>, size_t, WatchType,
                       std::unique_ptr<BreakpointCondition> > > watchpoints;
   bool breakpoints_applied;
+  bool catching_syscalls;
+  // Empty to catch every syscall.
+  std::set<int> caught_syscalls;
 
   TraceFrame::Time reverse_execution_barrier_event;
 
@@ -442,6 +542,29 @@ private:
    */
   std::map<Mark, Progress> reverse_exec_checkpoints;
 
+  uint64_t checkpoint_memory_budget;
+
+  /**
+   * Number of checkpoint creations and restores so far; see
+   * InternalMark::checkpoint_last_use.
+   */
+  uint64_t checkpoint_uses;
+
+  /**
+   * Measured wall-clock replay time divided by estimate_progress()'s
+   * prediction. Starts at 1 and is updated as we replay forward, so
+   * checkpoint spacing tracks how fast this trace actually replays.
+   */
+  double replay_speed_ratio;
+  /**
+   * Progress and wall-clock microseconds replayed since replay_speed_ratio
+   * was last updated.
+   */
+  Progress speed_sample_progress;
+  double speed_sample_microseconds;
+
+  FILE* timeline_log;
+
   /**
    * When these are non-null, then when singlestepping from
    * no_break_interval_start to no_break_interval_end, none of the currently
@@ -16,12 +16,15 @@
 #include <sys/wait.h>
 
 #include <algorithm>
+#include <limits>
 
 #include "Flags.h"
 #include "log.h"
+#include "kernel_abi.h"
 #include "RecordSession.h"
 #include "task.h"
 
+using namespace rr;
 using namespace std;
 
 static void note_switch(Task* prev_t, Task* t, int max_events) {
@@ -46,11 +49,48 @@ Task* Scheduler::get_next_task_with_same_priority(Task* t) {
   return it->second;
 }
 
+/**
+ * Collect pending wait statuses of tracees blocked in syscalls, so that
+ * finding a runnable task needs no waitpid() per task. waitid(WNOWAIT)
+ * tells us which tracee has a status without consuming it; if that's a
+ * blocked task we reap it with try_wait() and look for the next one. Tasks
+ * reaped here are no longer running, which is_task_runnable() notices.
+ * (pidfds can't replace this: they only become readable when a tracee
+ * exits, not at ptrace stops.)
+ *
+ * Returns true if some tracee still has a status we couldn't attribute to a
+ * blocked task, in which case every blocked task has to be probed.
+ */
+bool Scheduler::collect_tracee_statuses() {
+  while (true) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    int ret = waitid(P_ALL, 0, &info,
+                     WEXITED | WSTOPPED | WNOHANG | WNOWAIT | __WALL);
+    // If waitid fails for some reason, fall back to probing every task.
+    if (ret < 0) {
+      return true;
+    }
+    if (info.si_pid == 0) {
+      return false;
+    }
+    Task* t = session.find_task(info.si_pid);
+    if (!t || t->unstable || t->emulated_stop_type != NOT_STOPPED ||
+        !t->may_be_blocked() || !t->is_running() || !t->try_wait()) {
+      return true;
+    }
+    LOG(debug) << "  collected status " << HEX(t->status()) << " for "
+               << t->tid;
+  }
+}
+
 /**
  * Returns true if we should return t as the runnable task. Otherwise we
- * should check the next task.
+ * should check the next task. If |status_pending| is false, no tracee has
+ * changed state since we last waited, so tasks blocked in syscalls can't
+ * be runnable and we don't need to probe them.
  */
-static bool is_task_runnable(Task* t, bool* by_waitpid) {
+static bool is_task_runnable(Task* t, bool status_pending, bool* by_waitpid) {
   if (t->unstable) {
     LOG(debug) << "  " << t->tid << " is unstable, doing waitpid(-1)";
     return true;
@@ -66,6 +106,20 @@ static bool is_task_runnable(Task* t, bool* by_waitpid) {
     return true;
   }
 
+  if (!t->is_running()) {
+    LOG(debug) << "  " << t->tid << " was blocked on " << t->ev()
+               << "; already has status " << HEX(t->status());
+    t->pseudo_blocked = false;
+    *by_waitpid = true;
+    return true;
+  }
+
+  if (!status_pending && !t->pseudo_blocked) {
+    LOG(debug) << "  " << t->tid << " is blocked on " << t->ev()
+               << " and no tracee has changed state";
+    return false;
+  }
+
   LOG(debug) << "  " << t->tid << " is blocked on " << t->ev()
              << "; checking status ...";
   bool did_wait_for_t;
@@ -89,13 +143,18 @@ static bool is_task_runnable(Task* t, bool* by_waitpid) {
 Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
   *by_waitpid = false;
 
+  // With many tasks blocked in syscalls, probing each of them with
+  // waitpid() for every scheduling decision is expensive. Instead we
+  // collect the statuses that are pending up front.
+  bool status_pending = collect_tracee_statuses();
+
   while (true) {
     Task* t = get_next_round_robin_task();
     if (!t) {
       break;
     }
     LOG(debug) << "Choosing task " << t->tid << " from yield queue";
-    if (is_task_runnable(t, by_waitpid)) {
+    if (is_task_runnable(t, status_pending, by_waitpid)) {
       return t;
     }
     // This task had its chance to run but couldn't. Move to the
@@ -120,7 +179,7 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
     do {
       Task* t = task_iterator->second;
 
-      if (is_task_runnable(t, by_waitpid)) {
+      if (!is_starved(t) && is_task_runnable(t, status_pending, by_waitpid)) {
         return t;
       }
 
@@ -133,20 +192,145 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
     same_priority_start = same_priority_end;
   }
 
+  if (starved_task &&
+      is_task_runnable(starved_task, status_pending, by_waitpid)) {
+    // Nothing else can run. Starving it any longer would just stall us.
+    return starved_task;
+  }
   return nullptr;
 }
 
-#ifdef MONITOR_UNSWITCHABLE_WAITS
+Task* Scheduler::find_random_runnable_task(bool* by_waitpid) {
+  *by_waitpid = false;
+
+  bool status_pending = collect_tracee_statuses();
+
+  vector<Task*> tasks;
+  for (auto& p : task_priority_set) {
+    if (!is_starved(p.second)) {
+      tasks.push_back(p.second);
+    }
+  }
+  while (!tasks.empty()) {
+    size_t i = random() % tasks.size();
+    if (is_task_runnable(tasks[i], status_pending, by_waitpid)) {
+      return tasks[i];
+    }
+    tasks[i] = tasks.back();
+    tasks.pop_back();
+  }
+  return nullptr;
+}
+
+void Scheduler::make_chaos_decisions() {
+  // Timeslices are spread evenly on a log scale from max_ticks_ down to
+  // about a thousandth of it, so both very short and full timeslices are
+  // common.
+  current_timeslice_ = max<Ticks>(max_ticks_ >> (random() % 10), 1);
+
+  if (starve_decisions_left > 0) {
+    if (--starve_decisions_left == 0) {
+      starved_task = nullptr;
+    }
+  } else if (!(random() % 50) && task_priority_set.size() > 1) {
+    auto it = task_priority_set.begin();
+    advance(it, random() % task_priority_set.size());
+    starved_task = it->second;
+    starve_decisions_left = 10 + random() % 100;
+    LOG(debug) << "  chaos: starving " << starved_task->tid << " for "
+               << starve_decisions_left << " decisions";
+  }
+}
+
+Ticks Scheduler::timeslice_for(Task* t) const {
+  if (!t) {
+    return current_timeslice_;
+  }
+  if (t->spin_count) {
+    uint32_t shift = min<uint32_t>(t->spin_count, MAX_SPIN_SHIFT);
+    return min(current_timeslice_, max<Ticks>(max_ticks_ >> shift, 1));
+  }
+  if (t->timeslice_boost && !enable_chaos &&
+      max_ticks_ <= (numeric_limits<Ticks>::max() >> t->timeslice_boost)) {
+    return max_ticks_ << t->timeslice_boost;
+  }
+  return current_timeslice_;
+}
+
 /**
- * Get the current time from the preferred monotonic clock in units of
- * seconds, relative to an unspecific point in the past.
+ * Like is_task_runnable(), but never waits: tasks blocked in syscalls only
+ * count if we already have their status.
  */
-static double now_sec(void) {
-  struct timespec tp;
-  clock_gettime(CLOCK_MONOTONIC, &tp);
-  return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
+static bool is_task_ready(Task* t) {
+  if (t->unstable) {
+    return true;
+  }
+  return t->emulated_stop_type == NOT_STOPPED &&
+         (!t->may_be_blocked() || !t->is_running());
+}
+
+bool Scheduler::other_task_may_run(Task* t) const {
+  for (auto& p : task_priority_set) {
+    if (p.second != t && !is_starved(p.second) && is_task_ready(p.second)) {
+      return true;
+    }
+  }
+  for (Task* other : task_round_robin_queue) {
+    if (other != t && !is_starved(other) && is_task_ready(other)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Scheduler::on_timeslice_expired(Task* t) {
+  Registers regs = t->regs();
+  remote_code_ptr ip = regs.ip();
+  // Only ip and flags move around in a loop that polls memory without
+  // making progress.
+  regs.set_ip(remote_code_ptr());
+  regs.set_eflags(0);
+  bool no_progress = t->spin_ip != nullptr &&
+                     abs(ip - t->spin_ip) < SPIN_IP_RANGE &&
+                     regs.identical_to(t->spin_regs);
+  t->spin_ip = ip;
+  t->spin_regs = regs;
+  if (no_progress && other_task_may_run(t)) {
+    ++t->spin_count;
+    ++spins_detected_;
+    LOG(debug) << "  " << t->tid << " looks like it's spinning at " << ip
+               << " (" << t->spin_count << " timeslices); switching away";
+    // Same trick as for sched_yield: make the next decision prefer
+    // another task.
+    t->succ_event_counter = numeric_limits<int>::max() / 2;
+    t->timeslice_boost = 0;
+  } else {
+    t->spin_count = 0;
+    if (t->timeslice_boost < MAX_BOOST_SHIFT) {
+      ++t->timeslice_boost;
+    }
+  }
+}
+
+void Scheduler::on_syscall_entry(Task* t, int syscallno) {
+  t->spin_ip = nullptr;
+  if (t->timeslice_boost > 0) {
+    --t->timeslice_boost;
+  }
+  if (!is_sched_yield_syscall(syscallno, t->arch())) {
+    t->spin_count = 0;
+    t->yield_count = 0;
+    return;
+  }
+  // sched_yield already switches away; we just shorten the timeslices of
+  // tasks that do nothing but yield while others could run.
+  if (++t->yield_count >= SPIN_YIELD_COUNT && other_task_may_run(t)) {
+    ++t->spin_count;
+    ++spins_detected_;
+    LOG(debug) << "  " << t->tid << " is spinning on sched_yield ("
+               << t->yield_count << " in a row)";
+  }
 }
-#endif
 
 Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
                                  bool* by_waitpid) {
@@ -194,9 +378,22 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
     current = get_next_task_with_same_priority(current);
   }
 
-  Task* next = find_next_runnable_task(by_waitpid);
+  Task* next = nullptr;
+  current_timeslice_ = max_ticks_;
+  if (enable_chaos) {
+    make_chaos_decisions();
+    if (task_round_robin_queue.empty() && !(random() % 20)) {
+      // Ignore priorities for this decision.
+      next = find_random_runnable_task(by_waitpid);
+    }
+  }
+  if (!next) {
+    next = find_next_runnable_task(by_waitpid);
+  }
 
-  if (next && !next->unstable) {
+  // An unstable task we've already collected a status for won't show up in
+  // waitpid(-1) again.
+  if (next && (!next->unstable || !next->is_running())) {
     LOG(debug) << "  selecting task " << next->tid;
   } else {
     // All the tasks are blocked (or we found an unstable-exit task).
@@ -206,6 +403,7 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
 
     LOG(debug) << "  all tasks blocked or some unstable, waiting for runnable ("
                << task_priority_set.size() << " total)";
+    session.will_wait_for_blocked_tasks();
     do {
       tid = waitpid(-1, &status, __WALL | WSTOPPED | WUNTRACED);
       if (-1 == tid) {
@@ -232,6 +430,7 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
 
   note_switch(current, next, max_events);
   current = next;
+  current_timeslice_ = timeslice_for(current);
   return current;
 }
 
@@ -241,6 +440,10 @@ void Scheduler::on_create(Task* t) {
 }
 
 void Scheduler::on_destroy(Task* t) {
+  if (t == starved_task) {
+    starved_task = nullptr;
+    starve_decisions_left = 0;
+  }
   if (t == current) {
     current = get_next_task_with_same_priority(t);
     if (t == current) {
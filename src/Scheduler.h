@@ -30,6 +30,28 @@ class Task;
  * sched_yield are often expecting some kind of fair scheduling and may deadlock
  * (e.g. trying to acquire a spinlock) if some other tasks don't get a chance
  * to run.
+ *
+ * Tasks that spin waiting for another task (on an atomic, or calling
+ * sched_yield in a loop) would otherwise burn whole timeslices while the
+ * task they're waiting for can't run. When a task's timeslice expires with
+ * its ip in the same small range as its previous expiry and its other
+ * registers unchanged, and it hasn't made a traced syscall in between, it
+ * has made no progress, so we treat it as spinning. A compute loop at the
+ * same ip keeps changing its registers. If another task could run, we
+ * switch away from the spinning task as we do for sched_yield, and shorten
+ * its timeslices until it does something else.
+ *
+ * Timeslices also adapt to how tasks behave. Each time a task's timeslice
+ * expires without it spinning, its next timeslice is doubled, up to
+ * max-ticks << MAX_BOOST_SHIFT. Each traced syscall it makes halves it
+ * again, down to max-ticks. Compute-bound tasks therefore produce fewer
+ * EV_SCHED events. Tasks that mostly make syscalls keep the default
+ * timeslice, which they rarely use up anyway.
+ *
+ * In chaos mode the scheduler makes random decisions to shake out races that
+ * normal scheduling rarely triggers: each timeslice has a random length, tasks
+ * are sometimes scheduled without regard to priority, and every so often a
+ * randomly chosen task is starved for a while.
  */
 class Scheduler {
 public:
@@ -91,15 +113,49 @@ public:
    */
   enum { DEFAULT_MAX_TICKS = 250000 };
   enum { DEFAULT_MAX_EVENTS = 10 };
+  /**
+   * Timeslice expiries within this many bytes of the previous expiry's ip,
+   * with the same registers otherwise, count as the same spin loop. Each
+   * consecutive one halves the task's timeslice, down to
+   * max-ticks >> MAX_SPIN_SHIFT.
+   */
+  enum { SPIN_IP_RANGE = 256 };
+  enum { MAX_SPIN_SHIFT = 8 };
+  /**
+   * sched_yields in a row, with no other traced syscall in between, that
+   * we count as a spin.
+   */
+  enum { SPIN_YIELD_COUNT = 3 };
+  /**
+   * Compute-bound tasks get timeslices of up to max-ticks << MAX_BOOST_SHIFT.
+   */
+  enum { MAX_BOOST_SHIFT = 2 };
 
   Scheduler(RecordSession& session)
       : session(session),
         current(nullptr),
         max_ticks_(DEFAULT_MAX_TICKS),
-        max_events(DEFAULT_MAX_EVENTS) {}
+        current_timeslice_(DEFAULT_MAX_TICKS),
+        max_events(DEFAULT_MAX_EVENTS),
+        enable_chaos(false),
+        starved_task(nullptr),
+        starve_decisions_left(0),
+        spins_detected_(0) {}
 
-  void set_max_ticks(Ticks max_ticks) { max_ticks_ = max_ticks; }
+  void set_max_ticks(Ticks max_ticks) {
+    max_ticks_ = max_ticks;
+    current_timeslice_ = max_ticks;
+  }
   Ticks max_ticks() const { return max_ticks_; }
+  /**
+   * The number of ticks the task last returned by get_next_thread() may run
+   * for. This is max_ticks() adjusted for the task's behavior, or random in
+   * chaos mode.
+   */
+  Ticks current_timeslice() const { return current_timeslice_; }
+  void set_enable_chaos(bool enable_chaos) {
+    this->enable_chaos = enable_chaos;
+  }
   void set_max_events(TraceFrame::Time max_events) {
     this->max_events = max_events;
   }
@@ -131,6 +187,21 @@ public:
    */
   void schedule_one_round_robin(Task* last_task);
 
+  /**
+   * |t|'s timeslice expired. Detect whether it's spinning while another
+   * task could run, and if so make the next scheduling decision prefer
+   * another task; otherwise lengthen its timeslice.
+   */
+  void on_timeslice_expired(Task* t);
+  /**
+   * |t| entered the traced syscall |syscallno|.
+   */
+  void on_syscall_entry(Task* t, int syscallno);
+  /**
+   * Number of spin loops detected so far.
+   */
+  uint64_t spins_detected() const { return spins_detected_; }
+
   void on_create(Task* t);
   /**
    * De-register a thread. This function should be called when a thread exits.
@@ -151,6 +222,18 @@ private:
    * calling waitpid on it and observing a state change.
    */
   Task* find_next_runnable_task(bool* by_waitpid);
+  bool collect_tracee_statuses();
+  /**
+   * Chaos mode: return a runnable task chosen without regard to priority,
+   * or null if none is runnable.
+   */
+  Task* find_random_runnable_task(bool* by_waitpid);
+  /**
+   * Chaos mode: pick new random timeslice and starvation parameters for
+   * the next scheduling decision.
+   */
+  void make_chaos_decisions();
+  bool is_starved(Task* t) const { return t == starved_task; }
   /**
    * Returns the first task in the round-robin queue or null if it's empty.
    */
@@ -160,6 +243,16 @@ private:
    */
   void remove_round_robin_task();
   Task* get_next_task_with_same_priority(Task* t);
+  /**
+   * The timeslice for |t|: current_timeslice_, shortened if |t| has been
+   * spinning or lengthened if it's compute-bound.
+   */
+  Ticks timeslice_for(Task* t) const;
+  /**
+   * True if some task other than |t| is known to be ready to run, without
+   * waiting for blocked tasks' statuses.
+   */
+  bool other_task_may_run(Task* t) const;
 
   RecordSession& session;
 
@@ -183,7 +276,16 @@ private:
   Task* current;
 
   Ticks max_ticks_;
+  Ticks current_timeslice_;
   TraceFrame::Time max_events;
+
+  bool enable_chaos;
+  // Chaos mode: a task we're refusing to schedule while anything else is
+  // runnable, and for how many more scheduling decisions.
+  Task* starved_task;
+  int starve_decisions_left;
+
+  uint64_t spins_detected_;
 };
 
 #endif /* RR_REC_SCHED_H_ */
@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "SelfProfiler"
+
+#include "SelfProfiler.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Flags.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+/* Buffered events are written out once there's this much */
+static const size_t FLUSH_SIZE = 64 * 1024;
+
+/*static*/ SelfProfiler* SelfProfiler::create() {
+  const string& path = Flags::get().self_profile_path;
+  return path.empty() ? nullptr : new SelfProfiler(path);
+}
+
+/*static*/ SelfProfiler* SelfProfiler::get() {
+  static SelfProfiler* profiler = create();
+  return profiler;
+}
+
+/*static*/ uint64_t SelfProfiler::now_us() {
+  return monotonic_now_ns() / 1000;
+}
+
+SelfProfiler::SelfProfiler(const string& path)
+    : fd(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+      pid(getpid()) {
+  if (!fd.is_open()) {
+    FATAL() << "Can't open self-profile file " << path;
+  }
+  pthread_mutex_init(&mutex, nullptr);
+  buffer = "[\n";
+  atexit(flush_at_exit);
+}
+
+/*static*/ void SelfProfiler::flush_at_exit() {
+  SelfProfiler* profiler = get();
+  pthread_mutex_lock(&profiler->mutex);
+  profiler->flush();
+  pthread_mutex_unlock(&profiler->mutex);
+}
+
+void SelfProfiler::flush() {
+  if (getpid() != pid) {
+    // A forked child that hasn't exec'd yet mustn't write our events twice.
+    return;
+  }
+  const char* data = buffer.data();
+  size_t size = buffer.size();
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      LOG(warn) << "Can't write self-profile";
+      break;
+    }
+    data += ret;
+    size -= ret;
+  }
+  buffer.clear();
+}
+
+/**
+ * Names from rr (syscall names, event names, codec names) never need
+ * escaping, but be safe.
+ */
+static void append_json_string(string& out, const string& s) {
+  out += '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      out += ' ';
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+void SelfProfiler::add_span(const string& name, const char* category,
+                            pid_t tid, uint64_t start_us, uint64_t end_us) {
+  char buf[256];
+  pthread_mutex_lock(&mutex);
+  if (named_rows.insert(tid).second) {
+    snprintf(buf, sizeof(buf),
+             "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+             "\"args\":{\"name\":\"%s %d\"}},\n",
+             pid, tid, tid == pid ? "rr" : "tid", tid);
+    buffer += buf;
+  }
+  buffer += "{\"ph\":\"X\",\"name\":";
+  append_json_string(buffer, name.empty() ? string(category) : name);
+  snprintf(buf, sizeof(buf), ",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                             "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "},\n",
+           category, pid, tid, start_us, end_us - start_us);
+  buffer += buf;
+  if (buffer.size() >= FLUSH_SIZE) {
+    flush();
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_SELF_PROFILER_H_
+#define RR_SELF_PROFILER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <set>
+#include <string>
+
+#include "ScopedFd.h"
+
+/**
+ * Writes a timeline of what rr itself is doing to the file given by
+ * --self-profile, in the Chrome trace event JSON format, which
+ * chrome://tracing and Perfetto (ui.perfetto.dev) can load.
+ *
+ * Each span is a "complete" event on the timeline row of the task it's
+ * about (e.g. the tracee running, or rr handling one of its stops), or of
+ * the rr thread doing the work (e.g. compressing a trace block). Rows are
+ * labelled with the tid. Events are
+ * appended as they end, so a profile cut short by a crash is still usable;
+ * the closing ']' is optional in this format and isn't written.
+ */
+class SelfProfiler {
+public:
+  /**
+   * Returns null unless --self-profile was given. Can be called on any
+   * thread.
+   */
+  static SelfProfiler* get();
+
+  static uint64_t now_us();
+
+  /**
+   * Add a span covering [start_us, end_us) on the row for 'tid'.
+   */
+  void add_span(const std::string& name, const char* category, pid_t tid,
+                uint64_t start_us, uint64_t end_us);
+
+  /**
+   * Records a span from its construction to its destruction. Does nothing
+   * when self-profiling is off.
+   */
+  class Span {
+  public:
+    Span(const char* category, pid_t tid, const std::string& name = "")
+        : profiler(SelfProfiler::get()),
+          category(category),
+          tid(tid),
+          start_us(profiler ? now_us() : 0) {
+      if (profiler) {
+        this->name = name;
+      }
+    }
+    ~Span() {
+      if (profiler) {
+        profiler->add_span(name, category, tid, start_us, now_us());
+      }
+    }
+    bool enabled() const { return profiler != nullptr; }
+    void set_name(const std::string& name) {
+      if (profiler) {
+        this->name = name;
+      }
+    }
+
+  private:
+    SelfProfiler* profiler;
+    std::string name;
+    const char* category;
+    pid_t tid;
+    uint64_t start_us;
+  };
+
+private:
+  SelfProfiler(const std::string& path);
+
+  static SelfProfiler* create();
+  static void flush_at_exit();
+  void flush();
+
+  ScopedFd fd;
+  pid_t pid;
+  pthread_mutex_t mutex;
+  // BEGIN protected by 'mutex'
+  std::string buffer;
+  std::set<pid_t> named_rows;
+  // END protected by 'mutex'
+};
+
+#endif /* RR_SELF_PROFILER_H_ */
@@ -4,15 +4,22 @@
 
 #include "Session.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <syscall.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include <algorithm>
+#include <deque>
+#include <set>
 
 #include "rr/rr.h"
 
 #include "AutoRemoteSyscalls.h"
 #include "EmuFs.h"
+#include "Flags.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "task.h"
@@ -28,6 +35,12 @@ struct Session::CloneCompletion {
     vector<Task::CapturedState> member_states;
   };
   vector<TaskGroup> task_groups;
+
+  // Seconds spent in each phase of the clone, reported with -v.
+  CloneCompletion() : fork_time(0), remap_time(0), capture_time(0) {}
+  double fork_time;
+  double remap_time;
+  double capture_time;
 };
 
 Session::Session()
@@ -51,6 +64,7 @@ Session::Session(const Session& other) {
   next_task_serial_ = other.next_task_serial_;
   tracees_consistent = other.tracees_consistent;
   visible_execution_ = other.visible_execution_;
+  pipe_buffers_ = other.pipe_buffers_;
 }
 
 void Session::on_create(TaskGroup* tg) { task_group_map[tg->tguid()] = tg; }
@@ -160,6 +174,73 @@ AddressSpace* Session::find_address_space(const AddressSpaceUid& vmuid) const {
   return it->second;
 }
 
+/**
+ * Reaps the processes kill_all_tasks killed on a background thread. Those
+ * that are rr's children would otherwise stay zombies for rr's lifetime,
+ * and waiting for them on the main thread would make dropping a session
+ * wait for the kernel to tear down their address spaces.
+ */
+class ZombieReaper {
+public:
+  static ZombieReaper& get() {
+    static ZombieReaper reaper;
+    return reaper;
+  }
+
+  void reap(const vector<pid_t>& pids) {
+    pthread_mutex_lock(&mutex);
+    if (!started) {
+      pthread_t thread;
+      if (pthread_create(&thread, nullptr, reaper_thread_callback, this)) {
+        // Leave them as zombies, as if we'd never tried.
+        pthread_mutex_unlock(&mutex);
+        return;
+      }
+      pthread_detach(thread);
+      started = true;
+    }
+    queue.insert(queue.end(), pids.begin(), pids.end());
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  ZombieReaper() : started(false) {
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&cond, nullptr);
+  }
+
+  static void* reaper_thread_callback(void* p) {
+    static_cast<ZombieReaper*>(p)->reaper_thread();
+    return nullptr;
+  }
+
+  void reaper_thread() {
+    pthread_mutex_lock(&mutex);
+    while (true) {
+      if (queue.empty()) {
+        pthread_cond_wait(&cond, &mutex);
+        continue;
+      }
+      pid_t pid = queue.front();
+      queue.pop_front();
+      pthread_mutex_unlock(&mutex);
+      // Processes that aren't our children fail with ECHILD; their own
+      // parents reap them.
+      while (waitpid(pid, nullptr, __WALL) < 0 && errno == EINTR) {
+      }
+      pthread_mutex_lock(&mutex);
+    }
+  }
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // BEGIN protected by 'mutex'
+  std::deque<pid_t> queue;
+  bool started;
+  // END protected by 'mutex'
+};
+
 void Session::kill_all_tasks() {
   for (auto& v : task_map) {
     Task* t = v.second;
@@ -192,6 +273,7 @@ void Session::kill_all_tasks() {
       Registers r = t->regs();
       r.set_ip(intptr_t(-1));
       t->set_regs(r);
+      t->flush_regs();
       long result;
       do {
         // We have observed this failing with an ESRCH when the thread clearly
@@ -203,23 +285,33 @@ void Session::kill_all_tasks() {
     }
   }
 
-  while (!task_map.empty()) {
-    Task* t = task_map.rbegin()->second;
-    if (!t->stable_exit && !t->unstable) {
-      /**
-       * Destroy the OS task backing this by sending it SIGKILL and
-       * ensuring it was delivered.  After |kill()|, the only
-       * meaningful thing that can be done with this task is to
-       * delete it.
-       */
-      LOG(debug) << "sending SIGKILL to " << t->tid << " ...";
-      // If we haven't already done a stable exit via syscall,
-      // kill the task and note that the entire task group is unstable.
-      t->tgkill(SIGKILL);
-      t->task_group()->destabilize();
+  /**
+   * Destroy the OS tasks backing the remaining Tasks by sending SIGKILL to
+   * each of their processes, once for all its threads, and note that the
+   * entire task group is unstable. After that, the only meaningful thing
+   * that can be done with these tasks is to delete them.
+   */
+  set<TaskGroup*> killed;
+  vector<pid_t> killed_pids;
+  for (auto& v : task_map) {
+    Task* t = v.second;
+    if (t->stable_exit || t->unstable ||
+        !killed.insert(t->task_group().get()).second) {
+      continue;
     }
+    LOG(debug) << "sending SIGKILL to " << t->real_tgid() << " ...";
+    ::kill(t->real_tgid(), SIGKILL);
+    t->task_group()->destabilize();
+    killed_pids.push_back(t->real_tgid());
+  }
+
+  while (!task_map.empty()) {
+    delete task_map.rbegin()->second;
+  }
 
-    delete t;
+  // Recording's scheduler reaps with waitpid(-1) itself.
+  if (!killed_pids.empty() && !is_recording()) {
+    ZombieReaper::get().reap(killed_pids);
   }
 }
 
@@ -319,7 +411,10 @@ void Session::finish_initializing() {
     return;
   }
 
+  double start = now_sec();
+  size_t threads = 0;
   for (auto& tgleader : clone_completion->task_groups) {
+    threads += 1 + tgleader.member_states.size();
     AutoRemoteSyscalls remote(tgleader.clone_leader);
     for (auto& tgmember : tgleader.member_states) {
       Task* t_clone =
@@ -330,6 +425,14 @@ void Session::finish_initializing() {
     tgleader.clone_leader->copy_state(tgleader.clone_leader_state);
   }
 
+  if (Flags::get().verbose) {
+    const CloneCompletion& c = *clone_completion;
+    fprintf(stderr, "rr: cloned %zu task groups (%zu threads): fork %.1fms, "
+                    "remap %.1fms, capture %.1fms, finish %.1fms\n",
+            c.task_groups.size(), threads, c.fork_time * 1000,
+            c.remap_time * 1000, c.capture_time * 1000,
+            (now_sec() - start) * 1000);
+  }
   clone_completion = nullptr;
 }
 
@@ -375,13 +478,17 @@ static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
   remote.syscall(syscall_number_for_close(remote.arch()), remote_fd);
 }
 
-void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
+void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs,
+                            AddressSpace* only_vm) {
   assert_fully_initialized();
   assert(!dest.clone_completion);
 
   auto completion = unique_ptr<CloneCompletion>(new CloneCompletion());
 
   for (auto vm : vm_map) {
+    if (only_vm && vm.second != only_vm) {
+      continue;
+    }
     // Pick an arbitrary task to be group leader. The actual group leader
     // might have died already.
     Task* group_leader = *vm.second->task_set().begin();
@@ -391,9 +498,13 @@ void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
     completion->task_groups.push_back(CloneCompletion::TaskGroup());
     auto& group = completion->task_groups.back();
 
+    double phase_start = now_sec();
     group.clone_leader = group_leader->os_fork_into(&dest);
     dest.on_create(group.clone_leader);
     LOG(debug) << "  forked new group leader " << group.clone_leader->tid;
+    double now = now_sec();
+    completion->fork_time += now - phase_start;
+    phase_start = now;
 
     {
       AutoRemoteSyscalls remote(group.clone_leader);
@@ -405,6 +516,9 @@ void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
         }
         remap_shared_mmap(remote, dest_emu_fs, m, r);
       }
+      now = now_sec();
+      completion->remap_time += now - phase_start;
+      phase_start = now;
 
       for (auto t : group_leader->task_group()->task_set()) {
         if (group_leader == t) {
@@ -417,6 +531,7 @@ void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
     }
 
     group.clone_leader_state = group_leader->capture_state();
+    completion->capture_time += now_sec() - phase_start;
     // Close perfcounters for now. They will be automatically reopened
     // when we next run this task (if ever). This reduces the numer of
     // file descriptors we need to have open.
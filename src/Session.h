@@ -11,6 +11,7 @@
 #include <vector>
 
 #include "AddressSpace.h"
+#include "PipeMonitor.h"
 #include "TaskishUid.h"
 #include "TraceStream.h"
 
@@ -34,7 +35,10 @@ struct BreakStatus {
         breakpoint_hit(false),
         singlestep_complete(false),
         approaching_ticks_target(false),
-        task_exit(false) {}
+        task_exit(false),
+        syscallno(-1),
+        syscall_entry(false),
+        syscall_caught(false) {}
 
   // The triggering Task. This may be different from session->current_task()
   // when replay switches to a new task when ReplaySession::replay_step() ends.
@@ -54,10 +58,16 @@ struct BreakStatus {
   bool approaching_ticks_target;
   // True when we stopped because |task| is about to exit.
   bool task_exit;
+  // When >= 0, |task| just entered (if |syscall_entry|) or exited this
+  // syscall. That isn't a break by itself; ReplayTimeline sets
+  // |syscall_caught| when the debugger asked to catch the syscall.
+  int syscallno;
+  bool syscall_entry;
+  bool syscall_caught;
 
   bool any_break() {
     return !watchpoints_hit.empty() || signal || breakpoint_hit ||
-           singlestep_complete || approaching_ticks_target;
+           singlestep_complete || approaching_ticks_target || syscall_caught;
   }
 };
 enum RunCommand {
@@ -170,6 +180,13 @@ public:
   virtual void on_destroy(Task* t);
   void on_create(TaskGroup* tg);
   void on_destroy(TaskGroup* tg);
+  /**
+   * Called whenever a mapping of |id| is added to or removed from one of
+   * this session's address spaces, so that sessions with an EmuFs can
+   * track which emulated files are still mapped.
+   */
+  virtual void on_map_resource(const FileId& id) {}
+  virtual void on_unmap_resource(const FileId& id) {}
 
   /** Return the set of Tasks being tracekd in this session. */
   const TaskMap& tasks() const {
@@ -193,12 +210,37 @@ public:
   bool visible_execution() const { return visible_execution_; }
   void set_visible_execution(bool visible) { visible_execution_ = visible; }
 
+  /**
+   * Unread data of the pipes PipeMonitors track.
+   */
+  PipeBuffers& pipe_buffers() { return pipe_buffers_; }
+
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0),
+          ticks_processed(0),
+          syscalls_performed(0),
+          async_targets_reached(0),
+          async_target_singlesteps(0),
+          resumes(0),
+          singlesteps(0),
+          breakpoint_hits(0),
+          register_writes_saved(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    // Execution points of async events (e.g. signals) reached by
+    // ReplaySession::advance_to(), and the single-steps that took.
+    uint32_t async_targets_reached;
+    uint64_t async_target_singlesteps;
+    // Every time a tracee was resumed, how many of those were single-steps,
+    // and how many breakpoint traps (internal or user) that led to.
+    uint64_t resumes;
+    uint64_t singlesteps;
+    uint64_t breakpoint_hits;
+    // PTRACE_SETREGS/SETREGSET calls skipped because the registers hadn't
+    // changed, or were overwritten before the tracee resumed.
+    uint64_t register_writes_saved;
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
@@ -207,6 +249,18 @@ public:
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
+  void accumulate_async_target_reached(uint64_t singlesteps) {
+    statistics_.async_targets_reached += 1;
+    statistics_.async_target_singlesteps += singlesteps;
+  }
+  void accumulate_resume(bool singlestep) {
+    statistics_.resumes += 1;
+    statistics_.singlesteps += singlestep;
+  }
+  void accumulate_breakpoint_hit() { statistics_.breakpoint_hits += 1; }
+  void accumulate_register_write_saved() {
+    statistics_.register_writes_saved += 1;
+  }
   Statistics statistics() { return statistics_; }
 
 protected:
@@ -221,7 +275,12 @@ protected:
   BreakStatus diagnose_debugger_trap(Task* t);
   void check_for_watchpoint_changes(Task* t, BreakStatus& break_status);
 
-  void copy_state_to(Session& dest, EmuFs& dest_emu_fs);
+  /**
+   * Fork copies of our task groups into |dest|. If |only_vm| is non-null,
+   * only the task group using it is copied.
+   */
+  void copy_state_to(Session& dest, EmuFs& dest_emu_fs,
+                     AddressSpace* only_vm = nullptr);
 
   struct CloneCompletion;
   // Call this before doing anything that requires access to the full set
@@ -251,6 +310,8 @@ protected:
    * True while the execution of this session is visible to users.
    */
   bool visible_execution_;
+
+  PipeBuffers pipe_buffers_;
 };
 
 #endif // RR_SESSION_H_
@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "SocketMonitor.h"
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "RecordSession.h"
+#include "task.h"
+
+using namespace std;
+
+const uint32_t SocketMonitor::NO_CONNECTION;
+
+/**
+ * Format an endpoint from /proc/net/tcp{,6}, like "0100007F:1F90", as
+ * "127.0.0.1:8080" (or "[::1]:8080"). IPv4-mapped IPv6 addresses are
+ * formatted as IPv4 so that both ends agree whichever kind of socket each
+ * used.
+ */
+static bool parse_endpoint(const string& hex, bool ipv6, string* out) {
+  size_t addr_len = ipv6 ? 32 : 8;
+  if (hex.size() <= addr_len || hex[addr_len] != ':') {
+    return false;
+  }
+  // Each group of 8 digits is a 32-bit word in host byte order.
+  uint32_t words[4];
+  for (size_t i = 0; i < addr_len / 8; ++i) {
+    words[i] = strtoul(hex.substr(i * 8, 8).c_str(), nullptr, 16);
+  }
+  unsigned long port = strtoul(hex.c_str() + addr_len + 1, nullptr, 16);
+  struct in6_addr addr6;
+  memcpy(&addr6, words, sizeof(addr6));
+  const void* addr = words;
+  int family = ipv6 ? AF_INET6 : AF_INET;
+  if (ipv6 && IN6_IS_ADDR_V4MAPPED(&addr6)) {
+    addr = &words[3];
+    family = AF_INET;
+  }
+  char name[INET6_ADDRSTRLEN];
+  if (!inet_ntop(family, addr, name, sizeof(name))) {
+    return false;
+  }
+  char buf[INET6_ADDRSTRLEN + 16];
+  snprintf(buf, sizeof(buf), family == AF_INET6 ? "[%s]:%lu" : "%s:%lu",
+           name, port);
+  *out = buf;
+  return true;
+}
+
+/**
+ * Look up the local and peer endpoints of |t|'s fd |fd| in its network
+ * namespace's TCP tables. Returns false if it isn't a TCP socket.
+ */
+static bool find_tcp_endpoints(Task* t, int fd, string* local, string* peer) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/fd/%d", t->tid, fd);
+  char link[PATH_MAX];
+  ssize_t len = readlink(path, link, sizeof(link) - 1);
+  if (len < 0) {
+    return false;
+  }
+  link[len] = 0;
+  unsigned long inode;
+  if (sscanf(link, "socket:[%lu]", &inode) != 1) {
+    return false;
+  }
+
+  for (int ipv6 = 0; ipv6 <= 1; ++ipv6) {
+    snprintf(path, sizeof(path), "/proc/%d/net/tcp%s", t->tid,
+             ipv6 ? "6" : "");
+    ifstream in(path);
+    string line;
+    // Skip the header.
+    getline(in, line);
+    while (getline(in, line)) {
+      istringstream fields(line);
+      string slot, local_hex, peer_hex, state, queues, timer, retransmits;
+      unsigned long uid, timeout, line_inode;
+      if (!(fields >> slot >> local_hex >> peer_hex >> state >> queues >>
+            timer >> retransmits >> uid >> timeout >> line_inode)) {
+        continue;
+      }
+      if (line_inode == inode) {
+        return parse_endpoint(local_hex, ipv6, local) &&
+               parse_endpoint(peer_hex, ipv6, peer);
+      }
+    }
+  }
+  return false;
+}
+
+/* static */ void SocketMonitor::did_connect(Task* t, int fd) {
+  if (!t->session().is_recording() ||
+      !t->record_session().trace_writer().has_job()) {
+    return;
+  }
+  string local;
+  string peer;
+  if (!find_tcp_endpoints(t, fd, &local, &peer)) {
+    return;
+  }
+  TraceWriter& trace = t->record_session().trace_writer();
+  uint32_t connection = trace.add_job_connection(local, peer);
+  t->fd_table()->add_monitor(fd, make_shared<SocketMonitor>(connection));
+  trace.note_job_monitor();
+}
+
+/* static */ void SocketMonitor::did_listen(Task* t, int fd) {
+  if (!t->session().is_recording() ||
+      !t->record_session().trace_writer().has_job()) {
+    return;
+  }
+  string local;
+  string peer;
+  if (!find_tcp_endpoints(t, fd, &local, &peer)) {
+    return;
+  }
+  t->fd_table()->add_monitor(fd, make_shared<SocketMonitor>(NO_CONNECTION));
+  t->record_session().trace_writer().note_job_monitor();
+}
+
+/* static */ void SocketMonitor::did_replay_connect(Task* t, int fd) {
+  if (t->trace_reader().monitored_socket_at(t->current_trace_frame().time())) {
+    t->fd_table()->add_monitor(fd, make_shared<SocketMonitor>(NO_CONNECTION));
+  }
+}
+
+void SocketMonitor::did_write(Task* t, const std::vector<Range>& ranges) {
+  if (!t->session().is_recording()) {
+    return;
+  }
+  uint64_t length = 0;
+  for (auto& r : ranges) {
+    length += r.length;
+  }
+  if (length > 0) {
+    t->record_session().trace_writer().note_job_message(t->tid, connection,
+                                                        true, sent, length);
+    sent += length;
+  }
+}
+
+void SocketMonitor::did_receive(Task* t, size_t length) {
+  t->record_session().trace_writer().note_job_message(t->tid, connection,
+                                                      false, received, length);
+  received += length;
+}
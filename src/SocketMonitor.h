@@ -0,0 +1,68 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_SOCKET_MONITOR_H_
+#define RR_SOCKET_MONITOR_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "FileMonitor.h"
+
+/**
+ * A FileMonitor for the TCP connections tracees connect or accept while
+ * recording one rank of a distributed job (rr record --job). It counts the
+ * bytes sent and received in each direction, and notes each transfer's
+ * offset in the stream as a JobMessage in the trace. Both ends see the
+ * same offsets, so `rr job' can match each message one rank received with
+ * the event in which another rank sent it, however the stream was split
+ * into syscalls.
+ *
+ * Listening TCP sockets get a SocketMonitor too, so that accept4() can't
+ * be buffered and every accepted connection is seen. Replay attaches
+ * monitors in the same events, so that the syscallbuf makes the same
+ * buffering decisions.
+ */
+class SocketMonitor : public FileMonitor {
+public:
+  /**
+   * The connection of monitors on listening sockets, and during replay,
+   * where messages aren't noted.
+   */
+  static const uint32_t NO_CONNECTION = UINT32_MAX;
+
+  SocketMonitor(uint32_t connection)
+      : connection(connection), sent(0), received(0) {}
+
+  /**
+   * Start monitoring |fd| if it's a TCP socket that a successful connect()
+   * (or one in progress) or accept() just connected, and the trace is
+   * tagged with a job.
+   */
+  static void did_connect(Task* t, int fd);
+  /**
+   * Start monitoring |fd| if it's a TCP socket that a successful listen()
+   * just made a listening socket, and the trace is tagged with a job.
+   */
+  static void did_listen(Task* t, int fd);
+  /**
+   * During replay, monitor |fd| if recording attached a monitor to it in
+   * the current event.
+   */
+  static void did_replay_connect(Task* t, int fd);
+
+  /**
+   * Sends and receives must be traced so that we see every one.
+   */
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_ALL; }
+
+  virtual void did_write(Task* t, const std::vector<Range>& ranges);
+  virtual void did_receive(Task* t, size_t length);
+
+private:
+  uint32_t connection;
+  uint64_t sent;
+  uint64_t received;
+};
+
+#endif /* RR_SOCKET_MONITOR_H_ */
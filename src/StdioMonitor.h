@@ -33,6 +33,11 @@ public:
    */
   virtual Switchable will_write(Task* t);
 
+  /**
+   * Only writes need to be traced.
+   */
+  virtual int syscallbuf_policy() { return SYSCALLBUF_FD_TRACE_WRITES; }
+
   /**
    * During replay, echo writes to stdout/stderr.
    */
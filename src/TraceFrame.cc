@@ -16,10 +16,15 @@ void TraceFrame::set_exec_info(const Registers& regs,
     extra_perf = *extra_perf_values;
   }
   if (extra_regs) {
-    recorded_extra_regs = *extra_regs;
+    recorded_extra_regs = std::make_shared<ExtraRegisters>(*extra_regs);
   }
 }
 
+/*static*/ const ExtraRegisters& TraceFrame::no_extra_regs() {
+  static const ExtraRegisters none;
+  return none;
+}
+
 void TraceFrame::dump(FILE* out) const {
   out = out ? out : stdout;
 
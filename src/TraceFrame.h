@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <memory>
+
 #include "Event.h"
 #include "ExtraRegisters.h"
 #include "PerfCounters.h"
@@ -42,7 +44,9 @@ public:
   Ticks ticks() const { return ticks_; }
 
   const Registers& regs() const { return recorded_regs; }
-  const ExtraRegisters& extra_regs() const { return recorded_extra_regs; }
+  const ExtraRegisters& extra_regs() const {
+    return recorded_extra_regs ? *recorded_extra_regs : no_extra_regs();
+  }
   const PerfCounters::Extra& extra_perf_values() const { return extra_perf; }
 
   /**
@@ -63,6 +67,8 @@ private:
   friend class TraceReader;
   friend class TraceWriter;
 
+  static const ExtraRegisters& no_extra_regs();
+
   Time global_time;
   pid_t tid_;
   Event ev;
@@ -72,8 +78,9 @@ private:
   Registers recorded_regs;
 
   // Only used when has_exec_info, but variable length (and usually not
-  // present) so we don't want to stuff it into exec_info
-  ExtraRegisters recorded_extra_regs;
+  // present) so we don't want to stuff it into exec_info. Immutable, so
+  // frames read from a trace share it until it changes.
+  std::shared_ptr<const ExtraRegisters> recorded_extra_regs;
 };
 
 #endif /* RR_TRACE_FRAME_H_ */
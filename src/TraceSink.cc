@@ -0,0 +1,218 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "TraceSink"
+
+#include "TraceSink.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "log.h"
+
+using namespace std;
+
+/* append() blocks while this much data is waiting to be sent */
+static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+void* TraceSink::sink_thread_callback(void* p) {
+  static_cast<TraceSink*>(p)->sink_thread();
+  return nullptr;
+}
+
+/*static*/ shared_ptr<TraceSink> TraceSink::create(const string& command) {
+  // A socket rather than a pipe, so that we can write with MSG_NOSIGNAL and
+  // survive the command exiting early.
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    LOG(error) << "Can't create socket for streaming the trace";
+    return nullptr;
+  }
+  ScopedFd ours(fds[0]);
+  ScopedFd theirs(fds[1]);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG(error) << "Can't fork to run `" << command << "'";
+    return nullptr;
+  }
+  if (pid == 0) {
+    dup2(theirs, STDIN_FILENO);
+    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+    _exit(127);
+  }
+  return shared_ptr<TraceSink>(new TraceSink(ours, pid));
+}
+
+TraceSink::TraceSink(ScopedFd& fd, pid_t pid)
+    : fd(std::move(fd)),
+      pid(pid),
+      queued_bytes(0),
+      closing(false),
+      failed(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  pthread_create(&thread, nullptr, sink_thread_callback, this);
+  pthread_setname_np(thread, "trace sink");
+}
+
+TraceSink::~TraceSink() {
+  finish();
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void TraceSink::append(const string& name, const void* data, size_t size) {
+  pthread_mutex_lock(&mutex);
+  while (!closing && queued_bytes >= MAX_QUEUED_BYTES) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  if (!closing) {
+    jobs.push_back(Job());
+    Job& job = jobs.back();
+    job.name = name;
+    job.data.assign(static_cast<const uint8_t*>(data),
+                    static_cast<const uint8_t*>(data) + size);
+    queued_bytes += size;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void TraceSink::send_file(const string& name, const string& path) {
+  pthread_mutex_lock(&mutex);
+  if (!closing) {
+    jobs.push_back(Job());
+    jobs.back().name = name;
+    jobs.back().path = path;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool TraceSink::finish() {
+  if (!fd.is_open()) {
+    return !failed;
+  }
+
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, nullptr);
+
+  stringstream manifest;
+  for (auto& f : file_sizes) {
+    manifest << f.first << " " << f.second << "\n";
+  }
+  string m = manifest.str();
+  if (!failed && !send_record(MANIFEST, "", m.data(), m.size())) {
+    failed = true;
+  }
+  fd.close();
+
+  int status;
+  // Our tracee-reaping waitpid(-1) may already have collected the command,
+  // in which case we can't check how it exited.
+  if (waitpid(pid, &status, 0) == pid &&
+      (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+    LOG(warn) << "Trace streaming command failed with status " << status;
+    failed = true;
+  }
+  return !failed;
+}
+
+static bool send_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+bool TraceSink::send_record(RecordType type, const string& name,
+                            const void* data, size_t size) {
+  RecordHeader header;
+  header.type = type;
+  header.name_length = name.size();
+  header.data_length = size;
+  return send_all(fd, &header, sizeof(header)) &&
+         send_all(fd, name.data(), name.size()) && send_all(fd, data, size);
+}
+
+bool TraceSink::send_file_contents(const string& name, const string& path) {
+  ScopedFd file(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!file.is_open()) {
+    LOG(warn) << "Can't open " << path << " to stream it";
+    return false;
+  }
+  vector<uint8_t> buf(1024 * 1024);
+  while (true) {
+    ssize_t ret = read(file, buf.data(), buf.size());
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      return false;
+    }
+    if (ret == 0) {
+      return true;
+    }
+    if (!send_record(APPEND, name, buf.data(), ret)) {
+      return false;
+    }
+    file_sizes[name] += ret;
+  }
+}
+
+void TraceSink::sink_thread() {
+  pthread_mutex_lock(&mutex);
+
+  while (true) {
+    if (!jobs.empty()) {
+      Job job;
+      job.name.swap(jobs.front().name);
+      job.data.swap(jobs.front().data);
+      job.path.swap(jobs.front().path);
+      jobs.pop_front();
+      pthread_mutex_unlock(&mutex);
+
+      if (!failed) {
+        if (job.path.empty()) {
+          failed = !send_record(APPEND, job.name, job.data.data(),
+                                job.data.size());
+          file_sizes[job.name] += job.data.size();
+        } else {
+          failed = !send_file_contents(job.name, job.path);
+        }
+        if (failed) {
+          LOG(warn) << "Trace streaming failed; the local trace is unaffected";
+        }
+      }
+
+      pthread_mutex_lock(&mutex);
+      queued_bytes -= job.data.size();
+      pthread_cond_broadcast(&cond);
+      continue;
+    }
+
+    if (closing) {
+      break;
+    }
+
+    pthread_cond_wait(&cond, &mutex);
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
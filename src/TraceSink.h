@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACE_SINK_H_
+#define RR_TRACE_SINK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+
+/**
+ * A TraceSink streams a trace to another process while it's being recorded,
+ * so the trace can be shipped elsewhere without waiting for recording to
+ * finish.
+ *
+ * The stream is a sequence of records, each a RecordHeader followed by a
+ * file name relative to the trace directory and then |data_length| bytes.
+ * APPEND records append their data to the named file. The last record is a
+ * MANIFEST, whose data has a "<name> <size>\n" line for every file sent, so
+ * the receiver can tell the stream is complete. `rr receive` turns a stream
+ * back into a trace directory.
+ *
+ * Data is sent by a background thread, so callers only block when a lot of
+ * data is queued.
+ */
+class TraceSink {
+public:
+  enum RecordType { APPEND = 0, MANIFEST = 1 };
+  struct RecordHeader {
+    uint32_t type;
+    uint32_t name_length;
+    uint64_t data_length;
+  };
+
+  /**
+   * Run |command| with /bin/sh, streaming to its standard input. Returns
+   * null if it couldn't be started.
+   */
+  static std::shared_ptr<TraceSink> create(const std::string& command);
+  ~TraceSink();
+
+  /**
+   * Append |size| bytes at |data| to trace file |name|. Can be called on
+   * any thread.
+   */
+  void append(const std::string& name, const void* data, size_t size);
+  /**
+   * Send the contents of the file at |path| as trace file |name|. The file
+   * is read later, on the sink thread, so it mustn't be modified.
+   */
+  void send_file(const std::string& name, const std::string& path);
+  /**
+   * Send the manifest, close the stream and wait for the command to exit.
+   * Returns false if anything went wrong at any point.
+   */
+  bool finish();
+
+private:
+  TraceSink(ScopedFd& fd, pid_t pid);
+
+  struct Job {
+    std::string name;
+    // Data to append, or empty to send |path| instead.
+    std::vector<uint8_t> data;
+    std::string path;
+  };
+
+  static void* sink_thread_callback(void* p);
+  void sink_thread();
+  bool send_record(RecordType type, const std::string& name,
+                   const void* data, size_t size);
+  bool send_file_contents(const std::string& name, const std::string& path);
+
+  ScopedFd fd;
+  pid_t pid;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // BEGIN protected by 'mutex'
+  std::deque<Job> jobs;
+  size_t queued_bytes;
+  bool closing;
+  // END protected by 'mutex'
+
+  /* sink thread only, until it exits */
+  std::map<std::string, uint64_t> file_sizes;
+  bool failed;
+};
+
+#endif /* RR_TRACE_SINK_H_ */
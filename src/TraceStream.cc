@@ -4,14 +4,26 @@
 
 #include "TraceStream.h"
 
+#include <dirent.h>
+#include <ftw.h>
 #include <inttypes.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sysexits.h>
 
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <string>
 #include <sstream>
 
+#include "Flags.h"
 #include "log.h"
+#include "probes.h"
 #include "util.h"
 
 using namespace std;
@@ -21,11 +33,23 @@ using namespace std;
 // version number doesn't track the rr version number, because changes
 // to the trace format will be rare.
 //
-// NB: if you *do* change the trace format for whatever reason, you
-// MUST increment this version number.  Otherwise users' old traces
-// will become unreplayable and they won't know why.
+// NB: a reader replays a trace with a newer version as long as it knows
+// all the trace's required sections (see |other_sections|), so bumping
+// this number does NOT stop older rr versions from misreading a changed
+// format. Every format change needs a new required section name, either
+// by renaming the changed section or by listing a marker section with no
+// file of its own (see PIPE_DATA_SECTION). Increment this number as well,
+// so that we can still tell older traces apart.
 //
-#define TRACE_VERSION 27
+#define TRACE_VERSION 32
+// Oldest trace version we can still replay. Version 27 traces differ only
+// in lacking codec IDs in their block headers, which reads as zlib, and
+// version 28 only in lacking raw-data references. Versions before 30 store
+// frames without delta encoding, versions before 31 don't record the
+// syscallbuf size, which was always SYSCALLBUF_BUFFER_SIZE, and versions
+// before 32 follow every syscallbuf flush with an EV_SYSCALLBUF_RESET.
+#define MIN_COMPATIBLE_TRACE_VERSION 27
+#define DELTA_FRAMES_TRACE_VERSION 30
 
 struct SubstreamData {
   const char* name;
@@ -33,6 +57,8 @@ struct SubstreamData {
   int threads;
 };
 
+// Default compression settings. All substreams use zlib at its default level
+// unless recording asks otherwise.
 static const SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
   { "events", 1024 * 1024, 1 },
   { "data_header", 1024 * 1024, 1 },
@@ -41,6 +67,63 @@ static const SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
   { "tasks", 64 * 1024, 1 }
 };
 
+/**
+ * Besides its substreams, a trace has these files. After the version
+ * number, the version file lists every section of the trace (substreams
+ * and these files), each marked "required" or "optional". We can replay a
+ * trace from a newer rr as long as we understand all its required
+ * sections; optional sections we don't know about are skipped. So a new
+ * kind of optional data can be added without breaking older readers, while
+ * changing the format of an existing section means giving it a new name.
+ */
+struct SectionData {
+  const char* name;
+  bool required;
+};
+
+static const SectionData other_sections[] = { { "args_env", true },
+                                              { "compression", false },
+                                              { "index", false },
+                                              { "stats", false },
+                                              { "bookmarks", false },
+                                              { "wall_clock", false },
+                                              { "job", false } };
+
+// Required sections with no file of their own. Each marks a trace that
+// older rr versions would misreplay, so that they refuse it instead.
+// Listed by traces that elide pipe reads (see PipeMonitor); older versions
+// would replay those reads without their data.
+static const char PIPE_DATA_SECTION[] = "pipe_data";
+// Listed by traces recorded with a non-default --syscallbuf-size; older
+// versions would map buffers of the default size.
+static const char SYSCALLBUF_SIZE_SECTION[] = "syscallbuf_size";
+// Listed by every trace whose syscallbuf flush events carry the buffer
+// reset; older versions would wait for EV_SYSCALLBUF_RESET frames that
+// never come.
+static const char FLUSH_RESETS_SECTION[] = "flush_resets";
+
+static const char* const marker_sections[] = { PIPE_DATA_SECTION,
+                                               SYSCALLBUF_SIZE_SECTION,
+                                               FLUSH_RESETS_SECTION };
+
+static bool is_known_section(const string& name) {
+  TraceStream::Substream s;
+  if (TraceStream::substream_for_name(name, &s)) {
+    return true;
+  }
+  for (auto section : marker_sections) {
+    if (name == section) {
+      return true;
+    }
+  }
+  for (auto& section : other_sections) {
+    if (name == section.name) {
+      return true;
+    }
+  }
+  return false;
+}
+
 static const SubstreamData& substream(TraceStream::Substream s) {
   return substreams[s];
 }
@@ -86,10 +169,34 @@ static void ensure_default_rr_trace_dir() {
   }
 }
 
-string TraceStream::path(Substream s) {
+string TraceStream::path(Substream s) const {
   return trace_dir + "/" + substream(s).name;
 }
 
+/*static*/ TraceStream::CompressionPolicy
+TraceStream::default_compression_policy(Substream s) {
+  CompressionPolicy policy = { CompressionCodec::ZLIB,
+                               CompressionCodec::DEFAULT_LEVEL,
+                               substream(s).block_size,
+                               (uint32_t)substream(s).threads };
+  return policy;
+}
+
+/*static*/ const char* TraceStream::substream_name(Substream s) {
+  return substream(s).name;
+}
+
+/*static*/ bool TraceStream::substream_for_name(const string& name,
+                                                Substream* out) {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (name == substream(s).name) {
+      *out = s;
+      return true;
+    }
+  }
+  return false;
+}
+
 bool TraceWriter::good() const {
   for (auto& w : writers) {
     if (!w->good()) {
@@ -108,56 +215,254 @@ bool TraceReader::good() const {
   return true;
 }
 
-struct BasicInfo {
-  TraceFrame::Time global_time;
-  pid_t tid_;
-  EncodedEvent ev;
-  Ticks ticks_;
+/**
+ * Each delta-encoded frame in EVENTS is:
+ *   uint8_t flags
+ *   varint tid, if FRAME_NEW_TID; otherwise it's the previous frame's
+ *   varint encoded event
+ *   zigzag varint change in ticks
+ * and, for frames with exec info,
+ *   varint mask of the changed 32-bit words of the Registers, followed by
+ *     the XOR of the old and new value of each changed word
+ *   zigzag varint change in each of the extra perf values
+ *   if FRAME_EXTRA_REGS_CHANGED, the extra regs format byte, a varint size
+ *     and the data
+ * and, for signal events, the signal data. The frame's time is always one
+ * more than the previous frame's, so it isn't stored.
+ */
+enum {
+  FRAME_NEW_TID = 0x1,
+  FRAME_EXTRA_REGS_CHANGED = 0x2,
 };
 
+static const size_t REGISTER_WORDS = sizeof(Registers) / sizeof(uint32_t);
+static_assert(sizeof(Registers) % sizeof(uint32_t) == 0 &&
+                  REGISTER_WORDS <= 64,
+              "Registers don't fit in the changed-word mask");
+
+static void append(vector<uint8_t>& buf, const void* data, size_t size) {
+  buf.insert(buf.end(), static_cast<const uint8_t*>(data),
+             static_cast<const uint8_t*>(data) + size);
+}
+
+static void append_varint(vector<uint8_t>& buf, uint64_t value) {
+  while (value >= 0x80) {
+    buf.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  buf.push_back(uint8_t(value));
+}
+
+static uint64_t read_varint(CompressedReader& reader) {
+  uint64_t value = 0;
+  uint8_t byte;
+  for (int shift = 0; shift < 64; shift += 7) {
+    reader >> byte;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return value;
+}
+
+static uint64_t zigzag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+static bool same_extra_regs(const ExtraRegisters& a, const ExtraRegisters& b) {
+  return a.format() == b.format() && a.data_size() == b.data_size() &&
+         !memcmp(a.data_bytes(), b.data_bytes(), a.data_size());
+}
+
 void TraceWriter::write_frame(const TraceFrame& frame) {
-  auto& events = writer(EVENTS);
+  assert(frame.time() == global_time);
+  RR_PROBE2(write_frame, frame.time(), frame.event().type());
 
-  BasicInfo basic_info = { frame.time(), frame.tid(), frame.event().encode(),
-                           frame.ticks() };
-  events << basic_info;
-  if (!events.good()) {
-    FATAL() << "Tried to save " << sizeof(basic_info)
-            << " bytes to the trace, but failed";
+  auto& buf = frame_buffer;
+  buf.clear();
+  uint8_t flags = 0;
+  buf.push_back(flags);
+  if (frame.tid() != frame_deltas.last_tid) {
+    flags |= FRAME_NEW_TID;
+    append_varint(buf, frame.tid());
+    frame_deltas.last_tid = frame.tid();
   }
+  FrameDelta& delta = frame_deltas.tasks[frame.tid()];
+  append_varint(buf, uint32_t(frame.event().encode().encoded));
+  append_varint(buf, zigzag(frame.ticks() - delta.ticks));
+  delta.ticks = frame.ticks();
+
   // TODO: only store exec info for non-async-sig events when
   // debugging assertions are enabled.
   if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
-    events << frame.regs() << frame.extra_perf_values();
-    if (!events.good()) {
-      FATAL() << "Tried to save registers to the trace, but failed";
-    }
-
-    int extra_reg_bytes = frame.extra_regs().data_size();
-    char extra_reg_format = (char)frame.extra_regs().format();
-    events << extra_reg_format << extra_reg_bytes;
-    if (!events.good()) {
-      FATAL() << "Tried to save "
-              << sizeof(extra_reg_bytes) + sizeof(extra_reg_format)
-              << " bytes to the trace, but failed";
+    uint32_t words[REGISTER_WORDS];
+    uint32_t old_words[REGISTER_WORDS];
+    memcpy(words, &frame.regs(), sizeof(words));
+    memcpy(old_words, &delta.regs, sizeof(old_words));
+    uint64_t mask = 0;
+    for (size_t i = 0; i < REGISTER_WORDS; ++i) {
+      if (words[i] != old_words[i]) {
+        mask |= uint64_t(1) << i;
+      }
     }
-    if (extra_reg_bytes > 0) {
-      events.write((const char*)frame.extra_regs().data_bytes(),
-                   extra_reg_bytes);
-      if (!events.good()) {
-        FATAL() << "Tried to save " << extra_reg_bytes
-                << " bytes to the trace, but failed";
+    append_varint(buf, mask);
+    for (size_t i = 0; i < REGISTER_WORDS; ++i) {
+      if (words[i] != old_words[i]) {
+        uint32_t x = words[i] ^ old_words[i];
+        append(buf, &x, sizeof(x));
       }
     }
+    memcpy(&delta.regs, words, sizeof(words));
+
+    const PerfCounters::Extra& perf = frame.extra_perf_values();
+    append_varint(buf, zigzag(perf.page_faults - delta.extra_perf.page_faults));
+    append_varint(buf,
+                  zigzag(perf.hw_interrupts - delta.extra_perf.hw_interrupts));
+    append_varint(buf, zigzag(perf.instructions_retired -
+                              delta.extra_perf.instructions_retired));
+    delta.extra_perf = perf;
+
+    const ExtraRegisters& extra_regs = frame.extra_regs();
+    const ExtraRegisters& old_extra_regs =
+        delta.extra_regs ? *delta.extra_regs : TraceFrame::no_extra_regs();
+    if (!same_extra_regs(extra_regs, old_extra_regs)) {
+      flags |= FRAME_EXTRA_REGS_CHANGED;
+      buf.push_back(uint8_t(extra_regs.format()));
+      append_varint(buf, extra_regs.data_size());
+      append(buf, extra_regs.data_bytes(), extra_regs.data_size());
+      delta.extra_regs = frame.recorded_extra_regs;
+    }
   }
   if (frame.event().is_signal_event()) {
-    events << frame.event().Signal().signal_data();
+    uint64_t signal_data = frame.event().Signal().signal_data();
+    append(buf, &signal_data, sizeof(signal_data));
+  }
+  buf[0] = flags;
+
+  auto& events = writer(EVENTS);
+  events.write(buf.data(), buf.size());
+  if (!events.good()) {
+    FATAL() << "Tried to save " << buf.size()
+            << " bytes to the trace, but failed";
   }
 
   tick_time();
+
+  if (global_time % INDEX_INTERVAL == 0) {
+    UncompressedPositions positions;
+    positions.time = global_time;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      positions.pos[s] = writer(s).uncompressed_pos();
+    }
+    index_positions.push_back(positions);
+    frame_deltas.clear();
+  }
 }
 
 TraceFrame TraceReader::read_frame() {
+  TraceFrame frame;
+  if (lookahead.empty()) {
+    frame = decode_frame();
+  } else {
+    frame = std::move(lookahead.front());
+    lookahead.pop_front();
+  }
+  tick_time();
+  assert(time() == frame.time());
+  return frame;
+}
+
+/**
+ * Decode the frame after the last one decoded, which is the last one
+ * peeked at, if any, or the current one.
+ */
+TraceFrame TraceReader::decode_frame() {
+  if (trace_version < DELTA_FRAMES_TRACE_VERSION) {
+    return decode_legacy_frame();
+  }
+
+  auto& events = reader(EVENTS);
+  uint8_t flags;
+  events >> flags;
+  if (flags & FRAME_NEW_TID) {
+    frame_deltas.last_tid = read_varint(events);
+  }
+  pid_t tid = frame_deltas.last_tid;
+  FrameDelta& delta = frame_deltas.tasks[tid];
+  EncodedEvent ev;
+  ev.encoded = int(uint32_t(read_varint(events)));
+  delta.ticks += unzigzag(read_varint(events));
+  TraceFrame::Time time = global_time + lookahead.size() + 1;
+  TraceFrame frame(time, tid, Event(ev), delta.ticks);
+
+  if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
+    uint64_t mask = read_varint(events);
+    if (mask) {
+      uint32_t words[REGISTER_WORDS];
+      memcpy(words, &delta.regs, sizeof(words));
+      for (size_t i = 0; i < REGISTER_WORDS; ++i) {
+        if (mask & (uint64_t(1) << i)) {
+          uint32_t x;
+          events >> x;
+          words[i] ^= x;
+        }
+      }
+      memcpy(&delta.regs, words, sizeof(words));
+    }
+    frame.recorded_regs = delta.regs;
+
+    delta.extra_perf.page_faults += unzigzag(read_varint(events));
+    delta.extra_perf.hw_interrupts += unzigzag(read_varint(events));
+    delta.extra_perf.instructions_retired += unzigzag(read_varint(events));
+    frame.extra_perf = delta.extra_perf;
+
+    if (flags & FRAME_EXTRA_REGS_CHANGED) {
+      uint8_t extra_reg_format;
+      events >> extra_reg_format;
+      vector<uint8_t> data;
+      data.resize(read_varint(events));
+      events.read((char*)data.data(), data.size());
+      auto extra_regs = make_shared<ExtraRegisters>(frame.event().arch());
+      extra_regs->set_to_raw_data((ExtraRegisters::Format)extra_reg_format,
+                                  data);
+      delta.extra_regs = extra_regs;
+    } else if (!delta.extra_regs) {
+      delta.extra_regs = make_shared<ExtraRegisters>(frame.event().arch());
+    } else if (delta.extra_regs->arch() != frame.event().arch()) {
+      auto extra_regs = make_shared<ExtraRegisters>(*delta.extra_regs);
+      extra_regs->set_arch(frame.event().arch());
+      delta.extra_regs = extra_regs;
+    }
+    // Frames share their ExtraRegisters until they change, so unchanged
+    // ones cost nothing to decode.
+    frame.recorded_extra_regs = delta.extra_regs;
+  }
+  if (frame.event().is_signal_event()) {
+    uint64_t signal_data;
+    events >> signal_data;
+    frame.ev.Signal().set_signal_data(signal_data);
+  }
+
+  // The writer started afresh after the frame before an index point.
+  if ((time + 1) % INDEX_INTERVAL == 0) {
+    frame_deltas.clear();
+  }
+  return frame;
+}
+
+struct BasicInfo {
+  TraceFrame::Time global_time;
+  pid_t tid_;
+  EncodedEvent ev;
+  Ticks ticks_;
+};
+
+TraceFrame TraceReader::decode_legacy_frame() {
   // Read the common event info first, to see if we also have
   // exec info to read.
   auto& events = reader(EVENTS);
@@ -175,12 +480,14 @@ TraceFrame TraceReader::read_frame() {
       vector<uint8_t> data;
       data.resize(extra_reg_bytes);
       events.read((char*)data.data(), extra_reg_bytes);
-      frame.recorded_extra_regs.set_arch(frame.event().arch());
-      frame.recorded_extra_regs.set_to_raw_data(
-          (ExtraRegisters::Format)extra_reg_format, data);
+      auto extra_regs = make_shared<ExtraRegisters>(frame.event().arch());
+      extra_regs->set_to_raw_data((ExtraRegisters::Format)extra_reg_format,
+                                  data);
+      frame.recorded_extra_regs = extra_regs;
     } else {
       assert(extra_reg_format == ExtraRegisters::NONE);
-      frame.recorded_extra_regs = ExtraRegisters(frame.event().arch());
+      frame.recorded_extra_regs =
+          make_shared<ExtraRegisters>(frame.event().arch());
     }
   }
   if (frame.event().is_signal_event()) {
@@ -188,9 +495,6 @@ TraceFrame TraceReader::read_frame() {
     events >> signal_data;
     frame.ev.Signal().set_signal_data(signal_data);
   }
-
-  tick_time();
-  assert(time() == frame.time());
   return frame;
 }
 
@@ -247,13 +551,111 @@ string TraceWriter::try_hardlink_file(const string& file_name) {
   string basename = (last_slash != file_name.npos)
                         ? file_name.substr(last_slash + 1)
                         : file_name;
-  string link_path = dir() + "/mmap_" + count_str + "_hardlink_" + basename;
+  string link_name = string("mmap_") + count_str + "_hardlink_" + basename;
+  string link_path = dir() + "/" + link_name;
   int ret = link(file_name.c_str(), link_path.c_str());
   if (ret < 0) {
     // maybe tried to link across filesystems?
     return file_name;
   }
-  return link_path;
+  if (sink) {
+    sink->send_file(link_name, link_path);
+  }
+  // Relative to the trace directory, so the trace can be moved.
+  return link_name;
+}
+
+// Backing files copied into the trace by try_copy_file() have this
+// infix after their "mmap_<count>" prefix.
+static const char COPIED_FILE_INFIX[] = "_copy_";
+
+static bool is_copied_file(const string& backing_file_name) {
+  return backing_file_name.compare(0, 5, "mmap_") == 0 &&
+         backing_file_name.find(COPIED_FILE_INFIX) != string::npos &&
+         backing_file_name.find('/') == string::npos;
+}
+
+/**
+ * Copy all of |in| to |out| without it passing through our address space:
+ * share the extents if the filesystem can, otherwise let the kernel copy.
+ */
+static bool copy_file_contents(int in, int out, off_t size) {
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, in) == 0) {
+    return true;
+  }
+#endif
+#ifdef SYS_copy_file_range
+  while (size > 0) {
+    long ret = syscall(SYS_copy_file_range, in, nullptr, out, nullptr,
+                       (size_t)size, 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    size -= ret;
+  }
+  if (size == 0) {
+    return true;
+  }
+#endif
+  // Start again with plain reads and writes, in case copy_file_range
+  // copied part of the file before failing.
+  if (ftruncate(out, 0) < 0 || lseek(in, 0, SEEK_SET) < 0 ||
+      lseek(out, 0, SEEK_SET) < 0) {
+    return false;
+  }
+  vector<uint8_t> buf(1024 * 1024);
+  while (true) {
+    ssize_t len = read(in, buf.data(), buf.size());
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      return len == 0;
+    }
+    if (write(out, buf.data(), len) != len) {
+      return false;
+    }
+  }
+}
+
+string TraceWriter::try_copy_file(const TraceMappedRegion& map) {
+  uint64_t map_size = map.end() - map.start();
+  if ((uint64_t)map.stat().st_size > 2 * map_size) {
+    // Copying the whole file would cost much more than the mapped part.
+    return string();
+  }
+  ScopedFd in(map.file_name().c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!in.is_open() || fstat(in, &st) < 0 || st.st_ino != map.stat().st_ino ||
+      st.st_dev != map.stat().st_dev) {
+    // The file is unlinked or was replaced since it was mapped.
+    return string();
+  }
+
+  char count_str[20];
+  sprintf(count_str, "%d", mmap_count);
+  size_t last_slash = map.file_name().rfind('/');
+  string copy_name = string("mmap_") + count_str + COPIED_FILE_INFIX +
+                     map.file_name().substr(last_slash + 1);
+  string copy_path = dir() + "/" + copy_name;
+  ScopedFd out(copy_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+               0400);
+  if (!out.is_open()) {
+    return string();
+  }
+  if (!copy_file_contents(in, out, st.st_size)) {
+    LOG(warn) << "Can't copy " << map.file_name() << " into the trace";
+    unlink(copy_path.c_str());
+    return string();
+  }
+  if (sink) {
+    sink->send_file(copy_name, copy_path);
+  }
+  return copy_name;
 }
 
 TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
@@ -268,6 +670,16 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
   } else {
     if (should_copy_mmap_region(map.file_name(), &map.stat(), prot, flags)) {
       source = TraceReader::SOURCE_TRACE;
+      // A large private mapping is cheaper to record by copying its file
+      // into the trace directory, ideally without reading it at all,
+      // than by copying the mapped memory into the trace.
+      if (copy_mapped_files_min_size > 0 && (flags & MAP_PRIVATE) &&
+          size_t(map.end() - map.start()) >= copy_mapped_files_min_size) {
+        backing_file_name = try_copy_file(map);
+        if (!backing_file_name.empty()) {
+          source = TraceReader::SOURCE_FILE;
+        }
+      }
     } else {
       source = TraceReader::SOURCE_FILE;
       // Try hardlinking file into the trace directory. This will avoid
@@ -285,6 +697,15 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
                                              : DONT_RECORD_IN_TRACE;
 }
 
+// Backing files copied into the trace by pack_mapped_files() are named with
+// this prefix followed by a hash of their contents.
+static const char PACKED_FILE_PREFIX[] = "packed_";
+
+static bool is_packed_file(const string& backing_file_name) {
+  return backing_file_name.compare(0, sizeof(PACKED_FILE_PREFIX) - 1,
+                                   PACKED_FILE_PREFIX) == 0;
+}
+
 static void verify_backing_file(const TraceMappedRegion& map,
                                 const string& backing_file_name) {
   struct stat backing_stat;
@@ -311,12 +732,19 @@ TraceMappedRegion TraceReader::read_mapped_region(MappedData* data) {
   mmaps >> data->source >> map.type_ >> map.filename >> map.stat_ >>
       map.start_ >> map.end_ >> map.file_offset_pages >> backing_file_name;
   if (data->source == SOURCE_FILE) {
+    // Packed copies have their own metadata, and their contents were
+    // checked when they were packed. Copies made while recording are
+    // private to the trace too.
+    bool packed =
+        is_packed_file(backing_file_name) || is_copied_file(backing_file_name);
     if (backing_file_name[0] != '/') {
       backing_file_name = dir() + "/" + backing_file_name;
     }
     data->file_name = backing_file_name;
     data->file_data_offset_pages = map.file_offset_pages;
-    verify_backing_file(map, backing_file_name);
+    if (!packed) {
+      verify_backing_file(map, backing_file_name);
+    }
   }
   return map;
 }
@@ -341,48 +769,472 @@ static istream& operator>>(istream& in, vector<string>& vs) {
   return in;
 }
 
+// Set in a raw-data header's length when the data is a copy of earlier data.
+// The header is then followed by the RAW_DATA position of the original.
+static const size_t RAW_DATA_REFERENCE = (size_t)1 << (sizeof(size_t) * 8 - 1);
+
+// Entries to remember before forgetting everything and starting again.
+static const size_t MAX_RAW_DATA_DEDUP_ENTRIES = 1 << 20;
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * A fast 128-bit non-cryptographic hash. Recorded data isn't adversarial,
+ * so accidental collisions are the only concern.
+ */
+static void hash_raw_data(const uint8_t* data, size_t len, uint64_t out[2]) {
+  uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t h2 = 0x87c37b91114253d5ULL + len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h1 = rotl64(h1 ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    h2 = rotl64(h2 + w, 27) * 0x52dce729ULL + h1;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, len - i);
+  h1 ^= mix64(tail);
+  h2 += h1;
+  out[0] = mix64(h1 ^ rotl64(h2, 17));
+  out[1] = mix64(h2 + h1);
+}
+
 void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
   auto& data = writer(RAW_DATA);
   auto& data_header = writer(RAW_DATA_HEADER);
+  if (dedup_min_size > 0 && len >= dedup_min_size) {
+    RawDataKey key;
+    hash_raw_data(static_cast<const uint8_t*>(d), len, key.hash);
+    key.len = len;
+    auto it = raw_data_seen.find(key);
+    if (it != raw_data_seen.end()) {
+      data_header << global_time << addr.as_int() << (len | RAW_DATA_REFERENCE)
+                  << it->second;
+      return;
+    }
+    if (raw_data_seen.size() >= MAX_RAW_DATA_DEDUP_ENTRIES) {
+      raw_data_seen.clear();
+    }
+    raw_data_seen[key] = data.uncompressed_pos();
+  }
   data_header << global_time << addr.as_int() << len;
   data.write(d, len);
 }
 
 TraceReader::RawData TraceReader::read_raw_data() {
+  RawDataView view = read_raw_data_view();
+  RawData d;
+  d.data.assign(view.data, view.data + view.size);
+  d.addr = view.addr;
+  return d;
+}
+
+TraceReader::RawDataView TraceReader::read_raw_data_view() {
   auto& data = reader(RAW_DATA);
   auto& data_header = reader(RAW_DATA_HEADER);
   TraceFrame::Time time;
-  RawData d;
+  RawDataView d;
   size_t num_bytes;
   data_header >> time >> d.addr >> num_bytes;
   assert(time == global_time);
-  d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
+  if (num_bytes & RAW_DATA_REFERENCE) {
+    uint64_t pos;
+    data_header >> pos;
+    num_bytes &= ~RAW_DATA_REFERENCE;
+    raw_data_buffer.resize(num_bytes);
+    if (!data.read_at(pos, raw_data_buffer.data(), num_bytes)) {
+      FATAL() << "Can't read deduplicated raw data at " << pos;
+    }
+    d.data = raw_data_buffer.data();
+  } else {
+    d.data = data.read_view(num_bytes);
+    if (!d.data) {
+      // The record spans a block boundary.
+      raw_data_buffer.resize(num_bytes);
+      data.read(raw_data_buffer.data(), num_bytes);
+      d.data = raw_data_buffer.data();
+    }
+  }
+  d.size = num_bytes;
   return d;
 }
 
-bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+/**
+ * Return true if the next raw data record belongs to 'frame', without
+ * consuming it.
+ */
+bool TraceReader::next_raw_data_is_for_frame(const TraceFrame& frame) {
   auto& data_header = reader(RAW_DATA_HEADER);
-  while (!data_header.at_end()) {
-    TraceFrame::Time time;
-    data_header.save_state();
-    data_header >> time;
-    data_header.restore_state();
-    if (time == frame.time()) {
-      d = read_raw_data();
-      return true;
-    }
-    if (time > frame.time()) {
-      return false;
-    }
+  if (data_header.at_end()) {
+    return false;
+  }
+  TraceFrame::Time time;
+  data_header.save_state();
+  data_header >> time;
+  data_header.restore_state();
+  return time == frame.time();
+}
+
+bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+  if (!next_raw_data_is_for_frame(frame)) {
+    return false;
+  }
+  d = read_raw_data();
+  return true;
+}
+
+bool TraceReader::read_raw_data_view_for_frame(const TraceFrame& frame,
+                                               RawDataView& d) {
+  if (!next_raw_data_is_for_frame(frame)) {
+    return false;
+  }
+  d = read_raw_data_view();
+  return true;
+}
+
+uint64_t TraceWriter::stall_ns() {
+  uint64_t ns = 0;
+  for (auto& w : writers) {
+    ns += w->stall_ns();
+  }
+  return ns;
+}
+
+uint64_t TraceWriter::compression_backlog() {
+  uint64_t bytes = 0;
+  for (auto& w : writers) {
+    bytes += w->backlog();
+  }
+  return bytes;
+}
+
+void TraceWriter::set_adaptive_compression(bool adaptive) {
+  for (auto& w : writers) {
+    w->set_adaptive(adaptive);
+  }
+}
+
+void TraceWriter::set_huge_pages() {
+  for (auto& w : writers) {
+    w->set_huge_pages();
+  }
+}
+
+void TraceWriter::add_marker_section(const char* name) {
+  ofstream version(version_path(), ios::app);
+  version << name << " required" << endl;
+  if (!version.good()) {
+    FATAL() << "Unable to update " << version_path();
+  }
+}
+
+void TraceWriter::set_elides_pipe_data() {
+  add_marker_section(PIPE_DATA_SECTION);
+}
+
+void TraceWriter::set_custom_syscallbuf_size() {
+  add_marker_section(SYSCALLBUF_SIZE_SECTION);
+}
+
+void TraceWriter::bind_compression_threads(const vector<int>& cpus) {
+  for (auto& w : writers) {
+    w->bind_threads(cpus);
+  }
+}
+
+void TraceWriter::set_memory_budget(size_t limit) {
+  memory_budget = make_shared<WriteMemoryBudget>(limit);
+  for (auto& w : writers) {
+    w->set_memory_budget(memory_budget);
   }
-  return false;
 }
 
 void TraceWriter::close() {
   for (auto& w : writers) {
     w->close();
   }
+  write_index();
+  write_stats();
+  write_bookmarks();
+  write_wall_clock_times();
+  write_job();
+  finish_sink();
+  unlink(recording_path().c_str());
+}
+
+void TraceWriter::flush() {
+  for (auto& w : writers) {
+    w->flush();
+  }
+  write_recording_file();
+}
+
+/**
+ * Return this boot's id, so a reader can tell a trace recorded on another
+ * machine, or before a reboot, from one whose recorder is still running.
+ */
+static string boot_id() {
+  ifstream in("/proc/sys/kernel/random/boot_id");
+  string id;
+  in >> id;
+  return id;
+}
+
+/**
+ * Return when process |pid| started, in clock ticks since boot, or 0 if
+ * it isn't running. With the pid, that identifies a process even after
+ * its pid has been reused.
+ */
+static uint64_t process_start_time(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  ifstream in(path);
+  string stat((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  // The command name may contain spaces and parentheses, so count fields
+  // from the last ')'. starttime is the 20th after it.
+  size_t pos = stat.rfind(')');
+  if (pos == string::npos) {
+    return 0;
+  }
+  istringstream fields(stat.substr(pos + 1));
+  string field;
+  for (int i = 0; i < 19 && fields >> field; ++i) {
+  }
+  uint64_t start_time = 0;
+  fields >> start_time;
+  return start_time;
+}
+
+/**
+ * Record who we are and the last event that's been flushed. Compression
+ * threads write full blocks whenever they're ready, so a following reader
+ * can find later events in EVENTS before the data they refer to is in the
+ * other substreams; it mustn't read past the last flushed event.
+ */
+void TraceWriter::write_recording_file() {
+  string tmp_path = recording_path() + ".tmp";
+  {
+    ofstream out(tmp_path, ios::trunc);
+    static const string recorder_boot_id = boot_id();
+    static const uint64_t recorder_start_time = process_start_time(getpid());
+    out << getpid() << " " << time() - 1 << " " << recorder_boot_id << " "
+        << recorder_start_time << endl;
+  }
+  rename(tmp_path.c_str(), recording_path().c_str());
+}
+
+static int remove_trace_file(const char* path, const struct stat* sb,
+                             int typeflag, struct FTW* ftwbuf) {
+  if (remove(path)) {
+    LOG(warn) << "Failed to remove " << path;
+  }
+  return 0;
+}
+
+/*static*/ void TraceWriter::delete_trace(const string& dir) {
+  string link_name = latest_trace_symlink();
+  char target[PATH_MAX];
+  ssize_t len = readlink(link_name.c_str(), target, sizeof(target) - 1);
+  if (len >= 0) {
+    target[len] = 0;
+    if (dir == target) {
+      unlink(link_name.c_str());
+    }
+  }
+  // Depth-first, so directories are empty by the time we remove them.
+  nftw(dir.c_str(), remove_trace_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Send the files that aren't streamed as they're written, then finish the
+ * stream.
+ */
+void TraceWriter::finish_sink() {
+  if (!sink) {
+    return;
+  }
+  const string files[] = { version_path(), args_env_path(),
+                           compression_path(), index_path(), stats_path(),
+                           bookmarks_path(), wall_clock_path(),
+                           job_path() };
+  for (auto& f : files) {
+    if (access(f.c_str(), F_OK) == 0) {
+      sink->send_file(f.substr(dir().size() + 1), f);
+    }
+  }
+  if (!sink->finish()) {
+    LOG(error) << "Streaming trace " << dir() << " failed";
+  }
+  sink = nullptr;
+}
+
+void TraceWriter::write_stats() {
+  ofstream out(stats_path(), ios::trunc);
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    auto& stats = writer(s).stats();
+    out << substream_name(s) << " " << stats.stalls << " " << stats.stall_ns
+        << " " << stats.blocks << " " << stats.stored_blocks << " "
+        << stats.compress_ns << " " << stats.compress_bytes << "\n";
+  }
+  if (memory_budget) {
+    auto stats = memory_budget->stats();
+    out << "memory_budget " << stats.limit << " " << stats.peak << " "
+        << stats.waits << " " << stats.wait_ns << "\n";
+  }
+  for (auto& f : syscallbuf_fallbacks) {
+    out << "syscallbuf_fallback " << f.first << " " << f.second << "\n";
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write trace statistics " << stats_path();
+  }
+}
+
+void TraceWriter::add_bookmark(const string& name) {
+  Bookmark bookmark;
+  bookmark.time = time();
+  // One bookmark per line.
+  bookmark.name = name;
+  replace(bookmark.name.begin(), bookmark.name.end(), '\n', ' ');
+  bookmarks.push_back(bookmark);
+}
+
+void TraceWriter::write_bookmarks() {
+  if (bookmarks.empty()) {
+    return;
+  }
+  ofstream out(bookmarks_path(), ios::trunc);
+  for (auto& b : bookmarks) {
+    out << b.time << " " << b.name << "\n";
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write trace bookmarks " << bookmarks_path();
+  }
+}
+
+// Anything earlier than 2000-01-01 is a clock other than CLOCK_REALTIME.
+// The syscallbuf doesn't record clock_gettime()'s clock ID, so this is how
+// we tell them apart.
+static const int64_t MIN_WALL_CLOCK_SEC = 946684800;
+
+void TraceWriter::note_wall_clock_time(int64_t sec, int64_t usec) {
+  if (sec < MIN_WALL_CLOCK_SEC || usec < 0 || usec >= 1000000) {
+    return;
+  }
+  WallClockTime t;
+  t.time = time();
+  t.usecs = sec * 1000000 + usec;
+  if (!wall_clock_times.empty()) {
+    WallClockTime& last = wall_clock_times.back();
+    if (t.usecs / 1000 == last.usecs / 1000) {
+      return;
+    }
+    if (last.time == t.time) {
+      last.usecs = t.usecs;
+      return;
+    }
+  }
+  wall_clock_times.push_back(t);
+}
+
+void TraceWriter::write_wall_clock_times() {
+  if (wall_clock_times.empty()) {
+    return;
+  }
+  ofstream out(wall_clock_path(), ios::trunc);
+  for (auto& t : wall_clock_times) {
+    out << t.time << " " << t.usecs << "\n";
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write trace wall-clock index "
+              << wall_clock_path();
+  }
+}
+
+void TraceWriter::set_job(const string& id, int rank) {
+  job.id = id;
+  job.rank = rank;
+  char host[256];
+  if (gethostname(host, sizeof(host)) == 0) {
+    host[sizeof(host) - 1] = 0;
+    job.host = host;
+  } else {
+    job.host = "localhost";
+  }
+}
+
+uint32_t TraceWriter::add_job_connection(const string& local,
+                                         const string& peer) {
+  JobConnection c;
+  c.local = local;
+  c.peer = peer;
+  job.connections.push_back(c);
+  return job.connections.size() - 1;
+}
+
+void TraceWriter::note_job_message(pid_t tid, uint32_t connection, bool sent,
+                                   uint64_t offset, uint64_t length) {
+  JobMessage m;
+  m.time = time();
+  m.tid = tid;
+  m.connection = connection;
+  m.sent = sent;
+  m.offset = offset;
+  m.length = length;
+  job.messages.push_back(m);
+}
+
+void TraceWriter::note_job_monitor() { job.monitor_times.push_back(time()); }
+
+void TraceWriter::write_job() {
+  if (!has_job()) {
+    return;
+  }
+  ofstream out(job_path(), ios::trunc);
+  out << "job " << job.id << " " << job.rank << " " << job.host << "\n";
+  for (auto& c : job.connections) {
+    out << "connection " << c.local << " " << c.peer << "\n";
+  }
+  for (auto& m : job.messages) {
+    out << "message " << m.time << " " << m.tid << " " << m.connection << " "
+        << (m.sent ? "send" : "recv") << " " << m.offset << " " << m.length
+        << "\n";
+  }
+  for (auto time : job.monitor_times) {
+    out << "monitor " << time << "\n";
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write trace job file " << job_path();
+  }
+}
+
+void TraceWriter::write_index() {
+  if (index_positions.empty()) {
+    return;
+  }
+  ofstream out(index_path(), ios::binary | ios::trunc);
+  for (auto& p : index_positions) {
+    IndexEntry entry;
+    entry.time = p.time;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      writer(s).block_position(p.pos[s], &entry.block_offset[s],
+                               &entry.offset_in_block[s]);
+    }
+    out.write((const char*)&entry, sizeof(entry));
+  }
+  if (!out.good()) {
+    LOG(warn) << "Failed to write trace index " << index_path();
+  }
+  index_positions.clear();
 }
 
 static string make_trace_dir(const string& exe_path) {
@@ -408,20 +1260,43 @@ static string make_trace_dir(const string& exe_path) {
 }
 
 TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
-                         const string& cwd, int bind_to_cpu)
+                         const string& cwd, int bind_to_cpu,
+                         const vector<CompressionPolicy>& policies,
+                         const shared_ptr<TraceSink>& sink)
     : TraceStream(make_trace_dir(argv[0]),
                   // Somewhat arbitrarily start the
                   // global time from 1.
                   1),
-      mmap_count(0) {
+      sink(sink),
+      mmap_count(0),
+      copy_mapped_files_min_size(0),
+      dedup_min_size(0) {
   this->argv = argv;
   this->envp = envp;
   this->cwd = cwd;
   this->bind_to_cpu = bind_to_cpu;
 
+  if (!policies.empty()) {
+    assert(policies.size() == SUBSTREAM_COUNT);
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      this->policies[s] = policies[s];
+    }
+  }
+
+  ofstream compression(compression_path());
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    const CompressionPolicy& p = compression_policy(s);
     writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
-        path(s), substream(s).block_size, substream(s).threads));
+        path(s), p.block_size, p.threads, p.codec, p.level));
+    if (sink) {
+      writers[s]->set_sink(sink, substream(s).name);
+    }
+    compression << substream(s).name << " "
+                << CompressionCodec::get(p.codec)->name() << " " << p.level
+                << " " << p.block_size << " " << p.threads << endl;
+  }
+  if (!compression.good()) {
+    FATAL() << "Unable to create " << compression_path();
   }
 
   string ver_path = version_path();
@@ -430,6 +1305,14 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
     FATAL() << "Unable to create " << ver_path;
   }
   version << TRACE_VERSION << endl;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    version << substream_name(s) << " required" << endl;
+  }
+  for (auto& section : other_sections) {
+    version << section.name << (section.required ? " required" : " optional")
+            << endl;
+  }
+  version << FLUSH_RESETS_SECTION << " required" << endl;
 
   string link_name = latest_trace_symlink();
   // Try to update the symlink to |this|.  We only try attempt
@@ -455,39 +1338,326 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
   out << envp;
   out << bind_to_cpu;
   assert(out.good());
+
+  write_recording_file();
 }
 
 TraceFrame TraceReader::peek_frame() {
-  auto& events = reader(EVENTS);
-  events.save_state();
-  auto saved_time = global_time;
-  TraceFrame frame;
-  if (!at_end()) {
-    frame = read_frame();
+  if (lookahead.empty()) {
+    while (at_end()) {
+      if (!wait_for_more()) {
+        return TraceFrame();
+      }
+    }
+    lookahead.push_back(decode_frame());
   }
-  events.restore_state();
-  global_time = saved_time;
-  return frame;
+  return lookahead.front();
 }
 
 TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
-  auto& events = reader(EVENTS);
-  TraceFrame frame;
-  events.save_state();
-  auto saved_time = global_time;
-  while (good() && !at_end()) {
-    frame = read_frame();
-    if (frame.tid() == pid && frame.event().type() == type &&
-        (!frame.event().is_syscall_event() ||
-         frame.event().Syscall().state == state)) {
-      events.restore_state();
-      global_time = saved_time;
+  auto matches = [&](const TraceFrame& frame) {
+    return frame.tid() == pid && frame.event().type() == type &&
+           (!frame.event().is_syscall_event() ||
+            frame.event().Syscall().state == state);
+  };
+  for (auto& frame : lookahead) {
+    if (matches(frame)) {
       return frame;
     }
   }
+  auto& events = reader(EVENTS);
+  while (events.good() &&
+         (can_decode_frame(lookahead.empty() ? time()
+                                             : lookahead.back().time()) ||
+          wait_for_more())) {
+    lookahead.push_back(decode_frame());
+    if (matches(lookahead.back())) {
+      return lookahead.back();
+    }
+  }
   FATAL() << "Unable to find requested frame in stream";
   // Unreachable
-  return frame;
+  return TraceFrame();
+}
+
+/**
+ * Return the name under which the file at |path| is packed, which depends
+ * only on its contents, or the empty string if it can't be read.
+ */
+static string packed_file_name(const string& path) {
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!fd.is_open()) {
+    return string();
+  }
+  uint64_t hash[2] = { 0, 0 };
+  vector<uint8_t> buf(1024 * 1024);
+  while (true) {
+    ssize_t len = read(fd, buf.data(), buf.size());
+    if (len < 0) {
+      return string();
+    }
+    if (len == 0) {
+      break;
+    }
+    uint64_t chunk[2];
+    hash_raw_data(buf.data(), len, chunk);
+    hash[0] = mix64(hash[0] ^ chunk[0]);
+    hash[1] = mix64(rotl64(hash[1], 31) ^ chunk[1]);
+  }
+  char name[sizeof(PACKED_FILE_PREFIX) + 32];
+  sprintf(name, "%s%016" PRIx64 "%016" PRIx64, PACKED_FILE_PREFIX, hash[0],
+          hash[1]);
+  return name;
+}
+
+static void copy_file(const string& from, const string& to) {
+  ScopedFd in(from.c_str(), O_RDONLY | O_CLOEXEC);
+  string tmp = to + ".tmp";
+  unlink(tmp.c_str());
+  ScopedFd out(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+  if (!in.is_open() || !out.is_open()) {
+    FATAL() << "Can't copy " << from << " to " << tmp;
+  }
+  vector<uint8_t> buf(1024 * 1024);
+  while (true) {
+    ssize_t len = read(in, buf.data(), buf.size());
+    if (len < 0) {
+      FATAL() << "Can't read " << from;
+    }
+    if (len == 0) {
+      break;
+    }
+    if (write(out, buf.data(), len) != len) {
+      FATAL() << "Can't write " << tmp;
+    }
+  }
+  if (rename(tmp.c_str(), to.c_str()) < 0) {
+    FATAL() << "Can't rename " << tmp << " to " << to;
+  }
+}
+
+/**
+ * Try to hardlink a packed copy named |name| from another trace in the
+ * same directory as |trace_dir|.
+ */
+static bool link_packed_copy_from_other_trace(const string& trace_dir,
+                                              const string& name) {
+  size_t last_slash = trace_dir.rfind('/');
+  string parent =
+      last_slash == string::npos ? "." : trace_dir.substr(0, last_slash);
+  DIR* d = opendir(parent.c_str());
+  if (!d) {
+    return false;
+  }
+  bool linked = false;
+  while (struct dirent* e = readdir(d)) {
+    string other = parent + "/" + e->d_name + "/" + name;
+    if (e->d_name[0] != '.' &&
+        link(other.c_str(), (trace_dir + "/" + name).c_str()) == 0) {
+      linked = true;
+      break;
+    }
+  }
+  closedir(d);
+  return linked;
+}
+
+map<string, string> TraceReader::mapped_file_copies() const {
+  map<string, string> copies;
+  CompressedReader in(path(MMAPS));
+  while (!in.at_end()) {
+    MappedDataSource source;
+    TraceMappedRegion map;
+    string backing_file_name;
+    in >> source >> map.type_ >> map.filename >> map.stat_ >> map.start_ >>
+        map.end_ >> map.file_offset_pages >> backing_file_name;
+    if (!in.good()) {
+      break;
+    }
+    // Failed hardlinks leave the original name here.
+    if (source == SOURCE_FILE && backing_file_name != map.file_name()) {
+      copies[map.file_name()] = backing_file_name[0] == '/'
+                                    ? backing_file_name
+                                    : dir() + "/" + backing_file_name;
+    }
+  }
+  return copies;
+}
+
+vector<pair<TraceMappedRegion, TraceReader::MappedDataSource> >
+TraceReader::mapped_regions() const {
+  vector<pair<TraceMappedRegion, MappedDataSource> > regions;
+  CompressedReader in(path(MMAPS));
+  while (!in.at_end()) {
+    MappedDataSource source;
+    TraceMappedRegion map;
+    string backing_file_name;
+    in >> source >> map.type_ >> map.filename >> map.stat_ >> map.start_ >>
+        map.end_ >> map.file_offset_pages >> backing_file_name;
+    if (!in.good()) {
+      break;
+    }
+    regions.push_back(make_pair(map, source));
+  }
+  return regions;
+}
+
+size_t TraceReader::pack_mapped_files() {
+  struct Record {
+    MappedDataSource source;
+    TraceMappedRegion map;
+    string original_backing_file_name;
+    string backing_file_name;
+  };
+  vector<Record> records;
+  CompressedReader in(path(MMAPS));
+  while (true) {
+    Record r;
+    in >> r.source >> r.map.type_ >> r.map.filename >> r.map.stat_ >>
+        r.map.start_ >> r.map.end_ >> r.map.file_offset_pages >>
+        r.backing_file_name;
+    if (!in.good()) {
+      break;
+    }
+    r.original_backing_file_name = r.backing_file_name;
+    records.push_back(r);
+    if (in.at_end()) {
+      break;
+    }
+  }
+
+  // Maps each backing file path to the name of its packed copy.
+  map<string, string> packed;
+  vector<string> old_links;
+  for (auto& r : records) {
+    string& name = r.backing_file_name;
+    if (r.source != SOURCE_FILE || is_packed_file(name)) {
+      continue;
+    }
+    string file = name[0] == '/' ? name : dir() + "/" + name;
+    auto it = packed.find(file);
+    if (it == packed.end()) {
+      if (!is_copied_file(name)) {
+        verify_backing_file(r.map, file);
+      }
+      string packed_name = packed_file_name(file);
+      if (packed_name.empty()) {
+        FATAL() << "Can't read " << file << " to pack it";
+      }
+      string packed_path = dir() + "/" + packed_name;
+      if (access(packed_path.c_str(), F_OK) != 0 &&
+          !link_packed_copy_from_other_trace(dir(), packed_name)) {
+        copy_file(file, packed_path);
+      }
+      if (name[0] != '/') {
+        old_links.push_back(file);
+      }
+      it = packed.insert(make_pair(file, packed_name)).first;
+    }
+    name = it->second;
+  }
+  if (packed.empty()) {
+    return 0;
+  }
+
+  string new_mmaps = path(MMAPS) + ".tmp";
+  unlink(new_mmaps.c_str());
+  const CompressionPolicy& p = compression_policy(MMAPS);
+  CompressedWriter out(new_mmaps, p.block_size, p.threads, p.codec, p.level);
+  // Uncompressed start position of each record in the old and new streams.
+  vector<uint64_t> old_pos(1, 0);
+  vector<uint64_t> new_pos(1, 0);
+  for (auto& r : records) {
+    out << r.source << r.map.type() << r.map.file_name() << r.map.stat()
+        << r.map.start() << r.map.end() << r.map.offset_pages()
+        << r.backing_file_name;
+    uint64_t size = out.uncompressed_pos() - new_pos.back();
+    new_pos.push_back(out.uncompressed_pos());
+    old_pos.push_back(old_pos.back() + size - r.backing_file_name.size() +
+                      r.original_backing_file_name.size());
+  }
+  out.close();
+  if (!out.good()) {
+    FATAL() << "Can't write " << new_mmaps;
+  }
+
+  // Index entries refer to record boundaries, which have moved.
+  if (!index) {
+    load_index();
+  }
+  if (!index->empty()) {
+    vector<IndexEntry> entries = *index;
+    for (auto& entry : entries) {
+      uint64_t pos;
+      if (!in.uncompressed_position(entry.block_offset[MMAPS],
+                                    entry.offset_in_block[MMAPS], &pos)) {
+        FATAL() << "Trace index " << index_path() << " is inconsistent";
+      }
+      auto it = lower_bound(old_pos.begin(), old_pos.end(), pos);
+      if (it == old_pos.end() || *it != pos) {
+        FATAL() << "Trace index " << index_path() << " is inconsistent";
+      }
+      out.block_position(new_pos[it - old_pos.begin()],
+                         &entry.block_offset[MMAPS],
+                         &entry.offset_in_block[MMAPS]);
+    }
+    string new_index = index_path() + ".tmp";
+    ofstream index_out(new_index, ios::binary | ios::trunc);
+    index_out.write((const char*)entries.data(),
+                    entries.size() * sizeof(IndexEntry));
+    index_out.close();
+    if (!index_out.good() || rename(new_index.c_str(), index_path().c_str())) {
+      FATAL() << "Can't write " << new_index;
+    }
+    index = make_shared<vector<IndexEntry> >(entries);
+  }
+
+  if (rename(new_mmaps.c_str(), path(MMAPS).c_str()) < 0) {
+    FATAL() << "Can't rename " << new_mmaps;
+  }
+  for (auto& f : old_links) {
+    unlink(f.c_str());
+  }
+  readers[MMAPS] =
+      unique_ptr<CompressedReader>(new CompressedReader(path(MMAPS)));
+  return packed.size();
+}
+
+void TraceReader::load_index() {
+  index = make_shared<vector<IndexEntry> >();
+  ifstream in(index_path(), ios::binary);
+  IndexEntry entry;
+  while (in.read((char*)&entry, sizeof(entry))) {
+    index->push_back(entry);
+  }
+}
+
+bool TraceReader::skip_to_before_event(TraceFrame::Time time) {
+  if (!index) {
+    load_index();
+  }
+  // Find the last entry with entry.time <= time.
+  auto it = lower_bound(index->begin(), index->end(), time + 1,
+                        [](const IndexEntry& entry, TraceFrame::Time t) {
+    return entry.time < t;
+  });
+  if (it == index->begin()) {
+    return false;
+  }
+  --it;
+  // The entry positions us just after frame it->time - 1.
+  if (it->time - 1 <= global_time) {
+    return false;
+  }
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (!reader(s).seek(it->block_offset[s], it->offset_in_block[s])) {
+      FATAL() << "Trace index " << index_path() << " is inconsistent";
+    }
+  }
+  global_time = it->time - 1;
+  frame_deltas.clear();
+  lookahead.clear();
+  return true;
 }
 
 void TraceReader::rewind() {
@@ -495,16 +1665,45 @@ void TraceReader::rewind() {
     reader(s).rewind();
   }
   global_time = 0;
+  frame_deltas.clear();
+  lookahead.clear();
   assert(good());
 }
 
+/**
+ * True if the rr process named in the recording file at |path| is still
+ * running, in which case |flushed_time| is set to the last event it has
+ * flushed. A recorder that crashed leaves the file behind, and its pid may
+ * since have been reused; the trace may also have been copied from another
+ * machine. So the boot and the process's start time must match too.
+ */
+static bool recording_in_progress(const string& path,
+                                  TraceFrame::Time* flushed_time) {
+  ifstream in(path);
+  pid_t pid = 0;
+  string recorder_boot_id;
+  uint64_t recorder_start_time = 0;
+  if (!(in >> pid >> *flushed_time >> recorder_boot_id >>
+        recorder_start_time) ||
+      pid <= 0) {
+    return false;
+  }
+  return recorder_boot_id == boot_id() &&
+         recorder_start_time == process_start_time(pid);
+}
+
 TraceReader::TraceReader(const string& dir)
     : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
                   // Initialize the global time at 0, so
                   // that when we tick it when reading
                   // the first trace, it matches the
                   // initial global time at recording, 1.
-                  0) {
+                  0),
+      elides_pipe_data_(false),
+      custom_syscallbuf_size_(false),
+      flush_resets_(false),
+      following_(false),
+      flushed_time_(0) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
   }
@@ -527,7 +1726,36 @@ TraceReader::TraceReader(const string& dir)
   }
   int version = 0;
   vfile >> version;
-  if (vfile.fail() || TRACE_VERSION != version) {
+  bool version_ok = !vfile.fail();
+  // Traces before section lists were written have none.
+  bool has_sections = false;
+  string unknown_sections;
+  string name, kind;
+  while (vfile >> name >> kind) {
+    has_sections = true;
+    if (name == PIPE_DATA_SECTION) {
+      elides_pipe_data_ = true;
+    } else if (name == SYSCALLBUF_SIZE_SECTION) {
+      custom_syscallbuf_size_ = true;
+    } else if (name == FLUSH_RESETS_SECTION) {
+      flush_resets_ = true;
+    }
+    if (kind == "required" && !is_known_section(name)) {
+      unknown_sections += " " + name;
+    }
+  }
+  if (!unknown_sections.empty()) {
+    fprintf(stderr, "\n"
+                    "rr: error: Recorded trace `%s' has sections this version "
+                    "of rr doesn't\n"
+                    "           support:%s.  You'll need to replay it with a "
+                    "newer version of rr.\n"
+                    "\n",
+            trace_dir.c_str(), unknown_sections.c_str());
+    exit(EX_DATAERR);
+  }
+  if (!version_ok || version < MIN_COMPATIBLE_TRACE_VERSION ||
+      (version > TRACE_VERSION && !has_sections)) {
     fprintf(stderr, "\n"
                     "rr: error: Recorded trace `%s' has an incompatible "
                     "version %d; expected\n"
@@ -540,6 +1768,7 @@ TraceReader::TraceReader(const string& dir)
             path.c_str(), version, TRACE_VERSION, path.c_str(), path.c_str());
     exit(EX_DATAERR);
   }
+  trace_version = version;
 
   ifstream in(args_env_path());
   assert(in.good());
@@ -549,6 +1778,213 @@ TraceReader::TraceReader(const string& dir)
   in >> argv;
   in >> envp;
   in >> bind_to_cpu;
+
+  read_compression_policies();
+
+  CompressedReader::set_block_cache_size(Flags::get().block_cache_size);
+
+  uint32_t read_ahead_blocks = Flags::get().read_ahead_blocks;
+  if (read_ahead_blocks > 0) {
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      // Use as many threads as compressed the substream, which reflects
+      // how much data is expected.
+      reader(s).enable_read_ahead(
+          read_ahead_blocks,
+          min(read_ahead_blocks, compression_policy(s).threads));
+    }
+  }
+
+  following_ = recording_in_progress(recording_path(), &flushed_time_);
+}
+
+bool TraceReader::can_decode_frame(TraceFrame::Time last_decoded) const {
+  if (following_ && last_decoded >= flushed_time_) {
+    return false;
+  }
+  return !reader(EVENTS).at_end();
+}
+
+// How often to look for more of a trace that's being recorded.
+static const useconds_t FOLLOW_POLL_US = 100000;
+
+bool TraceReader::wait_for_more() {
+  TraceFrame::Time last_decoded =
+      lookahead.empty() ? time() : lookahead.back().time();
+  while (following_) {
+    // Blocks we've read may have been cached as the end of their file.
+    for (auto& r : readers) {
+      r->refresh();
+    }
+    if (can_decode_frame(last_decoded)) {
+      return true;
+    }
+    TraceFrame::Time flushed_time;
+    if (!recording_in_progress(recording_path(), &flushed_time)) {
+      // Everything the recorder wrote is in the files now.
+      following_ = false;
+      for (auto& r : readers) {
+        r->refresh();
+      }
+      return true;
+    }
+    if (flushed_time > flushed_time_) {
+      flushed_time_ = flushed_time;
+    } else {
+      usleep(FOLLOW_POLL_US);
+    }
+  }
+  return false;
+}
+
+void TraceReader::enable_read_ahead(uint32_t blocks, uint32_t threads) {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader(s).enable_read_ahead(blocks, threads);
+  }
+}
+
+/**
+ * Traces from before per-substream policies existed have no compression
+ * file; they used the defaults.
+ */
+void TraceReader::read_compression_policies() {
+  ifstream in(compression_path());
+  string name, codec_name;
+  CompressionPolicy p;
+  while (in >> name >> codec_name >> p.level >> p.block_size >> p.threads) {
+    Substream s;
+    if (!substream_for_name(name, &s)) {
+      continue;
+    }
+    // Readers may lack support for a codec; the policy is informational
+    // here, so keep the default codec rather than failing.
+    const CompressionCodec* codec = CompressionCodec::get(codec_name);
+    p.codec = codec ? codec->id() : policies[s].codec;
+    policies[s] = p;
+  }
+}
+
+bool TraceReader::read_writer_stats(
+    CompressedWriter::Stats* stats,
+    WriteMemoryBudget::Stats* budget_stats) const {
+  ifstream in(stats_path());
+  if (!in.good()) {
+    return false;
+  }
+  memset(stats, 0, sizeof(*stats) * SUBSTREAM_COUNT);
+  if (budget_stats) {
+    memset(budget_stats, 0, sizeof(*budget_stats));
+  }
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string name;
+    fields >> name;
+    Substream s;
+    CompressedWriter::Stats st;
+    WriteMemoryBudget::Stats bst;
+    if (name == "memory_budget") {
+      if (budget_stats &&
+          fields >> bst.limit >> bst.peak >> bst.waits >> bst.wait_ns) {
+        *budget_stats = bst;
+      }
+    } else if (substream_for_name(name, &s) &&
+               fields >> st.stalls >> st.stall_ns >> st.blocks >>
+                   st.stored_blocks >> st.compress_ns >> st.compress_bytes) {
+      stats[s] = st;
+    }
+  }
+  return true;
+}
+
+bool TraceReader::read_syscallbuf_fallbacks(
+    map<string, uint64_t>* counts) const {
+  ifstream in(stats_path());
+  if (!in.good()) {
+    return false;
+  }
+  counts->clear();
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string kind;
+    string name;
+    uint64_t count;
+    if (fields >> kind >> name >> count && kind == "syscallbuf_fallback") {
+      (*counts)[name] = count;
+    }
+  }
+  return true;
+}
+
+vector<TraceStream::Bookmark> TraceReader::read_bookmarks() const {
+  vector<Bookmark> bookmarks;
+  ifstream in(bookmarks_path());
+  Bookmark bookmark;
+  while (in >> bookmark.time && in.get() == ' ' &&
+         getline(in, bookmark.name)) {
+    bookmarks.push_back(bookmark);
+  }
+  return bookmarks;
+}
+
+vector<TraceStream::WallClockTime> TraceReader::read_wall_clock_times()
+    const {
+  vector<WallClockTime> times;
+  ifstream in(wall_clock_path());
+  WallClockTime t;
+  while (in >> t.time >> t.usecs) {
+    times.push_back(t);
+  }
+  return times;
+}
+
+bool TraceReader::read_job(JobInfo* job) const {
+  ifstream in(job_path());
+  string kind;
+  if (!(in >> kind) || kind != "job" ||
+      !(in >> job->id >> job->rank >> job->host)) {
+    return false;
+  }
+  while (in >> kind) {
+    if (kind == "connection") {
+      JobConnection c;
+      if (!(in >> c.local >> c.peer)) {
+        return false;
+      }
+      job->connections.push_back(c);
+    } else if (kind == "message") {
+      JobMessage m;
+      string direction;
+      if (!(in >> m.time >> m.tid >> m.connection >> direction >> m.offset >>
+            m.length) ||
+          m.connection >= job->connections.size()) {
+        return false;
+      }
+      m.sent = direction == "send";
+      job->messages.push_back(m);
+    } else if (kind == "monitor") {
+      TraceFrame::Time time;
+      if (!(in >> time)) {
+        return false;
+      }
+      job->monitor_times.push_back(time);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TraceReader::monitored_socket_at(TraceFrame::Time time) {
+  if (!socket_monitor_times) {
+    JobInfo job;
+    socket_monitor_times = make_shared<vector<TraceFrame::Time> >();
+    if (read_job(&job)) {
+      socket_monitor_times->swap(job.monitor_times);
+    }
+  }
+  return binary_search(socket_monitor_times->begin(),
+                       socket_monitor_times->end(), time);
 }
 
 /**
@@ -557,7 +1993,14 @@ TraceReader::TraceReader(const string& dir)
  * clone won't affect the state of 'other' (and vice versa).
  */
 TraceReader::TraceReader(const TraceReader& other)
-    : TraceStream(other.dir(), other.time()) {
+    : TraceStream(other.dir(), other.time()),
+      trace_version(other.trace_version),
+      elides_pipe_data_(other.elides_pipe_data_),
+      custom_syscallbuf_size_(other.custom_syscallbuf_size_),
+      flush_resets_(other.flush_resets_),
+      following_(other.following_),
+      flushed_time_(other.flushed_time_),
+      lookahead(other.lookahead) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] =
         unique_ptr<CompressedReader>(new CompressedReader(other.reader(s)));
@@ -567,6 +2010,12 @@ TraceReader::TraceReader(const TraceReader& other)
   envp = other.envp;
   cwd = other.cwd;
   bind_to_cpu = other.bind_to_cpu;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    policies[s] = other.policies[s];
+  }
+  frame_deltas = other.frame_deltas;
+  index = other.index;
+  socket_monitor_times = other.socket_monitor_times;
 }
 
 uint64_t TraceReader::uncompressed_bytes() const {
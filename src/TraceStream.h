@@ -5,8 +5,11 @@
 
 #include <unistd.h>
 
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "CompressedReader.h"
@@ -15,6 +18,7 @@
 #include "remote_ptr.h"
 #include "TraceFrame.h"
 #include "TraceMappedRegion.h"
+#include "TraceSink.h"
 #include "TraceTaskEvent.h"
 
 /**
@@ -49,6 +53,88 @@ public:
     SUBSTREAM_COUNT
   };
 
+  /**
+   * How one substream is compressed. Chosen when recording starts and
+   * saved in the trace's "compression" file. Readers don't need it to
+   * decode the trace, since every block records its own codec.
+   */
+  struct CompressionPolicy {
+    CompressionCodec::Id codec;
+    // CompressionCodec::DEFAULT_LEVEL, or a codec-specific level.
+    int level;
+    size_t block_size;
+    uint32_t threads;
+  };
+  static CompressionPolicy default_compression_policy(Substream s);
+  const CompressionPolicy& compression_policy(Substream s) const {
+    return policies[s];
+  }
+
+  /**
+   * A point in the trace that a tracee named through RR_MAGIC_BOOKMARK_FD.
+   */
+  struct Bookmark {
+    TraceFrame::Time time;
+    string name;
+  };
+
+  /**
+   * The wall-clock time, in microseconds since the epoch, that a tracee
+   * observed at or just before event |time|.
+   */
+  struct WallClockTime {
+    TraceFrame::Time time;
+    int64_t usecs;
+  };
+
+  /**
+   * A TCP connection that a tracee of a job's rank connected or accepted,
+   * as "<address>:<port>" of each end.
+   */
+  struct JobConnection {
+    string local;
+    string peer;
+  };
+
+  /**
+   * Data a task of a job's rank sent or received on connection
+   * |connection| (an index into JobInfo::connections) in event |time|.
+   * |offset| is the position of its first byte in the connection's stream
+   * in that direction, so a message is matched with the other rank's by
+   * the offsets in the other end's trace.
+   */
+  struct JobMessage {
+    TraceFrame::Time time;
+    pid_t tid;
+    uint32_t connection;
+    bool sent;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  /**
+   * How a trace recorded with `rr record --job' fits into a distributed
+   * job: the job's ID, the trace's rank (-1 if unknown), the host it was
+   * recorded on, and the traffic on TCP connections. |monitor_times| are
+   * the events, in order, in which a socket got a SocketMonitor.
+   */
+  struct JobInfo {
+    JobInfo() : rank(-1) {}
+    string id;
+    int rank;
+    string host;
+    std::vector<JobConnection> connections;
+    std::vector<JobMessage> messages;
+    std::vector<TraceFrame::Time> monitor_times;
+  };
+
+  static const char* substream_name(Substream s);
+  /**
+   * Look up the substream whose file is called |name|. Returns false if
+   * there is none.
+   */
+  static bool substream_for_name(const string& name, Substream* s);
+
   /** Return the directory storing this trace's files. */
   const string& dir() const { return trace_dir; }
 
@@ -66,12 +152,16 @@ public:
 
 protected:
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
-      : trace_dir(trace_dir), global_time(initial_time) {}
+      : trace_dir(trace_dir), global_time(initial_time) {
+    for (int s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      policies[s] = default_compression_policy((Substream)s);
+    }
+  }
 
   /**
    * Return the path of the file for the given substream.
    */
-  string path(Substream s);
+  string path(Substream s) const;
 
   /**
    * Return the path of the "args_env" file, into which the
@@ -84,12 +174,89 @@ protected:
    * trace.
    */
   string version_path() const { return trace_dir + "/version"; }
+  /**
+   * Return the path of the "compression" file, which stores the
+   * CompressionPolicy of each substream.
+   */
+  string compression_path() const { return trace_dir + "/compression"; }
+  /**
+   * Return the path of the "index" file, which maps event times to
+   * positions in the substreams. See IndexEntry.
+   */
+  string index_path() const { return trace_dir + "/index"; }
+  /**
+   * Return the path of the "stats" file, which stores the
+   * CompressedWriter::Stats of each substream when recording finished,
+   * and the WriteMemoryBudget::Stats if there was a budget.
+   */
+  string stats_path() const { return trace_dir + "/stats"; }
+  /**
+   * Return the path of the "bookmarks" file, which has a line
+   * "<event> <name>" for each bookmark the tracees saved through
+   * RR_MAGIC_BOOKMARK_FD.
+   */
+  string bookmarks_path() const { return trace_dir + "/bookmarks"; }
+  /**
+   * Return the path of the "wall_clock" file, which has a line
+   * "<event> <usecs>" for each WallClockTime, in event order.
+   */
+  string wall_clock_path() const { return trace_dir + "/wall_clock"; }
+  /**
+   * Return the path of the "job" file, which has a line
+   * "job <id> <rank> <host>", then "connection <local> <peer>" for each
+   * JobConnection, "message <event> <tid> <connection> send|recv
+   * <offset> <length>" for each JobMessage, in event order, and
+   * "monitor <event>" for each of JobInfo::monitor_times.
+   */
+  string job_path() const { return trace_dir + "/job"; }
+  /**
+   * Return the path of the "recording" file, which holds the pid of the
+   * rr process recording the trace, the last event it has flushed, and the
+   * boot id and process start time that identify the recorder, until the
+   * TraceWriter is closed.
+   */
+  string recording_path() const { return trace_dir + "/recording"; }
+
+  /**
+   * An IndexEntry records where each substream's data for events at or
+   * after |time| begins. They're written every INDEX_INTERVAL frames.
+   */
+  struct IndexEntry {
+    TraceFrame::Time time;
+    uint64_t block_offset[SUBSTREAM_COUNT];
+    uint64_t offset_in_block[SUBSTREAM_COUNT];
+  };
+  enum { INDEX_INTERVAL = 1000 };
 
   /**
    * Increment the global time and return the incremented value.
    */
   void tick_time() { ++global_time; }
 
+  /**
+   * Frames in EVENTS are encoded as changes from the previous frame of the
+   * same task. This is what the encoding of the next frame is relative to.
+   * It's cleared at every index point, so reading can start at any of them.
+   */
+  struct FrameDelta {
+    Ticks ticks;
+    Registers regs;
+    PerfCounters::Extra extra_perf;
+    // Shared with the frames that have these ExtraRegisters. Null before
+    // the task's first frame with exec info.
+    std::shared_ptr<const ExtraRegisters> extra_regs;
+  };
+  struct FrameDeltas {
+    FrameDeltas() : last_tid(0) {}
+    void clear() {
+      tasks.clear();
+      last_tid = 0;
+    }
+    std::unordered_map<pid_t, FrameDelta> tasks;
+    // Task of the previous frame.
+    pid_t last_tid;
+  };
+
   // Directory into which we're saving the trace files.
   string trace_dir;
   // The initial argv and envp for a tracee.
@@ -99,6 +266,8 @@ protected:
   string cwd;
   // CPU core# that the tracees are bound to
   int bind_to_cpu;
+  CompressionPolicy policies[SUBSTREAM_COUNT];
+  FrameDeltas frame_deltas;
 
   // Arbitrary notion of trace time, ticked on the recording of
   // each event (trace frame).
@@ -136,6 +305,124 @@ public:
    */
   void write_task_event(const TraceTaskEvent& event);
 
+  /**
+   * When |min_size| is nonzero, raw-data records of at least |min_size|
+   * bytes whose contents were already written are recorded as references
+   * to the earlier copy instead.
+   */
+  void set_raw_data_dedup_min_size(size_t min_size) {
+    dedup_min_size = min_size;
+  }
+
+  /**
+   * When |min_size| is nonzero, private mappings of at least |min_size|
+   * bytes that would otherwise have their memory copied into the trace
+   * copy their backing file into the trace directory instead, using
+   * reflinks or copy_file_range where the filesystem supports them.
+   */
+  void set_copy_mapped_files_min_size(size_t min_size) {
+    copy_mapped_files_min_size = min_size;
+  }
+
+  /**
+   * Store blocks uncompressed while compression can't keep up with the
+   * tracees. See CompressedWriter::set_adaptive.
+   */
+  void set_adaptive_compression(bool adaptive);
+
+  /**
+   * Back the substreams' buffers with transparent huge pages where
+   * possible. See CompressedWriter::set_huge_pages.
+   */
+  void set_huge_pages();
+
+  /**
+   * Mark the trace as leaving out pipe reads that replay reproduces, so
+   * that only rr versions that can do that replay it.
+   */
+  void set_elides_pipe_data();
+
+  /**
+   * Mark the trace as using syscallbufs of a non-default size, so that
+   * only rr versions that read the recorded size replay it.
+   */
+  void set_custom_syscallbuf_size();
+
+  /**
+   * Run the substreams' compression and write threads only on |cpus|.
+   */
+  void bind_compression_threads(const std::vector<int>& cpus);
+
+  /**
+   * Limit the memory used by all substreams' buffers and queued compressed
+   * blocks to about |limit| bytes, making compression (and eventually
+   * recording) wait for output when it's reached. See WriteMemoryBudget.
+   */
+  void set_memory_budget(size_t limit);
+
+  /**
+   * Count a syscall that entered the syscallbuf hook but had to be traced.
+   * The counts are saved with the recording statistics.
+   */
+  void count_syscallbuf_fallback(const std::string& syscall_name) {
+    ++syscallbuf_fallbacks[syscall_name];
+  }
+
+  /**
+   * Save a bookmark called |name| at the current event. Bookmarks are
+   * written when the trace is closed.
+   */
+  void add_bookmark(const std::string& name);
+
+  /**
+   * Note that a tracee read the wall-clock time |sec|.|usec| (from
+   * gettimeofday(), clock_gettime() or time()) before the current event.
+   * Values that can't be wall-clock times (e.g. from CLOCK_MONOTONIC) are
+   * ignored, and the index keeps at most one entry per millisecond.
+   */
+  void note_wall_clock_time(int64_t sec, int64_t usec);
+
+  /**
+   * Tag the trace as rank |rank| (-1 if unknown) of the distributed job
+   * |id|, recorded on this host. The job's connections and messages are
+   * written when the trace is closed.
+   */
+  void set_job(const std::string& id, int rank);
+  bool has_job() const { return !job.id.empty(); }
+  /**
+   * Add a TCP connection to the job's and return its index.
+   */
+  uint32_t add_job_connection(const std::string& local,
+                              const std::string& peer);
+  /**
+   * Note that task |tid| sent (or received, if !|sent|) |length| bytes at
+   * |offset| in the stream of job connection |connection| in the current
+   * event.
+   */
+  void note_job_message(pid_t tid, uint32_t connection, bool sent,
+                        uint64_t offset, uint64_t length);
+  /**
+   * Note that a socket got a SocketMonitor in the current event.
+   */
+  void note_job_monitor();
+
+  /**
+   * Total time spent waiting for compression to catch up, in all
+   * substreams, so far.
+   */
+  uint64_t stall_ns();
+  /**
+   * Number of bytes written to substream |s| so far, before compression.
+   */
+  uint64_t uncompressed_pos(Substream s) const {
+    return writer(s).uncompressed_pos();
+  }
+  /**
+   * Number of bytes written to all substreams that are still waiting to
+   * be compressed.
+   */
+  uint64_t compression_backlog();
+
   /**
    * Return true iff all trace files are "good".
    */
@@ -148,25 +435,94 @@ public:
    */
   void close();
 
+  /**
+   * Write out everything recorded so far, so that a TraceReader following
+   * the trace while it's recorded can read it. See
+   * TraceReader::wait_for_more.
+   */
+  void flush();
+
+  /**
+   * Delete the closed trace in directory |dir|, and the latest-trace
+   * symlink if it points there.
+   */
+  static void delete_trace(const string& dir);
+
   /**
    * Create a trace that will record the initial exe
    * image |argv[0]| with initial args |argv|, initial environment |envp|,
    * current working directory |cwd| and bound to cpu |bind_to_cpu|. This
    * data is recored in the trace.
    * The trace name is determined by the global rr args and environment.
+   * Substream |s| is compressed according to |policies[s]|; when
+   * |policies| is empty, default_compression_policy() is used for all
+   * substreams. When |sink| is non-null the trace is also streamed to it
+   * as it's written.
    */
   TraceWriter(const std::vector<std::string>& argv,
               const std::vector<std::string>& envp, const string& cwd,
-              int bind_to_cpu);
+              int bind_to_cpu, const std::vector<CompressionPolicy>& policies =
+                                   std::vector<CompressionPolicy>(),
+              const std::shared_ptr<TraceSink>& sink = nullptr);
 
 private:
   std::string try_hardlink_file(const std::string& file_name);
+  /**
+   * Copy the file backing |map| into the trace directory. Returns the
+   * copy's name relative to the trace directory, or an empty string if it
+   * wasn't copied.
+   */
+  std::string try_copy_file(const TraceMappedRegion& map);
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
 
+  /**
+   * List the required section |name| in the version file.
+   */
+  void add_marker_section(const char* name);
+  void write_index();
+  void write_stats();
+  void write_bookmarks();
+  void write_wall_clock_times();
+  void write_job();
+  void write_recording_file();
+  void finish_sink();
+
   std::unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
+  std::shared_ptr<TraceSink> sink;
+  std::shared_ptr<WriteMemoryBudget> memory_budget;
+  std::map<std::string, uint64_t> syscallbuf_fallbacks;
+  std::vector<Bookmark> bookmarks;
+  std::vector<WallClockTime> wall_clock_times;
+  JobInfo job;
+  // Encoded frame being written. Reused to avoid allocating per frame.
+  std::vector<uint8_t> frame_buffer;
   uint32_t mmap_count;
+  size_t copy_mapped_files_min_size;
+
+  struct UncompressedPositions {
+    TraceFrame::Time time;
+    uint64_t pos[SUBSTREAM_COUNT];
+  };
+  // Converted to IndexEntry records when the writers are closed.
+  std::vector<UncompressedPositions> index_positions;
+
+  struct RawDataKey {
+    uint64_t hash[2];
+    size_t len;
+    bool operator==(const RawDataKey& other) const {
+      return hash[0] == other.hash[0] && hash[1] == other.hash[1] &&
+             len == other.len;
+    }
+  };
+  struct RawDataKeyHash {
+    size_t operator()(const RawDataKey& key) const { return key.hash[0]; }
+  };
+  size_t dedup_min_size;
+  // Position in the RAW_DATA stream of the first copy of each record
+  // eligible for deduplication.
+  std::unordered_map<RawDataKey, uint64_t, RawDataKeyHash> raw_data_seen;
 };
 
 class TraceReader : public TraceStream {
@@ -179,6 +535,15 @@ public:
     std::vector<uint8_t> data;
     remote_ptr<void> addr;
   };
+  /**
+   * Like RawData, but |data| borrows from buffers owned by the TraceReader
+   * and is only valid until the next read from the same TraceReader.
+   */
+  struct RawDataView {
+    const uint8_t* data;
+    size_t size;
+    remote_ptr<void> addr;
+  };
 
   /**
    * Read relevant data from the trace.
@@ -216,6 +581,11 @@ public:
    * Read the next raw data record and return it.
    */
   RawData read_raw_data();
+  /**
+   * Read the next raw data record without copying it when possible. See
+   * RawDataView for the lifetime of the data.
+   */
+  RawDataView read_raw_data_view();
 
   /**
    * Reads the next raw data record for 'frame' from the current point in
@@ -223,6 +593,7 @@ public:
    * false.
    */
   bool read_raw_data_for_frame(const TraceFrame& frame, RawData& d);
+  bool read_raw_data_view_for_frame(const TraceFrame& frame, RawDataView& d);
 
   /**
    * Return true iff all trace files are "good".
@@ -233,11 +604,27 @@ public:
   /**
    * Return true if we're at the end of the trace file.
    */
-  bool at_end() const { return reader(EVENTS).at_end(); }
+  bool at_end() const {
+    return lookahead.empty() && !can_decode_frame(time());
+  }
+
+  /**
+   * True if the trace was still being recorded when this was opened, so
+   * that reading it to the end should wait_for_more() rather than stop.
+   */
+  bool following() const { return following_; }
+  /**
+   * When following a trace that's being recorded, wait until the recorder
+   * flushes more events or finishes, and return true; at_end() needs
+   * checking again then. Returns false if the trace isn't (or is no
+   * longer) being followed. Until then at_end() is true at the last
+   * flushed event.
+   */
+  bool wait_for_more();
 
   /**
    * Return the next trace frame, without mutating any stream
-   * state.
+   * state. Frames are only decoded once however much we peek at them.
    */
   TraceFrame peek_frame();
 
@@ -254,8 +641,117 @@ public:
    */
   void rewind();
 
+  /**
+   * Use the trace index to skip forward to the indexed position closest to
+   * but not after the frame for |time|, so that the next read_frame()
+   * returns a frame no later than |time|. Does nothing if there's no index
+   * or no indexed position ahead of the current one. Returns true if the
+   * position changed.
+   */
+  bool skip_to_before_event(TraceFrame::Time time);
+
+  /**
+   * Decompress up to |blocks| blocks of each substream ahead of the reader
+   * using |threads| background threads per substream, while frames are
+   * still parsed in order on the calling thread. Must be called before
+   * anything is read. (-R/--read-ahead does this for every TraceReader,
+   * with threads matched to how the substream was compressed.)
+   */
+  void enable_read_ahead(uint32_t blocks, uint32_t threads);
+
+  /**
+   * Read the recording statistics of each substream into |stats|, which
+   * has SUBSTREAM_COUNT entries, and the memory budget's statistics into
+   * |budget_stats| if it's non-null. Returns false if the trace has none.
+   * |budget_stats->limit| is 0 if recording had no memory budget.
+   */
+  bool read_writer_stats(CompressedWriter::Stats* stats,
+                         WriteMemoryBudget::Stats* budget_stats =
+                             nullptr) const;
+
+  /**
+   * Read the number of times each syscall entered the syscallbuf hook but
+   * had to be traced, by syscall name, into |counts|. Returns false if the
+   * trace has no recording statistics.
+   */
+  bool read_syscallbuf_fallbacks(
+      std::map<std::string, uint64_t>* counts) const;
+
+  /**
+   * Read the trace's bookmarks, in the order they were saved.
+   */
+  std::vector<Bookmark> read_bookmarks() const;
+
+  /**
+   * True if the trace leaves out pipe reads that replay must reproduce
+   * with PipeMonitors. See TraceWriter::set_elides_pipe_data.
+   */
+  bool elides_pipe_data() const { return elides_pipe_data_; }
+
+  /**
+   * True if the trace's syscallbufs may differ from SYSCALLBUF_BUFFER_SIZE.
+   * See TraceWriter::set_custom_syscallbuf_size.
+   */
+  bool custom_syscallbuf_size() const { return custom_syscallbuf_size_; }
+
+  /**
+   * True if the trace's syscallbuf flush events record whether they reset
+   * the buffer, instead of being followed by EV_SYSCALLBUF_RESET frames.
+   */
+  bool flush_resets() const { return flush_resets_; }
+
+  /**
+   * Read the trace's wall-clock time index, in event order. Empty if no
+   * tracee read the time, or the trace predates the index.
+   */
+  std::vector<WallClockTime> read_wall_clock_times() const;
+
+  /**
+   * Read what the trace records about its part in a distributed job.
+   * Returns false if it wasn't recorded with --job.
+   */
+  bool read_job(JobInfo* job) const;
+
+  /**
+   * True if a socket got a SocketMonitor in event |time| during recording.
+   */
+  bool monitored_socket_at(TraceFrame::Time time);
+
+  /**
+   * Copy the backing file of every file-backed mapping into the trace
+   * directory, named by a hash of its contents, and rewrite MMAPS to use
+   * the copies. This makes the trace independent of the files on this
+   * machine. Identical files are stored once, and are shared by hardlink
+   * with other traces in the same directory that already have a copy.
+   * Reading MMAPS starts again from the beginning afterwards. Returns the
+   * number of files packed.
+   */
+  size_t pack_mapped_files();
+
+  /**
+   * Map the name of every file that was mmapped during recording to the
+   * copy of it in the trace directory (a hardlink, copy or packed file)
+   * that replay maps instead, for files that have one. Doesn't disturb
+   * reading MMAPS.
+   */
+  std::map<std::string, std::string> mapped_file_copies() const;
+
+  /**
+   * Read every mapped region descriptor in the trace, with where replay
+   * gets its data from. Doesn't disturb reading MMAPS or check backing
+   * files, so the trace needn't be replayable.
+   */
+  std::vector<std::pair<TraceMappedRegion, MappedDataSource> >
+  mapped_regions() const;
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
+  uint64_t uncompressed_bytes(Substream s) const {
+    return reader(s).uncompressed_bytes();
+  }
+  uint64_t compressed_bytes(Substream s) const {
+    return reader(s).compressed_bytes();
+  }
 
   /**
    * Open the trace in 'dir'. When 'dir' is the empty string, open the
@@ -271,10 +767,36 @@ public:
   TraceReader(const TraceReader& other);
 
 private:
+  void read_compression_policies();
+  void load_index();
+  bool next_raw_data_is_for_frame(const TraceFrame& frame);
+  /**
+   * True if the frame after the one at |last_decoded| can be decoded.
+   */
+  bool can_decode_frame(TraceFrame::Time last_decoded) const;
+  TraceFrame decode_frame();
+  TraceFrame decode_legacy_frame();
+
   CompressedReader& reader(Substream s) { return *readers[s]; }
   const CompressedReader& reader(Substream s) const { return *readers[s]; }
 
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  int trace_version;
+  bool elides_pipe_data_;
+  bool custom_syscallbuf_size_;
+  bool flush_resets_;
+  bool following_;
+  // While following_, frames after this one may not be fully written yet.
+  TraceFrame::Time flushed_time_;
+  // Frames decoded from EVENTS by peeking but not yet read, oldest first.
+  std::deque<TraceFrame> lookahead;
+  // Loaded on first use and shared between copies. Sorted by time.
+  std::shared_ptr<std::vector<IndexEntry> > index;
+  // JobInfo::monitor_times, loaded on first use and shared between copies.
+  std::shared_ptr<std::vector<TraceFrame::Time> > socket_monitor_times;
+  // Holds raw data records that couldn't be viewed in place, e.g. because
+  // they span a block boundary. Reused to avoid allocating per record.
+  std::vector<uint8_t> raw_data_buffer;
 };
 
 #endif /* RR_TRACE_H_ */
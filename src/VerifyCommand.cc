@@ -0,0 +1,195 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "VerifyCommand"
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <limits>
+
+#include "Command.h"
+#include "Flags.h"
+#include "log.h"
+#include "main.h"
+#include "ReplaySession.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class VerifyCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  VerifyCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static VerifyCommand singleton;
+};
+
+VerifyCommand VerifyCommand::singleton(
+    "verify",
+    " rr -C <checksum-mode> verify [OPTIONS] [<trace_dir>]\n"
+    "  Replay the trace, checking the memory checksums that were recorded\n"
+    "  with the same -C/--checksum mode.\n"
+    "  -j, --jobs=<N>             split the trace into N consecutive ranges\n"
+    "                             of events and check each in a separate\n"
+    "                             replay, in parallel. Every replay still\n"
+    "                             runs from the start of the trace, but\n"
+    "                             only computes checksums in its range.\n"
+    "  -s, --segment=<K>/<N>      check only the Kth of N consecutive\n"
+    "                             ranges of events, so that machines with\n"
+    "                             copies of the trace can share the work.\n"
+    "                             With -j the segment is split further.\n");
+
+struct VerifyFlags {
+  int jobs;
+  // Check segment |segment| (from 1) of |segments|.
+  int segment;
+  int segments;
+
+  VerifyFlags() : jobs(1), segment(1), segments(1) {}
+};
+
+static bool parse_segment(const string& spec, VerifyFlags& flags) {
+  int k, n;
+  char c;
+  if (sscanf(spec.c_str(), "%d/%d%c", &k, &n, &c) != 2 || n < 1 ||
+      n > 1024 * 1024 || k < 1 || k > n) {
+    fprintf(stderr, "Invalid segment `%s'\n", spec.c_str());
+    return false;
+  }
+  flags.segment = k;
+  flags.segments = n;
+  return true;
+}
+
+static bool parse_verify_arg(std::vector<std::string>& args,
+                             VerifyFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'j', "jobs", HAS_PARAMETER },
+                                        { 's', "segment", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 's':
+      if (!parse_segment(opt.value, flags)) {
+        return false;
+      }
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Return the time of the last frame in the trace.
+ */
+static TraceFrame::Time last_event(const string& trace_dir) {
+  TraceReader trace(trace_dir);
+  trace.skip_to_before_event(numeric_limits<TraceFrame::Time>::max());
+  while (!trace.at_end()) {
+    trace.read_frame();
+  }
+  return trace.time();
+}
+
+/**
+ * Replay until the trace reaches |end| or the tracees exit, checking
+ * checksums at events in [start, end). Checksum mismatches are fatal.
+ */
+static void verify_range(const string& trace_dir, TraceFrame::Time start,
+                         TraceFrame::Time end) {
+  Flags& flags = Flags::get_for_init();
+  flags.checksum_start = start;
+  flags.checksum_end = end;
+
+  ReplaySession::shr_ptr session = ReplaySession::create(trace_dir);
+  while (session->trace_reader().time() < end) {
+    auto result = session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+    assert(result.status == REPLAY_CONTINUE);
+  }
+}
+
+static int verify(const string& trace_dir, const VerifyFlags& flags) {
+  if (Flags::get().checksum == Flags::CHECKSUM_NONE) {
+    fprintf(stderr, "rr verify needs the -C/--checksum mode the trace was "
+                    "recorded with\n");
+    return 1;
+  }
+
+  TraceFrame::Time last = last_event(trace_dir);
+  // Frames are numbered from 1.
+  TraceFrame::Time segment_start =
+      1 + int64_t(last) * (flags.segment - 1) / flags.segments;
+  TraceFrame::Time segment_end =
+      1 + int64_t(last) * flags.segment / flags.segments;
+  TraceFrame::Time events = segment_end - segment_start;
+  if (events == 0) {
+    return 0;
+  }
+  int jobs = max(1, min<int>(flags.jobs, events));
+  vector<pid_t> children;
+  for (int i = 0; i < jobs; ++i) {
+    TraceFrame::Time start = segment_start + int64_t(events) * i / jobs;
+    TraceFrame::Time end = segment_start + int64_t(events) * (i + 1) / jobs;
+    pid_t child = fork();
+    if (child < 0) {
+      FATAL() << "Can't fork to verify the trace";
+    }
+    if (child == 0) {
+      verify_range(trace_dir, start, end);
+      exit(0);
+    }
+    LOG(debug) << "Verifying events " << start << "-" << end - 1 << " in "
+               << child;
+    children.push_back(child);
+  }
+
+  int failures = 0;
+  for (auto child : children) {
+    int status;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ++failures;
+    }
+  }
+  if (failures > 0) {
+    fprintf(stderr, "rr verify: %d of %d replays failed\n", failures, jobs);
+    return 1;
+  }
+  return 0;
+}
+
+int VerifyCommand::run(std::vector<std::string>& args) {
+  VerifyFlags flags;
+
+  while (parse_verify_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir) || !args.empty()) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return verify(trace_dir, flags);
+}
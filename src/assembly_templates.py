@@ -112,6 +112,9 @@ templates = {
         RawBytes(0xe8),         # call $trampoline_relative_addr
         Field('trampoline_relative_addr', 4),
         RawBytes(0x8d, 0xa4, 0x24, 0x00, 0x01, 0x00, 0x00), # lea 256(%esp),%esp
+        # Room for instructions relocated from the patch site; see
+        # Monkeypatcher::try_patch_syscall.
+        RawBytes(*([0x90] * 16)), # nop * 16
         RawBytes(0xe9),         # jmp $return_relative_addr
         Field('return_relative_addr', 4),
     ),
@@ -145,6 +148,9 @@ templates = {
         RawBytes(0xe8),         # call $trampoline_relative_addr
         Field('trampoline_relative_addr', 4),
         RawBytes(0x48, 0x8d, 0xa4, 0x24, 0x00, 0x01, 0x00, 0x00), # lea 256(%rsp),%rsp
+        # Room for instructions relocated from the patch site; see
+        # Monkeypatcher::try_patch_syscall.
+        RawBytes(*([0x90] * 16)), # nop * 16
         RawBytes(0xe9),         # jmp $return_relative_addr
         Field('return_relative_addr', 4),
     ),
@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# Measure how much rr slows down each benchmark workload.
+#
+#  bench.sh <objdir> <workload>...
+#
+# Each workload is a program in <objdir>/bin. It is run natively, recorded,
+# and replayed with -a and with -a --fast. The script prints one JSON object
+# per line per workload, so results from different rr builds can be diffed
+# or loaded into a spreadsheet:
+#
+#  {"workload":..., "native_s":..., "record_s":..., "replay_s":...,
+#   "replay_fast_s":..., "trace_kb":..., "record_max_rss_kb":...,
+#   "replay_max_rss_kb":...}
+#
+# Peak RSS is only reported when GNU time is installed as /usr/bin/time;
+# otherwise it's null.
+
+objdir=$1
+shift
+rr=$objdir/bin/rr
+
+workdir=`mktemp -d /tmp/rr-bench-XXXXXX`
+trap "rm -rf $workdir" EXIT
+
+# run <output-var-prefix> <command>...
+#
+# Run the command with its output discarded, setting ${prefix}_s to the
+# elapsed seconds and ${prefix}_rss to the peak RSS in KB (or null).
+function run { prefix=$1; shift
+    local start=`date +%s.%N`
+    if [[ -x /usr/bin/time ]]; then
+        /usr/bin/time -f %M -o $workdir/rss "$@" > /dev/null 2>&1
+        local status=$?
+        eval ${prefix}_rss=`cat $workdir/rss | tail -1`
+    else
+        "$@" > /dev/null 2>&1
+        local status=$?
+        eval ${prefix}_rss=null
+    fi
+    local end=`date +%s.%N`
+    eval ${prefix}_s=`awk "BEGIN { print $end - $start }"`
+    if [[ $status != 0 ]]; then
+        echo "bench.sh: '$*' failed with status $status" >&2
+        exit 1
+    fi
+}
+
+for workload in "$@"; do
+    exe=$objdir/bin/$workload
+    tracedir=$workdir/$workload
+
+    run native $exe
+    run record env _RR_TRACE_DIR=$tracedir $rr record $exe
+    trace=`readlink -f $tracedir/latest-trace`
+    run replay $rr replay -a $trace
+    run replay_fast $rr replay -a --fast $trace
+    trace_kb=`du -sk $trace | cut -f1`
+
+    echo "{\"workload\":\"$workload\", \"native_s\":$native_s," \
+         "\"record_s\":$record_s, \"replay_s\":$replay_s," \
+         "\"replay_fast_s\":$replay_fast_s, \"trace_kb\":$trace_kb," \
+         "\"record_max_rss_kb\":$record_rss," \
+         "\"replay_max_rss_kb\":$replay_rss}"
+    rm -rf $tracedir
+done
@@ -0,0 +1,22 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Repeatedly fork and exec a trivial program, like a shell script does. */
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    pid_t child = fork();
+    if (child == 0) {
+      execl("/bin/true", "true", (char*)NULL);
+      _exit(1);
+    }
+    waitpid(child, NULL, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Two threads handing a token back and forth through a condition
+ * variable, so every handoff blocks in futex(). */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int turn;
+static int iterations;
+
+static void* pong(void* arg) {
+  int i;
+  for (i = 0; i < iterations; ++i) {
+    pthread_mutex_lock(&lock);
+    while (turn != 1) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    turn = 0;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  pthread_t thread;
+  int i;
+
+  iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  pthread_create(&thread, NULL, pong, NULL);
+  for (i = 0; i < iterations; ++i) {
+    pthread_mutex_lock(&lock);
+    while (turn != 0) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    turn = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  pthread_join(thread, NULL);
+  return 0;
+}
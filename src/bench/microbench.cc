@@ -0,0 +1,177 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/**
+ * Microbenchmarks for rr's hot internal paths that don't need a tracee.
+ *
+ *  rr_microbench [<benchmark>...]
+ *
+ * runs the named benchmarks (all of them by default) and prints one JSON
+ * object per benchmark, like src/bench/bench.sh does for whole workloads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../AddressSpace.h"
+#include "../CompressedReader.h"
+#include "../CompressedWriter.h"
+#include "../GdbExpression.h"
+#include "../log.h"
+#include "../Registers.h"
+#include "../util.h"
+
+using namespace rr;
+using namespace std;
+
+static void report(const char* name, double ops, const char* unit,
+                   double seconds) {
+  printf("{\"benchmark\":\"%s\", \"%s\":%.0f, \"seconds\":%.3f, "
+         "\"%s_per_sec\":%.0f}\n",
+         name, unit, ops, seconds, unit, ops / seconds);
+}
+
+static string compressed_file_path() {
+  char path[] = "/tmp/rr-microbench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    FATAL() << "Can't create temporary file";
+  }
+  close(fd);
+  return path;
+}
+
+/**
+ * Trace data is a mix of compressible structures and incompressible
+ * memory contents; produce something similar.
+ */
+static vector<uint8_t> trace_like_data(size_t size) {
+  vector<uint8_t> data(size);
+  uint32_t x = 1;
+  for (size_t i = 0; i < size; i += 4) {
+    x = x * 1103515245 + 12345;
+    uint32_t v = (i / 4) % 8 < 6 ? uint32_t(i / 64) : x;
+    memcpy(&data[i], &v, min<size_t>(4, size - i));
+  }
+  return data;
+}
+
+static const size_t COMPRESSED_BYTES = 256 * 1024 * 1024;
+static const size_t COMPRESSED_CHUNK = 4096;
+
+static void bench_compressed_write_read() {
+  string path = compressed_file_path();
+  vector<uint8_t> data = trace_like_data(1024 * 1024);
+
+  double start = now_sec();
+  {
+    CompressedWriter writer(path, 1024 * 1024, 1);
+    for (size_t written = 0; written < COMPRESSED_BYTES;
+         written += COMPRESSED_CHUNK) {
+      writer.write(&data[written % data.size()], COMPRESSED_CHUNK);
+    }
+    writer.close();
+  }
+  report("compressed_write", COMPRESSED_BYTES, "bytes", now_sec() - start);
+
+  start = now_sec();
+  {
+    CompressedReader reader(path);
+    vector<uint8_t> buf(COMPRESSED_CHUNK);
+    for (size_t nread = 0; nread < COMPRESSED_BYTES;
+         nread += COMPRESSED_CHUNK) {
+      if (!reader.read(buf.data(), buf.size())) {
+        FATAL() << "Short read from " << path;
+      }
+    }
+  }
+  report("compressed_read", COMPRESSED_BYTES, "bytes", now_sec() - start);
+
+  unlink(path.c_str());
+}
+
+static void bench_gdb_expression() {
+  // (1 + 2) == 3, with no register or memory accesses so no task is needed.
+  static const uint8_t bytecode[] = { 0x22, 1,    // const8 1
+                                      0x22, 2,    // const8 2
+                                      0x02,       // add
+                                      0x22, 3,    // const8 3
+                                      0x13,       // equal
+                                      0x27 };     // end
+  GdbExpression expression(bytecode, sizeof(bytecode));
+  static const int evaluations = 1000000;
+  double start = now_sec();
+  for (int i = 0; i < evaluations; ++i) {
+    GdbExpression::Value v;
+    if (!expression.evaluate(nullptr, &v) || v.i != 1) {
+      FATAL() << "Wrong expression result";
+    }
+  }
+  report("gdb_expression_evaluate", evaluations, "ops", now_sec() - start);
+}
+
+static void bench_registers_compare() {
+  Registers a(RR_NATIVE_ARCH);
+  Registers b = a;
+  static const int compares = 1000000;
+  double start = now_sec();
+  for (int i = 0; i < compares; ++i) {
+    if (!a.matches(b)) {
+      FATAL() << "Registers don't match";
+    }
+  }
+  report("registers_compare", compares, "ops", now_sec() - start);
+}
+
+static void bench_memory_map() {
+  static const int mappings = 10000;
+  static const int lookups = 1000000;
+  size_t page = page_size();
+  AddressSpace::MemoryMap map;
+
+  double start = now_sec();
+  for (int i = 0; i < mappings; ++i) {
+    remote_ptr<void> addr = 0x10000000 + 2 * page * i;
+    map[Mapping(addr, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS)] =
+        MappableResource();
+  }
+  report("memory_map_insert", mappings, "ops", now_sec() - start);
+
+  start = now_sec();
+  for (int i = 0; i < lookups; ++i) {
+    remote_ptr<void> addr = 0x10000000 + 2 * page * (i % mappings) + 8;
+    if (map.find(Mapping(addr, 1)) == map.end()) {
+      FATAL() << "Mapping not found";
+    }
+  }
+  report("memory_map_lookup", lookups, "ops", now_sec() - start);
+}
+
+struct Benchmark {
+  const char* name;
+  void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+  { "compressed", bench_compressed_write_read },
+  { "gdb_expression", bench_gdb_expression },
+  { "registers", bench_registers_compare },
+  { "memory_map", bench_memory_map },
+};
+
+int main(int argc, char* argv[]) {
+  for (auto& b : benchmarks) {
+    bool selected = argc == 1;
+    for (int i = 1; i < argc; ++i) {
+      selected = selected || !strcmp(argv[i], b.name);
+    }
+    if (selected) {
+      b.run();
+    }
+  }
+  return 0;
+}
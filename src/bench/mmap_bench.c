@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Map, touch and unmap large and small anonymous regions. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20;
+  size_t big = 64 * 1024 * 1024;
+  size_t page = sysconf(_SC_PAGESIZE);
+  void* small[256];
+  int i, j;
+
+  for (i = 0; i < iterations; ++i) {
+    char* p = mmap(NULL, big, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memset(p, i, big);
+    munmap(p, big);
+
+    for (j = 0; j < 256; ++j) {
+      small[j] = mmap(NULL, page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      *(char*)small[j] = j;
+    }
+    for (j = 0; j < 256; ++j) {
+      munmap(small[j], page);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Deliver lots of signals to a handler, synchronously and from a timer. */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static volatile int handled;
+
+static void handler(int sig) { ++handled; }
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  struct sigaction sa;
+  struct itimerval timer;
+  int i;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGALRM, &sa, NULL);
+
+  memset(&timer, 0, sizeof(timer));
+  timer.it_interval.tv_usec = 1000;
+  timer.it_value.tv_usec = 1000;
+  setitimer(ITIMER_REAL, &timer, NULL);
+
+  for (i = 0; i < iterations; ++i) {
+    raise(SIGUSR1);
+  }
+  return handled >= iterations ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Cheap syscalls in a tight loop, mostly handled by the syscallbuf. */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+  int zero = open("/dev/zero", O_RDONLY);
+  int null = open("/dev/null", O_WRONLY);
+  char buf[64];
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    read(zero, buf, sizeof(buf));
+    write(null, buf, sizeof(buf));
+    /* Not buffered, so each one is a full ptrace stop. */
+    if (i % 16 == 0) {
+      syscall(SYS_getppid);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/* Many short-lived threads doing a little work and a few syscalls each. */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define NUM_THREADS 64
+
+static void* work(void* arg) {
+  volatile long sum = 0;
+  long i;
+  for (i = 0; i < 100000; ++i) {
+    sum += i;
+    if (i % 10000 == 0) {
+      getpid();
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 10;
+  pthread_t threads[NUM_THREADS];
+  int i, j;
+
+  for (i = 0; i < iterations; ++i) {
+    for (j = 0; j < NUM_THREADS; ++j) {
+      pthread_create(&threads[j], NULL, work, NULL);
+    }
+    for (j = 0; j < NUM_THREADS; ++j) {
+      pthread_join(threads[j], NULL);
+    }
+  }
+  return 0;
+}
@@ -82,6 +82,12 @@ def write_syscall_record_cases(f):
         if isinstance(arg_descriptor, str):
             f.write("    syscall_state.reg_parameter<%s>(%d);\n"
                     % (arg_descriptor, arg))
+        elif isinstance(arg_descriptor, syscalls.ResultSizedBuffer):
+            f.write("    syscall_state.reg_parameter(\n"
+                    "        %d, ParamSize::from_syscall_result<%s>(\n"
+                    "               (%s)t->regs().arg%d()));\n"
+                    % (arg, arg_descriptor.result_type,
+                       arg_descriptor.size_type, arg_descriptor.size_arg))
     for name, obj in syscalls.all():
         # Irregular syscalls will be handled by hand-written code elsewhere.
         if isinstance(obj, syscalls.RegularSyscall):
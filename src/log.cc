@@ -30,6 +30,7 @@ static void emergency_debug(Task* t) {
 
 EmergencyDebugOstream::~EmergencyDebugOstream() {
   log_stream() << std::endl;
+  FlightRecorder::dump(log_stream());
   t->log_pending_events();
   emergency_debug(t);
 }
@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "Flags.h"
+#include "FlightRecorder.h"
 #include "task.h"
 
 enum LogLevel { LOG_fatal, LOG_error, LOG_warn, LOG_info, LOG_debug };
@@ -85,6 +86,7 @@ NewlineTerminatingOstream& operator<<(NewlineTerminatingOstream& stream,
 struct FatalOstream {
   ~FatalOstream() {
     log_stream() << std::endl;
+    FlightRecorder::dump(log_stream());
     abort();
   }
 };
@@ -106,6 +106,11 @@ void print_usage(FILE* out) {
       "                             says otherwise.  NAME should be a string "
       "like\n"
       "                             'Ivy Bridge'.\n"
+      "  -B, --block-cache=<MB>     keep up to MB megabytes (default 64) of\n"
+      "                             decompressed trace blocks for reuse when\n"
+      "                             replay reads the same part of the trace\n"
+      "                             again, e.g. after returning to a\n"
+      "                             checkpoint. 0 disables the cache.\n"
       "  -C, --checksum={on-syscalls,on-all-events}|FROM_TIME\n"
       "                             compute and store (during recording) or\n"
       "                             read and verify (during replay) checksums\n"
@@ -127,15 +132,35 @@ void print_usage(FILE* out) {
       "                             like good ideas, for example launching an\n"
       "                             interactive emergency debugger if stderr\n"
       "                             isn't a tty.\n"
+      "  -I, --timing               print how long each phase of startup "
+      "took,\n"
+      "                             e.g. to reach the first exec or the\n"
+      "                             debugger prompt\n"
       "  -K, --check-cached-mmaps   verify that cached task mmaps match "
       "/proc/maps\n"
+      "  -G, --check-cached-mmaps-every=<N>\n"
+      "                             with -K, only verify at every Nth event\n"
+      "                             of each address space\n"
+      "  -J, --check-cached-mmaps-changed\n"
+      "                             with -K, only verify the mappings around\n"
+      "                             address ranges rr has changed since the\n"
+      "                             last check\n"
       "  -E, --fatal-errors         any warning or error that is printed is\n"
       "                             treated as fatal\n"
+      "  -L, --self-profile=<FILE>  write a timeline of what rr is doing to\n"
+      "                             FILE, in Chrome trace event JSON format\n"
+      "                             (load it in chrome://tracing or Perfetto)\n"
       "  -M, --mark-stdio           mark stdio writes with [rr <PID> <EV>]\n"
       "                             where EV is the global trace time at\n"
       "                             which the write occurs and PID is the pid\n"
       "                             of the process it occurs in.\n"
       "  -N, --version              print the version number and exit\n"
+      "  -P, --checksum-pages       with -C during recording, also store a\n"
+      "                             checksum for each page, so replay can\n"
+      "                             report the first divergent page\n"
+      "  -R, --read-ahead=<BLOCKS>  when reading a trace, decompress up to\n"
+      "                             BLOCKS blocks of each trace file ahead of\n"
+      "                             the reader on background threads\n"
       "  -S, --suppress-environment-warnings\n"
       "                             suppress warnings about issues in the\n"
       "                             environment that rr has no control over\n"
@@ -156,16 +181,23 @@ bool parse_global_option(std::vector<std::string>& args) {
   static const OptionSpec options[] = {
     { 'C', "checksum", HAS_PARAMETER },
     { 'K', "check-cached-mmaps", NO_PARAMETER },
+    { 'G', "check-cached-mmaps-every", HAS_PARAMETER },
+    { 'J', "check-cached-mmaps-changed", NO_PARAMETER },
     { 'U', "cpu-unbound", NO_PARAMETER },
     { 'T', "dump-at", HAS_PARAMETER },
     { 'D', "dump-on", HAS_PARAMETER },
     { 'F', "force-things", NO_PARAMETER },
     { 'A', "microarch", HAS_PARAMETER },
     { 'M', "mark-stdio", NO_PARAMETER },
+    { 'R', "read-ahead", HAS_PARAMETER },
+    { 'B', "block-cache", HAS_PARAMETER },
     { 'S', "suppress-environment-warnings", NO_PARAMETER },
     { 'E', "fatal-errors", NO_PARAMETER },
     { 'V', "verbose", NO_PARAMETER },
-    { 'N', "version", NO_PARAMETER }
+    { 'N', "version", NO_PARAMETER },
+    { 'P', "checksum-pages", NO_PARAMETER },
+    { 'L', "self-profile", HAS_PARAMETER },
+    { 'I', "timing", NO_PARAMETER }
   };
 
   ParsedOption opt;
@@ -178,6 +210,12 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'A':
       flags.forced_uarch = opt.value;
       break;
+    case 'B':
+      if (!opt.verify_valid_int(0, 64 * 1024)) {
+        return false;
+      }
+      flags.block_cache_size = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'C':
       if (opt.value == "on-syscalls") {
         LOG(info) << "checksumming on syscall exit";
@@ -199,12 +237,27 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'F':
       flags.force_things = true;
       break;
+    case 'G':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.check_cached_mmaps_interval = opt.int_value;
+      break;
+    case 'J':
+      flags.check_cached_mmaps_changed = true;
+      break;
     case 'K':
       flags.check_cached_mmaps = true;
       break;
     case 'M':
       flags.mark_stdio = true;
       break;
+    case 'R':
+      if (!opt.verify_valid_int(0, 64)) {
+        return false;
+      }
+      flags.read_ahead_blocks = opt.int_value;
+      break;
     case 'S':
       flags.suppress_environment_warnings = true;
       break;
@@ -217,6 +270,15 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'N':
       show_version = true;
       break;
+    case 'P':
+      flags.checksum_pages = true;
+      break;
+    case 'L':
+      flags.self_profile_path = opt.value;
+      break;
+    case 'I':
+      flags.timing = true;
+      break;
     default:
       assert(0 && "Invalid flag");
   }
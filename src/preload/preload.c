@@ -112,11 +112,11 @@ static int buffer_enabled;
 static int process_inited;
 
 /**
- * If syscallbuf_fds_disabled[fd] is nonzero, then operations on that fd
- * must be performed through traced syscalls, not the syscallbuf.
- * The rr supervisor modifies this array directly to dynamically turn
- * syscallbuf on and off for particular fds. fds outside the array range must
- * never use the syscallbuf.
+ * syscallbuf_fds_disabled[fd] holds the SYSCALLBUF_FD_TRACE_* flags saying
+ * which operations on that fd must be performed through traced syscalls,
+ * not the syscallbuf. The rr supervisor modifies this array directly to
+ * dynamically turn syscallbuf on and off for particular fds. fds outside
+ * the array range must never use the syscallbuf.
  */
 static volatile char syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
 
@@ -136,6 +136,8 @@ static __thread int thread_inited TLS_STORAGE_MODEL;
  * syscallbuf_hdr|, so |buffer| is also a pointer to the buffer
  * header. */
 static __thread uint8_t* buffer TLS_STORAGE_MODEL;
+/* Size of the segment at |buffer|, including the header. */
+static __thread uint32_t buffer_size TLS_STORAGE_MODEL;
 /* This is used to support the buffering of "may-block" system calls.
  * The problem that needs to be addressed can be introduced with a
  * simple example; assume that we're buffering the "read" and "write"
@@ -202,10 +204,14 @@ static uint8_t* buffer_last(void) {
  * Return a pointer to the byte just after the very end of the mapped
  * region.
  */
-static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
+static uint8_t* buffer_end(void) { return buffer + buffer_size; }
 
 #define MEMCPY_UNROLL 4
 #define MEMCPY_WORD uintptr_t
+/* Copies at least this big use |rep movsb|, which modern x86 CPUs run at
+ * close to full memory bandwidth; its startup cost isn't worth paying for
+ * small copies. */
+#define MEMCPY_REP_MOVSB_MIN 256
 
 /**
  * Same as libc memcpy(), but usable within syscallbuf transaction
@@ -214,6 +220,15 @@ static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
 static void local_memcpy(void* dest, const void* source, size_t n) {
   char* dst = dest;
   const char* src = source;
+#if defined(__i386__) || defined(__x86_64__)
+  if (n >= MEMCPY_REP_MOVSB_MIN) {
+    __asm__ __volatile__("rep movsb"
+                         : "+D"(dst), "+S"(src), "+c"(n)
+                         :
+                         : "memory");
+    return;
+  }
+#endif
   static const size_t block_size = MEMCPY_UNROLL * sizeof(MEMCPY_WORD);
   char* dst_end = dest + n;
 
@@ -568,6 +583,7 @@ static void set_up_buffer(void) {
 
   /* rr initializes the buffer header. */
   buffer = args.syscallbuf_ptr;
+  buffer_size = args.syscallbuf_size;
 }
 
 /**
@@ -743,21 +759,28 @@ int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
 #define PTHREAD_MUTEX_ELISION_NP 256
 #define PTHREAD_MUTEX_NO_ELISION_NP 512
 
+/* This has to run on every lock, not just in pthread_mutex_init, because
+ * mutexes initialized with PTHREAD_MUTEX_INITIALIZER never go through
+ * init and glibc may enable elision for them when they're first locked.
+ * It only writes the mutex when the kind actually needs fixing, which is
+ * at most once per mutex. */
 static void fix_mutex_kind(pthread_mutex_t* mutex) {
-  int type = mutex->__data.__kind & PTHREAD_MUTEX_TYPE_MASK;
+  int kind = mutex->__data.__kind;
   /* Disable priority inheritance. */
-  mutex->__data.__kind &= ~PTHREAD_MUTEX_PRIO_INHERIT_NP;
-  if (type != PTHREAD_MUTEX_TIMED_NP) {
+  int fixed = kind & ~PTHREAD_MUTEX_PRIO_INHERIT_NP;
+  if ((kind & PTHREAD_MUTEX_TYPE_MASK) == PTHREAD_MUTEX_TIMED_NP) {
     /* Currently glibc only tries to use elision for TIMED/NORMAL
      * mutexes. Setting elision flag bits for other types of
      * mutexes triggers glibc misbehavior.
      */
-    return;
+    /* Cancel explicitly-set elision requests */
+    fixed &= ~PTHREAD_MUTEX_ELISION_NP;
+    /* Prevent auto-enabling of elision */
+    fixed |= PTHREAD_MUTEX_NO_ELISION_NP;
+  }
+  if (__builtin_expect(fixed != kind, 0)) {
+    mutex->__data.__kind = fixed;
   }
-  /* Cancel explicitly-set elision requests */
-  mutex->__data.__kind &= ~PTHREAD_MUTEX_ELISION_NP;
-  /* Prevent auto-enabling of elision */
-  mutex->__data.__kind |= PTHREAD_MUTEX_NO_ELISION_NP;
 }
 
 /*
@@ -878,6 +901,19 @@ static void* prep_syscall_for_fd(int fd) {
   return prep_syscall();
 }
 
+/**
+ * Like prep_syscall_for_fd, but for a syscall that only reads from (or
+ * only writes to) |fd|, as given by |trace_flag|, so it can be buffered as
+ * long as the fd's policy doesn't have that flag.
+ */
+static void* prep_syscall_for_fd_access(int fd, int trace_flag) {
+  if (fd < 0 || fd >= SYSCALLBUF_FDS_DISABLED_SIZE ||
+      (syscallbuf_fds_disabled[fd] & trace_flag)) {
+    return NULL;
+  }
+  return prep_syscall();
+}
+
 static void arm_desched_event(void) {
   /* Don't trace the ioctl; doing so would trigger a flushing
    * ptrace trap, which is exactly what this code is trying to
@@ -1038,8 +1074,142 @@ static long commit_raw_syscall(int syscallno, void* record_end, long ret) {
   return ret;
 }
 
+/**
+ * |ret_size| is the result of a syscall indicating how much data was returned
+ * in scratch buffer |buf2|; this function copies that data to |buf| and returns
+ * a pointer to the end of it. If there is no scratch buffer (|buf2| is NULL)
+ * just returns |ptr|.
+ */
+static void* copy_output_buffer(int ret_size, void* ptr, void* buf,
+                                void* buf2) {
+  if (!buf2) {
+    return ptr;
+  }
+  if (ret_size <= 0) {
+    return buf2;
+  }
+  local_memcpy(buf, buf2, ret_size);
+  return buf2 + ret_size;
+}
+
+/**
+ * Return the total length of the |iovcnt| buffers at |iov|, or -1 if they
+ * can't possibly fit in the syscallbuf (in which case the syscall must be
+ * traced). Must be called before prep_syscall(), since it doesn't unlock the
+ * buffer.
+ */
+static long iovecs_length(const struct iovec* iov, size_t iovcnt) {
+  long total = 0;
+  size_t i;
+  if (iovcnt > buffer_size / sizeof(*iov) || (iovcnt && !iov)) {
+    return -1;
+  }
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > buffer_size) {
+      return -1;
+    }
+    total += iov[i].iov_len;
+    if (total > buffer_size) {
+      return -1;
+    }
+  }
+  return total;
+}
+
+/**
+ * Point the |iovcnt| scratch iovecs at |iov2| to consecutive buffers
+ * starting at |data2|, with the same lengths as the buffers at |iov|.
+ */
+static void init_scratch_iovecs(const struct iovec* iov, size_t iovcnt,
+                                struct iovec* iov2, void* data2) {
+  size_t i;
+  for (i = 0; i < iovcnt; ++i) {
+    iov2[i].iov_base = data2;
+    iov2[i].iov_len = iov[i].iov_len;
+    data2 += iov[i].iov_len;
+  }
+}
+
+/**
+ * Scatter the |ret_size| bytes read into |data2| (see init_scratch_iovecs)
+ * to the buffers at |iov|, and return a pointer to the end of the data
+ * (or |data2| if nothing was read). |length| is the total length of the
+ * buffers, which is what was reserved at |data2|; recvmsg with MSG_TRUNC
+ * can return more than that.
+ */
+static void* copy_output_iovecs(long ret_size, const struct iovec* iov,
+                                size_t iovcnt, void* data2, long length) {
+  void* data_end;
+  size_t i;
+  if (ret_size <= 0) {
+    return data2;
+  }
+  if (ret_size > length) {
+    ret_size = length;
+  }
+  data_end = data2 + ret_size;
+  for (i = 0; i < iovcnt && data2 < data_end; ++i) {
+    size_t len = iov[i].iov_len;
+    if (len > (size_t)(data_end - data2)) {
+      len = data_end - data2;
+    }
+    local_memcpy(iov[i].iov_base, data2, len);
+    data2 += len;
+  }
+  return data_end;
+}
+
 /* Keep syscalls in alphabetical order, please. */
 
+#ifdef SYS_accept4
+static long sys_accept4(const struct syscall_info* call) {
+  const int syscallno = SYS_accept4;
+  int sockfd = call->args[0];
+  struct sockaddr* addr = (struct sockaddr*)call->args[1];
+  socklen_t* addrlen = (socklen_t*)call->args[2];
+  int flags = call->args[3];
+  socklen_t len = 0;
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  struct sockaddr* addr2 = NULL;
+  socklen_t* addrlen2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (addrlen) {
+    /* No address is longer than sockaddr_storage, so the kernel never
+     * writes more than that however much room it's given. */
+    len = *addrlen;
+    if (len > sizeof(struct sockaddr_storage)) {
+      len = sizeof(struct sockaddr_storage);
+    }
+    addrlen2 = ptr;
+    ptr += sizeof(*addrlen2);
+    if (addr) {
+      addr2 = ptr;
+      ptr += len;
+    }
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  if (addrlen2) {
+    *addrlen2 = len;
+  }
+
+  ret = untraced_syscall4(syscallno, sockfd, addr2, addrlen2, flags);
+
+  if (addrlen2 && ret >= 0) {
+    if (addr2) {
+      local_memcpy(addr, addr2, *addrlen2 < len ? *addrlen2 : len);
+    }
+    *addrlen = *addrlen2;
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_access(const struct syscall_info* call) {
   const int syscallno = SYS_access;
   const char* pathname = (const char*)call->args[0];
@@ -1112,6 +1282,33 @@ static long sys_creat(const struct syscall_info* call) {
   return sys_open(&open_call);
 }
 
+static long sys_epoll_wait(const struct syscall_info* call) {
+  const int syscallno = SYS_epoll_wait;
+  int epfd = call->args[0];
+  struct epoll_event* events = (struct epoll_event*)call->args[1];
+  int maxevents = call->args[2];
+  int timeout = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(epfd);
+  struct epoll_event* events2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (events && maxevents > 0) {
+    events2 = ptr;
+    ptr += maxevents * sizeof(*events2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, epfd, events2, maxevents, timeout);
+  ptr = copy_output_buffer(ret > 0 ? (long)(ret * sizeof(*events2)) : ret,
+                           ptr, events, events2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static int sys_fcntl64_no_outparams(const struct syscall_info* call) {
   const int syscallno = RR_FCNTL_SYSCALL;
   int fd = call->args[0];
@@ -1237,6 +1434,39 @@ static long sys_fcntl(const struct syscall_info* call)
   }
 }
 
+#if defined(SYS_fstatat64)
+static long sys_fstatat64(const struct syscall_info* call)
+#else
+static long sys_newfstatat(const struct syscall_info* call)
+#endif
+{
+  const int syscallno = call->no;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  struct stat64* buf = (struct stat64*)call->args[2];
+  int flags = call->args[3];
+
+  /* Not may-block, like the other stat calls. |dirfd| may be AT_FDCWD, and
+   * anyway stat doesn't read from the file, so don't check whether it's
+   * disabled. */
+  void* ptr = prep_syscall();
+  struct stat64* buf2 = NULL;
+  long ret;
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += sizeof(*buf2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall4(syscallno, dirfd, pathname, buf2, flags);
+  if (buf2 && ret >= 0) {
+    local_memcpy(buf, buf2, sizeof(*buf));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_futex(const struct syscall_info* call) {
   enum {
     FUTEX_USES_UADDR2 = 1 << 0,
@@ -1244,26 +1474,30 @@ static long sys_futex(const struct syscall_info* call) {
 
   int op = call->args[1];
   int flags = 0;
+  int blockness = WONT_BLOCK;
   switch (FUTEX_CMD_MASK & op) {
     case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET:
       break;
     case FUTEX_CMP_REQUEUE:
     case FUTEX_WAKE_OP:
       flags |= FUTEX_USES_UADDR2;
       break;
 
-    /* It turns out not to be worth buffering the FUTEX_WAIT*
-     * calls.  When a WAIT call is made, we know almost for sure
-     * that the tracee is going to be desched'd (otherwise the
-     * userspace CAS would have succeeded).  This is unlike
-     * read/write, f.e., where the vast majority of calls aren't
-     * desched'd and the overhead is worth it.  So all that
-     * buffering WAIT does is add the overhead of arming/disarming
-     * desched (which is a measurable perf loss).
+    /* When a WAIT call is made, the tracee is quite likely to be
+     * desched'd (otherwise the userspace CAS would have succeeded),
+     * in which case buffering it only adds the overhead of
+     * arming/disarming desched. But waits often return immediately
+     * because the futex word changed or a wakeup raced with us, and
+     * those are much cheaper buffered than traced.
      *
-     * NB: don't ever try to buffer FUTEX_LOCK_PI; it requires
-     * special processing in the tracer process (in addition to
-     * not being worth doing for perf reasons). */
+     * NB: don't ever try to buffer the PI operations; they require
+     * special processing in the tracer process. */
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      blockness = MAY_BLOCK;
+      break;
+
     default:
       return traced_raw_syscall(call);
   }
@@ -1293,9 +1527,7 @@ static long sys_futex(const struct syscall_info* call) {
     saved_uaddr2 = ptr;
     ptr += sizeof(*saved_uaddr2);
   }
-  /* See above; it's not worth buffering may-block futex
-   * calls. */
-  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1318,6 +1550,31 @@ static long sys_futex(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_getdents64(const struct syscall_info* call) {
+  const int syscallno = SYS_getdents64;
+  int fd = call->args[0];
+  void* dirp = (void*)call->args[1];
+  unsigned int count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* dirp2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (dirp && count > 0) {
+    dirp2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, fd, dirp2, count);
+  ptr = copy_output_buffer(ret, ptr, dirp, dirp2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_gettimeofday(const struct syscall_info* call) {
   const int syscallno = SYS_gettimeofday;
   struct timeval* tp = (struct timeval*)call->args[0];
@@ -1508,22 +1765,52 @@ static long sys_poll(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
-/**
- * |ret_size| is the result of a syscall indicating how much data was returned
- * in scratch buffer |buf2|; this function copies that data to |buf| and returns
- * a pointer to the end of it. If there is no scratch buffer (|buf2| is NULL)
- * just returns |ptr|.
- */
-static void* copy_output_buffer(int ret_size, void* ptr, void* buf,
-                                void* buf2) {
-  if (!buf2) {
-    return ptr;
+static long sys_pread64(const struct syscall_info* call) {
+  const int syscallno = SYS_pread64;
+  int fd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_READS);
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && count > 0) {
+    buf2 = ptr;
+    ptr += count;
   }
-  if (ret_size <= 0) {
-    return buf2;
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
   }
-  local_memcpy(buf, buf2, ret_size);
-  return buf2 + ret_size;
+
+  /* The offset is one register on x86-64 and two on x86; pass both. */
+  ret = untraced_syscall5(syscallno, fd, buf2, count, call->args[3],
+                          call->args[4]);
+  ptr = copy_output_buffer(ret, ptr, buf, buf2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwrite64(const struct syscall_info* call) {
+  const int syscallno = SYS_pwrite64;
+  int fd = call->args[0];
+  const void* buf = (const void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_WRITES);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, buf, count, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
 }
 
 static long sys_read(const struct syscall_info* call) {
@@ -1532,7 +1819,7 @@ static long sys_read(const struct syscall_info* call) {
   void* buf = (void*)call->args[1];
   size_t count = call->args[2];
 
-  void* ptr = prep_syscall_for_fd(fd);
+  void* ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_READS);
   void* buf2 = NULL;
   long ret;
 
@@ -1576,6 +1863,38 @@ static long sys_readlink(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_readv(const struct syscall_info* call) {
+  const int syscallno = SYS_readv;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  int iovcnt = call->args[2];
+  long length = iovcnt < 0 ? -1 : iovecs_length(iov, iovcnt);
+
+  void* ptr;
+  struct iovec* iov2;
+  void* data2;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (length < 0) {
+    return traced_raw_syscall(call);
+  }
+  ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_READS);
+  iov2 = ptr;
+  ptr += iovcnt * sizeof(*iov2);
+  data2 = ptr;
+  ptr += length;
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  init_scratch_iovecs(iov, iovcnt, iov2, data2);
+
+  ret = untraced_syscall3(syscallno, fd, iov2, iovcnt);
+  ptr = copy_output_iovecs(ret, iov, iovcnt, data2, length);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 #if defined(SYS_socketcall)
 static long sys_socketcall_recv(const struct syscall_info* call) {
   const int syscallno = SYS_socketcall;
@@ -1586,7 +1905,7 @@ static long sys_socketcall_recv(const struct syscall_info* call) {
   unsigned int flags = args[3];
   unsigned long new_args[4];
 
-  void* ptr = prep_syscall_for_fd(sockfd);
+  void* ptr = prep_syscall_for_fd_access(sockfd, SYSCALLBUF_FD_TRACE_READS);
   void* buf2 = NULL;
   long ret;
 
@@ -1629,7 +1948,7 @@ static long sys_recvfrom(const struct syscall_info* call) {
   struct sockaddr* src_addr = (struct sockaddr*)call->args[4];
   socklen_t* addrlen = (socklen_t*)call->args[5];
 
-  void* ptr = prep_syscall_for_fd(sockfd);
+  void* ptr = prep_syscall_for_fd_access(sockfd, SYSCALLBUF_FD_TRACE_READS);
   void* buf2 = NULL;
   struct sockaddr* src_addr2 = NULL;
   socklen_t* addrlen2 = NULL;
@@ -1668,6 +1987,96 @@ static long sys_recvfrom(const struct syscall_info* call) {
 }
 #endif
 
+#ifdef SYS_recvmsg
+static long sys_recvmsg(const struct syscall_info* call) {
+  const int syscallno = SYS_recvmsg;
+  int sockfd = call->args[0];
+  struct msghdr* msg = (struct msghdr*)call->args[1];
+  int flags = call->args[2];
+  long length = msg ? iovecs_length(msg->msg_iov, msg->msg_iovlen) : -1;
+
+  void* ptr;
+  struct msghdr* msg2;
+  struct iovec* iov2;
+  void* control2 = NULL;
+  void* name2 = NULL;
+  void* data2;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (length < 0 || msg->msg_namelen > buffer_size ||
+      msg->msg_controllen > buffer_size) {
+    return traced_raw_syscall(call);
+  }
+  ptr = prep_syscall_for_fd_access(sockfd, SYSCALLBUF_FD_TRACE_READS);
+  msg2 = ptr;
+  ptr += sizeof(*msg2);
+  iov2 = ptr;
+  ptr += msg->msg_iovlen * sizeof(*iov2);
+  /* The kernel reports the lengths of the name and control data whenever
+   * their buffers are non-null, even if they're empty. */
+  if (msg->msg_control) {
+    control2 = ptr;
+    ptr += msg->msg_controllen;
+  }
+  if (msg->msg_name) {
+    name2 = ptr;
+    ptr += msg->msg_namelen;
+  }
+  data2 = ptr;
+  ptr += length;
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  local_memcpy(msg2, msg, sizeof(*msg2));
+  msg2->msg_name = name2;
+  msg2->msg_iov = iov2;
+  msg2->msg_control = control2;
+  init_scratch_iovecs(msg->msg_iov, msg->msg_iovlen, iov2, data2);
+
+  ret = untraced_syscall3(syscallno, sockfd, msg2, flags);
+
+  if (ret >= 0) {
+    if (name2) {
+      local_memcpy(msg->msg_name, name2, msg2->msg_namelen < msg->msg_namelen
+                                             ? msg2->msg_namelen
+                                             : msg->msg_namelen);
+      msg->msg_namelen = msg2->msg_namelen;
+    }
+    if (control2) {
+      local_memcpy(msg->msg_control, control2, msg2->msg_controllen);
+      msg->msg_controllen = msg2->msg_controllen;
+    }
+    msg->msg_flags = msg2->msg_flags;
+  }
+  ptr = copy_output_iovecs(ret, msg->msg_iov, msg->msg_iovlen, data2, length);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
+#ifdef SYS_sendmsg
+static long sys_sendmsg(const struct syscall_info* call) {
+  const int syscallno = SYS_sendmsg;
+  int sockfd = call->args[0];
+  const struct msghdr* msg = (const struct msghdr*)call->args[1];
+  int flags = call->args[2];
+
+  void* ptr = prep_syscall_for_fd_access(sockfd, SYSCALLBUF_FD_TRACE_WRITES);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, sockfd, msg, flags);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_time(const struct syscall_info* call) {
   const int syscallno = SYS_time;
   time_t* tp = (time_t*)call->args[0];
@@ -1722,7 +2131,7 @@ static long sys_write(const struct syscall_info* call) {
   const void* buf = (const void*)call->args[1];
   size_t count = call->args[2];
 
-  void* ptr = prep_syscall_for_fd(fd);
+  void* ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_WRITES);
   long ret;
 
   assert(syscallno == call->no);
@@ -1742,7 +2151,7 @@ static long sys_writev(const struct syscall_info* call) {
   const struct iovec* iov = (const struct iovec*)call->args[1];
   unsigned long iovcnt = call->args[2];
 
-  void* ptr = prep_syscall_for_fd(fd);
+  void* ptr = prep_syscall_for_fd_access(fd, SYSCALLBUF_FD_TRACE_WRITES);
   long ret;
 
   assert(syscallno == call->no);
@@ -1800,16 +2209,26 @@ static long syscall_hook_internal(const struct syscall_info* call) {
 #define CASE(syscallname)                                                      \
   case SYS_##syscallname:                                                      \
     return sys_##syscallname(call)
+#if defined(SYS_accept4)
+    CASE(accept4);
+#endif
     CASE(access);
     CASE(clock_gettime);
     CASE(close);
     CASE(creat);
+    CASE(epoll_wait);
 #if defined(SYS_fcntl64)
     CASE(fcntl64);
 #else
     CASE(fcntl);
+#endif
+#if defined(SYS_fstatat64)
+    CASE(fstatat64);
+#else
+    CASE(newfstatat);
 #endif
     CASE(futex);
+    CASE(getdents64);
     CASE(getrusage);
     CASE(gettid);
     CASE(gettimeofday);
@@ -1821,11 +2240,20 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(madvise);
     CASE(open);
     CASE(poll);
+    CASE(pread64);
+    CASE(pwrite64);
     CASE(read);
     CASE(readlink);
+    CASE(readv);
 #if defined(SYS_recvfrom)
     CASE(recvfrom);
 #endif
+#if defined(SYS_recvmsg)
+    CASE(recvmsg);
+#endif
+#if defined(SYS_sendmsg)
+    CASE(sendmsg);
+#endif
 #if defined(SYS_socketcall)
     CASE(socketcall);
 #endif
@@ -32,16 +32,30 @@
  * so we can't use it. */
 #define SYSCALLBUF_DESCHED_SIGNAL SIGPWR
 
-/* This size counts the header along with record data. */
+/* These sizes count the header along with record data. Each thread's
+ * buffer is SYSCALLBUF_BUFFER_SIZE bytes unless `rr record
+ * --syscallbuf-size' chose another size, which rr returns from
+ * SYS_rrcall_init_buffers. */
 #define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+#define SYSCALLBUF_MIN_BUFFER_SIZE (64 << 10)
+#define SYSCALLBUF_MAX_BUFFER_SIZE (64 << 20)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
 
-/* Size of table mapping fd numbers to syscallbuf-disabled flag.
- * Most Linux kernels limit fds to 1024 so it probably doesn't make sense
- * to raise this value... */
-#define SYSCALLBUF_FDS_DISABLED_SIZE 1024
+/* Size of the table mapping fd numbers to SYSCALLBUF_FD_TRACE_* flags.
+ * This covers the kernel's default fs.nr_open limit. The table lives in
+ * the preload library's bss, so only pages holding flags for fds rr
+ * actually monitors are ever touched. */
+#define SYSCALLBUF_FDS_DISABLED_SIZE (1 << 20)
+
+/* Per-fd syscallbuf policy. An fd with no flags set is fully buffered.
+ * Any nonzero policy makes operations other than reads and writes (close,
+ * lseek etc.) traced too, so rr sees them. */
+#define SYSCALLBUF_FD_TRACE_READS 0x1
+#define SYSCALLBUF_FD_TRACE_WRITES 0x2
+#define SYSCALLBUF_FD_TRACE_ALL                                                \
+  (SYSCALLBUF_FD_TRACE_READS | SYSCALLBUF_FD_TRACE_WRITES)
 
 #define RR_PAGE_ADDR 0x70000000
 #define RR_PAGE_IN_UNTRACED_SYSCALL_ADDR (RR_PAGE_ADDR + 4)
@@ -119,7 +133,8 @@ struct rrcall_init_preload_params {
   PTR(void) syscall_hook_trampoline;
   PTR(void) syscall_hook_stub_buffer;
   PTR(void) syscall_hook_stub_buffer_end;
-  /* Array of size SYSCALLBUF_FDS_DISABLED_SIZE */
+  /* Array of SYSCALLBUF_FD_TRACE_* flags, of size
+   * SYSCALLBUF_FDS_DISABLED_SIZE */
   PTR(volatile char) syscallbuf_fds_disabled;
 };
 
@@ -132,14 +147,12 @@ TEMPLATE_ARCH
 struct rrcall_init_buffers_params {
   /* The fd we're using to track desched events. */
   int desched_counter_fd;
-  /* padding for 64-bit archs. Structs written to tracee memory must not have
-   * holes!
-   */
-  int padding;
 
   /* "Out" params. */
-  /* Returned pointer to and size of the shared syscallbuf
-   * segment. */
+  /* Returned size and pointer to the shared syscallbuf segment.
+   * (|syscallbuf_size| also keeps 64-bit |syscallbuf_ptr| aligned;
+   * structs written to tracee memory must not have holes!) */
+  uint32_t syscallbuf_size;
   PTR(void) syscallbuf_ptr;
 };
 
@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PROBES_H_
+#define RR_PROBES_H_
+
+/**
+ * Static tracepoints (USDT probes) in rr's own hot paths, so tools like
+ * bpftrace and perf can see where rr spends its time without rebuilding it.
+ * For example
+ *
+ *   bpftrace -e 'usdt:/path/to/rr:rr:write_frame { @[arg1] = count(); }'
+ *
+ * Probes are a single nop each when nothing is attached. They're only
+ * compiled in when <sys/sdt.h> (systemtap-sdt-dev) was found at build time.
+ *
+ * Every probe is also stored in the FlightRecorder, whatever the build, so
+ * its arguments are always evaluated and must be cheap.
+ *
+ * Probes, all in provider "rr":
+ *   record_step_start(tid), record_step_done(tid)
+ *   resume(tid, ptrace request, sig), wait_start(tid), wait_done(tid, status)
+ *   write_frame(global time, event type)
+ *   compress_start(uncompressed bytes, codec),
+ *   compress_done(uncompressed bytes, compressed bytes)
+ *   replay_step_start(tid, step action), replay_step_done(tid, completion)
+ *   clone_start(), clone_done()
+ *   checkpoint_create(trace time), checkpoint_restore(trace time)
+ */
+
+#include "FlightRecorder.h"
+
+#ifdef RR_HAVE_SDT
+#include <sys/sdt.h>
+#define RR_SDT_PROBE(name) DTRACE_PROBE(rr, name)
+#define RR_SDT_PROBE1(name, a) DTRACE_PROBE1(rr, name, a)
+#define RR_SDT_PROBE2(name, a, b) DTRACE_PROBE2(rr, name, a, b)
+#define RR_SDT_PROBE3(name, a, b, c) DTRACE_PROBE3(rr, name, a, b, c)
+#else
+#define RR_SDT_PROBE(name)
+#define RR_SDT_PROBE1(name, a)
+#define RR_SDT_PROBE2(name, a, b)
+#define RR_SDT_PROBE3(name, a, b, c)
+#endif
+
+#define RR_PROBE(name)                                                         \
+  do {                                                                         \
+    FlightRecorder::record(#name);                                             \
+    RR_SDT_PROBE(name);                                                        \
+  } while (0)
+#define RR_PROBE1(name, a)                                                     \
+  do {                                                                         \
+    FlightRecorder::record(#name, (uint64_t)(a));                              \
+    RR_SDT_PROBE1(name, a);                                                    \
+  } while (0)
+#define RR_PROBE2(name, a, b)                                                  \
+  do {                                                                         \
+    FlightRecorder::record(#name, (uint64_t)(a), (uint64_t)(b));               \
+    RR_SDT_PROBE2(name, a, b);                                                 \
+  } while (0)
+#define RR_PROBE3(name, a, b, c)                                               \
+  do {                                                                         \
+    FlightRecorder::record(#name, (uint64_t)(a), (uint64_t)(b),                \
+                           (uint64_t)(c));                                     \
+    RR_SDT_PROBE3(name, a, b, c);                                              \
+  } while (0)
+
+#endif /* RR_PROBES_H_ */
@@ -57,8 +57,10 @@
 #include "kernel_metadata.h"
 #include "kernel_supplement.h"
 #include "log.h"
+#include "PipeMonitor.h"
 #include "RecordSession.h"
 #include "Scheduler.h"
+#include "SocketMonitor.h"
 #include "task.h"
 #include "TraceStream.h"
 #include "util.h"
@@ -363,6 +365,11 @@ struct TaskSyscallState {
    * and relocates it to the parameter's location in scratch memory.
    */
   remote_ptr<void> relocate_pointer_to_scratch(remote_ptr<void> ptr);
+  /**
+   * Internal method that returns true if no other task can observe the
+   * memory parameters while the syscall runs.
+   */
+  bool outparams_private_to_task();
   /**
    * Internal method that takes the index of a MemoryParam and a vector
    * containing the actual sizes assigned to each param < param_index, and
@@ -383,6 +390,14 @@ struct TaskSyscallState {
    * original destinations, update registers, etc.
    */
   void process_syscall_results();
+  /**
+   * Called with the output of a monitored read; see |monitored_read_fd|.
+   * Returns true if it needn't be recorded.
+   */
+  bool output_reproducible(const uint8_t* data, size_t size) {
+    return monitored_read_fd >= 0 &&
+           t->fd_table()->did_read(t, monitored_read_fd, data, size);
+  }
 
   /**
    * Upon successful syscall completion, each RestoreAndRecordScratch record
@@ -445,6 +460,12 @@ struct TaskSyscallState {
    *  valid when preparation_done is true. */
   WriteBack write_back;
 
+  /** When >= 0, the syscall is a read from this fd, whose FileMonitor may
+   *  be able to reproduce the data during replay. The data is only recorded
+   *  if it can't.
+   */
+  int monitored_read_fd;
+
   /** When true, this syscall has already been prepared and should not
    *  be set up again.
    */
@@ -455,20 +476,71 @@ struct TaskSyscallState {
    */
   bool scratch_enabled;
 
-  TaskSyscallState()
-      : t(nullptr),
-        ptraced_tracee(nullptr),
-        new_task(nullptr),
-        expect_errno(0),
-        should_emulate_result(false),
-        preparation_done(false),
-        scratch_enabled(false) {}
+  /** True between the start of a syscall's recording and its end. Otherwise
+   *  this state is kept only so its buffers can be reused by the task's next
+   *  syscall.
+   */
+  bool active;
+
+  /** Buffers used by process_syscall_results(). They're members so that
+   *  their memory is reused from syscall to syscall.
+   */
+  vector<size_t> actual_sizes;
+  vector<uint8_t> result_data;
+  vector<Task::MemoryTransfer> transfers;
+
+  TaskSyscallState() { reset(); }
+
+  /**
+   * Return to the initial state, without freeing the buffers.
+   */
+  void reset() {
+    t = nullptr;
+    param_list.clear();
+    scratch = nullptr;
+    after_syscall_actions.clear();
+    exec_saved_event = nullptr;
+    ptraced_tracee = nullptr;
+    new_task = nullptr;
+    syscall_entry_registers = nullptr;
+    expect_errno = 0;
+    should_emulate_result = false;
+    monitored_read_fd = -1;
+    preparation_done = false;
+    scratch_enabled = false;
+    active = false;
+  }
 };
 
 static const Property<TaskSyscallState, Task> syscall_state_property;
 
-void rec_set_syscall_new_task(Task* t, Task* new_task) {
+/**
+ * Return the state of the syscall |t| is recording, or null if there's none.
+ */
+static TaskSyscallState* current_syscall_state(Task* t) {
+  auto syscall_state = syscall_state_property.get(*t);
+  return syscall_state && syscall_state->active ? syscall_state : nullptr;
+}
+
+static TaskSyscallState& begin_syscall_state(Task* t) {
+  auto& syscall_state = syscall_state_property.get_or_create(*t);
+  syscall_state.active = true;
+  return syscall_state;
+}
+
+/**
+ * Finish with the current syscall's state. It stays attached to the task,
+ * reset, so the next syscall doesn't allocate.
+ */
+static void end_syscall_state(Task* t) {
   auto syscall_state = syscall_state_property.get(*t);
+  if (syscall_state) {
+    syscall_state->reset();
+  }
+}
+
+void rec_set_syscall_new_task(Task* t, Task* new_task) {
+  auto syscall_state = current_syscall_state(t);
   ASSERT(t, syscall_state) << "new task created outside of syscall?";
   ASSERT(t, is_clone_syscall(t->regs().original_syscallno(), t->arch()) ||
                 is_fork_syscall(t->regs().original_syscallno(), t->arch()));
@@ -566,6 +638,34 @@ remote_ptr<void> TaskSyscallState::relocate_pointer_to_scratch(
   return result;
 }
 
+/**
+ * Scratch memory keeps the kernel's writes to outparams of a syscall that
+ * may block from being seen by anything else before we record the syscall
+ * exit. When nothing else can see the outparams, the kernel can write them
+ * in place and we avoid copying them through scratch.
+ */
+bool TaskSyscallState::outparams_private_to_task() {
+  if (t->vm()->task_set().size() != 1) {
+    return false;
+  }
+  const AddressSpace::MemoryMap& mem = t->vm()->memmap();
+  for (auto& param : param_list) {
+    if (param.mode == IN || param.mode == IN_OUT_NO_SCRATCH ||
+        !param.num_bytes.incoming_size) {
+      continue;
+    }
+    Mapping range(floor_page_size(param.dest),
+                  ceil_page_size(param.dest + param.num_bytes.incoming_size));
+    for (auto it = mem.lower_bound(range);
+         it != mem.end() && it->first.start < range.end; ++it) {
+      if (it->first.flags & MAP_SHARED) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 Switchable TaskSyscallState::done_preparing(Switchable sw) {
   if (preparation_done) {
     return switchable;
@@ -573,6 +673,12 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   preparation_done = true;
   write_back = WRITE_BACK;
 
+  if (sw == ALLOW_SWITCH && !param_list.empty() &&
+      outparams_private_to_task()) {
+    switchable = sw;
+    return switchable;
+  }
+
   ssize_t scratch_num_bytes = scratch - t->scratch_ptr;
   ASSERT(t, scratch_num_bytes >= 0);
   if (sw == ALLOW_SWITCH && scratch_num_bytes > t->scratch_size) {
@@ -590,6 +696,8 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   }
 
   scratch_enabled = true;
+  t->record_session().note_scratch_use(t->ev().Syscall().number, t->arch(),
+                                       scratch_num_bytes);
 
   // Step 1: Copy all IN/IN_OUT parameters to their scratch areas
   for (auto& param : param_list) {
@@ -649,10 +757,13 @@ void TaskSyscallState::process_syscall_results() {
   // record everything as if it succeeded. That handles failed syscalls that
   // wrote partial results, but doesn't handle syscalls that failed with
   // EFAULT.
-  vector<size_t> actual_sizes;
+  actual_sizes.clear();
+  transfers.clear();
   if (scratch_enabled) {
     size_t scratch_num_bytes = scratch - t->scratch_ptr;
-    auto data = t->read_mem(t->scratch_ptr.cast<uint8_t>(), scratch_num_bytes);
+    auto& data = result_data;
+    data.resize(scratch_num_bytes);
+    t->read_bytes_helper(t->scratch_ptr, data.size(), data.data());
     Registers r = t->regs();
     // Step 1: compute actual sizes of all buffers and copy outputs
     // from scratch back to their origin
@@ -661,10 +772,11 @@ void TaskSyscallState::process_syscall_results() {
       size_t size = eval_param_size(i, actual_sizes);
       if (write_back == WRITE_BACK &&
           (param.mode == IN_OUT || param.mode == OUT)) {
-        const uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
-        t->write_bytes_helper(param.dest, size, d);
+        uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
+        transfers.push_back(Task::MemoryTransfer(param.dest, size, d));
       }
     }
+    t->write_bytes_multi(transfers);
     bool memory_cleaned_up = false;
     // Step 2: restore modified in-memory pointers and registers
     for (size_t i = 0; i < param_list.size(); ++i) {
@@ -693,17 +805,42 @@ void TaskSyscallState::process_syscall_results() {
             t->record_remote(param.dest, size);
           } else {
             const uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
-            t->record_local(param.dest, size, d);
+            if (!output_reproducible(d, size)) {
+              t->record_local(param.dest, size, d);
+            }
           }
         }
       }
     }
     t->set_regs(r);
   } else {
+    // All outputs are read into one buffer, one after another.
+    size_t total_size = 0;
     for (size_t i = 0; i < param_list.size(); ++i) {
-      auto& param = param_list[i];
       size_t size = eval_param_size(i, actual_sizes);
-      t->record_remote(param.dest, size);
+      if (!param_list[i].dest.is_null()) {
+        total_size += size;
+      }
+    }
+    result_data.resize(total_size);
+    uint8_t* output = result_data.data();
+    for (size_t i = 0; i < param_list.size(); ++i) {
+      auto& param = param_list[i];
+      if (!param.dest.is_null()) {
+        transfers.push_back(
+            Task::MemoryTransfer(param.dest, actual_sizes[i], output));
+        output += actual_sizes[i];
+      }
+    }
+    t->read_bytes_multi(transfers);
+    output = result_data.data();
+    for (size_t i = 0; i < param_list.size(); ++i) {
+      auto& param = param_list[i];
+      size_t size = param.dest.is_null() ? 0 : actual_sizes[i];
+      if (!output_reproducible(output, size)) {
+        t->record_local(param.dest, size, output);
+      }
+      output += size;
     }
   }
 
@@ -1568,12 +1705,28 @@ static void destroy_buffers(Task* t) {
   advance_syscall(t);
 }
 
+/**
+ * Count the futex wait |t| is in for the contention report. Only waits
+ * that reach us are counted; the rest are buffered.
+ */
+static void note_futex_wait(Task* t) {
+  switch ((int)t->regs().arg2_signed() & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      t->record_session().note_futex_wait(t, t->regs().arg1());
+      break;
+  }
+}
+
 template <typename Arch>
 static Switchable rec_prepare_syscall_arch(Task* t,
                                            TaskSyscallState& syscall_state) {
   int syscallno = t->ev().Syscall().number;
 
   if (t->desched_rec()) {
+    if (syscallno == Arch::futex) {
+      note_futex_wait(t);
+    }
     /* |t| was descheduled while in a buffered syscall.  We don't
      * use scratch memory for the call, because the syscallbuf itself
      * is serving that purpose. More importantly, we *can't* set up
@@ -1761,6 +1914,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
       switch ((int)t->regs().arg2_signed() & FUTEX_CMD_MASK) {
         case FUTEX_WAIT:
         case FUTEX_WAIT_BITSET:
+          note_futex_wait(t);
           syscall_state.reg_parameter<int>(1, IN_OUT_NO_SCRATCH);
           return ALLOW_SWITCH;
 
@@ -1771,6 +1925,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
           break;
 
         case FUTEX_WAKE:
+        case FUTEX_WAKE_BITSET:
           syscall_state.reg_parameter<int>(1, IN_OUT_NO_SCRATCH);
           break;
 
@@ -1972,27 +2127,6 @@ static Switchable rec_prepare_syscall_arch(Task* t,
       return ALLOW_SWITCH;
     }
 
-    case Arch::getcwd: {
-      syscall_state.reg_parameter(
-          1, ParamSize::from_syscall_result<typename Arch::ssize_t>(
-                 (size_t)t->regs().arg2()));
-      return PREVENT_SWITCH;
-    }
-
-    case Arch::getdents:
-    case Arch::getdents64: {
-      syscall_state.reg_parameter(2, ParamSize::from_syscall_result<int>(
-                                         (unsigned int)t->regs().arg3()));
-      return PREVENT_SWITCH;
-    }
-
-    case Arch::readlink: {
-      syscall_state.reg_parameter(
-          2, ParamSize::from_syscall_result<typename Arch::ssize_t>(
-                 (size_t)t->regs().arg3()));
-      return PREVENT_SWITCH;
-    }
-
     case Arch::getgroups: {
       // We could record a little less data by restricting the recorded data
       // to the syscall result * sizeof(Arch::legacy_gid_t), but that would
@@ -2360,13 +2494,6 @@ static Switchable rec_prepare_syscall_arch(Task* t,
           new sig_set_t(t->read_mem(remote_ptr<sig_set_t>(t->regs().arg1()))));
       return ALLOW_SWITCH;
 
-    case Arch::getxattr:
-    case Arch::lgetxattr:
-    case Arch::fgetxattr:
-      syscall_state.reg_parameter(
-          3, ParamSize::from_syscall_result<size_t>(t->regs().arg4()));
-      return PREVENT_SWITCH;
-
     case Arch::sched_setaffinity: {
       syscall_state.syscall_entry_registers =
           unique_ptr<Registers>(new Registers(t->regs()));
@@ -2404,6 +2531,20 @@ static Switchable rec_prepare_syscall_arch(Task* t,
           t, syscall_state, (int)t->regs().arg1_signed(),
           (int)t->regs().arg3_signed(), 4, USE_DIRECTLY);
 
+    case Arch::io_uring_setup:
+    case Arch::io_uring_enter:
+    case Arch::io_uring_register: {
+      syscall_state.syscall_entry_registers =
+          unique_ptr<Registers>(new Registers(t->regs()));
+      // Make the kernel reject the call (zero entries or a bad fd) and
+      // report ENOSYS, so the tracee never gets a ring we can't record.
+      Registers r = t->regs();
+      r.set_arg1(syscallno == Arch::io_uring_setup ? 0 : -1);
+      t->set_regs(r);
+      syscall_state.emulate_result(-ENOSYS);
+      return PREVENT_SWITCH;
+    }
+
     case Arch::seccomp:
       syscall_state.syscall_entry_registers =
           unique_ptr<Registers>(new Registers(t->regs()));
@@ -2474,7 +2615,7 @@ static Switchable rec_prepare_syscall_internal(
 }
 
 Switchable rec_prepare_syscall(Task* t) {
-  auto& syscall_state = syscall_state_property.get_or_create(*t);
+  auto& syscall_state = begin_syscall_state(t);
   syscall_state.init(t);
 
   Switchable s = rec_prepare_syscall_internal(t, syscall_state);
@@ -2482,7 +2623,7 @@ Switchable rec_prepare_syscall(Task* t) {
   if (is_sigreturn(syscallno, t->arch())) {
     // There isn't going to be an exit event for this syscall, so remove
     // syscall_state now.
-    syscall_state_property.remove(*t);
+    end_syscall_state(t);
     return s;
   }
   return syscall_state.done_preparing(s);
@@ -2527,9 +2668,9 @@ static void rec_prepare_restart_syscall_internal(
 }
 
 void rec_prepare_restart_syscall(Task* t) {
-  auto& syscall_state = *syscall_state_property.get(*t);
+  auto& syscall_state = *current_syscall_state(t);
   rec_prepare_restart_syscall_internal(t, syscall_state);
-  syscall_state_property.remove(*t);
+  end_syscall_state(t);
 }
 
 enum ScratchAddrType { FIXED_ADDRESS, DYNAMIC_ADDRESS };
@@ -2541,7 +2682,7 @@ static const uintptr_t FIXED_SCRATCH_PTR = 0x68000000;
 template <typename Arch>
 static void init_scratch_memory(Task* t,
                                 ScratchAddrType addr_type = DYNAMIC_ADDRESS) {
-  const int scratch_size = 512 * page_size();
+  const size_t scratch_size = t->record_session().scratch_size();
   size_t sz = scratch_size;
   // The PROT_EXEC looks scary, and it is, but it's to prevent
   // this region from being coalesced with another anonymous
@@ -2583,6 +2724,7 @@ static void init_scratch_memory(Task* t,
 
   t->vm()->map(t->scratch_ptr, sz, prot, flags, 0,
                MappableResource::scratch(t->rec_tid));
+  t->record_session().note_injected_state(t);
 }
 
 // We have |keys_length| instead of using array_length(keys) to work
@@ -2922,6 +3064,42 @@ static string extra_expected_errno_info(Task* t,
   return ss.str();
 }
 
+static void did_create_pipe(Task* t) {
+  if (!t->regs().syscall_failed()) {
+    PipeMonitor::did_create_pipe(t, t->regs().arg1());
+  }
+}
+
+static void did_create_socketpair(Task* t) {
+  const Registers& r = t->regs();
+  if (!r.syscall_failed()) {
+    PipeMonitor::did_create_socketpair(t, (int)r.arg1_signed(),
+                                       (int)r.arg2_signed(), r.arg4());
+  }
+}
+
+static void did_connect_socket(Task* t) {
+  const Registers& r = t->regs();
+  // A nonblocking connect() is monitored while it completes.
+  if (!r.syscall_failed() || r.syscall_result_signed() == -EINPROGRESS) {
+    SocketMonitor::did_connect(t, (int)r.arg1_signed());
+  }
+}
+
+static void did_accept_socket(Task* t) {
+  const Registers& r = t->regs();
+  if (!r.syscall_failed()) {
+    SocketMonitor::did_connect(t, (int)r.syscall_result_signed());
+  }
+}
+
+static void did_listen_socket(Task* t) {
+  const Registers& r = t->regs();
+  if (!r.syscall_failed()) {
+    SocketMonitor::did_listen(t, (int)r.arg1_signed());
+  }
+}
+
 template <typename Arch>
 static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
   int syscallno = t->ev().Syscall().number;
@@ -2932,6 +3110,11 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
   t->on_syscall_exit(syscallno, t->regs());
 
   if (const struct syscallbuf_record* rec = t->desched_rec()) {
+    if (syscallno == Arch::read && t->regs().syscall_result_signed() > 0) {
+      // The data is in the syscallbuf record, so it's recorded anyway.
+      t->fd_table()->did_read(t, (int)t->regs().arg1_signed(), nullptr,
+                              t->regs().syscall_result());
+    }
     t->record_local(t->syscallbuf_child.cast<void>() +
                         (rec->extra_data - (uint8_t*)t->syscallbuf_hdr),
                     rec->size - sizeof(*rec), (uint8_t*)rec->extra_data);
@@ -2972,6 +3155,82 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
       process_execve<Arch>(t, syscall_state);
       break;
 
+    case Arch::read: {
+      int fd = (int)t->regs().arg1_signed();
+      if (t->regs().syscall_result_signed() > 0 &&
+          t->fd_table()->is_monitoring(fd)) {
+        syscall_state.monitored_read_fd = fd;
+        t->fd_table()->did_receive(t, fd, t->regs().syscall_result());
+      }
+      break;
+    }
+
+    case Arch::readv:
+    case Arch::recvfrom:
+    case Arch::recvmsg: {
+      const Registers& r = t->regs();
+      int flags = 0;
+      if (syscallno == Arch::recvfrom) {
+        flags = (int)r.arg4();
+      } else if (syscallno == Arch::recvmsg) {
+        flags = (int)r.arg3();
+      }
+      // Peeking leaves the data to be received again.
+      if (r.syscall_result_signed() > 0 && !(flags & MSG_PEEK)) {
+        t->fd_table()->did_receive(t, (int)r.arg1_signed(),
+                                   r.syscall_result());
+      }
+      break;
+    }
+
+    case Arch::connect:
+      syscall_state.after_syscall_action(did_connect_socket);
+      break;
+
+    case Arch::accept:
+    case Arch::accept4:
+      syscall_state.after_syscall_action(did_accept_socket);
+      break;
+
+    case Arch::listen:
+      syscall_state.after_syscall_action(did_listen_socket);
+      break;
+
+    case Arch::pipe:
+    case Arch::pipe2:
+      syscall_state.after_syscall_action(did_create_pipe);
+      break;
+
+    case Arch::socketpair:
+      syscall_state.after_syscall_action(did_create_socketpair);
+      break;
+
+    case Arch::gettimeofday: {
+      remote_ptr<typename Arch::timeval> tv = t->regs().arg1();
+      if (!tv.is_null() && t->regs().syscall_result_signed() == 0) {
+        auto v = t->read_mem(tv);
+        t->trace_writer().note_wall_clock_time(v.tv_sec, v.tv_usec);
+      }
+      break;
+    }
+
+    case Arch::clock_gettime: {
+      remote_ptr<typename Arch::timespec> ts = t->regs().arg2();
+      if (!ts.is_null() && (int)t->regs().arg1_signed() == CLOCK_REALTIME &&
+          t->regs().syscall_result_signed() == 0) {
+        auto v = t->read_mem(ts);
+        t->trace_writer().note_wall_clock_time(v.tv_sec, v.tv_nsec / 1000);
+      }
+      break;
+    }
+
+    case Arch::time:
+      if (t->regs().syscall_result_signed() >= 0) {
+        t->trace_writer().note_wall_clock_time(
+            t->regs().syscall_result_signed(), 0);
+      }
+      break;
+
     case Arch::mmap:
       switch (Arch::mmap_semantics) {
         case Arch::StructArguments: {
@@ -3046,6 +3305,9 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
       break;
 
     case Arch::ptrace:
+    case Arch::io_uring_setup:
+    case Arch::io_uring_enter:
+    case Arch::io_uring_register:
     case Arch::sched_setaffinity: {
       // Restore the register that we altered.
       Registers r = t->regs();
@@ -3162,9 +3424,15 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
       }
       break;
 
-    case SYS_rrcall_init_buffers:
-      t->init_buffers(nullptr, SHARE_DESCHED_EVENT_FD);
+    case SYS_rrcall_init_buffers: {
+      t->init_buffers(nullptr, SHARE_DESCHED_EVENT_FD,
+                      t->record_session().syscallbuf_size());
+      t->record_session().note_injected_state(t);
+      // Replay needs the syscallbuf size we chose.
+      t->record_remote(
+          remote_ptr<rrcall_init_buffers_params<Arch> >(t->regs().arg1()));
       break;
+    }
 
     case SYS_rrcall_init_preload: {
       t->at_preload_init();
@@ -3202,8 +3470,8 @@ static void rec_process_syscall_internal(Task* t,
 }
 
 void rec_process_syscall(Task* t) {
-  auto& syscall_state = *syscall_state_property.get(*t);
+  auto& syscall_state = *current_syscall_state(t);
   rec_process_syscall_internal(t, syscall_state);
   syscall_state.process_syscall_results();
-  syscall_state_property.remove(*t);
+  end_syscall_state(t);
 }
@@ -32,6 +32,7 @@
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "PipeMonitor.h"
 #include "ReplaySession.h"
 #include "task.h"
 #include "TraceStream.h"
@@ -783,6 +784,55 @@ static void process_shmdt(Task* t, const TraceFrame& trace_frame,
   step->action = TSTEP_RETIRE;
 }
 
+template <typename Arch>
+static void process_pipe(Task* t, const TraceFrame& trace_frame,
+                         SyscallEntryOrExit state, ReplayTraceStep* step) {
+  step->syscall.emu = EMULATE;
+  if (SYSCALL_ENTRY == state || trace_frame.regs().syscall_failed()) {
+    step->action = syscall_action(state);
+    return;
+  }
+
+  // Finish the syscall now so the new fds are in memory for PipeMonitor.
+  t->apply_all_data_records_from_trace();
+  t->set_return_value_from_trace();
+  t->validate_regs();
+
+  const Registers& r = trace_frame.regs();
+  if (Arch::socketpair == trace_frame.event().Syscall().number) {
+    PipeMonitor::did_create_socketpair(t, (int)r.arg1_signed(),
+                                       (int)r.arg2_signed(), r.arg4());
+  } else {
+    PipeMonitor::did_create_pipe(t, r.arg1());
+  }
+
+  step->action = TSTEP_RETIRE;
+}
+
+/**
+ * Return the syscallbuf size recorded for the current rrcall_init_buffers.
+ * Traces that don't record it used the default size, and so do traces that
+ * don't list the syscallbuf_size section.
+ */
+template <typename Arch> static size_t recorded_syscallbuf_size(Task* t) {
+  TraceReader::RawDataView data;
+  if (!t->trace_reader().read_raw_data_view_for_frame(t->current_trace_frame(),
+                                                      data)) {
+    return SYSCALLBUF_BUFFER_SIZE;
+  }
+  ASSERT(t, data.size == sizeof(rrcall_init_buffers_params<Arch>))
+      << "Unexpected rrcall_init_buffers data size " << data.size;
+  size_t size =
+      reinterpret_cast<const rrcall_init_buffers_params<Arch>*>(data.data)
+          ->syscallbuf_size;
+  ASSERT(t, size == SYSCALLBUF_BUFFER_SIZE ||
+                t->trace_reader().custom_syscallbuf_size())
+      << "Syscallbuf size " << size
+      << " recorded in a trace without a syscallbuf_size section";
+  return size;
+}
+
+template <typename Arch>
 static void process_init_buffers(Task* t, SyscallEntryOrExit state,
                                  ReplayTraceStep* step) {
   /* This was a phony syscall to begin with. */
@@ -802,7 +852,8 @@ static void process_init_buffers(Task* t, SyscallEntryOrExit state,
   /* We don't want the desched event fd during replay, because
    * we already know where they were.  (The perf_event fd is
    * emulated anyway.) */
-  t->init_buffers(rec_child_map_addr, DONT_SHARE_DESCHED_EVENT_FD);
+  t->init_buffers(rec_child_map_addr, DONT_SHARE_DESCHED_EVENT_FD,
+                  recorded_syscallbuf_size<Arch>(t));
 
   ASSERT(t, t->syscallbuf_child.cast<void>() == rec_child_map_addr)
       << "Should have mapped syscallbuf at " << rec_child_map_addr
@@ -1018,6 +1069,11 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     case Arch::shmdt:
       return process_shmdt(t, trace_frame, state, trace_regs.arg1(), step);
 
+    case Arch::pipe:
+    case Arch::pipe2:
+    case Arch::socketpair:
+      return process_pipe<Arch>(t, trace_frame, state, step);
+
     case Arch::ipc:
       switch ((int)trace_regs.arg1_signed()) {
         case SHMAT:
@@ -1075,7 +1131,7 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
       return;
 
     case SYS_rrcall_init_buffers:
-      return process_init_buffers(t, state, step);
+      return process_init_buffers<Arch>(t, state, step);
 
     case SYS_rrcall_init_preload:
       step->syscall.emu = EMULATE;
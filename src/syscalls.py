@@ -52,14 +52,27 @@ class InvalidSyscall(UnsupportedSyscall):
     def __init__(self, x86=None, x64=None):
         UnsupportedSyscall.__init__(self, x86=x86, x64=x64)
 
+class ResultSizedBuffer(object):
+    """An output buffer whose length is the syscall result.
+
+    The buffer's size is bounded by the syscall argument |size_arg|, which is
+    converted to |size_type| first.  The syscall result has type
+    |result_type|.
+    """
+    def __init__(self, size_arg, result_type="typename Arch::ssize_t",
+                 size_type="size_t"):
+        self.size_arg = size_arg
+        self.result_type = result_type
+        self.size_type = size_type
+
 class RegularSyscall(BaseSyscall, ReplaySemantics):
     """A syscall for which replay information may be recorded automatically.
 
     The arguments required for rr to record may be specified directly
     through the arg1...arg6 keyword arguments.  The values for these
     arguments determine the size of the associated arguments to the syscall.
-    The only allowed type for a given argument is a Python string, in which
-    case the size of the argument is sizeof(arg).
+    For a Python string, the size of the argument is sizeof(arg).  For a
+    ResultSizedBuffer, it's the syscall result, bounded by another argument.
 
     To ensure correct handling for mixed-arch process groups (e.g. a mix of 32
     and 64-bit processes), types should be specified using Arch instead of
@@ -524,7 +537,7 @@ oldlstat = UnsupportedSyscall(x86=84)
 # null byte to buf.  It will truncate the contents (to a length of
 # bufsiz characters), in case the buffer is too small to hold all of
 # the contents.
-readlink = IrregularEmulatedSyscall(x86=85, x64=89)
+readlink = EmulatedSyscall(x86=85, x64=89, arg2=ResultSizedBuffer(3))
 
 uselib = UnsupportedSyscall(x86=86, x64=134)
 swapon = UnsupportedSyscall(x86=87, x64=167)
@@ -766,7 +779,9 @@ _llseek = EmulatedSyscall(x86=140, arg4="typename Arch::__kernel_loff_t")
 # from the directory referred to by the open file descriptor fd into
 # the buffer pointed to by dirp.  The argument count specifies the
 # size of that buffer.
-getdents = IrregularEmulatedSyscall(x86=141, x64=78)
+getdents = EmulatedSyscall(x86=141, x64=78,
+                           arg2=ResultSizedBuffer(3, result_type="int",
+                                                  size_type="unsigned int"))
 
 #  int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
 #struct timeval *timeout);
@@ -996,7 +1011,7 @@ chown = EmulatedSyscall(x86=182, x64=92)
 # absolute pathname that is the current working directory of the
 # calling process.  The pathname is returned as the function result
 # and via the argument buf, if present.
-getcwd = IrregularEmulatedSyscall(x86=183, x64=79)
+getcwd = EmulatedSyscall(x86=183, x64=79, arg1=ResultSizedBuffer(2))
 
 capget = IrregularEmulatedSyscall(x86=184, x64=125)
 capset = EmulatedSyscall(x86=185, x64=126)
@@ -1145,7 +1160,9 @@ mincore = IrregularEmulatedSyscall(x86=218, x64=27)
 # application (except in the case of MADV_DONTNEED)", but that is a lie.
 madvise = IrregularEmulatedSyscall(x86=219, x64=28)
 
-getdents64 = IrregularEmulatedSyscall(x86=220, x64=217)
+getdents64 = EmulatedSyscall(x86=220, x64=217,
+                             arg2=ResultSizedBuffer(3, result_type="int",
+                                                    size_type="unsigned int"))
 
 #  int fcntl(int fd, int cmd, ... ( arg ));
 #
@@ -1192,9 +1209,12 @@ fsetxattr = EmulatedSyscall(x86=228, x64=190)
 # getxattr() retrieves the value of the extended attribute identified
 # by name and associated with the given path in the file system. The
 # length of the attribute value is returned.
-getxattr = IrregularEmulatedSyscall(x86=229, x64=191)
-lgetxattr = IrregularEmulatedSyscall(x86=230, x64=192)
-fgetxattr = IrregularEmulatedSyscall(x86=231, x64=193)
+getxattr = EmulatedSyscall(x86=229, x64=191,
+                           arg3=ResultSizedBuffer(4, result_type="size_t"))
+lgetxattr = EmulatedSyscall(x86=230, x64=192,
+                            arg3=ResultSizedBuffer(4, result_type="size_t"))
+fgetxattr = EmulatedSyscall(x86=231, x64=193,
+                            arg3=ResultSizedBuffer(4, result_type="size_t"))
 
 listxattr = UnsupportedSyscall(x86=232, x64=194)
 llistxattr = UnsupportedSyscall(x86=233, x64=195)
@@ -1685,6 +1705,19 @@ renameat2 = UnsupportedSyscall(x86=353, x64=316)
 seccomp = IrregularEmulatedSyscall(x86=354, x64=317)
 getrandom = IrregularEmulatedSyscall(x86=355, x64=318)
 
+# int io_uring_setup(u32 entries, struct io_uring_params *p);
+# int io_uring_enter(unsigned int fd, u32 to_submit, u32 min_complete,
+#                    u32 flags, sigset_t *sig);
+# int io_uring_register(unsigned int fd, unsigned int opcode, void *arg,
+#                       unsigned int nr_args);
+#
+# The kernel reads and writes io_uring's submission and completion rings
+# asynchronously, which we can't record, so these always fail with
+# ENOSYS. Applications then fall back to ordinary syscalls.
+io_uring_setup = IrregularEmulatedSyscall(x86=425, x64=425)
+io_uring_enter = IrregularEmulatedSyscall(x86=426, x64=426)
+io_uring_register = IrregularEmulatedSyscall(x86=427, x64=427)
+
 # restart_syscall is a little special.
 restart_syscall = RestartSyscall(x86=0, x64=219)
 
@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <elf.h>
 #include <errno.h>
+#include <limits.h>
 #include <linux/net.h>
 #include <linux/perf_event.h>
 #include <stdlib.h>
@@ -15,6 +16,7 @@
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 
@@ -31,12 +33,16 @@
 #include "kernel_metadata.h"
 #include "kernel_supplement.h"
 #include "log.h"
+#include "MagicBookmarkMonitor.h"
 #include "MagicSaveDataMonitor.h"
+#include "probes.h"
 #include "RecordSession.h"
 #include "record_signal.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
 #include "seccomp-bpf.h"
+#include "SelfProfiler.h"
+#include "SocketMonitor.h"
 #include "StdioMonitor.h"
 #include "StringVectorToCharArray.h"
 #include "util.h"
@@ -223,6 +229,9 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
            int _priority, SupportedArch a)
     : pseudo_blocked(false),
       succ_event_counter(),
+      spin_count(0),
+      yield_count(0),
+      timeslice_boost(0),
       unstable(false),
       stable_exit(false),
       priority(_priority),
@@ -233,7 +242,6 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       in_wait_type(WAIT_TYPE_NONE),
       scratch_ptr(),
       scratch_size(),
-      flushed_syscallbuf(false),
       delay_syscallbuf_reset(false),
       delay_syscallbuf_flush(false),
       // This will be initialized when the syscall buffer is.
@@ -252,6 +260,7 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       prname("???"),
       ticks(0),
       registers(a),
+      registers_dirty(false),
       is_stopped(false),
       extra_registers(a),
       extra_registers_known(false),
@@ -303,6 +312,7 @@ Task::~Task() {
   // it for futex_wait below after we've detached.
   ASSERT(this, as->mem_fd().is_open());
 
+  flush_regs();
   fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
 
   if (unstable) {
@@ -676,7 +686,8 @@ ReplaySession& Task::replay_session() const { return *session().as_replay(); }
 
 template <typename Arch>
 void Task::init_buffers_arch(remote_ptr<void> map_hint,
-                             ShareDeschedEventFd share_desched_fd) {
+                             ShareDeschedEventFd share_desched_fd,
+                             size_t syscallbuf_size) {
   // NB: the tracee can't be interrupted with a signal while
   // we're processing the rrcall, because it's masked off all
   // signals.
@@ -688,8 +699,9 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint,
   auto args = read_mem(child_args);
 
   if (as->syscallbuf_enabled()) {
-    init_syscall_buffer(remote, map_hint);
+    init_syscall_buffer(remote, map_hint, syscallbuf_size);
     args.syscallbuf_ptr = syscallbuf_child;
+    args.syscallbuf_size = num_syscallbuf_bytes;
     if (share_desched_fd == SHARE_DESCHED_EVENT_FD) {
       desched_fd_child = args.desched_counter_fd;
       desched_fd = remote.retrieve_fd(desched_fd_child);
@@ -698,6 +710,7 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint,
     }
   } else {
     args.syscallbuf_ptr = remote_ptr<void>(nullptr);
+    args.syscallbuf_size = 0;
   }
 
   // Return the mapped buffers to the child.
@@ -712,8 +725,10 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint,
 }
 
 void Task::init_buffers(remote_ptr<void> map_hint,
-                        ShareDeschedEventFd share_desched_fd) {
-  RR_ARCH_FUNCTION(init_buffers_arch, arch(), map_hint, share_desched_fd);
+                        ShareDeschedEventFd share_desched_fd,
+                        size_t syscallbuf_size) {
+  RR_ARCH_FUNCTION(init_buffers_arch, arch(), map_hint, share_desched_fd,
+                   syscallbuf_size);
 }
 
 void Task::destroy_buffers() {
@@ -953,6 +968,20 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
       fd_table()->did_close(regs.arg1());
       return;
 
+    case Arch::connect:
+    case Arch::listen:
+      if (session().is_replaying()) {
+        SocketMonitor::did_replay_connect(this, (int)regs.arg1_signed());
+      }
+      return;
+    case Arch::accept:
+    case Arch::accept4:
+      if (session().is_replaying() && !regs.syscall_failed()) {
+        SocketMonitor::did_replay_connect(this,
+                                          (int)regs.syscall_result_signed());
+      }
+      return;
+
     case Arch::unshare:
       if (regs.arg1() & CLONE_FILES) {
         fds->erase_task(this);
@@ -960,7 +989,26 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
       }
       return;
 
-    case Arch::write: {
+    case Arch::read: {
+      int fd = (int)regs.arg1_signed();
+      ssize_t amount = regs.syscall_result_signed();
+      if (session().is_replaying() && amount > 0 &&
+          fd_table()->is_monitoring(fd)) {
+        // Recording left out the data if the fd's monitor could reproduce
+        // it. Otherwise it's the first record for this frame.
+        TraceReader::RawDataView data;
+        bool recorded = trace_reader().read_raw_data_view_for_frame(
+            current_trace_frame(), data);
+        if (recorded && data.size > 0) {
+          write_bytes_helper(data.addr, data.size, data.data);
+        }
+        fd_table()->did_replay_read(this, fd, recorded, regs.arg2(), amount);
+      }
+      return;
+    }
+
+    case Arch::write:
+    case Arch::sendto: {
       int fd = (int)regs.arg1_signed();
       vector<FileMonitor::Range> ranges;
       ssize_t amount = regs.syscall_result_signed();
@@ -971,11 +1019,21 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
       return;
     }
 
-    case Arch::writev: {
+    case Arch::writev:
+    case Arch::sendmsg: {
       int fd = (int)regs.arg1_signed();
+      remote_ptr<typename Arch::iovec> iovecsp = regs.arg2();
+      size_t iovcnt = regs.arg3();
+      if (syscallno == Arch::sendmsg) {
+        if (!fd_table()->is_monitoring(fd) || regs.syscall_failed()) {
+          return;
+        }
+        auto msg = read_mem(remote_ptr<typename Arch::msghdr>(regs.arg2()));
+        iovecsp = msg.msg_iov.rptr();
+        iovcnt = msg.msg_iovlen;
+      }
       vector<FileMonitor::Range> ranges;
-      auto iovecs =
-          read_mem(remote_ptr<typename Arch::iovec>(regs.arg2()), regs.arg3());
+      auto iovecs = read_mem(iovecsp, iovcnt);
       ssize_t written = regs.syscall_result_signed();
       ASSERT(this, written >= 0);
       for (auto& v : iovecs) {
@@ -1043,6 +1101,7 @@ void Task::post_exec(const Registers* replay_regs,
    * (should!) be the same as for the recorded tasks.  So we can
    * start validating registers at events. */
   session().post_exec();
+  note_startup_phase("first exec");
 
   as->erase_task(this);
   fds->erase_task(this);
@@ -1265,6 +1324,7 @@ const ExtraRegisters& Task::extra_regs() {
       ASSERT(this, vec.iov_len == xsave_area_size)
           << "Didn't get enough register data; expected " << xsave_area_size
           << " but got " << vec.iov_len;
+      extra_registers.clear_unused_xsave_components();
     } else {
 #if defined(__i386__)
       LOG(debug) << "  (refreshing extra-register cache using FPXREGS)";
@@ -1293,7 +1353,8 @@ const ExtraRegisters& Task::extra_regs() {
 void Task::validate_regs(uint32_t flags) {
   /* don't validate anything before execve is done as the actual
    * process did not start prior to this point */
-  if (!session().can_validate()) {
+  if (!session().can_validate() ||
+      (session().is_replaying() && !session().as_replay()->should_verify())) {
     return;
   }
 
@@ -1397,9 +1458,14 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how, int sig,
   // replay.
   // Accumulate any unknown stuff in tick_count().
   hpc.reset(tick_period == 0 ? 0xffffffff : tick_period);
+  AddressSpace::invalidate_read_caches();
   LOG(debug) << "resuming execution with " << ptrace_req_name(how);
+  RR_PROBE3(resume, tid, how, sig);
+  session().accumulate_resume(how == RESUME_SINGLESTEP ||
+                              how == RESUME_SYSEMU_SINGLESTEP);
   breakpoint_set_where_execution_resumed =
       vm()->get_breakpoint_type_at_addr(ip()) != TRAP_NONE;
+  flush_regs();
   ptrace_if_alive(how, nullptr, (void*)(uintptr_t) sig);
   is_stopped = false;
   extra_registers_known = false;
@@ -1413,20 +1479,36 @@ const TraceFrame& Task::current_trace_frame() {
 }
 
 ssize_t Task::set_data_from_trace() {
-  auto buf = trace_reader().read_raw_data();
-  if (!buf.addr.is_null() && buf.data.size() > 0) {
-    write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+  auto buf = trace_reader().read_raw_data_view();
+  if (!buf.addr.is_null() && buf.size > 0) {
+    write_bytes_helper(buf.addr, buf.size, buf.data);
   }
-  return buf.data.size();
+  return buf.size;
 }
 
 void Task::apply_all_data_records_from_trace() {
-  TraceReader::RawData buf;
-  while (trace_reader().read_raw_data_for_frame(current_trace_frame(), buf)) {
-    if (!buf.addr.is_null() && buf.data.size() > 0) {
-      write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+  // Views are only valid until the next read, so small records are copied
+  // and written together; big ones aren't worth copying. Records may
+  // overlap so they're still written in trace order.
+  vector<vector<uint8_t> > data;
+  vector<MemoryTransfer> transfers;
+  TraceReader::RawDataView buf;
+  while (trace_reader().read_raw_data_view_for_frame(current_trace_frame(),
+                                                     buf)) {
+    if (buf.addr.is_null() || buf.size == 0) {
+      continue;
+    }
+    if (buf.size >= page_size()) {
+      write_bytes_multi(transfers);
+      transfers.clear();
+      data.clear();
+      write_bytes_helper(buf.addr, buf.size, buf.data);
+      continue;
     }
+    data.push_back(vector<uint8_t>(buf.data, buf.data + buf.size));
+    transfers.push_back(MemoryTransfer(buf.addr, buf.size, data.back().data()));
   }
+  write_bytes_multi(transfers);
 }
 
 void Task::set_return_value_from_trace() {
@@ -1441,13 +1523,36 @@ void Task::set_return_value_from_trace() {
 
 void Task::set_regs(const Registers& regs) {
   ASSERT(this, is_stopped);
-  registers = regs;
+  // Callers may modify |registers| in place and pass it back to us.
+  if (&regs != &registers) {
+    if (registers.identical_to(regs)) {
+      session().accumulate_register_write_saved();
+      return;
+    }
+    registers = regs;
+  }
+  if (registers_dirty) {
+    session().accumulate_register_write_saved();
+  }
+  registers_dirty = true;
+}
+
+void Task::flush_regs() {
+  if (!registers_dirty) {
+    return;
+  }
+  registers_dirty = false;
   auto ptrace_regs = registers.get_ptrace();
   ptrace_if_alive(PTRACE_SETREGS, nullptr, &ptrace_regs);
 }
 
 void Task::set_extra_regs(const ExtraRegisters& regs) {
   ASSERT(this, !regs.empty()) << "Trying to set empty ExtraRegisters";
+  if (extra_registers_known && extra_registers.format() == regs.format() &&
+      extra_registers.data == regs.data) {
+    session().accumulate_register_write_saved();
+    return;
+  }
   extra_registers = regs;
   extra_registers_known = true;
 
@@ -1639,9 +1744,9 @@ void Task::stash_sig() {
   // Callers should avoid passing SYSCALLBUF_DESCHED_SIGNAL in here.
   assert(sig != SYSCALLBUF_DESCHED_SIGNAL);
   // multiple non-RT signals coalesce
-  if (sig < SIGRTMIN) {
-    for (auto it = stashed_signals.begin(); it != stashed_signals.end(); ++it) {
-      if (it->si.si_signo == sig) {
+  if (sig < SIGRTMIN && stashed_signals) {
+    for (auto& s : *stashed_signals) {
+      if (s.si.si_signo == sig) {
         LOG(debug) << "discarding stashed signal " << sig
                    << " since we already have one pending";
         return;
@@ -1650,7 +1755,7 @@ void Task::stash_sig() {
   }
 
   const siginfo_t& si = get_siginfo();
-  stashed_signals.push_back(StashedSignal(si));
+  push_stash_sig(si);
   wait_status = 0;
 }
 
@@ -1660,9 +1765,9 @@ void Task::stash_synthetic_sig(const siginfo_t& si) {
   // Callers should avoid passing SYSCALLBUF_DESCHED_SIGNAL in here.
   assert(sig != SYSCALLBUF_DESCHED_SIGNAL);
   // multiple non-RT signals coalesce
-  if (sig < SIGRTMIN) {
-    for (auto it = stashed_signals.begin(); it != stashed_signals.end(); ++it) {
-      if (it->si.si_signo == sig) {
+  if (sig < SIGRTMIN && stashed_signals) {
+    for (auto& s : *stashed_signals) {
+      if (s.si.si_signo == sig) {
         LOG(debug) << "discarding stashed signal " << sig
                    << " since we already have one pending";
         return;
@@ -1670,19 +1775,43 @@ void Task::stash_synthetic_sig(const siginfo_t& si) {
     }
   }
 
-  stashed_signals.push_back(StashedSignal(si));
+  push_stash_sig(si);
+}
+
+void Task::push_stash_sig(const siginfo_t& si) {
+  if (!stashed_signals) {
+    stashed_signals =
+        unique_ptr<deque<StashedSignal> >(new deque<StashedSignal>());
+  }
+  stashed_signals->push_back(StashedSignal(si));
 }
 
 siginfo_t Task::pop_stash_sig() {
   assert(has_stashed_sig());
-  siginfo_t si = stashed_signals.front().si;
-  stashed_signals.pop_front();
+  siginfo_t si = stashed_signals->front().si;
+  stashed_signals->pop_front();
+  if (stashed_signals->empty()) {
+    // Most tasks never have a signal stashed, or only briefly; don't keep
+    // the deque's buffers around for them.
+    stashed_signals = nullptr;
+  }
   return si;
 }
 
 siginfo_t Task::peek_stash_sig() {
   assert(has_stashed_sig());
-  return stashed_signals.front().si;
+  return stashed_signals->front().si;
+}
+
+size_t Task::memory_footprint() const {
+  size_t bytes = sizeof(*this) + prname.capacity() +
+                 pending_events.size() * sizeof(Event) +
+                 extra_registers.data_size();
+  if (stashed_signals) {
+    bytes += sizeof(*stashed_signals) +
+             stashed_signals->size() * sizeof(StashedSignal);
+  }
+  return bytes;
 }
 
 const string& Task::trace_dir() const {
@@ -1822,6 +1951,8 @@ static const int ptrace_exit_wait_status = (PTRACE_EVENT_EXIT << 16) | 0x857f;
 
 void Task::wait(AllowInterrupt allow_interrupt) {
   LOG(debug) << "going into blocking waitpid(" << tid << ") ...";
+  RR_PROBE1(wait_start, tid);
+  SelfProfiler::Span span("tracee", tid, "running");
   ASSERT(this, !unstable) << "Don't wait for unstable tasks";
 
   // We only need this during recording.  If tracees go runaway
@@ -1890,6 +2021,7 @@ void Task::wait(AllowInterrupt allow_interrupt) {
 
   LOG(debug) << "  waitpid(" << tid << ") returns " << ret << "; status "
              << HEX(status);
+  RR_PROBE2(wait_done, tid, status);
   ASSERT(this, tid == ret) << "waitpid(" << tid << ") failed with " << ret;
 
   // If some other ptrace-stop happened to race with our
@@ -1967,6 +2099,9 @@ void Task::fixup_syscall_regs() {
 
 void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   LOG(debug) << "  (refreshing register cache)";
+  // Registers set while the task was stopped can't be written any more,
+  // e.g. because it was killed.
+  registers_dirty = false;
   intptr_t original_syscallno = registers.original_syscallno();
   // Skip reading registers immediately after a PTRACE_EVENT_EXEC, since
   // we may not know the correct architecture.
@@ -2048,6 +2183,9 @@ static void set_up_process(Session& session) {
   if (RR_MAGIC_SAVE_DATA_FD != dup2(fd, RR_MAGIC_SAVE_DATA_FD)) {
     FATAL() << "error duping to RR_MAGIC_SAVE_DATA_FD";
   }
+  if (RR_MAGIC_BOOKMARK_FD != dup2(fd, RR_MAGIC_BOOKMARK_FD)) {
+    FATAL() << "error duping to RR_MAGIC_BOOKMARK_FD";
+  }
 
   fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
   if (0 > fd) {
@@ -2433,7 +2571,8 @@ void Task::copy_state(const CapturedState& state) {
       // segment between rr and the tracee.  So we
       // have to unmap it, create a copy, and then
       // re-map the copy in rr and the tracee.
-      init_syscall_buffer(remote, state.syscallbuf_child);
+      init_syscall_buffer(remote, state.syscallbuf_child,
+                          state.num_syscallbuf_bytes);
       ASSERT(this, state.syscallbuf_child == syscallbuf_child);
       // Ensure the copied syscallbuf has the same contents
       // as the old one, for consistency checking.
@@ -2504,7 +2643,7 @@ void Task::open_mem_fd_if_needed() {
 }
 
 void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
-                               remote_ptr<void> map_hint) {
+                               remote_ptr<void> map_hint, size_t size) {
   static int nonce = 0;
   // Create the segment we'll share with the tracee.
   char path[PATH_MAX];
@@ -2533,12 +2672,12 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   unlink(path);
 
   ScopedFd shmem_fd = remote.retrieve_fd(child_shmem_fd);
-  resize_shmem_segment(shmem_fd, SYSCALLBUF_BUFFER_SIZE);
+  resize_shmem_segment(shmem_fd, size);
   LOG(debug) << "created shmem segment " << path;
 
   // Map the segment in ours and the tracee's address spaces.
   void* map_addr;
-  num_syscallbuf_bytes = SYSCALLBUF_BUFFER_SIZE;
+  num_syscallbuf_bytes = size;
   int prot = PROT_READ | PROT_WRITE;
   int flags = MAP_SHARED;
   if ((void*)-1 == (map_addr = mmap(nullptr, num_syscallbuf_bytes, prot, flags,
@@ -2563,6 +2702,16 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   // No entries to begin with.
   memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
 
+  // Shared memory can only use whole huge pages. Whether it gets them at
+  // all depends on the shmem THP setting and the filesystem /tmp is on;
+  // otherwise this has no effect.
+  if (session().is_recording() && record_session().use_huge_pages() &&
+      num_syscallbuf_bytes % HUGE_PAGE_SIZE == 0) {
+    madvise(map_addr, num_syscallbuf_bytes, MADV_HUGEPAGE);
+    remote.syscall(syscall_number_for_madvise(arch()), child_map_addr,
+                   num_syscallbuf_bytes, MADV_HUGEPAGE);
+  }
+
   vm()->map(child_map_addr, num_syscallbuf_bytes, prot, flags, 0,
             MappableResource::syscallbuf(rec_tid, shmem_fd, path));
 
@@ -2591,9 +2740,13 @@ void Task::maybe_flush_syscallbuf() {
     // No syscallbuf or no records.  No flushing to do.
     return;
   }
+  // The reset is part of the flush event, so replay doesn't need a
+  // separate EV_SYSCALLBUF_RESET frame for it.
+  bool reset = is_stopped && !delay_syscallbuf_reset;
   // Write the entire buffer in one shot without parsing it,
   // because replay will take care of that.
-  push_event(Event(EV_SYSCALLBUF_FLUSH, NO_EXEC_INFO, arch()));
+  note_syscallbuf_wall_clock_times();
+  push_event(SyscallbufFlushEvent(reset, arch()));
   record_local(syscallbuf_child,
                // Record the header for consistency checking.
                is_stopped ? syscallbuf_data_size() : num_syscallbuf_bytes,
@@ -2601,14 +2754,58 @@ void Task::maybe_flush_syscallbuf() {
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
 
-  if (is_stopped) {
-    // Reset header.
+  if (reset) {
     assert(!syscallbuf_hdr->abort_commit);
-    if (!delay_syscallbuf_reset) {
-      syscallbuf_hdr->num_rec_bytes = 0;
+    if (record_session().stats_enabled()) {
+      record_session().note_buffered_syscalls(count_syscallbuf_records());
     }
+    syscallbuf_hdr->num_rec_bytes = 0;
   }
-  flushed_syscallbuf = true;
+}
+
+uint32_t Task::count_syscallbuf_records() const {
+  uint32_t count = 0;
+  auto record_ptr = reinterpret_cast<const uint8_t*>(syscallbuf_hdr + 1);
+  auto end_ptr = record_ptr + syscallbuf_hdr->num_rec_bytes;
+  while (record_ptr < end_ptr) {
+    auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (record->size < sizeof(*record)) {
+      break;
+    }
+    ++count;
+    record_ptr += stored_record_size(record->size);
+  }
+  return count;
+}
+
+template <typename Arch> void Task::note_syscallbuf_wall_clock_times_arch() {
+  auto record_ptr = reinterpret_cast<const uint8_t*>(syscallbuf_hdr + 1);
+  auto end_ptr = record_ptr + syscallbuf_hdr->num_rec_bytes;
+  while (record_ptr < end_ptr) {
+    auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (record->size < sizeof(*record)) {
+      break;
+    }
+    size_t data_size = record->size - sizeof(*record);
+    if (record->ret == 0) {
+      if (record->syscallno == Arch::gettimeofday &&
+          data_size >= sizeof(typename Arch::timeval)) {
+        auto tv =
+            reinterpret_cast<const typename Arch::timeval*>(record->extra_data);
+        trace_writer().note_wall_clock_time(tv->tv_sec, tv->tv_usec);
+      } else if (record->syscallno == Arch::clock_gettime &&
+                 data_size >= sizeof(typename Arch::timespec)) {
+        auto ts = reinterpret_cast<const typename Arch::timespec*>(
+            record->extra_data);
+        trace_writer().note_wall_clock_time(ts->tv_sec, ts->tv_nsec / 1000);
+      }
+    }
+    record_ptr += stored_record_size(record->size);
+  }
+}
+
+void Task::note_syscallbuf_wall_clock_times() {
+  RR_ARCH_FUNCTION(note_syscallbuf_wall_clock_times_arch, arch());
 }
 
 ssize_t Task::read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
@@ -2681,6 +2878,10 @@ ssize_t Task::read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
     return read_bytes_ptrace(addr, buf_size, buf);
   }
 
+  if (as->read_cached(addr, buf_size, buf)) {
+    return buf_size;
+  }
+
   errno = 0;
   ssize_t nread = pread64(as->mem_fd(), buf, buf_size, addr.as_int());
   // We open the mem_fd just after being notified of
@@ -2766,6 +2967,67 @@ bool Task::try_replace_pages(remote_ptr<void> addr, ssize_t buf_size,
   return true;
 }
 
+/**
+ * Transfer as many of |transfers| as possible with process_vm_readv/writev
+ * and return how many were completely transferred. The kernel never splits
+ * a remote iovec, so everything after the returned index is untouched
+ * except possibly the first.
+ */
+static size_t transfer_bytes_multi(
+    pid_t tid, const vector<Task::MemoryTransfer>& transfers, bool write) {
+  size_t done = 0;
+  while (done < transfers.size()) {
+    size_t count = min(transfers.size() - done, size_t(IOV_MAX));
+    vector<struct iovec> local(count);
+    vector<struct iovec> remote(count);
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+      const Task::MemoryTransfer& t = transfers[done + i];
+      local[i].iov_base = t.buf;
+      local[i].iov_len = t.size;
+      remote[i].iov_base = reinterpret_cast<void*>(t.addr.as_int());
+      remote[i].iov_len = t.size;
+      total += t.size;
+    }
+    ssize_t ret =
+        write ? process_vm_writev(tid, local.data(), count, remote.data(),
+                                  count, 0)
+              : process_vm_readv(tid, local.data(), count, remote.data(),
+                                 count, 0);
+    if (ret < 0) {
+      return done;
+    }
+    size_t left = ret;
+    size_t end = done + count;
+    while (done < end && left >= transfers[done].size) {
+      left -= transfers[done].size;
+      ++done;
+    }
+    if (size_t(ret) < total) {
+      return done;
+    }
+  }
+  return done;
+}
+
+void Task::read_bytes_multi(const vector<MemoryTransfer>& transfers) {
+  size_t done = transfer_bytes_multi(tid, transfers, false);
+  for (size_t i = done; i < transfers.size(); ++i) {
+    read_bytes_helper(transfers[i].addr, transfers[i].size, transfers[i].buf);
+  }
+}
+
+void Task::write_bytes_multi(const vector<MemoryTransfer>& transfers) {
+  size_t done = transfer_bytes_multi(tid, transfers, true);
+  for (size_t i = 0; i < done; ++i) {
+    vm()->notify_written(transfers[i].addr, transfers[i].size);
+  }
+  for (size_t i = done; i < transfers.size(); ++i) {
+    write_bytes_helper(transfers[i].addr, transfers[i].size,
+                       transfers[i].buf);
+  }
+}
+
 /**
  * This function exists to work around
  * https://bugzilla.kernel.org/show_bug.cgi?id=99101.
@@ -2957,6 +3219,7 @@ static void setup_fd_table(FdTable& fds) {
   fds.add_monitor(STDOUT_FILENO, new StdioMonitor(STDOUT_FILENO));
   fds.add_monitor(STDERR_FILENO, new StdioMonitor(STDERR_FILENO));
   fds.add_monitor(RR_MAGIC_SAVE_DATA_FD, new MagicSaveDataMonitor());
+  fds.add_monitor(RR_MAGIC_BOOKMARK_FD, new MagicBookmarkMonitor());
 }
 
 /*static*/ Task* Task::spawn(Session& session, const TraceStream& trace,
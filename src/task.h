@@ -486,12 +486,14 @@ public:
    * of *exit from* the rrcall.  Registers will be updated with
    * the return value from the rrcall, which is also returned
    * from this call.  |map_hint| suggests where to map the
-   * region; see |init_syscallbuf_buffer()|.
+   * region; see |init_syscallbuf_buffer()|. The syscallbuf is
+   * |syscallbuf_size| bytes.
    *
    * Pass SHARE_DESCHED_EVENT_FD to additionally share that fd.
    */
   void init_buffers(remote_ptr<void> map_hint,
-                    ShareDeschedEventFd share_desched_fd);
+                    ShareDeschedEventFd share_desched_fd,
+                    size_t syscallbuf_size);
 
   /**
    * Destroy in the tracee task the scratch buffer and syscallbuf (if
@@ -804,6 +806,27 @@ public:
     return v;
   }
 
+  /**
+   * A range of tracee memory and the local buffer it's read into or written
+   * from, for read_bytes_multi() and write_bytes_multi().
+   */
+  struct MemoryTransfer {
+    MemoryTransfer(remote_ptr<void> addr, size_t size, void* buf)
+        : addr(addr), size(size), buf(buf) {}
+    remote_ptr<void> addr;
+    size_t size;
+    void* buf;
+  };
+  /**
+   * Read or write all of |transfers|, or don't return. Uses one
+   * process_vm_readv/writev call for up to IOV_MAX ranges, instead of a
+   * syscall per range. Ranges the kernel refuses (e.g. because the tracee
+   * can't read or write them itself) fall back to read_bytes_helper() and
+   * write_bytes_helper().
+   */
+  void read_bytes_multi(const std::vector<MemoryTransfer>& transfers);
+  void write_bytes_multi(const std::vector<MemoryTransfer>& transfers);
+
   /**
    * Read and return the C string located at |child_addr| in
    * this address space.
@@ -853,8 +876,16 @@ public:
    */
   void set_return_value_from_trace();
 
-  /** Set the tracee's registers to |regs|. */
+  /**
+   * Set the tracee's registers to |regs|. The tracee's registers are only
+   * written (by flush_regs()) when it's resumed or detached, and not at all
+   * if they end up unchanged.
+   */
   void set_regs(const Registers& regs);
+  /**
+   * Write registers changed by set_regs() to the tracee now.
+   */
+  void flush_regs();
 
   /** Set the tracee's extra registers to |regs|. */
   void set_extra_regs(const ExtraRegisters& regs);
@@ -947,7 +978,7 @@ public:
    */
   void stash_sig();
   void stash_synthetic_sig(const siginfo_t& si);
-  bool has_stashed_sig() const { return !stashed_signals.empty(); }
+  bool has_stashed_sig() const { return stashed_signals != nullptr; }
   siginfo_t peek_stash_sig();
   siginfo_t pop_stash_sig();
 
@@ -1179,6 +1210,17 @@ public:
    * it's processed in succession.  The scheduler maintains this
    * state and uses it to make scheduling decisions. */
   uint32_t succ_event_counter;
+  /* Spin-loop detection state maintained by the scheduler: the ip at this
+   * task's last timeslice expiry (null if it has made a traced syscall
+   * since) and its other registers then, how many times in a row it has
+   * been seen spinning, and how many sched_yields it has made in a row. */
+  remote_code_ptr spin_ip;
+  Registers spin_regs;
+  uint32_t spin_count;
+  uint32_t yield_count;
+  /* log2 of how much longer than max-ticks the scheduler currently lets
+   * this task run; see Scheduler. */
+  uint32_t timeslice_boost;
   /* True when any assumptions made about the status of this
    * process have been invalidated, and must be re-established
    * with a waitpid() call. Only applies to tasks which are dying, usually
@@ -1258,12 +1300,6 @@ public:
   remote_ptr<void> scratch_ptr;
   ssize_t scratch_size;
 
-  /* Nonzero after the trace recorder has flushed the
-   * syscallbuf.  When this happens, the recorder must prepare a
-   * "reset" of the buffer, to zero the record count, at the
-   * next available slow (taking |desched| into
-   * consideration). */
-  bool flushed_syscallbuf;
   /* This bit is set when code wants to prevent the syscall
    * record buffer from being reset when it normally would be.
    * Currently, the desched'd syscall code uses this. */
@@ -1321,6 +1357,12 @@ public:
 
   PropertyTable& properties() { return properties_; }
 
+  /**
+   * Approximate bytes of rr's memory this task accounts for: the Task
+   * itself and the per-task data it owns on the heap.
+   */
+  size_t memory_footprint() const;
+
   struct CapturedState {
     pid_t rec_tid;
     uint32_t serial;
@@ -1356,10 +1398,24 @@ private:
   /** Helper function for update_sigaction. */
   template <typename Arch> void update_sigaction_arch(const Registers& regs);
 
+  /** Number of syscall records in the syscallbuf. */
+  uint32_t count_syscallbuf_records() const;
+
+  /**
+   * Add the wall-clock times read by buffered syscalls to the trace's
+   * wall-clock index.
+   */
+  void note_syscallbuf_wall_clock_times();
+  template <typename Arch> void note_syscallbuf_wall_clock_times_arch();
+
+  /** Append |si| to the stashed signals. */
+  void push_stash_sig(const siginfo_t& si);
+
   /** Helper function for init_buffers. */
   template <typename Arch>
   void init_buffers_arch(remote_ptr<void> map_hint,
-                         ShareDeschedEventFd share_desched_fd);
+                         ShareDeschedEventFd share_desched_fd,
+                         size_t syscallbuf_size);
 
   /**
    * Return a new Task cloned from |p|.  |flags| are a set of
@@ -1442,11 +1498,11 @@ private:
    * Map the syscallbuffer for this, shared with this process.
    * |map_hint| is the address where the syscallbuf is expected
    * to be mapped --- and this is asserted --- or nullptr if
-   * there are no expectations.
+   * there are no expectations. The buffer is |size| bytes.
    * Initializes syscallbuf_child.
    */
   void init_syscall_buffer(AutoRemoteSyscalls& remote,
-                           remote_ptr<void> map_hint);
+                           remote_ptr<void> map_hint, size_t size);
 
   /**
    * True if this has blocked delivery of the desched signal.
@@ -1517,6 +1573,9 @@ private:
   Ticks ticks;
   // When |is_stopped|, these are our child registers.
   Registers registers;
+  // When |registers_dirty|, |registers| has changes that haven't been
+  // written to the tracee yet.
+  bool registers_dirty;
   // True when we know via waitpid() that the task is stopped and we haven't
   // resumed it.
   bool is_stopped;
@@ -1550,7 +1609,9 @@ private:
     StashedSignal(const siginfo_t& si) : si(si) {}
     siginfo_t si;
   };
-  std::deque<StashedSignal> stashed_signals;
+  // Allocated only while there are any, since most tasks never stash a
+  // signal and an empty deque still costs several hundred bytes.
+  std::unique_ptr<std::deque<StashedSignal> > stashed_signals;
   // The task group this belongs to.
   std::shared_ptr<TaskGroup> tg;
   // Contents of the |tls| argument passed to |clone()| and
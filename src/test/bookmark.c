@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#include <rr/rr.h>
+
+#define BOOKMARK "after-setup"
+
+static void first_breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+static void second_breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  int i;
+
+  first_breakpoint();
+  for (i = 0; i < 100; ++i) {
+    geteuid();
+  }
+
+  test_assert(strlen(BOOKMARK) ==
+              write(RR_MAGIC_BOOKMARK_FD, BOOKMARK, strlen(BOOKMARK)));
+  second_breakpoint();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
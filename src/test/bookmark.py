@@ -0,0 +1,13 @@
+from rrutil import *
+
+send_gdb('b first_breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('b second_breakpoint')
+expect_gdb('Breakpoint 2')
+
+send_gdb('c')
+# We start at the bookmark, after first_breakpoint.
+expect_gdb('Breakpoint 2, second_breakpoint')
+
+ok()
@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Exercise the syscalls the syscallbuf buffers with scratch iovecs,
+ * messages and output structs. */
+
+static void test_pread_pwrite(void) {
+  char name[] = "/tmp/rr-buffered-syscalls-XXXXXX";
+  int fd = mkstemp(name);
+  char buf[6];
+
+  test_assert(fd >= 0);
+  test_assert(0 == unlink(name));
+  test_assert(10 == pwrite64(fd, "0123456789", 10, 0));
+  test_assert(3 == pwrite64(fd, "abc", 3, 4));
+  memset(buf, 0, sizeof(buf));
+  test_assert(5 == pread64(fd, buf, 5, 3));
+  test_assert(0 == strcmp(buf, "3abc7"));
+  test_assert(0 == pread64(fd, buf, 5, 100));
+  close(fd);
+}
+
+static void test_epoll_wait(void) {
+  int fds[2];
+  int epfd = epoll_create(1);
+  struct epoll_event ev;
+  struct epoll_event events[4];
+
+  test_assert(epfd >= 0);
+  test_assert(0 == pipe(fds));
+  ev.events = EPOLLIN;
+  ev.data.u64 = 0x1234567890abcdefULL;
+  test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev));
+  test_assert(0 == syscall(SYS_epoll_wait, epfd, events, 4, 0));
+  test_assert(1 == write(fds[1], "x", 1));
+  memset(events, 0, sizeof(events));
+  test_assert(1 == syscall(SYS_epoll_wait, epfd, events, 4, -1));
+  test_assert(events[0].events == EPOLLIN);
+  test_assert(events[0].data.u64 == 0x1234567890abcdefULL);
+  close(fds[0]);
+  close(fds[1]);
+  close(epfd);
+}
+
+static void test_sendmsg_recvmsg(void) {
+  int socks[2];
+  int fds[2];
+  int received_fd;
+  char part1[3];
+  char part2[8];
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  char c;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, socks));
+  test_assert(0 == pipe(fds));
+
+  iov[0].iov_base = "hello";
+  iov[0].iov_len = 5;
+  iov[1].iov_base = " world";
+  iov[1].iov_len = 6;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int));
+  test_assert(11 == sendmsg(socks[0], &msg, 0));
+
+  iov[0].iov_base = part1;
+  iov[0].iov_len = sizeof(part1);
+  iov[1].iov_base = part2;
+  iov[1].iov_len = sizeof(part2);
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  test_assert(11 == recvmsg(socks[1], &msg, 0));
+  test_assert(0 == memcmp(part1, "hel", 3));
+  test_assert(0 == memcmp(part2, "lo world", 8));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  test_assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS);
+  memcpy(&received_fd, CMSG_DATA(cmsg), sizeof(int));
+
+  test_assert(1 == write(fds[1], "!", 1));
+  test_assert(1 == read(received_fd, &c, 1));
+  test_assert(c == '!');
+
+  close(received_fd);
+  close(fds[0]);
+  close(fds[1]);
+  close(socks[0]);
+  close(socks[1]);
+}
+
+static void test_getdents64_fstatat(void) {
+  int fd = open("/", O_RDONLY | O_DIRECTORY);
+  char buf[4096];
+  struct stat st;
+  long ret;
+
+  test_assert(fd >= 0);
+  ret = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+  test_assert(ret > 0);
+  test_assert(0 == fstatat(fd, ".", &st, 0));
+  test_assert(S_ISDIR(st.st_mode));
+  test_assert(-1 == fstatat(fd, "rr-no-such-file", &st, 0) && errno == ENOENT);
+  close(fd);
+}
+
+int main(int argc, char* argv[]) {
+  test_pread_pwrite();
+  test_epoll_wait();
+  test_sendmsg_recvmsg();
+  test_getdents64_fstatat();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,28 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS (1 << 24)
+
+static void* compute(__attribute__((unused)) void* p) {
+  int i, dummy = 0;
+
+  /* A tight loop with no syscalls: every timeslice expires at about the
+   * same ip, but the loop keeps making progress. */
+  for (i = 1; i < NUM_ITERATIONS; ++i) {
+    dummy += i % (1 << 20);
+  }
+  return (void*)(uintptr_t)dummy;
+}
+
+int main(void) {
+  pthread_t thread;
+
+  /* First on our own, then in a worker while we wait for it. */
+  compute(NULL);
+  test_assert(0 == pthread_create(&thread, NULL, compute, NULL));
+  test_assert(0 == pthread_join(thread, NULL));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
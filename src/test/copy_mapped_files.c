@@ -0,0 +1,31 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define TEST_FILENAME "copy_mapped_files.data"
+#define FILE_SIZE (2 * 1024 * 1024)
+
+int main(int argc, char* argv[]) {
+  int fd = open(TEST_FILENAME, O_CREAT | O_EXCL | O_RDWR, 0600);
+  char* bytes;
+  int i;
+
+  test_assert(fd >= 0);
+  test_assert(0 == ftruncate(fd, FILE_SIZE));
+  for (i = 0; i < FILE_SIZE; i += 4096) {
+    test_assert(1 == pwrite(fd, "x", 1, i));
+  }
+
+  bytes = (char*)mmap(NULL, FILE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  test_assert(bytes != MAP_FAILED);
+  close(fd);
+  unlink(TEST_FILENAME);
+
+  for (i = 0; i < FILE_SIZE; i += 4096) {
+    test_assert(bytes[i] == 'x' && bytes[i + 1] == 0);
+  }
+  munmap(bytes, FILE_SIZE);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
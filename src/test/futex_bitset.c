@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int futex_word;
+
+static long sys_futex(int* uaddr, int op, int val,
+                      const struct timespec* timeout, int val3) {
+  return syscall(SYS_futex, uaddr, op, val, timeout, NULL, val3);
+}
+
+static void* waker_thread(void* dontcare) {
+  usleep(100000);
+  __sync_fetch_and_add(&futex_word, 1);
+  test_assert(0 <= sys_futex(&futex_word, FUTEX_WAKE_BITSET_PRIVATE, 1, NULL,
+                             FUTEX_BITSET_MATCH_ANY));
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  struct timespec ts = { 0, 1000 };
+  pthread_t waker;
+  int i;
+
+  for (i = 0; i < 100; ++i) {
+    /* The futex word doesn't match, so these return immediately. */
+    test_assert(-1 == sys_futex(&futex_word, FUTEX_WAIT_BITSET_PRIVATE, 1,
+                                NULL, FUTEX_BITSET_MATCH_ANY) &&
+                EAGAIN == errno);
+    test_assert(-1 == sys_futex(&futex_word, FUTEX_WAIT_PRIVATE, 1, NULL, 0) &&
+                EAGAIN == errno);
+    /* Nobody's waiting. */
+    test_assert(0 == sys_futex(&futex_word, FUTEX_WAKE_BITSET_PRIVATE, 1,
+                               NULL, FUTEX_BITSET_MATCH_ANY));
+  }
+
+  /* A relative timeout that expires. */
+  test_assert(-1 == sys_futex(&futex_word, FUTEX_WAIT_PRIVATE, 0, &ts, 0) &&
+              ETIMEDOUT == errno);
+
+  /* A wait that really blocks until another thread wakes us. */
+  pthread_create(&waker, NULL, waker_thread, NULL);
+  while (futex_word == 0) {
+    long ret = sys_futex(&futex_word, FUTEX_WAIT_BITSET_PRIVATE, 0, NULL,
+                         FUTEX_BITSET_MATCH_ANY);
+    test_assert(0 == ret || (-1 == ret && (EAGAIN == errno || EINTR == errno)));
+  }
+  pthread_join(waker, NULL);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define CHUNKS 16
+#define CHUNK_SIZE (100 * 1024)
+
+static char buf[CHUNK_SIZE];
+
+static void fill(char* p, size_t len, int seed) {
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    p[i] = (char)(i * 7 + seed);
+  }
+}
+
+static void write_all(int fd, const char* p, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, p, len);
+    test_assert(ret > 0);
+    p += ret;
+    len -= ret;
+  }
+}
+
+static void read_all(int fd, char* p, size_t len) {
+  while (len > 0) {
+    ssize_t ret = read(fd, p, len);
+    test_assert(ret > 0);
+    p += ret;
+    len -= ret;
+  }
+}
+
+static void check(const char* p, size_t len, int seed) {
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    test_assert(p[i] == (char)(i * 7 + seed));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int fds[2];
+  int sv[2];
+  pid_t child;
+  int status;
+  int i;
+
+  test_assert(0 == pipe(fds));
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+  child = fork();
+  if (!child) {
+    struct iovec iov[2];
+    char small[16];
+
+    close(fds[0]);
+    for (i = 0; i < CHUNKS; ++i) {
+      /* Chunks are bigger than the pipe buffer, so writes block. */
+      fill(buf, CHUNK_SIZE, i);
+      write_all(fds[1], buf, CHUNK_SIZE);
+    }
+    fill(small, sizeof(small), 100);
+    iov[0].iov_base = small;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = small + 5;
+    iov[1].iov_len = sizeof(small) - 5;
+    test_assert(sizeof(small) == writev(fds[1], iov, 2));
+    close(fds[1]);
+
+    /* Echo back what the parent sends on the socketpair. */
+    read_all(sv[1], buf, CHUNK_SIZE);
+    write_all(sv[1], buf, CHUNK_SIZE);
+    return 0;
+  }
+
+  close(fds[1]);
+  for (i = 0; i < CHUNKS; ++i) {
+    read_all(fds[0], buf, CHUNK_SIZE);
+    check(buf, CHUNK_SIZE, i);
+  }
+  read_all(fds[0], buf, 16);
+  check(buf, 16, 100);
+  test_assert(0 == read(fds[0], buf, 1));
+
+  fill(buf, CHUNK_SIZE, 200);
+  write_all(sv[0], buf, CHUNK_SIZE);
+  memset(buf, 0, CHUNK_SIZE);
+  read_all(sv[0], buf, CHUNK_SIZE);
+  check(buf, CHUNK_SIZE, 200);
+
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
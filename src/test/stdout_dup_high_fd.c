@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define HIGH_FD 5000
+
+int main(int argc, char* argv[]) {
+  static const char msg[] = "EXIT-SUCCESS\n";
+  int pipe_fds[2];
+  char buf[sizeof(msg)];
+  struct rlimit lim;
+
+  test_assert(0 == getrlimit(RLIMIT_NOFILE, &lim));
+  if (lim.rlim_max <= HIGH_FD) {
+    atomic_puts("Can't open high fds, skipping test");
+    atomic_puts("EXIT-SUCCESS");
+    return 0;
+  }
+  lim.rlim_cur = HIGH_FD + 2;
+  test_assert(0 == setrlimit(RLIMIT_NOFILE, &lim));
+
+  /* Reads and writes through a high fd that isn't monitored. */
+  test_assert(0 == pipe(pipe_fds));
+  test_assert(HIGH_FD + 1 == dup2(pipe_fds[1], HIGH_FD + 1));
+  test_assert(sizeof(msg) == write(HIGH_FD + 1, msg, sizeof(msg)));
+  test_assert(sizeof(msg) == read(pipe_fds[0], buf, sizeof(buf)));
+  test_assert(!strcmp(buf, msg));
+
+  /* Writes to stdout through a high fd must still reach the
+     StdioMonitor, so they're echoed during replay. */
+  test_assert(HIGH_FD == dup2(STDOUT_FILENO, HIGH_FD));
+  write(HIGH_FD, msg, sizeof(msg) - 1);
+  return 0;
+}
@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* One rank of a two-rank "job" talking over TCP on the loopback
+ * interface: `tcp_job listen <port-file>' or `tcp_job connect
+ * <port-file>'. The listener writes its port to <port-file>. */
+
+static int listen_port(const char* port_file) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char tmp[PATH_MAX];
+  char port[16];
+  int tmpfd;
+  int listenfd;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_assert(0 <= (listenfd = socket(AF_INET, SOCK_STREAM, 0)));
+  test_assert(0 == bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)));
+  test_assert(0 == listen(listenfd, 1));
+  test_assert(0 == getsockname(listenfd, (struct sockaddr*)&addr, &len));
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", port_file);
+  snprintf(port, sizeof(port), "%d\n", ntohs(addr.sin_port));
+  test_assert(0 <= (tmpfd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0600)));
+  test_assert((ssize_t)strlen(port) == write(tmpfd, port, strlen(port)));
+  test_assert(0 == close(tmpfd));
+  test_assert(0 == rename(tmp, port_file));
+
+  /* accept4() is normally buffered; rr must still see the connection. */
+  test_assert(0 <= (fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)));
+  close(listenfd);
+  return fd;
+}
+
+static int connect_port(const char* port_file) {
+  struct sockaddr_in addr;
+  char port[16];
+  ssize_t len;
+  int fd;
+
+  while (0 > (fd = open(port_file, O_RDONLY))) {
+    usleep(10000);
+  }
+  test_assert(0 < (len = read(fd, port, sizeof(port) - 1)));
+  port[len] = 0;
+  close(fd);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(atoi(port));
+  test_assert(0 <= (fd = socket(AF_INET, SOCK_STREAM, 0)));
+  test_assert(0 == connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+  return fd;
+}
+
+int main(int argc, char* argv[]) {
+  char buf[16];
+  int fd;
+
+  test_assert(argc == 3);
+  if (!strcmp(argv[1], "listen")) {
+    fd = listen_port(argv[2]);
+    /* Receive the two sends in pieces that don't line up with them. */
+    test_assert(2 == read(fd, buf, 2));
+    test_assert(7 == recv(fd, buf, 7, MSG_WAITALL));
+    test_assert(!memcmp(buf, "nghello", 7));
+    test_assert(4 == write(fd, "pong", 4));
+  } else {
+    struct iovec iov[2] = { { "hel", 3 }, { "lo", 2 } };
+    fd = connect_port(argv[2]);
+    test_assert(4 == send(fd, "ping", 4, 0));
+    test_assert(5 == writev(fd, iov, 2));
+    test_assert(4 == recv(fd, buf, 4, MSG_WAITALL));
+    test_assert(!memcmp(buf, "pong", 4));
+  }
+  close(fd);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
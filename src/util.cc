@@ -8,6 +8,8 @@
 #include "util.h"
 
 #include <algorithm>
+#include <fstream>
+#include <sstream>
 
 #include <assert.h>
 #include <elf.h>
@@ -20,6 +22,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "preload/preload_interface.h"
@@ -174,7 +177,8 @@ void dump_process_memory(Task* t, TraceFrame::Time global_time,
 
 static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
                                   unsigned checksum, unsigned rec_checksum,
-                                  const string& raw_map_line) {
+                                  const string& raw_map_line,
+                                  const string& page_info) {
   char cur_dump[PATH_MAX];
   char rec_dump[PATH_MAX];
 
@@ -194,8 +198,8 @@ static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
       << "Divergence in contents of memory segment after '" << ev << "':\n"
                                                                      "\n"
       << raw_map_line << "    (recorded checksum:" << HEX(rec_checksum)
-      << "; replaying checksum:" << HEX(checksum) << ")\n"
-                                                     "\n"
+      << "; replaying checksum:" << HEX(checksum) << ")\n" << page_info
+      << "\n"
       << "Dumped current memory contents to " << cur_dump
       << ". If you've created a memory dump for\n"
       << "the '" << ev << "' event (line " << t->trace_time()
@@ -244,6 +248,127 @@ static bool checksum_segment_filter(const Mapping& m,
   return may_diverge;
 }
 
+/**
+ * Checksums are accumulated over reads of at most this size, so huge
+ * mappings don't need a buffer as big as themselves.
+ */
+static const size_t CHECKSUM_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * Return true if the |pagemap| entry says the page was never touched, i.e.
+ * it's neither present nor swapped.
+ */
+static bool page_unpopulated(uint64_t pagemap_entry) {
+  return !(pagemap_entry & ((1ULL << 63) | (1ULL << 62)));
+}
+
+/**
+ * Checksums of individual pages, for -P. Pages whose checksum is zero are
+ * omitted.
+ */
+typedef map<remote_ptr<void>, unsigned> PageChecksums;
+
+/**
+ * Add the 32-bit words in the first |len| bytes of |m| to |checksum|,
+ * stopping at the first unreadable byte. Untouched pages of private
+ * anonymous mappings read as zeroes, which don't change the sum, so
+ * when |pagemap| is open we don't read them. If |pages| is non-null, also
+ * store each page's checksum there.
+ */
+static void checksum_mapping(Task* t, const Mapping& m, size_t len,
+                             ScopedFd& pagemap, unsigned* checksum,
+                             PageChecksums* pages) {
+  bool skip_unpopulated = pagemap.is_open() && (m.flags & MAP_ANONYMOUS) &&
+                          !(m.flags & MAP_SHARED);
+  vector<uint8_t> mem;
+  vector<uint64_t> entries(CHECKSUM_CHUNK_SIZE / page_size());
+  for (size_t offset = 0; offset < len; offset += CHECKSUM_CHUNK_SIZE) {
+    remote_ptr<void> chunk = m.start + offset;
+    size_t chunk_len = min(CHECKSUM_CHUNK_SIZE, len - offset);
+    // [read_start, read_end) is the part of the chunk we have to read. We
+    // only trim untouched pages at either end, to keep reads large.
+    size_t read_start = 0;
+    size_t read_end = chunk_len;
+    if (skip_unpopulated) {
+      ssize_t n = pread64(pagemap, entries.data(),
+                          entries.size() * sizeof(uint64_t),
+                          chunk.as_int() / page_size() * sizeof(uint64_t));
+      size_t pages = ceil_page_size(chunk_len) / page_size();
+      if (n >= ssize_t(pages * sizeof(uint64_t))) {
+        size_t first = 0;
+        while (first < pages && page_unpopulated(entries[first])) {
+          ++first;
+        }
+        size_t last = pages;
+        while (last > first && page_unpopulated(entries[last - 1])) {
+          --last;
+        }
+        read_start = first * page_size();
+        read_end = min(chunk_len, last * page_size());
+      }
+    }
+    if (read_start >= read_end) {
+      continue;
+    }
+
+    mem.resize(read_end - read_start);
+    ssize_t nread =
+        t->read_bytes_fallible(chunk + read_start, mem.size(), mem.data());
+    nread = max(ssize_t(0), nread);
+    const unsigned* buf = reinterpret_cast<const unsigned*>(mem.data());
+    ssize_t words_per_page = page_size() / sizeof(*buf);
+    ssize_t words = nread / sizeof(*buf);
+    for (ssize_t page = 0; page < words; page += words_per_page) {
+      unsigned page_checksum = 0;
+      for (ssize_t i = page; i < min(words, page + words_per_page); ++i) {
+        page_checksum += buf[i];
+      }
+      *checksum += page_checksum;
+      if (pages && page_checksum) {
+        (*pages)[chunk + read_start + page * sizeof(*buf)] = page_checksum;
+      }
+    }
+    if (nread < ssize_t(mem.size())) {
+      return;
+    }
+  }
+}
+
+/**
+ * Describe the lowest page whose checksum differs between |rec| and |rep|,
+ * or return an empty string if they're the same.
+ */
+static string first_divergent_page(const PageChecksums& rec,
+                                   const PageChecksums& rep) {
+  auto rec_it = rec.begin();
+  auto rep_it = rep.begin();
+  while (rec_it != rec.end() || rep_it != rep.end()) {
+    remote_ptr<void> page;
+    unsigned rec_checksum = 0;
+    unsigned rep_checksum = 0;
+    if (rep_it == rep.end() ||
+        (rec_it != rec.end() && rec_it->first <= rep_it->first)) {
+      page = rec_it->first;
+    } else {
+      page = rep_it->first;
+    }
+    if (rec_it != rec.end() && rec_it->first == page) {
+      rec_checksum = rec_it++->second;
+    }
+    if (rep_it != rep.end() && rep_it->first == page) {
+      rep_checksum = rep_it++->second;
+    }
+    if (rec_checksum != rep_checksum) {
+      stringstream s;
+      s << "First divergent page is " << page << " (recorded checksum:"
+        << HEX(rec_checksum) << "; replaying checksum:" << HEX(rep_checksum)
+        << ")\n";
+      return s.str();
+    }
+  }
+  return string();
+}
+
 /**
  * Either create and store checksums for each segment mapped in |t|'s
  * address space, or validate an existing computed checksum.  Behavior
@@ -265,26 +390,24 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
     FATAL() << "Failed to open checksum file " << filename;
   }
 
+  char pagemap_path[PATH_MAX];
+  snprintf(pagemap_path, sizeof(pagemap_path), "/proc/%d/pagemap", t->tid);
+  ScopedFd pagemap(pagemap_path, O_RDONLY | O_CLOEXEC);
+
   const AddressSpace& as = *(t->vm());
   for (auto& kv : as.memmap()) {
     const Mapping& first = kv.first;
     const MappableResource& second = kv.second;
 
-    vector<uint8_t> mem;
-    ssize_t valid_mem_len = 0;
+    size_t checksum_len = 0;
+    unsigned checksum = 0;
 
     if (checksum_segment_filter(first, second)) {
-      mem.resize(first.num_bytes());
-      valid_mem_len =
-          t->read_bytes_fallible(first.start, first.num_bytes(), mem.data());
-      valid_mem_len = max(ssize_t(0), valid_mem_len);
+      checksum_len = first.num_bytes();
     }
 
-    unsigned* buf = (unsigned*)mem.data();
-    unsigned checksum = 0;
-    int i;
-
-    if (second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos) {
+    if (checksum_len &&
+        second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos) {
       /* The syscallbuf consists of a region that's written
       * deterministically wrt the trace events, and a
       * region that's written nondeterministically in the
@@ -299,18 +422,20 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
       * the deterministic region. */
       auto child_hdr = first.start.cast<struct syscallbuf_hdr>();
       auto hdr = t->read_mem(child_hdr);
-      valid_mem_len = !buf ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
-                                     sizeof(struct syscallbuf_record);
-    }
-
-    ASSERT(t, buf || valid_mem_len == 0);
-    for (i = 0; i < ssize_t(valid_mem_len / sizeof(*buf)); ++i) {
-      checksum += buf[i];
+      checksum_len = min(checksum_len, sizeof(hdr) + hdr.num_rec_bytes +
+                                           sizeof(struct syscallbuf_record));
     }
 
     string raw_map_line = first.str() + ' ' + second.str();
+    PageChecksums pages;
     if (STORE_CHECKSUMS == c.mode) {
+      checksum_mapping(t, first, checksum_len, pagemap, &checksum,
+                       Flags::get().checksum_pages ? &pages : nullptr);
       fprintf(c.checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+      for (auto& p : pages) {
+        fprintf(c.checksums_file, " %lx %x\n", (unsigned long)p.first.as_int(),
+                p.second);
+      }
     } else {
       char line[1024];
       unsigned rec_checksum;
@@ -329,6 +454,21 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
           << "Segment " << rec_start_addr << "-" << rec_end_addr
           << " changed to " << first << "??";
 
+      // Page checksums, if recorded with -P, follow on indented lines.
+      PageChecksums rec_pages;
+      int ch;
+      while ((ch = getc(c.checksums_file)) == ' ') {
+        unsigned long page;
+        unsigned page_checksum;
+        fgets(line, sizeof(line), c.checksums_file);
+        nparsed = sscanf(line, "%lx %x", &page, &page_checksum);
+        ASSERT(t, 2 == nparsed) << "Only parsed " << nparsed << " items";
+        rec_pages[page] = page_checksum;
+      }
+      if (ch != EOF) {
+        ungetc(ch, c.checksums_file);
+      }
+
       if (is_start_of_scratch_region(t, rec_start_addr)) {
         /* Replay doesn't touch scratch regions, so
          * their contents are allowed to diverge.
@@ -339,9 +479,12 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
                    << rec_start_addr << dec;
         continue;
       }
+      checksum_mapping(t, first, checksum_len, pagemap, &checksum,
+                       rec_pages.empty() ? nullptr : &pages);
       if (checksum != rec_checksum) {
         notify_checksum_error(t, c.global_time, checksum, rec_checksum,
-                              raw_map_line.c_str());
+                              raw_map_line.c_str(),
+                              first_divergent_page(rec_pages, pages));
       }
     }
   }
@@ -366,6 +509,10 @@ bool should_checksum(Task* t, const TraceFrame& f) {
   if (Flags::CHECKSUM_NONE == checksum) {
     return false;
   }
+  if (f.time() < Flags::get().checksum_start ||
+      f.time() >= Flags::get().checksum_end) {
+    return false;
+  }
   if (Flags::CHECKSUM_ALL == checksum) {
     return true;
   }
@@ -622,6 +769,13 @@ void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
                : "ebx");
 }
 
+void cpuid(int code, int subrequest, unsigned int* a, unsigned int* b,
+           unsigned int* c, unsigned int* d) {
+  asm volatile("cpuid"
+               : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+               : "a"(code), "c"(subrequest));
+}
+
 void set_cpu_affinity(int cpu) {
   assert(cpu >= 0);
 
@@ -638,6 +792,114 @@ int get_num_cpus() {
   return cpus > 0 ? cpus : 1;
 }
 
+static string read_sysfs_line(const string& path) {
+  ifstream in(path.c_str());
+  string line;
+  getline(in, line);
+  return line;
+}
+
+static int read_sysfs_int(const string& path) {
+  string line = read_sysfs_line(path);
+  char* end;
+  long v = strtol(line.c_str(), &end, 10);
+  return line.empty() || *end ? -1 : (int)v;
+}
+
+bool parse_cpu_list(const string& list, vector<int>* cpus) {
+  cpus->clear();
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t comma = list.find(',', start);
+    string range = list.substr(start, comma - start);
+    char* end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    if (range.empty() || *end || first < 0 || last < first ||
+        last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+    if (comma == string::npos) {
+      break;
+    }
+    start = comma + 1;
+  }
+  return !cpus->empty();
+}
+
+string format_cpu_list(const vector<int>& cpus) {
+  vector<int> sorted = cpus;
+  sort(sorted.begin(), sorted.end());
+  stringstream out;
+  for (size_t i = 0; i < sorted.size();) {
+    size_t j = i;
+    while (j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1) {
+      ++j;
+    }
+    out << (i ? "," : "") << sorted[i];
+    if (j > i) {
+      out << "-" << sorted[j];
+    }
+    i = j + 1;
+  }
+  return out.str();
+}
+
+vector<CpuInfo> get_cpu_topology() {
+  vector<int> online;
+  if (!parse_cpu_list(read_sysfs_line("/sys/devices/system/cpu/online"),
+                      &online)) {
+    for (int i = 0; i < get_num_cpus(); ++i) {
+      online.push_back(i);
+    }
+  }
+
+  // core_id is only unique within a package, so number cores by
+  // (package, core_id).
+  map<pair<int, int>, int> core_numbers;
+  vector<CpuInfo> cpus;
+  for (int cpu : online) {
+    stringstream dir;
+    dir << "/sys/devices/system/cpu/cpu" << cpu;
+    CpuInfo info = { cpu, -1, -1 };
+    int package = read_sysfs_int(dir.str() + "/topology/physical_package_id");
+    int core_id = read_sysfs_int(dir.str() + "/topology/core_id");
+    if (core_id >= 0) {
+      auto key = make_pair(package, core_id);
+      auto it = core_numbers.find(key);
+      if (it == core_numbers.end()) {
+        it = core_numbers.insert(make_pair(key, (int)core_numbers.size()))
+                 .first;
+      }
+      info.core = it->second;
+    }
+    cpus.push_back(info);
+  }
+
+  for (int node = 0;; ++node) {
+    stringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    if (access(path.str().c_str(), R_OK)) {
+      break;
+    }
+    vector<int> node_cpus;
+    parse_cpu_list(read_sysfs_line(path.str()), &node_cpus);
+    for (auto& info : cpus) {
+      if (find(node_cpus.begin(), node_cpus.end(), info.cpu) !=
+          node_cpus.end()) {
+        info.node = node;
+      }
+    }
+  }
+  return cpus;
+}
+
 template <typename Arch>
 static void extract_clone_parameters_arch(const Registers& regs,
                                           remote_ptr<void>* stack,
@@ -813,3 +1075,32 @@ static void install_patched_seccomp_filter_arch(Task* t) {
 void install_patched_seccomp_filter(Task* t) {
   RR_ARCH_FUNCTION(install_patched_seccomp_filter_arch, t->arch(), t);
 }
+
+double now_sec() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
+}
+
+uint64_t monotonic_now_ns() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return uint64_t(tp.tv_sec) * 1000000000 + tp.tv_nsec;
+}
+
+static const double rr_start_sec = now_sec();
+
+void note_startup_phase(const char* phase) {
+  if (!Flags::get().timing) {
+    return;
+  }
+  static set<string> phases_reached;
+  static double last_phase_sec = rr_start_sec;
+  if (!phases_reached.insert(phase).second) {
+    return;
+  }
+  double now = now_sec();
+  fprintf(stderr, "rr timing: %-24s at %9.3f ms (+%.3f ms)\n", phase,
+          (now - rr_start_sec) * 1000, (now - last_phase_sec) * 1000);
+  last_phase_sec = now;
+}
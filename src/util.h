@@ -7,6 +7,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "Event.h"
 #include "remote_ptr.h"
@@ -146,6 +147,9 @@ remote_ptr<void> floor_page_size(remote_ptr<void> addr);
 /** Return the system page size. */
 size_t page_size();
 
+/** Size of a transparent huge page on x86. */
+enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
 /** Return the default action of |sig|. */
 enum signal_action { DUMP_CORE, TERMINATE, CONTINUE, STOP, IGNORE };
 signal_action default_action(int sig);
@@ -206,6 +210,11 @@ enum cpuid_requests {
  */
 void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
            unsigned int* d);
+/**
+ * Like cpuid() above, but also returns EBX in *b.
+ */
+void cpuid(int code, int subrequest, unsigned int* a, unsigned int* b,
+           unsigned int* c, unsigned int* d);
 
 /**
  * Force this process (and its descendants) to only use the cpu with the given
@@ -218,6 +227,27 @@ void set_cpu_affinity(int cpu);
  */
 int get_num_cpus();
 
+/**
+ * Where an online CPU sits in the machine, as reported by sysfs. |core| is
+ * unique across packages; fields sysfs doesn't report are -1.
+ */
+struct CpuInfo {
+  int cpu;
+  int core;
+  int node;
+};
+std::vector<CpuInfo> get_cpu_topology();
+
+/**
+ * Parse a kernel CPU list like "0-3,8" into |cpus|. Returns false if |list|
+ * is malformed.
+ */
+bool parse_cpu_list(const std::string& list, std::vector<int>* cpus);
+/**
+ * Format |cpus| as a kernel CPU list.
+ */
+std::string format_cpu_list(const std::vector<int>& cpus);
+
 /**
  * Extract various clone(2) parameters out of the given Task's registers.
  * Each remote_ptr parameter may be nullptr.
@@ -248,4 +278,22 @@ void dump_task_map(const std::map<pid_t, Task*>& tasks);
  */
 void install_patched_seccomp_filter(Task* t);
 
+/**
+ * Get the current time from the preferred monotonic clock in units of
+ * seconds, relative to an unspecific point in the past.
+ */
+double now_sec();
+
+/**
+ * Like now_sec(), but in whole nanoseconds, for timing short intervals.
+ */
+uint64_t monotonic_now_ns();
+
+/**
+ * With --timing, print to stderr how long after rr started it reached the
+ * startup phase |phase|, and how long since the previous phase. Only the
+ * first time each phase is reached is printed.
+ */
+void note_startup_phase(const char* phase);
+
 #endif /* RR_UTIL_H_ */